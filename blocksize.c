@@ -0,0 +1,141 @@
+/*
+ * ProFTPD - mod_rsync block size selection
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+#include "mod_rsync.h"
+#include "blocksize.h"
+#include "policy.h"
+
+static int blocksize_policy = RSYNC_BLOCKSIZE_POLICY_SQRT;
+
+static const char *trace_channel = "rsync.blocksize";
+
+static uint64_t isqrt(uint64_t n) {
+  uint64_t root = 0, bit = ((uint64_t) 1) << 62;
+
+  while (bit > n) {
+    bit >>= 2;
+  }
+
+  while (bit != 0) {
+    if (n >= root + bit) {
+      n -= root + bit;
+      root = (root >> 1) + bit;
+
+    } else {
+      root >>= 1;
+    }
+
+    bit >>= 2;
+  }
+
+  return root;
+}
+
+int rsync_blocksize_set_policy(int policy) {
+  switch (policy) {
+    case RSYNC_BLOCKSIZE_POLICY_SQRT:
+    case RSYNC_BLOCKSIZE_POLICY_ADAPTIVE:
+      blocksize_policy = policy;
+      return 0;
+  }
+
+  errno = EINVAL;
+  return -1;
+}
+
+int rsync_blocksize_get_policy(void) {
+  return blocksize_policy;
+}
+
+int32_t rsync_blocksize_choose(const char *path, off_t len, uint32_t sum_len,
+    int32_t max_len) {
+  struct rsync_policy_stats stats;
+  uint64_t block_len2;
+  int32_t block_len;
+
+  if (path == NULL ||
+      len <= 0 ||
+      sum_len == 0 ||
+      max_len <= 0) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  if (blocksize_policy != RSYNC_BLOCKSIZE_POLICY_ADAPTIVE) {
+    return 0;
+  }
+
+  if (rsync_policy_get(path, &stats) < 0) {
+    return 0;
+  }
+
+  if (stats.total_bytes == 0) {
+    /* No delta to go by; reuse the block length chosen before. */
+    block_len = stats.block_len < max_len ? stats.block_len : max_len;
+    if (block_len > 0) {
+      pr_trace_msg(trace_channel, 17,
+        "'%s' has used block length %ld before", path, (long) block_len);
+    }
+
+    return block_len;
+  }
+
+  if (stats.matched_bytes * 100 <
+      stats.total_bytes * RSYNC_BLOCKSIZE_MIN_MATCH_PCT) {
+    pr_trace_msg(trace_channel, 17,
+      "'%s' has matched little before, using block length %ld", path,
+      (long) max_len);
+    return max_len;
+  }
+
+  /* The expected changes, k, are the runs per byte, times the length; the
+   * best block length is then sqrt(N*S/k), i.e. sqrt(S/(runs per byte)).
+   * Expecting no changes, we allow for one.
+   */
+  if (stats.literal_runs == 0 ||
+      (uint64_t) len < stats.total_bytes / stats.literal_runs) {
+    block_len2 = (uint64_t) len * sum_len;
+
+  } else {
+    block_len2 = (stats.total_bytes / stats.literal_runs) * sum_len;
+  }
+
+  if (block_len2 >= (uint64_t) max_len * max_len) {
+    block_len = max_len;
+
+  } else {
+    block_len = (int32_t) isqrt(block_len2) & ~7;
+    if (block_len < RSYNC_BLOCKSIZE_MIN_BLOCK_SIZE) {
+      block_len = RSYNC_BLOCKSIZE_MIN_BLOCK_SIZE;
+    }
+  }
+
+  pr_trace_msg(trace_channel, 17,
+    "'%s' has had %" PR_LU " literal runs in %" PR_LU " bytes, %" PR_LU
+    " matched; using block length %ld", path, (pr_off_t) stats.literal_runs,
+    (pr_off_t) stats.total_bytes, (pr_off_t) stats.matched_bytes,
+    (long) block_len);
+  return block_len;
+}
@@ -0,0 +1,67 @@
+/*
+ * ProFTPD - mod_rsync block size selection
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+#ifndef MOD_RSYNC_BLOCKSIZE_H
+#define MOD_RSYNC_BLOCKSIZE_H
+
+#include "mod_rsync.h"
+
+/* The block length of a basis file's sums trades the size of the sums (one
+ * per block) against the literal data sent around each change (up to a
+ * block either side).  rsync's rule, the square root of the file length,
+ * assumes nothing about how the file changes.
+ *
+ * The adaptive policy goes by the history of the files received so far
+ * (see policy.h): how many changed regions (literal runs) each had per byte,
+ * and how much of it matched.  For a file of length N, expecting k
+ * changes, with S bytes of sum per block, the cost N*S/B + k*B is least for
+ * a block length B of sqrt(N*S/k).  A file which matched hardly at all gets
+ * the longest blocks, as its sums are likely wasted.
+ */
+
+#define RSYNC_BLOCKSIZE_POLICY_SQRT		0
+#define RSYNC_BLOCKSIZE_POLICY_ADAPTIVE		1
+
+/* Chosen block lengths are at least this long. */
+#define RSYNC_BLOCKSIZE_MIN_BLOCK_SIZE		128
+
+/* Files which matched less than this (in percent) are assumed not to match
+ * next time either.
+ */
+#define RSYNC_BLOCKSIZE_MIN_MATCH_PCT		5
+
+/* Selects the policy; SQRT, rsync's rule, is the default. */
+int rsync_blocksize_set_policy(int policy);
+int rsync_blocksize_get_policy(void);
+
+/* Returns the block length to use for a basis file of the given length,
+ * whose sums take sum_len bytes per block, up to max_len; or 0 if rsync's
+ * rule is to be used, i.e. there is no history for the file.  A file with no
+ * delta history gets the block length it was given before, if any.
+ */
+int32_t rsync_blocksize_choose(const char *path, off_t len, uint32_t sum_len,
+  int32_t max_len);
+
+#endif /* MOD_RSYNC_BLOCKSIZE_H */
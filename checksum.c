@@ -24,57 +24,85 @@
 
 #include "mod_rsync.h"
 #include "checksum.h"
+#include "multibuf.h"
 #include "options.h"
 #include "msg.h"
 #include "disconnect.h"
+#include "version.h"
+
+#include <openssl/opensslconf.h>
+#ifndef OPENSSL_NO_MD4
+# include <openssl/md4.h>
+#endif /* !OPENSSL_NO_MD4 */
+#include <openssl/md5.h>
+
+#ifdef HAVE_XXHASH
+# include <xxhash.h>
+# if defined(XXH_VERSION_NUMBER) && XXH_VERSION_NUMBER >= 800
+#  define RSYNC_USE_XXH3
+# endif
+#endif /* HAVE_XXHASH */
 
 static const char *trace_channel = "rsync.checksum";
 
 #ifdef OPENSSL_NO_MD4
 typedef struct {
   /* state (ABCD) */
-  uint32_t A, B, C, D;
+  uint32_t state[4];
 
-  /* number of bits, module 2^64 (LSB first) */
-  uint32_t count[2];
+  /* number of bytes, modulo 2^64 */
+  uint64_t count;
 
   /* input buffer */
   unsigned char buffer[64];
 
 } MD4_CTX;
 
-#define MASK32		(0xffffffff)
-
 #define F(X,Y,Z)	((((X) & (Y)) | ((~(X)) & (Z))))
 #define G(X,Y,Z)	((((X) & (Y)) | ((X) & (Z)) | ((Y) & (Z))))
 #define H(X,Y,Z)	(((X) ^ (Y) ^ (Z)))
 
-#define lshift(x,s)	(((((x) << (s)) & MASK32) | (((x) >> (32 - (s))) & MASK32)))
+#define lshift(x,s)	(((x) << (s)) | ((x) >> (32 - (s))))
 
 #define ROUND1(a,b,c,d,k,s) \
-  a = lshift((a + F(b,c,d) + M[k]) & MASK32, s)
+  a = lshift(a + F(b,c,d) + M[k], s)
 
 #define ROUND2(a,b,c,d,k,s) \
-  a = lshift((a + G(b,c,d) + M[k] + 0x5a827999) & MASK32, s)
+  a = lshift(a + G(b,c,d) + M[k] + 0x5a827999, s)
 
 #define ROUND3(a,b,c,d,k,s) \
-  a = lshift((a + H(b,c,d) + M[k] + 0x6ed9eba1) & MASK32, s)
+  a = lshift(a + H(b,c,d) + M[k] + 0x6ed9eba1, s)
+
+static void Decode(const unsigned char *input, uint32_t *val) {
+  register unsigned int i;
+
+  for (i = 0; i < 16; i++) {
+    val[i] = ((uint32_t) input[(i * 4) + 3] << 24) |
+             ((uint32_t) input[(i * 4) + 2] << 16) |
+             ((uint32_t) input[(i * 4) + 1] << 8) |
+             ((uint32_t) input[(i * 4) + 0] << 0);
+  }
+}
+
+static void Encode(unsigned char *output, uint32_t val) {
+  output[0] = val & 0xff;
+  output[1] = (val >> 8) & 0xff;
+  output[2] = (val >> 16) & 0xff;
+  output[3] = (val >> 24) & 0xff;
+}
+
+/* Applies MD4 to a 64 byte chunk */
+static void do_md4(MD4_CTX *ctx, const unsigned char *chunk) {
+  uint32_t M[16];
+  uint32_t A, B, C, D;
 
-/* Applies MD4 to 64 byte chunks */
-static void do_md4(MD4_ctx *ctx, uint32_t *val) {
-  uint32 state0, state1, state2, state3;
-  uint32 A, B, C, D;
+  Decode(chunk, M);
 
   A = ctx->state[0];
   B = ctx->state[1];
   C = ctx->state[2];
   D = ctx->state[3];
 
-  state0 = A;
-  state1 = B;
-  state2 = C;
-  state3 = C;
-
   ROUND1(A,B,C,D,  0,  3);  ROUND1(D,A,B,C,  1,  7);
   ROUND1(C,D,A,B,  2, 11);  ROUND1(B,C,D,A,  3, 19);
   ROUND1(A,B,C,D,  4,  3);  ROUND1(D,A,B,C,  5,  7);
@@ -102,177 +130,684 @@ static void do_md4(MD4_ctx *ctx, uint32_t *val) {
   ROUND3(A,B,C,D,  3,  3);  ROUND3(D,A,B,C, 11,  9);
   ROUND3(C,D,A,B,  7, 11);  ROUND3(B,C,D,A, 15, 15);
 
-  A += state0;
-  B += state1;
-  C += state2;
-  D += state3;
+  ctx->state[0] += A;
+  ctx->state[1] += B;
+  ctx->state[2] += C;
+  ctx->state[3] += D;
+}
 
-  A &= MASK32;
-  B &= MASK32;
-  C &= MASK32;
-  D &= MASK32;
+static int MD4_Init(MD4_CTX *ctx) {
+  ctx->count = 0;
 
-  ctx->state[0] = A;
-  ctx->state[1] = B;
-  ctx->state[2] = C;
-  ctx->state[3] = D;
+  ctx->state[0] = 0x67452301;
+  ctx->state[1] = 0xefcdab89;
+  ctx->state[2] = 0x98badcfe;
+  ctx->state[3] = 0x10325476;
+  return 1;
 }
 
-static void Encode(unsigned char *output, uint32_t val) {
-  output[0] = val & 0xff;
-  output[1] = (val >> 8) & 0xff;
-  output[2] = (val >> 16) & 0xff;
-  output[3] = (val >> 24) & 0xff;
+static int MD4_Update(MD4_CTX *ctx, const void *input, size_t input_len) {
+  const unsigned char *ptr;
+  size_t buffered;
+
+  ptr = input;
+  buffered = (size_t) (ctx->count % 64);
+  ctx->count += input_len;
+
+  /* Complete any partial chunk left over from a previous update first. */
+  if (buffered > 0) {
+    size_t len;
+
+    len = 64 - buffered;
+    if (len > input_len) {
+      len = input_len;
+    }
+
+    memcpy(ctx->buffer + buffered, ptr, len);
+    ptr += len;
+    input_len -= len;
+
+    if (buffered + len < 64) {
+      return 1;
+    }
+
+    do_md4(ctx, ctx->buffer);
+  }
+
+  while (input_len >= 64) {
+    do_md4(ctx, ptr);
+    ptr += 64;
+    input_len -= 64;
+  }
+
+  if (input_len > 0) {
+    memcpy(ctx->buffer, ptr, input_len);
+  }
+
+  return 1;
 }
 
-static void Decode(unsigned char *input, uint32_t *val) {
+static int MD4_Final(unsigned char digest[16], MD4_CTX *ctx) {
+  unsigned char tail[72];
+  uint64_t bits;
+  size_t buffered, padlen;
   register unsigned int i;
 
-  for (i = 0; i < 16; i++) {
-    val[i] = (input[(i * 4) + 3] << 24) |
-             (input[(i * 4) + 2] << 16) |
-             (input[(i * 4) + 1] << 8) |
-             (input[(i * 4) + 0] << 0);
+  bits = ctx->count << 3;
+  buffered = (size_t) (ctx->count % 64);
+
+  /* Pad to 56 bytes (mod 64), then append the length in bits. */
+  padlen = (buffered < 56) ? (56 - buffered) : (120 - buffered);
+  memset(tail, 0, sizeof(tail));
+  tail[0] = 0x80;
+
+  for (i = 0; i < 8; i++) {
+    tail[padlen + i] = (unsigned char) ((bits >> (i * 8)) & 0xff);
   }
+
+  MD4_Update(ctx, tail, padlen + 8);
+
+  Encode(digest, ctx->state[0]);
+  Encode(digest + (1 * sizeof(uint32_t)), ctx->state[1]);
+  Encode(digest + (2 * sizeof(uint32_t)), ctx->state[2]);
+  Encode(digest + (3 * sizeof(uint32_t)), ctx->state[3]);
+  return 1;
 }
+#endif /* OPENSSL_NO_MD4 */
 
-static int MD4_Init(MD4_CTX *ctx) {
-  ctx->count[0] = ctx->count[1] = 0;
+struct rsync_checksum_algo {
+  const char *name;
+  int algo;
+  size_t digest_len;
+};
+
+static struct rsync_checksum_algo checksum_algos[] = {
+  { "md4",	RSYNC_CHECKSUM_ALGO_MD4,	16 },
+  { "md5",	RSYNC_CHECKSUM_ALGO_MD5,	16 },
+  { "xxh64",	RSYNC_CHECKSUM_ALGO_XXH64,	8 },
+  { "xxh3",	RSYNC_CHECKSUM_ALGO_XXH3,	8 },
+  { "xxh128",	RSYNC_CHECKSUM_ALGO_XXH128,	16 },
+  { "none",	RSYNC_CHECKSUM_ALGO_NONE,	1 },
+
+  { NULL, 0, 0 }
+};
+
+struct rsync_checksum {
+  int algo;
+  int32_t seed;
+
+  union {
+    MD4_CTX md4;
+    MD5_CTX md5;
+#ifdef HAVE_XXHASH
+    XXH64_state_t *xxh64;
+#endif /* HAVE_XXHASH */
+#ifdef RSYNC_USE_XXH3
+    XXH3_state_t *xxh3;
+#endif /* RSYNC_USE_XXH3 */
+  } ctx;
+};
+
+static const char *checksum_prefs = NULL;
+
+/* rsync transmits its 64-bit hash values in little-endian order. */
+static void checksum_put64(unsigned char *buf, uint64_t val) {
+  register unsigned int i;
 
-  ctx->state[0] = 0x67452301;
-  ctx->state[1] = 0xefcdab89;
-  ctx->state[2] = 0x98badcfe;
-  ctx->state[3] = 0x10325476;
+  for (i = 0; i < 8; i++) {
+    buf[i] = (unsigned char) (val & 0xff);
+    val >>= 8;
+  }
 }
 
-static void md4_tail(MD4_CTX *ctx, const unsigned char *data, uint32 data_len) {
-  unsigned char buf[128];
-  uint32_t M[16];
+static void checksum_put32(unsigned char *buf, uint32_t val) {
+  buf[0] = (unsigned char) (val & 0xff);
+  buf[1] = (unsigned char) ((val >> 8) & 0xff);
+  buf[2] = (unsigned char) ((val >> 16) & 0xff);
+  buf[3] = (unsigned char) ((val >> 24) & 0xff);
+}
+
+int rsync_checksum_get_algo(const char *name) {
+  register unsigned int i;
 
-  /* Count the total number of bits, module 2^64. */
-  ctx->count[0] += (data_len << 3);
-  if (ctx->count[0] < (data_len << 3)) {
-    ctx->count[1]++;
+  if (name == NULL) {
+    errno = EINVAL;
+    return -1;
   }
-  ctx->count[1] += (data_len >> 29);
 
-  memset(buf, 0, 128);
-  if (data_len > 0) {
-    /* XXX Make sure that data_len <= sizeof(buf) before doing this copy? */
-    memcpy(buf, data, data_len);
+  for (i = 0; checksum_algos[i].name != NULL; i++) {
+    if (strcasecmp(checksum_algos[i].name, name) == 0) {
+      return checksum_algos[i].algo;
+    }
   }
 
-  buf[data_len] = 0x80;
+  errno = ENOENT;
+  return -1;
+}
 
-  if (data_len <= 55) {
-    Encode(buf + 56, ctx->count[0]);
-    Encode(buf + 60, ctx->count[1]);
-    Decode(buf, M);
-    do_md4(ctx, M);
+const char *rsync_checksum_get_name(int algo) {
+  register unsigned int i;
 
-  } else {
-    Encode(buf + 120, ctx->count[0]);
-    Encode(buf + 124, ctx->count[1]);
-    Decode(buf, M);
-    do_md4(ctx, M);
-    Decode(buf + 64, M);
-    do_md4(ctx, M);
+  for (i = 0; checksum_algos[i].name != NULL; i++) {
+    if (checksum_algos[i].algo == algo) {
+      return checksum_algos[i].name;
+    }
   }
+
+  errno = ENOENT;
+  return NULL;
 }
 
-static void MD4_Update(MD4_CTX *ctx, const void *input, size_t input_len) {
-  uint32_t M[16];
-  const unsigned char *ptr;
+size_t rsync_checksum_get_digest_len(int algo) {
+  register unsigned int i;
 
-  ptr = input;
+  for (i = 0; checksum_algos[i].name != NULL; i++) {
+    if (checksum_algos[i].algo == algo) {
+      return checksum_algos[i].digest_len;
+    }
+  }
+
+  errno = ENOENT;
+  return 0;
+}
 
-  if (input_len == 0) {
-    md4_tail(ptr, input_len);
+int rsync_checksum_supported(int algo) {
+  switch (algo) {
+    case RSYNC_CHECKSUM_ALGO_MD4:
+    case RSYNC_CHECKSUM_ALGO_MD5:
+      return TRUE;
+
+#ifdef HAVE_XXHASH
+    case RSYNC_CHECKSUM_ALGO_XXH64:
+      return TRUE;
+#endif /* HAVE_XXHASH */
+
+#ifdef RSYNC_USE_XXH3
+    case RSYNC_CHECKSUM_ALGO_XXH3:
+    case RSYNC_CHECKSUM_ALGO_XXH128:
+      return TRUE;
+#endif /* RSYNC_USE_XXH3 */
+
+    default:
+      break;
   }
 
-  while (input_len >= 64) {
-    Decode(ptr, M);
-    do_md4(ctx, M);
-    ptr += 64;
-    input_len -= 64;
+  return FALSE;
+}
+
+/* Returns the given list of names, minus any unknown or unsupported
+ * algorithms, or NULL if no supported algorithms remain.
+ */
+static const char *filter_algos(pool *p, const char *names) {
+  char *ptr, *name;
+  const char *algos = NULL;
+
+  ptr = pstrdup(p, names);
+  while ((name = strsep(&ptr, " ,")) != NULL) {
+    int algo;
+
+    pr_signals_handle();
+
+    if (*name == '\0') {
+      continue;
+    }
+
+    algo = rsync_checksum_get_algo(name);
+    if (algo < 0 ||
+        rsync_checksum_supported(algo) == FALSE) {
+      pr_trace_msg(trace_channel, 9,
+        "ignoring unsupported checksum algorithm '%s'", name);
+      continue;
+    }
+
+    if (algos == NULL) {
+      algos = rsync_checksum_get_name(algo);
 
-    ctx->count[0] += (64 << 3);
-    if (ctx->count[0] < (64 << 3) {
-      ctx->count[1]++;
+    } else {
+      algos = pstrcat(p, algos, " ", rsync_checksum_get_name(algo), NULL);
     }
   }
 
-  if (input_len > 0) {
-    md4_tail(input, input_len);
+  return algos;
+}
+
+int rsync_checksum_set_preferred(pool *p, const char *names) {
+  const char *algos;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (names == NULL) {
+    /* Reset to the defaults. */
+    checksum_prefs = NULL;
+    return 0;
   }
+
+  algos = filter_algos(p, names);
+  if (algos == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  checksum_prefs = algos;
+  return 0;
 }
 
-static void MD4_Final(unsigned char digest[16], MD4_CTX *ctx) {
-  Encode(ctx->digest, ctx->state[0]);
-  Encode(ctx->digest + (1 * sizeof(uint32_t)), ctx->state[1]);
-  Encode(ctx->digest + (2 * sizeof(uint32_t)), ctx->state[2]);
-  Encode(ctx->digest + (3 * sizeof(uint32_t)), ctx->state[3]);
+const char *rsync_checksum_get_preferred(pool *p) {
+  if (checksum_prefs != NULL) {
+    return checksum_prefs;
+  }
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return filter_algos(p, RSYNC_CHECKSUM_DEFAULT_PREFERENCES);
 }
 
-static unsigned char *MD4(const unsigned char *data, size_t data_len,
-    unsigned char digest[16]) {
-  MD4_CTX ctx;
-  MD4_Init(&ctx);
-  MD4_Update(&ctx, data, data_len);
-  MD4_Final(digest, &ctx);
+static void checksum_cleanup_cb(void *data) {
+  struct rsync_checksum *ck;
+
+  ck = data;
+
+  switch (ck->algo) {
+#ifdef HAVE_XXHASH
+    case RSYNC_CHECKSUM_ALGO_XXH64:
+      if (ck->ctx.xxh64 != NULL) {
+        XXH64_freeState(ck->ctx.xxh64);
+        ck->ctx.xxh64 = NULL;
+      }
+      break;
+#endif /* HAVE_XXHASH */
+
+#ifdef RSYNC_USE_XXH3
+    case RSYNC_CHECKSUM_ALGO_XXH3:
+    case RSYNC_CHECKSUM_ALGO_XXH128:
+      if (ck->ctx.xxh3 != NULL) {
+        XXH3_freeState(ck->ctx.xxh3);
+        ck->ctx.xxh3 = NULL;
+      }
+      break;
+#endif /* RSYNC_USE_XXH3 */
+
+    default:
+      break;
+  }
 }
-#endif /* OPENSSL_NO_MD4 */
 
-int rsync_checksum_handle_data(pool *p, struct rsync_session *sess,
-    unsigned char **data, uint32_t *datalen) {
+/* Notes: see rsync-${version}/checksum.c#sum_init().
+ *
+ * The MD4 file checksum includes the seed, as a prefix; none of the others
+ * do.
+ */
+struct rsync_checksum *rsync_checksum_create(pool *p, int algo, int32_t seed) {
+  struct rsync_checksum *ck;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (rsync_checksum_supported(algo) == FALSE) {
+    errno = ENOSYS;
+    return NULL;
+  }
+
+  ck = pcalloc(p, sizeof(struct rsync_checksum));
+  ck->algo = algo;
+  ck->seed = seed;
+
+  switch (algo) {
+    case RSYNC_CHECKSUM_ALGO_MD4: {
+      unsigned char buf[4];
+
+      MD4_Init(&(ck->ctx.md4));
+
+      checksum_put32(buf, (uint32_t) seed);
+      MD4_Update(&(ck->ctx.md4), buf, sizeof(buf));
+      break;
+    }
+
+    case RSYNC_CHECKSUM_ALGO_MD5:
+      MD5_Init(&(ck->ctx.md5));
+      break;
+
+#ifdef HAVE_XXHASH
+    case RSYNC_CHECKSUM_ALGO_XXH64:
+      ck->ctx.xxh64 = XXH64_createState();
+      if (ck->ctx.xxh64 == NULL) {
+        errno = ENOMEM;
+        return NULL;
+      }
+
+      XXH64_reset(ck->ctx.xxh64, 0);
+      register_cleanup(p, ck, checksum_cleanup_cb, checksum_cleanup_cb);
+      break;
+#endif /* HAVE_XXHASH */
+
+#ifdef RSYNC_USE_XXH3
+    case RSYNC_CHECKSUM_ALGO_XXH3:
+    case RSYNC_CHECKSUM_ALGO_XXH128:
+      ck->ctx.xxh3 = XXH3_createState();
+      if (ck->ctx.xxh3 == NULL) {
+        errno = ENOMEM;
+        return NULL;
+      }
+
+      if (algo == RSYNC_CHECKSUM_ALGO_XXH3) {
+        XXH3_64bits_reset(ck->ctx.xxh3);
+
+      } else {
+        XXH3_128bits_reset(ck->ctx.xxh3);
+      }
+
+      register_cleanup(p, ck, checksum_cleanup_cb, checksum_cleanup_cb);
+      break;
+#endif /* RSYNC_USE_XXH3 */
+
+    default:
+      errno = ENOSYS;
+      return NULL;
+  }
+
+  return ck;
+}
+
+int rsync_checksum_update(struct rsync_checksum *ck, const unsigned char *data,
+    size_t datalen) {
+
+  if (ck == NULL ||
+      (data == NULL && datalen > 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (datalen == 0) {
+    return 0;
+  }
+
+  switch (ck->algo) {
+    case RSYNC_CHECKSUM_ALGO_MD4:
+      MD4_Update(&(ck->ctx.md4), data, datalen);
+      break;
+
+    case RSYNC_CHECKSUM_ALGO_MD5:
+      MD5_Update(&(ck->ctx.md5), data, datalen);
+      break;
+
+#ifdef HAVE_XXHASH
+    case RSYNC_CHECKSUM_ALGO_XXH64:
+      XXH64_update(ck->ctx.xxh64, data, datalen);
+      break;
+#endif /* HAVE_XXHASH */
+
+#ifdef RSYNC_USE_XXH3
+    case RSYNC_CHECKSUM_ALGO_XXH3:
+      XXH3_64bits_update(ck->ctx.xxh3, data, datalen);
+      break;
+
+    case RSYNC_CHECKSUM_ALGO_XXH128:
+      XXH3_128bits_update(ck->ctx.xxh3, data, datalen);
+      break;
+#endif /* RSYNC_USE_XXH3 */
+
+    default:
+      errno = ENOSYS;
+      return -1;
+  }
+
+  return 0;
+}
+
+size_t rsync_checksum_finish(struct rsync_checksum *ck, unsigned char *digest) {
+  if (ck == NULL ||
+      digest == NULL) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  switch (ck->algo) {
+    case RSYNC_CHECKSUM_ALGO_MD4:
+      MD4_Final(digest, &(ck->ctx.md4));
+      return 16;
+
+    case RSYNC_CHECKSUM_ALGO_MD5:
+      MD5_Final(digest, &(ck->ctx.md5));
+      return 16;
+
+#ifdef HAVE_XXHASH
+    case RSYNC_CHECKSUM_ALGO_XXH64:
+      checksum_put64(digest, XXH64_digest(ck->ctx.xxh64));
+      checksum_cleanup_cb(ck);
+      return 8;
+#endif /* HAVE_XXHASH */
+
+#ifdef RSYNC_USE_XXH3
+    case RSYNC_CHECKSUM_ALGO_XXH3:
+      checksum_put64(digest, XXH3_64bits_digest(ck->ctx.xxh3));
+      checksum_cleanup_cb(ck);
+      return 8;
+
+    case RSYNC_CHECKSUM_ALGO_XXH128: {
+      XXH128_hash_t hash;
+
+      hash = XXH3_128bits_digest(ck->ctx.xxh3);
+      checksum_put64(digest, hash.low64);
+      checksum_put64(digest + 8, hash.high64);
+      checksum_cleanup_cb(ck);
+      return 16;
+    }
+#endif /* RSYNC_USE_XXH3 */
+
+    default:
+      break;
+  }
+
+  errno = ENOSYS;
+  return 0;
+}
+
+/* Notes: see rsync-${version}/checksum.c#get_checksum2().
+ *
+ * For MD4, the seed (if any) follows the data.  For MD5, the seed precedes
+ * the data if the client supports the "proper" seed order (the CHKSUM_SEED_FIX
+ * compatibility flag), and follows it otherwise.  The xxhash algorithms use
+ * the seed as the hash seed; rsync passes its int seed as is, so a negative
+ * seed is sign-extended.
+ */
+size_t rsync_checksum_block(struct rsync_session *sess,
+    const unsigned char *data, size_t datalen, unsigned char *digest) {
   struct rsync_options *opts;
+  unsigned char seedbuf[4];
+  int32_t seed;
+
+  if (sess == NULL ||
+      (data == NULL && datalen > 0) ||
+      digest == NULL) {
+    errno = EINVAL;
+    return 0;
+  }
 
   opts = sess->options;
-pr_trace_msg(trace_channel, 9, "checksum_handle: opts = %p", opts);
+  seed = opts->checksum_seed;
+  checksum_put32(seedbuf, (uint32_t) seed);
+
+  switch (sess->checksum_algo) {
+    case RSYNC_CHECKSUM_ALGO_MD4: {
+      MD4_CTX ctx;
+
+      MD4_Init(&ctx);
+      MD4_Update(&ctx, data, datalen);
+      if (seed != 0) {
+        MD4_Update(&ctx, seedbuf, sizeof(seedbuf));
+      }
+      MD4_Final(digest, &ctx);
+      return 16;
+    }
 
-  /* If we're the server, and the client didn't provide a seed, then
-   * get the seed value.
-   */
-  if (opts->sender) {
-    unsigned char *buf, *ptr;
-    uint32_t buflen, bufsz;
+    case RSYNC_CHECKSUM_ALGO_MD5: {
+      MD5_CTX ctx;
+      int seed_first;
+
+      seed_first = (sess->compat_flags &
+        RSYNC_VERSION_COMPAT_FL_CHKSUM_SEED_FIX);
 
-    if (opts->checksum_seed == 0) {
-      opts->checksum_seed = (int) time(NULL);
-pr_trace_msg(trace_channel, 17, "generated checksum seed %lu", (unsigned long) opts->checksum_seed);
+      MD5_Init(&ctx);
+      if (seed != 0 &&
+          seed_first) {
+        MD5_Update(&ctx, seedbuf, sizeof(seedbuf));
+      }
+
+      MD5_Update(&ctx, data, datalen);
+
+      if (seed != 0 &&
+          !seed_first) {
+        MD5_Update(&ctx, seedbuf, sizeof(seedbuf));
+      }
+      MD5_Final(digest, &ctx);
+      return 16;
+    }
+
+#ifdef HAVE_XXHASH
+    case RSYNC_CHECKSUM_ALGO_XXH64:
+      checksum_put64(digest,
+        XXH64(data, datalen, (uint64_t) (int64_t) seed));
+      return 8;
+#endif /* HAVE_XXHASH */
+
+#ifdef RSYNC_USE_XXH3
+    case RSYNC_CHECKSUM_ALGO_XXH3:
+      checksum_put64(digest,
+        XXH3_64bits_withSeed(data, datalen, (uint64_t) (int64_t) seed));
+      return 8;
+
+    case RSYNC_CHECKSUM_ALGO_XXH128: {
+      XXH128_hash_t hash;
+
+      hash = XXH3_128bits_withSeed(data, datalen,
+        (uint64_t) (int64_t) seed);
+      checksum_put64(digest, hash.low64);
+      checksum_put64(digest + 8, hash.high64);
+      return 16;
     }
+#endif /* RSYNC_USE_XXH3 */
+
+    default:
+      break;
+  }
+
+  errno = ENOSYS;
+  return 0;
+}
+
+/* As for rsync_checksum_block(), for each consecutive block of the data.
+ * MD4 and MD5 use the multi-buffer kernels; the xxhash algorithms are fast
+ * enough one block at a time.
+ */
+int rsync_checksum_blocks(struct rsync_session *sess,
+    const unsigned char *data, size_t datalen, uint32_t block_len,
+    unsigned char *digests) {
+  struct rsync_options *opts;
+  unsigned char seedbuf[4];
+  const unsigned char *prefix = NULL, *suffix = NULL;
+  size_t digest_len;
+  int count = 0;
+  int32_t seed;
+
+  if (sess == NULL ||
+      (data == NULL && datalen > 0) ||
+      block_len == 0 ||
+      digests == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  opts = sess->options;
+  seed = opts->checksum_seed;
+  checksum_put32(seedbuf, (uint32_t) seed);
+
+  switch (sess->checksum_algo) {
+    case RSYNC_CHECKSUM_ALGO_MD4:
+      if (seed != 0) {
+        suffix = seedbuf;
+      }
+
+      return rsync_multibuf_digest(sess->checksum_algo, data, datalen,
+        block_len, NULL, suffix, digests);
+
+    case RSYNC_CHECKSUM_ALGO_MD5:
+      if (seed != 0) {
+        if (sess->compat_flags & RSYNC_VERSION_COMPAT_FL_CHKSUM_SEED_FIX) {
+          prefix = seedbuf;
 
-    /* Send the checksum seed. */
-    bufsz = buflen = sizeof(int32_t);
-    ptr = buf = palloc(p, bufsz);
+        } else {
+          suffix = seedbuf;
+        }
+      }
 
-    rsync_msg_write_int(&buf, &buflen, (int32_t) opts->checksum_seed);
+      return rsync_multibuf_digest(sess->checksum_algo, data, datalen,
+        block_len, prefix, suffix, digests);
 
-    if ((rsync_write_data)(p, sess->channel_id, ptr, (bufsz - buflen)) < 0) {
-      (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
-        "error sending checksum seed: %s", strerror(errno));
-      errno = EIO;
+    default:
+      break;
+  }
+
+  digest_len = rsync_checksum_get_digest_len(sess->checksum_algo);
+
+  while (datalen > 0) {
+    size_t len;
+
+    len = datalen > block_len ? block_len : datalen;
+    if (rsync_checksum_block(sess, data, len,
+        digests + (count * digest_len)) == 0) {
       return -1;
     }
 
-    pr_trace_msg(trace_channel, 9, "sent checksum seed %lu",
-      (unsigned long) opts->checksum_seed);
+    count++;
+    data += len;
+    datalen -= len;
+  }
 
-  } else {
-/*
-    opts->checksum_seed = read_int(data, datalen);
-*/
+  return count;
+}
+
+int rsync_checksum_handle_data(pool *p, struct rsync_session *sess,
+    unsigned char **data, uint32_t *datalen) {
+  struct rsync_options *opts;
+  unsigned char *buf, *ptr;
+  uint32_t buflen, bufsz;
+
+  opts = sess->options;
+
+  /* As the server, we always send the checksum seed, regardless of whether
+   * we are the sender or the receiver.  If the client didn't provide a seed,
+   * then generate one.
+   */
+  if (opts->checksum_seed == 0) {
+    opts->checksum_seed = (int32_t) (time(NULL) ^ (getpid() << 6));
+    pr_trace_msg(trace_channel, 17, "generated checksum seed %lu",
+      (unsigned long) opts->checksum_seed);
   }
 
-  if (sess->protocol_version < 30) {
-    /* Prior to protocol version 30, use MD4. */
-    /* NOTE: Consider simply omitting support for older protocol versions, at
-     * least for initial implementation.
-     */
+  /* Send the checksum seed. */
+  bufsz = buflen = sizeof(int32_t);
+  ptr = buf = palloc(p, bufsz);
+
+  rsync_msg_write_int(&buf, &buflen, (int32_t) opts->checksum_seed);
 
-  } else {
-    /* Protocol version 30 and later, user MD5. */
+  if ((rsync_write_data)(p, sess->channel_id, ptr, (bufsz - buflen)) < 0) {
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "error sending checksum seed: %s", strerror(errno));
+    errno = EIO;
+    return -1;
   }
 
+  pr_trace_msg(trace_channel, 9, "sent checksum seed %lu",
+    (unsigned long) opts->checksum_seed);
+
+  sess->checksum_seed = opts->checksum_seed;
   return 0;
 }
@@ -28,13 +28,66 @@
 #include "mod_rsync.h"
 #include "session.h"
 
-/* XXX Protocol version 30 and later use MD5; prior to that, MD4.
+/* Protocol version 30 and later use MD5; prior to that, MD4.  Protocol 31
+ * clients may negotiate one of the faster xxhash algorithms instead.
  *
  * Since MD4 is considered weak, recent versions of OpenSSL have to be 
  * compiled with MD4 support explicitly enabled; for these versions, we
  * will need to supply our own MD4.  Damn.
  */
 
+#define RSYNC_CHECKSUM_ALGO_NONE		0
+#define RSYNC_CHECKSUM_ALGO_MD4			1
+#define RSYNC_CHECKSUM_ALGO_MD5			2
+#define RSYNC_CHECKSUM_ALGO_XXH64		3
+#define RSYNC_CHECKSUM_ALGO_XXH3		4
+#define RSYNC_CHECKSUM_ALGO_XXH128		5
+
+/* The longest digest produced by any of the supported algorithms. */
+#define RSYNC_CHECKSUM_MAX_DIGEST_LEN		16
+
+/* Our default preference order, when negotiating with the client. */
+#define RSYNC_CHECKSUM_DEFAULT_PREFERENCES	"xxh128 xxh3 xxh64 md5 md4"
+
+struct rsync_checksum;
+
+/* Returns the algorithm ID for the given name, or -1 (with errno set to
+ * ENOENT) if the name is not known.
+ */
+int rsync_checksum_get_algo(const char *name);
+const char *rsync_checksum_get_name(int algo);
+size_t rsync_checksum_get_digest_len(int algo);
+
+/* Returns TRUE if the given algorithm is supported in this build. */
+int rsync_checksum_supported(int algo);
+
+/* Configure/retrieve the space-delimited list of algorithms, in preference
+ * order, which we offer to clients.
+ */
+int rsync_checksum_set_preferred(pool *p, const char *names);
+const char *rsync_checksum_get_preferred(pool *p);
+
+/* Whole-file (transfer) checksums. */
+struct rsync_checksum *rsync_checksum_create(pool *p, int algo, int32_t seed);
+int rsync_checksum_update(struct rsync_checksum *ck, const unsigned char *data,
+  size_t datalen);
+size_t rsync_checksum_finish(struct rsync_checksum *ck, unsigned char *digest);
+
+/* Block ("strong") checksums, using the session's negotiated algorithm,
+ * checksum seed, and seed ordering.  Returns the length of the digest.
+ */
+size_t rsync_checksum_block(struct rsync_session *sess,
+  const unsigned char *data, size_t datalen, unsigned char *digest);
+
+/* Computes the block checksums of consecutive blocks of block_len bytes in
+ * the given data, e.g. for a file's signature; the last block may be short.
+ * The digests array must have room for the digest of each block.  Returns
+ * the number of blocks.
+ */
+int rsync_checksum_blocks(struct rsync_session *sess,
+  const unsigned char *data, size_t datalen, uint32_t block_len,
+  unsigned char *digests);
+
 int rsync_checksum_handle_data(pool *p, struct rsync_session *sess,
   unsigned char **data, uint32_t *datalen);
 
@@ -0,0 +1,1239 @@
+/*
+ * ProFTPD - mod_rsync compression
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_rsync.h"
+#include "compress.h"
+
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif /* HAVE_ZSTD */
+
+#ifdef HAVE_LZ4
+# include <lz4.h>
+#endif /* HAVE_LZ4 */
+
+static const char *trace_channel = "rsync.compress";
+
+/* Default compression levels, per rsync-${version}/compat.c. */
+#define RSYNC_COMPRESS_ZLIB_DEFAULT_LEVEL	6
+#define RSYNC_COMPRESS_ZSTD_DEFAULT_LEVEL	3
+
+struct compress_algo {
+  const char *name;
+  int algo;
+};
+
+static struct compress_algo compress_algos[] = {
+  { "zstd",	RSYNC_COMPRESS_ALGO_ZSTD },
+  { "lz4",	RSYNC_COMPRESS_ALGO_LZ4 },
+  { "zlibx",	RSYNC_COMPRESS_ALGO_ZLIBX },
+  { "zlib",	RSYNC_COMPRESS_ALGO_ZLIB },
+  { "none",	RSYNC_COMPRESS_ALGO_NONE },
+
+  { NULL, 0 }
+};
+
+static const char *compress_prefs = NULL;
+
+/* Per-algorithm level caps; zero means no cap. */
+static int compress_max_levels[RSYNC_COMPRESS_ALGO_MAX+1];
+
+/* rsync's default list of suffixes of files not worth compressing, kept
+ * sorted for bsearch(3); see rsync_compress_skip_path().
+ */
+static const char *compress_default_skip_suffixes[] = {
+  "3g2", "3gp", "7z", "aac", "ace", "apk", "avi", "bz2", "deb", "dmg", "ear",
+  "f4v", "flac", "flv", "gpg", "gz", "iso", "jar", "jpeg", "jpg", "lrz", "lz",
+  "lz4", "lzma", "lzo", "m1a", "m1v", "m2a", "m2ts", "m2v", "m4a", "m4b",
+  "m4p", "m4r", "m4v", "mka", "mkv", "mov", "mp1", "mp2", "mp3", "mp4", "mpa",
+  "mpeg", "mpg", "mpv", "mts", "odb", "odf", "odg", "odi", "odm", "odp",
+  "ods", "odt", "oga", "ogg", "ogm", "ogv", "ogx", "opus", "otg", "oth",
+  "otp", "ots", "ott", "oxt", "png", "qt", "rar", "rpm", "rz", "rzip", "spx",
+  "squashfs", "sxc", "sxd", "sxg", "sxm", "sxw", "sz", "tbz", "tbz2", "tgz",
+  "tlz", "ts", "txz", "tzo", "vob", "war", "webm", "webp", "xz", "z", "zip",
+  "zst"
+};
+
+static const char **compress_skip_suffixes = compress_default_skip_suffixes;
+static size_t compress_skip_count =
+  sizeof(compress_default_skip_suffixes) / sizeof(char *);
+
+/* Longest suffix which we try to match. */
+#define RSYNC_COMPRESS_MAX_SUFFIX_LEN		32
+
+/* Maximum number of suffixes to which a single pattern, with character
+ * classes, may expand.
+ */
+#define RSYNC_COMPRESS_MAX_SUFFIX_EXPANSION	64
+
+/* Sampled data whose entropy exceeds 7.5 bits per byte (in 1/256ths of a
+ * bit) is deemed to be already compressed.  Samples which are too small are
+ * not judged.
+ */
+#define RSYNC_COMPRESS_PROBE_MAX_ENTROPY	((7 * 256) + 128)
+#define RSYNC_COMPRESS_PROBE_MIN_LEN		512
+#define RSYNC_COMPRESS_PROBE_MAX_LEN		4096
+
+/* For skipped files, lz4 is told to favor speed over everything else. */
+#define RSYNC_COMPRESS_LZ4_SKIP_ACCELERATION	65537
+
+int rsync_compress_get_algo(const char *name) {
+  register unsigned int i;
+
+  if (name == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (i = 0; compress_algos[i].name != NULL; i++) {
+    if (strcasecmp(compress_algos[i].name, name) == 0) {
+      return compress_algos[i].algo;
+    }
+  }
+
+  errno = ENOENT;
+  return -1;
+}
+
+const char *rsync_compress_get_name(int algo) {
+  register unsigned int i;
+
+  for (i = 0; compress_algos[i].name != NULL; i++) {
+    if (compress_algos[i].algo == algo) {
+      return compress_algos[i].name;
+    }
+  }
+
+  errno = ENOENT;
+  return NULL;
+}
+
+int rsync_compress_supported(int algo) {
+  switch (algo) {
+    case RSYNC_COMPRESS_ALGO_NONE:
+    case RSYNC_COMPRESS_ALGO_ZLIB:
+    case RSYNC_COMPRESS_ALGO_ZLIBX:
+      return TRUE;
+
+#ifdef HAVE_LZ4
+    case RSYNC_COMPRESS_ALGO_LZ4:
+      return TRUE;
+#endif /* HAVE_LZ4 */
+
+#ifdef HAVE_ZSTD
+    case RSYNC_COMPRESS_ALGO_ZSTD:
+      return TRUE;
+#endif /* HAVE_ZSTD */
+
+    default:
+      break;
+  }
+
+  return FALSE;
+}
+
+/* Returns the given list of names, minus any unknown or unsupported
+ * algorithms, or NULL if no supported algorithms remain.
+ */
+static const char *filter_algos(pool *p, const char *names) {
+  char *ptr, *name;
+  const char *algos = NULL;
+
+  ptr = pstrdup(p, names);
+  while ((name = strsep(&ptr, " ,")) != NULL) {
+    int algo;
+
+    pr_signals_handle();
+
+    if (*name == '\0') {
+      continue;
+    }
+
+    algo = rsync_compress_get_algo(name);
+    if (algo < 0 ||
+        rsync_compress_supported(algo) == FALSE) {
+      pr_trace_msg(trace_channel, 9,
+        "ignoring unsupported compression algorithm '%s'", name);
+      continue;
+    }
+
+    if (algos == NULL) {
+      algos = rsync_compress_get_name(algo);
+
+    } else {
+      algos = pstrcat(p, algos, " ", rsync_compress_get_name(algo), NULL);
+    }
+  }
+
+  return algos;
+}
+
+int rsync_compress_set_preferred(pool *p, const char *names) {
+  const char *algos;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (names == NULL) {
+    /* Reset to the defaults. */
+    compress_prefs = NULL;
+    return 0;
+  }
+
+  algos = filter_algos(p, names);
+  if (algos == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  compress_prefs = algos;
+  return 0;
+}
+
+const char *rsync_compress_get_preferred(pool *p) {
+  if (compress_prefs != NULL) {
+    return compress_prefs;
+  }
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return filter_algos(p, RSYNC_COMPRESS_DEFAULT_PREFERENCES);
+}
+
+int rsync_compress_set_max_level(int algo, int level) {
+  if (algo < 0 ||
+      algo > RSYNC_COMPRESS_ALGO_MAX ||
+      level < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  compress_max_levels[algo] = level;
+  return 0;
+}
+
+int rsync_compress_get_level(int algo, int requested) {
+  int level, min_level, max_level, default_level;
+
+  switch (algo) {
+    case RSYNC_COMPRESS_ALGO_ZLIB:
+    case RSYNC_COMPRESS_ALGO_ZLIBX:
+      min_level = Z_BEST_SPEED;
+      max_level = Z_BEST_COMPRESSION;
+      default_level = RSYNC_COMPRESS_ZLIB_DEFAULT_LEVEL;
+      break;
+
+#ifdef HAVE_ZSTD
+    case RSYNC_COMPRESS_ALGO_ZSTD:
+      min_level = ZSTD_minCLevel();
+      max_level = ZSTD_maxCLevel();
+      default_level = RSYNC_COMPRESS_ZSTD_DEFAULT_LEVEL;
+      break;
+#endif /* HAVE_ZSTD */
+
+    case RSYNC_COMPRESS_ALGO_LZ4:
+    case RSYNC_COMPRESS_ALGO_NONE:
+      /* No levels, as far as rsync is concerned. */
+      return 0;
+
+    default:
+      errno = EINVAL;
+      return -1;
+  }
+
+  /* Note that this means that zstd's "fast" level of -1 cannot be requested
+   * explicitly; rsync has the same limitation.
+   */
+  if (requested == Z_DEFAULT_COMPRESSION) {
+    level = default_level;
+
+  } else {
+    if (requested < min_level ||
+        requested > max_level) {
+      pr_trace_msg(trace_channel, 2,
+        "invalid %s compression level %d requested (valid range %d-%d)",
+        rsync_compress_get_name(algo), requested, min_level, max_level);
+      errno = EINVAL;
+      return -1;
+    }
+
+    level = requested;
+  }
+
+  if (compress_max_levels[algo] > 0 &&
+      level > compress_max_levels[algo]) {
+    pr_trace_msg(trace_channel, 9,
+      "reducing %s compression level %d to configured maximum %d",
+      rsync_compress_get_name(algo), level, compress_max_levels[algo]);
+    level = compress_max_levels[algo];
+  }
+
+  return level;
+}
+
+static int skip_suffix_cmp(const void *a, const void *b) {
+  return strcmp(*((const char **) a), *((const char **) b));
+}
+
+/* Expands any character classes in the given suffix pattern, adding the
+ * resulting (lowercased) suffixes to the list.
+ */
+static int expand_suffix(pool *p, array_header *list, const char *pattern) {
+  register unsigned int i, j;
+  array_header *partials;
+  const char *ptr;
+
+  partials = make_array(p, 1, sizeof(char *));
+  *((char **) push_array(partials)) = "";
+
+  for (ptr = pattern; *ptr != '\0'; ptr++) {
+    array_header *expanded;
+    const char *chars;
+    size_t nchars;
+
+    if (*ptr == '[') {
+      const char *end;
+
+      end = strchr(ptr + 1, ']');
+      if (end == NULL ||
+          end == ptr + 1) {
+        errno = EINVAL;
+        return -1;
+      }
+
+      chars = ptr + 1;
+      nchars = end - chars;
+      ptr = end;
+
+    } else {
+      chars = ptr;
+      nchars = 1;
+    }
+
+    if (partials->nelts * nchars > RSYNC_COMPRESS_MAX_SUFFIX_EXPANSION) {
+      errno = EINVAL;
+      return -1;
+    }
+
+    expanded = make_array(p, partials->nelts * nchars, sizeof(char *));
+    for (i = 0; i < partials->nelts; i++) {
+      char *partial;
+
+      partial = ((char **) partials->elts)[i];
+      for (j = 0; j < nchars; j++) {
+        char c[2];
+
+        c[0] = tolower((int) chars[j]);
+        c[1] = '\0';
+        *((char **) push_array(expanded)) = pstrcat(p, partial, c, NULL);
+      }
+    }
+
+    partials = expanded;
+  }
+
+  for (i = 0; i < partials->nelts; i++) {
+    char *suffix;
+
+    suffix = ((char **) partials->elts)[i];
+    if (*suffix != '\0' &&
+        strlen(suffix) <= RSYNC_COMPRESS_MAX_SUFFIX_LEN) {
+      *((char **) push_array(list)) = suffix;
+    }
+  }
+
+  return 0;
+}
+
+int rsync_compress_set_skip_suffixes(pool *p, const char *suffixes) {
+  register unsigned int i;
+  array_header *list;
+  char *ptr, *suffix;
+  const char **elts;
+  size_t count = 0;
+
+  if (suffixes == NULL) {
+    /* Reset to the defaults. */
+    compress_skip_suffixes = compress_default_skip_suffixes;
+    compress_skip_count = sizeof(compress_default_skip_suffixes) /
+      sizeof(char *);
+    return 0;
+  }
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  list = make_array(p, 0, sizeof(char *));
+
+  ptr = pstrdup(p, suffixes);
+  while ((suffix = strsep(&ptr, "/")) != NULL) {
+    pr_signals_handle();
+
+    if (*suffix == '\0') {
+      continue;
+    }
+
+    if (expand_suffix(p, list, suffix) < 0) {
+      pr_trace_msg(trace_channel, 3,
+        "ignoring invalid skip-compress suffix '%s'", suffix);
+    }
+  }
+
+  /* Sort the list, and weed out duplicates (e.g. from "[Jj][Pp][Gg]"). */
+  elts = list->elts;
+  qsort(elts, list->nelts, sizeof(char *), skip_suffix_cmp);
+
+  for (i = 0; i < list->nelts; i++) {
+    if (count > 0 &&
+        strcmp(elts[count-1], elts[i]) == 0) {
+      continue;
+    }
+
+    elts[count++] = elts[i];
+  }
+
+  compress_skip_suffixes = elts;
+  compress_skip_count = count;
+
+  pr_trace_msg(trace_channel, 9, "using %lu skip-compress suffixes",
+    (unsigned long) count);
+  return 0;
+}
+
+int rsync_compress_skip_path(const char *path) {
+  const char *name, *ptr;
+
+  if (path == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (compress_skip_count == 0) {
+    return FALSE;
+  }
+
+  name = strrchr(path, '/');
+  name = (name != NULL) ? name + 1 : path;
+
+  /* Try every suffix of the name, so that e.g. "tar.gz" can be matched. */
+  for (ptr = strchr(name, '.'); ptr != NULL; ptr = strchr(ptr + 1, '.')) {
+    register unsigned int i;
+    char suffix[RSYNC_COMPRESS_MAX_SUFFIX_LEN+1], *key;
+    size_t len;
+
+    len = strlen(ptr + 1);
+    if (len == 0 ||
+        len > RSYNC_COMPRESS_MAX_SUFFIX_LEN) {
+      continue;
+    }
+
+    for (i = 0; i <= len; i++) {
+      suffix[i] = tolower((int) ptr[i+1]);
+    }
+
+    key = suffix;
+    if (bsearch(&key, compress_skip_suffixes, compress_skip_count,
+        sizeof(char *), skip_suffix_cmp) != NULL) {
+      pr_trace_msg(trace_channel, 17,
+        "path '%s' matches skip-compress suffix '%s'", path, suffix);
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/* Returns log2(x), in 1/256ths, for x > 0. */
+static uint32_t log2_fixed(uint32_t x) {
+  register unsigned int i;
+  uint32_t n = 0, res;
+  uint64_t y;
+
+  while ((x >> n) > 1) {
+    n++;
+  }
+
+  /* Normalize x into [1, 2), in 16.16 fixed point, then compute the
+   * fractional bits by repeated squaring.
+   */
+  y = ((uint64_t) x << 16) >> n;
+  res = n << 8;
+
+  for (i = 0; i < 8; i++) {
+    y = (y * y) >> 16;
+    if (y >= (2 << 16)) {
+      y >>= 1;
+      res |= (0x80 >> i);
+    }
+  }
+
+  return res;
+}
+
+int rsync_compress_probe(const unsigned char *data, size_t datalen) {
+  register unsigned int i;
+  uint32_t counts[256], log2_len, entropy;
+  uint64_t sum = 0;
+
+  if (data == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (datalen < RSYNC_COMPRESS_PROBE_MIN_LEN) {
+    return TRUE;
+  }
+
+  if (datalen > RSYNC_COMPRESS_PROBE_MAX_LEN) {
+    datalen = RSYNC_COMPRESS_PROBE_MAX_LEN;
+  }
+
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < datalen; i++) {
+    counts[data[i]]++;
+  }
+
+  /* Shannon entropy: the sum of -p(c) * log2(p(c)), for each byte value c;
+   * here, with p(c) = counts[c] / datalen.
+   */
+  log2_len = log2_fixed((uint32_t) datalen);
+  for (i = 0; i < 256; i++) {
+    if (counts[i] > 0) {
+      sum += (uint64_t) counts[i] * (log2_len - log2_fixed(counts[i]));
+    }
+  }
+
+  entropy = (uint32_t) (sum / datalen);
+
+  pr_trace_msg(trace_channel, 17,
+    "sampled %lu bytes: entropy %u.%02u bits/byte", (unsigned long) datalen,
+    entropy >> 8, ((entropy & 0xff) * 100) >> 8);
+
+  if (entropy > RSYNC_COMPRESS_PROBE_MAX_ENTROPY) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+int rsync_compress_transport_compressed(pool *p) {
+  const char *algo;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* mod_sftp sets this once the SSH key exchange has completed; it names the
+   * compression used for server-to-client data, i.e. for what we send.
+   */
+  algo = pr_env_get(p, "SFTP_SERVER_COMPRESSION_ALGO");
+  if (algo == NULL ||
+      strcasecmp(algo, "none") == 0) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void compress_cleanup_cb(void *data) {
+  struct rsync_compress *comp;
+
+  comp = data;
+
+  switch (comp->algo) {
+    case RSYNC_COMPRESS_ALGO_ZLIB:
+    case RSYNC_COMPRESS_ALGO_ZLIBX:
+      if (comp->deflate_ctx != NULL) {
+        deflateEnd(comp->deflate_ctx);
+        comp->deflate_ctx = NULL;
+      }
+
+      if (comp->inflate_ctx != NULL) {
+        inflateEnd(comp->inflate_ctx);
+        comp->inflate_ctx = NULL;
+      }
+      break;
+
+#ifdef HAVE_ZSTD
+    case RSYNC_COMPRESS_ALGO_ZSTD:
+      if (comp->deflate_ctx != NULL) {
+        ZSTD_freeCCtx(comp->deflate_ctx);
+        comp->deflate_ctx = NULL;
+      }
+
+      if (comp->inflate_ctx != NULL) {
+        ZSTD_freeDCtx(comp->inflate_ctx);
+        comp->inflate_ctx = NULL;
+      }
+      break;
+#endif /* HAVE_ZSTD */
+
+    default:
+      /* The lz4 state is allocated from the pool. */
+      break;
+  }
+}
+
+struct rsync_compress *rsync_compress_create(pool *p, int algo, int level) {
+  struct rsync_compress *comp;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (algo == RSYNC_COMPRESS_ALGO_NONE ||
+      rsync_compress_supported(algo) == FALSE) {
+    errno = ENOSYS;
+    return NULL;
+  }
+
+  comp = pcalloc(p, sizeof(struct rsync_compress));
+  comp->pool = p;
+  comp->algo = algo;
+  comp->level = level;
+
+  /* The (de)compression contexts are allocated on first use, since a given
+   * session usually only needs one direction.
+   */
+  register_cleanup(p, comp, compress_cleanup_cb, compress_cleanup_cb);
+
+  pr_trace_msg(trace_channel, 9, "created %s compressor (level %d)",
+    rsync_compress_get_name(algo), level);
+  return comp;
+}
+
+/* Returns the level at which to compress the current file. */
+static int get_file_level(struct rsync_compress *comp) {
+  if (comp->skip == FALSE) {
+    return comp->level;
+  }
+
+  switch (comp->algo) {
+    case RSYNC_COMPRESS_ALGO_ZLIB:
+    case RSYNC_COMPRESS_ALGO_ZLIBX:
+      return Z_NO_COMPRESSION;
+
+#ifdef HAVE_ZSTD
+    case RSYNC_COMPRESS_ALGO_ZSTD:
+      return ZSTD_minCLevel();
+#endif /* HAVE_ZSTD */
+
+    default:
+      break;
+  }
+
+  return comp->level;
+}
+
+static z_stream *zlib_get_deflater(struct rsync_compress *comp) {
+  z_stream *zstrm;
+  int res;
+
+  zstrm = comp->deflate_ctx;
+  if (zstrm != NULL) {
+    return zstrm;
+  }
+
+  zstrm = pcalloc(comp->pool, sizeof(z_stream));
+
+  /* Note that rsync uses raw deflate streams, i.e. without the zlib
+   * header/trailer, hence the negative window bits.
+   */
+  res = deflateInit2(zstrm, get_file_level(comp), Z_DEFLATED, -15, 8,
+    Z_DEFAULT_STRATEGY);
+  if (res != Z_OK) {
+    comp->deflate_error = zstrm->msg ? zstrm->msg : "unknown error";
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  comp->deflate_ctx = zstrm;
+  return zstrm;
+}
+
+static z_stream *zlib_get_inflater(struct rsync_compress *comp) {
+  z_stream *zstrm;
+  int res;
+
+  zstrm = comp->inflate_ctx;
+  if (zstrm != NULL) {
+    return zstrm;
+  }
+
+  zstrm = pcalloc(comp->pool, sizeof(z_stream));
+
+  res = inflateInit2(zstrm, -15);
+  if (res != Z_OK) {
+    pr_trace_msg(trace_channel, 3, "error initializing inflate stream: %s",
+      zstrm->msg ? zstrm->msg : "unknown error");
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  comp->inflate_ctx = zstrm;
+  return zstrm;
+}
+
+static int zlib_deflate(struct rsync_compress *comp, int flags) {
+  z_stream *zstrm;
+  int res;
+
+  zstrm = zlib_get_deflater(comp);
+  if (zstrm == NULL) {
+    return -1;
+  }
+
+  zstrm->next_in = (Bytef *) comp->next_in;
+  zstrm->avail_in = comp->avail_in;
+  zstrm->next_out = comp->next_out;
+  zstrm->avail_out = comp->avail_out;
+
+  res = deflate(zstrm,
+    (flags & RSYNC_COMPRESS_FL_FLUSH) ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+  if (res != Z_OK &&
+      res != Z_BUF_ERROR) {
+    comp->deflate_error = zstrm->msg ? zstrm->msg : "unknown error";
+    errno = EIO;
+    return -1;
+  }
+
+  comp->next_in = zstrm->next_in;
+  comp->avail_in = zstrm->avail_in;
+  comp->next_out = zstrm->next_out;
+  comp->avail_out = zstrm->avail_out;
+
+  /* If deflate() filled the output buffer, there may be more to come. */
+  if (comp->avail_out == 0) {
+    return 1;
+  }
+
+  return 0;
+}
+
+static int zlib_inflate(struct rsync_compress *comp) {
+  z_stream *zstrm;
+  int res;
+
+  zstrm = zlib_get_inflater(comp);
+  if (zstrm == NULL) {
+    return -1;
+  }
+
+  zstrm->next_in = (Bytef *) comp->next_in;
+  zstrm->avail_in = comp->avail_in;
+  zstrm->next_out = comp->next_out;
+  zstrm->avail_out = comp->avail_out;
+
+  res = inflate(zstrm, Z_SYNC_FLUSH);
+  if (res != Z_OK &&
+      res != Z_BUF_ERROR) {
+    pr_trace_msg(trace_channel, 3, "error inflating data: %s",
+      zstrm->msg ? zstrm->msg : "unknown error");
+    errno = EIO;
+    return -1;
+  }
+
+  comp->next_in = zstrm->next_in;
+  comp->avail_in = zstrm->avail_in;
+  comp->next_out = zstrm->next_out;
+  comp->avail_out = zstrm->avail_out;
+
+  if (comp->avail_out == 0) {
+    return 1;
+  }
+
+  return 0;
+}
+
+#ifdef HAVE_ZSTD
+static int zstd_deflate(struct rsync_compress *comp, int flags) {
+  ZSTD_CCtx *cctx;
+  ZSTD_inBuffer in;
+  ZSTD_outBuffer out;
+  size_t res;
+
+  cctx = comp->deflate_ctx;
+  if (cctx == NULL) {
+    cctx = ZSTD_createCCtx();
+    if (cctx == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+
+    comp->deflate_level = get_file_level(comp);
+    res = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+      comp->deflate_level);
+    if (ZSTD_isError(res)) {
+      comp->deflate_error = ZSTD_getErrorName(res);
+      ZSTD_freeCCtx(cctx);
+      errno = EINVAL;
+      return -1;
+    }
+
+    comp->deflate_ctx = cctx;
+  }
+
+  out.dst = comp->next_out;
+  out.size = comp->avail_out;
+  out.pos = 0;
+
+  if (comp->deflate_level != get_file_level(comp)) {
+    /* A new level only applies to a new frame.  The last file's data was all
+     * flushed at its end, so ending its frame only adds the frame's last
+     * (empty) block; the receiver then decodes the next frame as part of the
+     * same stream.
+     */
+    in.src = NULL;
+    in.size = 0;
+    in.pos = 0;
+
+    res = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_end);
+    if (ZSTD_isError(res)) {
+      comp->deflate_error = ZSTD_getErrorName(res);
+      errno = EIO;
+      return -1;
+    }
+
+    comp->next_out += out.pos;
+    comp->avail_out -= out.pos;
+
+    if (res > 0) {
+      return 1;
+    }
+
+    comp->deflate_level = get_file_level(comp);
+    res = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+      comp->deflate_level);
+    if (ZSTD_isError(res)) {
+      comp->deflate_error = ZSTD_getErrorName(res);
+      errno = EINVAL;
+      return -1;
+    }
+
+    out.dst = comp->next_out;
+    out.size = comp->avail_out;
+    out.pos = 0;
+  }
+
+  in.src = comp->next_in;
+  in.size = comp->avail_in;
+  in.pos = 0;
+
+  res = ZSTD_compressStream2(cctx, &out, &in,
+    (flags & RSYNC_COMPRESS_FL_FLUSH) ? ZSTD_e_flush : ZSTD_e_continue);
+  if (ZSTD_isError(res)) {
+    comp->deflate_error = ZSTD_getErrorName(res);
+    errno = EIO;
+    return -1;
+  }
+
+  comp->next_in += in.pos;
+  comp->avail_in -= in.pos;
+  comp->next_out += out.pos;
+  comp->avail_out -= out.pos;
+
+  /* For ZSTD_e_flush, the return value is the amount of data still to be
+   * flushed.
+   */
+  if ((flags & RSYNC_COMPRESS_FL_FLUSH) &&
+      res > 0) {
+    return 1;
+  }
+
+  if (comp->avail_out == 0) {
+    return 1;
+  }
+
+  return 0;
+}
+
+static int zstd_inflate(struct rsync_compress *comp) {
+  ZSTD_DCtx *dctx;
+  ZSTD_inBuffer in;
+  ZSTD_outBuffer out;
+  size_t res;
+
+  dctx = comp->inflate_ctx;
+  if (dctx == NULL) {
+    dctx = ZSTD_createDCtx();
+    if (dctx == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+
+    comp->inflate_ctx = dctx;
+  }
+
+  in.src = comp->next_in;
+  in.size = comp->avail_in;
+  in.pos = 0;
+
+  out.dst = comp->next_out;
+  out.size = comp->avail_out;
+  out.pos = 0;
+
+  /* Decoding stops at the end of each frame, and the stream may go on to
+   * another (see zstd_deflate()).
+   */
+  for (;;) {
+    size_t in_pos, out_pos;
+
+    in_pos = in.pos;
+    out_pos = out.pos;
+
+    res = ZSTD_decompressStream(dctx, &out, &in);
+    if (ZSTD_isError(res)) {
+      pr_trace_msg(trace_channel, 3, "error decompressing data: %s",
+        ZSTD_getErrorName(res));
+      errno = EIO;
+      return -1;
+    }
+
+    if (in.pos == in.size ||
+        out.pos == out.size ||
+        (in.pos == in_pos && out.pos == out_pos)) {
+      break;
+    }
+  }
+
+  comp->next_in += in.pos;
+  comp->avail_in -= in.pos;
+  comp->next_out += out.pos;
+  comp->avail_out -= out.pos;
+
+  if (comp->avail_out == 0) {
+    return 1;
+  }
+
+  return 0;
+}
+#endif /* HAVE_ZSTD */
+
+#ifdef HAVE_LZ4
+static int lz4_deflate(struct rsync_compress *comp, int flags) {
+  size_t inlen;
+  int res;
+
+  if (comp->avail_in == 0) {
+    return 0;
+  }
+
+  if (comp->deflate_ctx == NULL) {
+    /* The state is reused for every block, rather than being allocated by
+     * LZ4_compress_default() each time.
+     */
+    comp->deflate_ctx = palloc(comp->pool, LZ4_sizeofState());
+  }
+
+  /* Only take as much input as is guaranteed to fit, once compressed, into
+   * the available output space.
+   */
+  inlen = comp->avail_in;
+  while (inlen > 0 &&
+         (size_t) LZ4_compressBound(inlen) > comp->avail_out) {
+    size_t overhead;
+
+    overhead = (size_t) LZ4_compressBound(inlen) - comp->avail_out;
+    inlen = inlen > overhead ? inlen - overhead : 0;
+  }
+
+  if (inlen == 0) {
+    return 1;
+  }
+
+  res = LZ4_compress_fast_extState(comp->deflate_ctx,
+    (const char *) comp->next_in, (char *) comp->next_out, (int) inlen,
+    (int) comp->avail_out,
+    comp->skip ? RSYNC_COMPRESS_LZ4_SKIP_ACCELERATION : 1);
+  if (res <= 0) {
+    comp->deflate_error = "output space exhausted";
+    errno = EIO;
+    return -1;
+  }
+
+  comp->next_in += inlen;
+  comp->avail_in -= inlen;
+  comp->next_out += res;
+  comp->avail_out -= res;
+
+  return comp->avail_in > 0 ? 1 : 0;
+}
+
+static int lz4_inflate(struct rsync_compress *comp) {
+  int res;
+
+  if (comp->avail_in == 0) {
+    return 0;
+  }
+
+  res = LZ4_decompress_safe((const char *) comp->next_in,
+    (char *) comp->next_out, (int) comp->avail_in, (int) comp->avail_out);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 3, "error decompressing %lu bytes of data",
+      (unsigned long) comp->avail_in);
+    errno = EIO;
+    return -1;
+  }
+
+  comp->next_in += comp->avail_in;
+  comp->avail_in = 0;
+  comp->next_out += res;
+  comp->avail_out -= res;
+
+  return 0;
+}
+#endif /* HAVE_LZ4 */
+
+int rsync_compress_deflate(struct rsync_compress *comp, int flags) {
+  if (comp == NULL ||
+      (comp->next_in == NULL && comp->avail_in > 0) ||
+      comp->next_out == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  switch (comp->algo) {
+    case RSYNC_COMPRESS_ALGO_ZLIB:
+    case RSYNC_COMPRESS_ALGO_ZLIBX:
+      return zlib_deflate(comp, flags);
+
+#ifdef HAVE_ZSTD
+    case RSYNC_COMPRESS_ALGO_ZSTD:
+      return zstd_deflate(comp, flags);
+#endif /* HAVE_ZSTD */
+
+#ifdef HAVE_LZ4
+    case RSYNC_COMPRESS_ALGO_LZ4:
+      return lz4_deflate(comp, flags);
+#endif /* HAVE_LZ4 */
+
+    default:
+      break;
+  }
+
+  errno = ENOSYS;
+  return -1;
+}
+
+int rsync_compress_inflate(struct rsync_compress *comp) {
+  if (comp == NULL ||
+      (comp->next_in == NULL && comp->avail_in > 0) ||
+      comp->next_out == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  switch (comp->algo) {
+    case RSYNC_COMPRESS_ALGO_ZLIB:
+    case RSYNC_COMPRESS_ALGO_ZLIBX:
+      return zlib_inflate(comp);
+
+#ifdef HAVE_ZSTD
+    case RSYNC_COMPRESS_ALGO_ZSTD:
+      return zstd_inflate(comp);
+#endif /* HAVE_ZSTD */
+
+#ifdef HAVE_LZ4
+    case RSYNC_COMPRESS_ALGO_LZ4:
+      return lz4_inflate(comp);
+#endif /* HAVE_LZ4 */
+
+    default:
+      break;
+  }
+
+  errno = ENOSYS;
+  return -1;
+}
+
+int rsync_compress_reset(struct rsync_compress *comp) {
+  if (comp == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  switch (comp->algo) {
+    case RSYNC_COMPRESS_ALGO_ZLIB:
+    case RSYNC_COMPRESS_ALGO_ZLIBX:
+      /* Resetting is much cheaper than ending and re-initializing. */
+      if (comp->deflate_ctx != NULL) {
+        deflateReset(comp->deflate_ctx);
+
+        /* Right after a reset, changing the level is cheap. */
+        deflateParams(comp->deflate_ctx, get_file_level(comp),
+          Z_DEFAULT_STRATEGY);
+      }
+
+      if (comp->inflate_ctx != NULL) {
+        inflateReset(comp->inflate_ctx);
+      }
+      break;
+
+#ifdef HAVE_ZSTD
+    case RSYNC_COMPRESS_ALGO_ZSTD:
+      /* The zstd streams continue across files.  A change of level ends the
+       * current frame, once there is output space for that; see
+       * zstd_deflate().
+       */
+      break;
+#endif /* HAVE_ZSTD */
+
+    default:
+      /* lz4 has no state. */
+      break;
+  }
+
+  return 0;
+}
+
+int rsync_compress_set_skip(struct rsync_compress *comp, int skip) {
+  if (comp == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  comp->skip = skip ? TRUE : FALSE;
+  return 0;
+}
+
+int rsync_compress_prime_deflate(struct rsync_compress *comp,
+    const unsigned char *data, size_t datalen) {
+  z_stream *zstrm;
+  int res;
+
+  if (comp == NULL ||
+      data == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (comp->algo != RSYNC_COMPRESS_ALGO_ZLIB) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  zstrm = zlib_get_deflater(comp);
+  if (zstrm == NULL) {
+    return -1;
+  }
+
+  /* For raw deflate streams, zlib allows the dictionary to be set at any
+   * block boundary (e.g. right after a Z_SYNC_FLUSH); the data is appended
+   * to the compressor's history, which is what rsync's (patched) zlib does
+   * with its Z_INSERT_ONLY flush mode.
+   */
+  res = deflateSetDictionary(zstrm, data, (uInt) datalen);
+  if (res != Z_OK) {
+    comp->deflate_error = zstrm->msg ? zstrm->msg : "unknown error";
+    errno = EIO;
+    return -1;
+  }
+
+  return 0;
+}
+
+int rsync_compress_prime_inflate(struct rsync_compress *comp,
+    const unsigned char *data, size_t datalen) {
+  z_stream *zstrm;
+  int res;
+
+  if (comp == NULL ||
+      data == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (comp->algo != RSYNC_COMPRESS_ALGO_ZLIB) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  zstrm = zlib_get_inflater(comp);
+  if (zstrm == NULL) {
+    return -1;
+  }
+
+  res = inflateSetDictionary(zstrm, data, (uInt) datalen);
+  if (res != Z_OK) {
+    pr_trace_msg(trace_channel, 3, "error priming inflate stream: %s",
+      zstrm->msg ? zstrm->msg : "unknown error");
+    errno = EIO;
+    return -1;
+  }
+
+  return 0;
+}
+
+int rsync_compress_inflate_sync(struct rsync_compress *comp) {
+  z_stream *zstrm;
+  unsigned char trailer[4] = { 0x00, 0x00, 0xff, 0xff }, scratch[8];
+  int res;
+
+  if (comp == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (comp->algo != RSYNC_COMPRESS_ALGO_ZLIB &&
+      comp->algo != RSYNC_COMPRESS_ALGO_ZLIBX) {
+    return 0;
+  }
+
+  zstrm = zlib_get_inflater(comp);
+  if (zstrm == NULL) {
+    return -1;
+  }
+
+  if (!inflateSyncPoint(zstrm)) {
+    pr_trace_msg(trace_channel, 3,
+      "inflate stream not at expected sync point");
+    errno = EIO;
+    return -1;
+  }
+
+  zstrm->next_in = trailer;
+  zstrm->avail_in = sizeof(trailer);
+  zstrm->next_out = scratch;
+  zstrm->avail_out = sizeof(scratch);
+
+  res = inflate(zstrm, Z_SYNC_FLUSH);
+  if (res != Z_OK &&
+      res != Z_BUF_ERROR) {
+    pr_trace_msg(trace_channel, 3, "error inflating sync trailer: %s",
+      zstrm->msg ? zstrm->msg : "unknown error");
+    errno = EIO;
+    return -1;
+  }
+
+  return 0;
+}
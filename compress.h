@@ -0,0 +1,186 @@
+/*
+ * ProFTPD - mod_rsync compression
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_RSYNC_COMPRESS_H
+#define MOD_RSYNC_COMPRESS_H
+
+#include "mod_rsync.h"
+#include "session.h"
+
+/* The "zlib" and "zlibx" algorithms both use deflate; they differ only in
+ * whether matched data is fed into the compressor's dictionary ("zlib") or
+ * not ("zlibx").  The zstd and lz4 algorithms require protocol 31 clients
+ * which negotiate, or which use --compress-choice.
+ */
+
+#define RSYNC_COMPRESS_ALGO_NONE		0
+#define RSYNC_COMPRESS_ALGO_ZLIB		1
+#define RSYNC_COMPRESS_ALGO_ZLIBX		2
+#define RSYNC_COMPRESS_ALGO_LZ4			3
+#define RSYNC_COMPRESS_ALGO_ZSTD		4
+
+#define RSYNC_COMPRESS_ALGO_MAX			RSYNC_COMPRESS_ALGO_ZSTD
+
+/* Our default preference order, when negotiating with the client. */
+#define RSYNC_COMPRESS_DEFAULT_PREFERENCES	"zstd lz4 zlibx zlib none"
+
+/* Flush modes for rsync_compress_deflate(). */
+#define RSYNC_COMPRESS_FL_CONTINUE		0
+#define RSYNC_COMPRESS_FL_FLUSH			1
+
+/* A streaming (de)compressor.  As with zlib's z_stream, the caller points
+ * the next_in/next_out fields at its buffers, and the library advances them.
+ */
+struct rsync_compress {
+  pool *pool;
+  int algo;
+  int level;
+
+  const unsigned char *next_in;
+  size_t avail_in;
+
+  unsigned char *next_out;
+  size_t avail_out;
+
+  /* Whether the current file is compressed at the cheapest level; see
+   * rsync_compress_set_skip().
+   */
+  int skip;
+
+  /* Why compressing failed, if it did.  Compressing may be done by a worker
+   * thread (see workers.h), so it is left to the caller to log this.
+   */
+  const char *deflate_error;
+
+  /* Private, algorithm-specific state. */
+  void *deflate_ctx;
+  void *inflate_ctx;
+
+  /* The level of the zstd frame being compressed. */
+  int deflate_level;
+};
+
+/* Returns the algorithm ID for the given name, or -1 (with errno set to
+ * ENOENT) if the name is not known.
+ */
+int rsync_compress_get_algo(const char *name);
+const char *rsync_compress_get_name(int algo);
+
+/* Returns TRUE if the given algorithm is supported in this build. */
+int rsync_compress_supported(int algo);
+
+/* Configure/retrieve the space-delimited list of algorithms, in preference
+ * order, which we offer to clients.
+ */
+int rsync_compress_set_preferred(pool *p, const char *names);
+const char *rsync_compress_get_preferred(pool *p);
+
+/* Configure the maximum compression level which clients may request for the
+ * given algorithm; a level of zero removes any such cap.
+ */
+int rsync_compress_set_max_level(int algo, int level);
+
+/* Returns the compression level to use for the given algorithm, given the
+ * level requested by the client (Z_DEFAULT_COMPRESSION if none), applying
+ * any configured cap.  Returns -1 (with errno set to EINVAL) if the requested
+ * level is not valid for the algorithm.
+ */
+int rsync_compress_get_level(int algo, int requested);
+
+/* Creates a compression stream.  The stream is meant to live for the
+ * entire session, and is reused for every file; see rsync_compress_reset().
+ */
+struct rsync_compress *rsync_compress_create(pool *p, int algo, int level);
+
+/* Prepares the stream for the next file.  rsync restarts its zlib streams
+ * for each file, but not its zstd streams.  Any change made by
+ * rsync_compress_set_skip() takes effect here; for zstd, whose level only
+ * changes with a new frame, the frame is ended before the file's data.
+ */
+int rsync_compress_reset(struct rsync_compress *comp);
+
+/* Configures whether the next file's data, i.e. after the next
+ * rsync_compress_reset(), is worth compressing.  Skipped files are still sent
+ * in the compressed format, as the receiver expects, but at the algorithm's
+ * cheapest level (e.g. stored blocks, for zlib).
+ */
+int rsync_compress_set_skip(struct rsync_compress *comp, int skip);
+
+/* Configure the slash-delimited list of file suffixes (e.g. "gz/jpg/mp4")
+ * which are not worth compressing, per rsync's --skip-compress.  A NULL
+ * list restores the default list; an empty list skips nothing.  As for
+ * rsync, suffixes are matched case-insensitively, and may contain simple
+ * character classes, e.g. "mp[34]".
+ */
+int rsync_compress_set_skip_suffixes(pool *p, const char *suffixes);
+
+/* Returns TRUE if the given path matches the skip-compress suffix list. */
+int rsync_compress_skip_path(const char *path);
+
+/* Examines a sample of file data (e.g. the first block), and returns FALSE
+ * if the data appears to be already compressed (i.e. of near-maximal
+ * entropy), TRUE otherwise.
+ */
+int rsync_compress_probe(const unsigned char *data, size_t datalen);
+
+/* Returns TRUE if the outer SSH transport is already compressing the data
+ * we send, in which case compressing it ourselves gains nothing.
+ */
+int rsync_compress_transport_compressed(pool *p);
+
+/* Compresses as much of the pending input as fits in the pending output
+ * space.  With RSYNC_COMPRESS_FL_FLUSH, all compressed data for the input
+ * so far is made available to the receiver.  Returns 1 if there is more
+ * output pending (i.e. the caller should provide more output space and call
+ * again), 0 if not, and -1 on error.
+ */
+int rsync_compress_deflate(struct rsync_compress *comp, int flags);
+
+/* Decompresses as much of the pending input as fits in the pending output
+ * space.  Returns 1 if there is more output pending, 0 if not, and -1 on
+ * error.
+ *
+ * Note that lz4 data is not streamed: each rsync_compress_deflate() call
+ * produces a self-contained block, consuming only as much input as will fit,
+ * compressed, in the output space; each rsync_compress_inflate() call must
+ * be given exactly one such block.
+ */
+int rsync_compress_inflate(struct rsync_compress *comp);
+
+/* For the "zlib" algorithm, matched data is added to the history of both the
+ * compressor and the decompressor, without being sent.  The deflate stream
+ * must be at a block boundary, e.g. just after a flush.
+ */
+int rsync_compress_prime_deflate(struct rsync_compress *comp,
+  const unsigned char *data, size_t datalen);
+int rsync_compress_prime_inflate(struct rsync_compress *comp,
+  const unsigned char *data, size_t datalen);
+
+/* rsync strips the 00 00 ff ff trailer which zlib appends when flushing; this
+ * restores it for the decompressor, once all of the data preceding a flush
+ * point has been inflated.  A no-op for algorithms other than zlib.
+ */
+int rsync_compress_inflate_sync(struct rsync_compress *comp);
+
+#endif /* MOD_RSYNC_COMPRESS_H */
@@ -0,0 +1,468 @@
+/*
+ * ProFTPD - mod_rsync destination files
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+#include "mod_rsync.h"
+#include "destfile.h"
+#include "fileio.h"
+
+/* How the file is built. */
+#define DESTFILE_TYPE_TEMP		1
+#define DESTFILE_TYPE_UNNAMED		2
+#define DESTFILE_TYPE_DIRECT		3
+#define DESTFILE_TYPE_DONE		4
+
+/* Attempts at a unique name in which to link an unnamed file. */
+#define DESTFILE_MAX_LINK_TRIES		100
+
+/* Unnamed files which cannot be linked (e.g. without /proc, in a chroot)
+ * are copied; once that happens, we stop making them.
+ */
+static int unnamed_failed = FALSE;
+
+static unsigned long tmp_count = 0;
+
+static const char *trace_channel = "rsync.destfile";
+
+struct rsync_destfile {
+  pool *pool;
+  const char *path;
+  const char *dir;
+  const char *name;
+
+  /* The temporary file, if named. */
+  const char *tmp_path;
+
+  int type;
+  int fd;
+
+  int have_attrs;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+
+  int have_mtime;
+  struct timespec mtime;
+
+  int xerrno;
+};
+
+static void split_path(struct rsync_destfile *df) {
+  const char *ptr;
+
+  ptr = strrchr(df->path, '/');
+  if (ptr == NULL) {
+    df->dir = ".";
+    df->name = df->path;
+
+  } else if (ptr == df->path) {
+    df->dir = "/";
+    df->name = ptr + 1;
+
+  } else {
+    df->dir = pstrndup(df->pool, df->path, ptr - df->path);
+    df->name = ptr + 1;
+  }
+}
+
+/* Returns a temporary name alongside the destination, with the given
+ * suffix, per rsync: ".<name>.<suffix>".
+ */
+static char *get_tmp_path(struct rsync_destfile *df, const char *suffix) {
+  return pdircat(df->pool, df->dir,
+    pstrcat(df->pool, ".", df->name, ".", suffix, NULL), NULL);
+}
+
+static int open_tmp(struct rsync_destfile *df) {
+  char *template;
+  int fd;
+
+  template = get_tmp_path(df, "XXXXXX");
+  fd = mkstemp(template);
+  if (fd < 0) {
+    return -1;
+  }
+
+  df->tmp_path = template;
+  return fd;
+}
+
+static int apply_attrs(struct rsync_destfile *df, int fd) {
+  if (df->have_attrs) {
+    /* The owner first, as changing it may clear the setuid/setgid bits. */
+    if ((df->uid != (uid_t) -1 ||
+         df->gid != (gid_t) -1) &&
+        fchown(fd, df->uid, df->gid) < 0) {
+      if (errno != EPERM) {
+        return -1;
+      }
+
+      pr_trace_msg(trace_channel, 3,
+        "unable to set owner of '%s' (UID %lu, GID %lu): %s", df->path,
+        (unsigned long) df->uid, (unsigned long) df->gid, strerror(errno));
+    }
+
+    if (fchmod(fd, df->mode) < 0) {
+      return -1;
+    }
+  }
+
+  if (df->have_mtime) {
+    struct timespec ts[2];
+
+    ts[0].tv_sec = 0;
+    ts[0].tv_nsec = UTIME_OMIT;
+    ts[1] = df->mtime;
+
+    if (futimens(fd, ts) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Gives the unnamed file the given name, via /proc, or failing that (e.g.
+ * in a chroot), by descriptor, which needs CAP_DAC_READ_SEARCH.
+ */
+static int link_unnamed(int fd, const char *path) {
+  char proc_path[64];
+  int res;
+
+  memset(proc_path, '\0', sizeof(proc_path));
+  snprintf(proc_path, sizeof(proc_path)-1, "/proc/self/fd/%d", fd);
+
+  res = linkat(AT_FDCWD, proc_path, AT_FDCWD, path, AT_SYMLINK_FOLLOW);
+#ifdef AT_EMPTY_PATH
+  if (res < 0 &&
+      errno == ENOENT) {
+    res = linkat(fd, "", AT_FDCWD, path, AT_EMPTY_PATH);
+  }
+#endif /* AT_EMPTY_PATH */
+
+  return res;
+}
+
+/* Copies the unnamed file into a named temporary file, which is renamed into
+ * place.
+ */
+static int copy_unnamed(struct rsync_destfile *df) {
+  unsigned char buf[8192];
+  off_t offset = 0;
+  int fd, xerrno;
+
+  fd = open_tmp(df);
+  if (fd < 0) {
+    return -1;
+  }
+
+  while (TRUE) {
+    ssize_t res;
+
+    res = rsync_fileio_read(df->fd, buf, sizeof(buf), offset);
+    if (res < 0 ||
+        (res > 0 &&
+         rsync_fileio_write(fd, buf, (size_t) res, offset) < 0)) {
+      break;
+    }
+
+    offset += res;
+
+    if ((size_t) res < sizeof(buf)) {
+      if (apply_attrs(df, fd) == 0 &&
+          rename(df->tmp_path, df->path) == 0) {
+        (void) close(fd);
+        return 0;
+      }
+
+      break;
+    }
+  }
+
+  xerrno = errno;
+
+  (void) close(fd);
+  (void) unlink(df->tmp_path);
+
+  errno = xerrno;
+  return -1;
+}
+
+/* Links the unnamed file into place.  A link cannot replace an existing
+ * file; in that case, it is linked under a temporary name, then renamed.
+ */
+static int place_unnamed(struct rsync_destfile *df) {
+  register unsigned int i;
+
+  if (link_unnamed(df->fd, df->path) == 0) {
+    return 0;
+  }
+
+  for (i = 0; errno == EEXIST && i < DESTFILE_MAX_LINK_TRIES; i++) {
+    char suffix[32];
+    const char *tmp_path;
+
+    memset(suffix, '\0', sizeof(suffix));
+    snprintf(suffix, sizeof(suffix)-1, "%06lX",
+      (((unsigned long) getpid() << 8) ^ ++tmp_count) & 0xffffffUL);
+    tmp_path = get_tmp_path(df, suffix);
+
+    if (link_unnamed(df->fd, tmp_path) == 0) {
+      int xerrno;
+
+      if (rename(tmp_path, df->path) == 0) {
+        return 0;
+      }
+
+      xerrno = errno;
+      (void) unlink(tmp_path);
+
+      errno = xerrno;
+      return -1;
+    }
+  }
+
+  if (errno == ENOENT ||
+      errno == EPERM) {
+    pr_trace_msg(trace_channel, 3,
+      "unable to link unnamed file for '%s' (%s), copying it instead",
+      df->path, strerror(errno));
+    unnamed_failed = TRUE;
+
+    return copy_unnamed(df);
+  }
+
+  return -1;
+}
+
+static int commit_file(struct rsync_destfile *df) {
+  if (apply_attrs(df, df->fd) < 0) {
+    return -1;
+  }
+
+  switch (df->type) {
+    case DESTFILE_TYPE_TEMP:
+      return rename(df->tmp_path, df->path);
+
+    case DESTFILE_TYPE_UNNAMED:
+      return place_unnamed(df);
+
+    case DESTFILE_TYPE_DIRECT:
+      return 0;
+  }
+
+  errno = EINVAL;
+  return -1;
+}
+
+/* Removes whatever was created for the file. */
+static void remove_file(struct rsync_destfile *df) {
+  switch (df->type) {
+    case DESTFILE_TYPE_TEMP:
+      (void) unlink(df->tmp_path);
+      break;
+
+    case DESTFILE_TYPE_DIRECT:
+      (void) unlink(df->path);
+      break;
+  }
+
+  df->type = DESTFILE_TYPE_DONE;
+}
+
+struct rsync_destfile *rsync_destfile_open(pool *p, const char *path,
+    int flags) {
+  struct rsync_destfile *df;
+  int fd;
+
+  if (p == NULL ||
+      path == NULL ||
+      *path == '\0') {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  df = pcalloc(p, sizeof(struct rsync_destfile));
+  df->pool = p;
+  df->path = pstrdup(p, path);
+  df->fd = -1;
+  split_path(df);
+
+  if (flags & RSYNC_DESTFILE_FL_SMALL) {
+#ifdef O_TMPFILE
+    if (!unnamed_failed) {
+      fd = open(df->dir, O_TMPFILE|O_RDWR, 0600);
+      if (fd >= 0) {
+        df->type = DESTFILE_TYPE_UNNAMED;
+        df->fd = fd;
+        return df;
+      }
+
+      pr_trace_msg(trace_channel, 19,
+        "unable to open unnamed file in '%s': %s", df->dir, strerror(errno));
+    }
+#endif /* O_TMPFILE */
+
+    fd = open(df->path, O_WRONLY|O_CREAT|O_EXCL, 0600);
+    if (fd >= 0) {
+      df->type = DESTFILE_TYPE_DIRECT;
+      df->fd = fd;
+      return df;
+    }
+
+    if (errno != EEXIST) {
+      return NULL;
+    }
+  }
+
+  fd = open_tmp(df);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  df->type = DESTFILE_TYPE_TEMP;
+  df->fd = fd;
+  return df;
+}
+
+int rsync_destfile_get_fd(struct rsync_destfile *df) {
+  if (df == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return df->fd;
+}
+
+int rsync_destfile_set_attrs(struct rsync_destfile *df, mode_t mode,
+    uid_t uid, gid_t gid, const struct timespec *mtime) {
+  if (df == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  df->have_attrs = TRUE;
+  df->mode = mode;
+  df->uid = uid;
+  df->gid = gid;
+
+  if (mtime != NULL) {
+    df->have_mtime = TRUE;
+    df->mtime = *mtime;
+  }
+
+  return 0;
+}
+
+int rsync_destfile_commit(struct rsync_destfile **dfs, unsigned int count) {
+  register unsigned int i;
+  struct rsync_fileio_op ops[RSYNC_FILEIO_RING_SIZE];
+  unsigned int nfailed = 0, nops = 0;
+
+  if (dfs == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (dfs[i] == NULL ||
+        dfs[i]->type == DESTFILE_TYPE_DONE) {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    struct rsync_destfile *df;
+
+    df = dfs[i];
+    df->xerrno = 0;
+
+    if (commit_file(df) < 0) {
+      df->xerrno = errno;
+      nfailed++;
+
+      pr_trace_msg(trace_channel, 3, "error committing '%s': %s", df->path,
+        strerror(df->xerrno));
+      remove_file(df);
+    }
+
+    df->type = DESTFILE_TYPE_DONE;
+  }
+
+  /* The files are in place; close them all at once. */
+  for (i = 0; i < count; i++) {
+    memset(&(ops[nops]), 0, sizeof(struct rsync_fileio_op));
+    ops[nops].type = RSYNC_FILEIO_OP_CLOSE;
+    ops[nops].fd = dfs[i]->fd;
+    nops++;
+
+    if (nops == RSYNC_FILEIO_RING_SIZE ||
+        i == count - 1) {
+      register unsigned int j;
+
+      (void) rsync_fileio_run(ops, nops);
+
+      for (j = 0; j < nops; j++) {
+        struct rsync_destfile *df;
+
+        df = dfs[i + 1 - nops + j];
+        df->fd = -1;
+
+        if (ops[j].res < 0 &&
+            df->xerrno == 0) {
+          df->xerrno = ops[j].xerrno;
+          nfailed++;
+        }
+      }
+
+      nops = 0;
+    }
+  }
+
+  return (int) nfailed;
+}
+
+int rsync_destfile_get_error(struct rsync_destfile *df) {
+  if (df == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return df->xerrno;
+}
+
+int rsync_destfile_abort(struct rsync_destfile *df) {
+  if (df == NULL ||
+      df->type == DESTFILE_TYPE_DONE) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  (void) close(df->fd);
+  df->fd = -1;
+
+  remove_file(df);
+  return 0;
+}
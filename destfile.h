@@ -0,0 +1,77 @@
+/*
+ * ProFTPD - mod_rsync destination files
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+#ifndef MOD_RSYNC_DESTFILE_H
+#define MOD_RSYNC_DESTFILE_H
+
+#include "mod_rsync.h"
+
+/* As the receiver, each file is built in a file of its own, which replaces
+ * the destination only once complete (per rsync-${version}/receiver.c): a
+ * temporary file named ".<name>.XXXXXX", in the same directory, renamed into
+ * place.
+ *
+ * A small file (see rsync_small_file_size) instead is built in an unnamed
+ * O_TMPFILE file, linked into place; or, where that is not supported and the
+ * destination does not yet exist, the destination is created directly.  Its
+ * attributes are set through the descriptor, before it gets its name; and
+ * the files of a batch are closed together.
+ */
+
+struct rsync_destfile;
+
+/* Flags for rsync_destfile_open(). */
+#define RSYNC_DESTFILE_FL_SMALL			0x001
+
+/* Opens a file in which to build the given destination file.  The file is
+ * empty, and writable by us only, until committed.
+ */
+struct rsync_destfile *rsync_destfile_open(pool *p, const char *path,
+  int flags);
+
+/* Returns the descriptor to which to write the file. */
+int rsync_destfile_get_fd(struct rsync_destfile *df);
+
+/* Sets the attributes the file is to have, once committed: its mode, owner
+ * (per fchown(2), -1 leaves the uid or gid as it is), and, if not NULL, its
+ * modification time.
+ */
+int rsync_destfile_set_attrs(struct rsync_destfile *df, mode_t mode,
+  uid_t uid, gid_t gid, const struct timespec *mtime);
+
+/* Sets the attributes of the given files, puts them in place of their
+ * destinations, and closes them; returns the number which failed, whose
+ * errors are then available from rsync_destfile_get_error().  A file which
+ * could not be put in place is removed, leaving its destination as it was.
+ */
+int rsync_destfile_commit(struct rsync_destfile **dfs, unsigned int count);
+
+/* Returns the error with which the file failed to commit, if any, else 0. */
+int rsync_destfile_get_error(struct rsync_destfile *df);
+
+/* Discards the file, leaving its destination as it was. */
+int rsync_destfile_abort(struct rsync_destfile *df);
+
+#endif /* MOD_RSYNC_DESTFILE_H */
@@ -0,0 +1,679 @@
+/*
+ * ProFTPD - mod_rsync file I/O
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+#include "mod_rsync.h"
+#include "fileio.h"
+
+#ifdef HAVE_IO_URING
+# include <linux/io_uring.h>
+# include <linux/stat.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <sys/sysmacros.h>
+#endif /* HAVE_IO_URING */
+
+static int fileio_backend = RSYNC_FILEIO_BACKEND_AUTO;
+
+static const char *trace_channel = "rsync.fileio";
+
+#ifdef HAVE_IO_URING
+struct fileio_ring {
+  int fd;
+  unsigned int entries;
+
+  /* The submission queue, which we fill (the tail) and the kernel consumes
+   * (the head); and the completion queue, which the kernel fills, and we
+   * consume.
+   */
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+
+  /* Operations the kernel does not support are done with the POSIX calls. */
+  int have_open, have_stat, have_close;
+};
+
+static struct fileio_ring fileio_ring;
+
+/* Whether we have a ring, or failed to set one up, and so should not try
+ * again.
+ */
+static int fileio_ring_ok = FALSE;
+static int fileio_ring_failed = FALSE;
+
+static void ring_close(struct fileio_ring *ring) {
+  if (ring->sqes != NULL) {
+    (void) munmap(ring->sqes, ring->sqes_len);
+  }
+
+  if (ring->cq_ptr != NULL &&
+      ring->cq_ptr != ring->sq_ptr) {
+    (void) munmap(ring->cq_ptr, ring->cq_len);
+  }
+
+  if (ring->sq_ptr != NULL) {
+    (void) munmap(ring->sq_ptr, ring->sq_len);
+  }
+
+  if (ring->fd >= 0) {
+    (void) close(ring->fd);
+  }
+
+  memset(ring, 0, sizeof(struct fileio_ring));
+  ring->fd = -1;
+  fileio_ring_ok = FALSE;
+}
+
+static int ring_open(struct fileio_ring *ring) {
+  struct io_uring_params params;
+  struct io_uring_probe *probe;
+  uint64_t probebuf[(sizeof(struct io_uring_probe) +
+    (256 * sizeof(struct io_uring_probe_op))) / sizeof(uint64_t) + 1];
+  unsigned char *sq, *cq;
+  int fd, xerrno;
+
+  memset(&params, 0, sizeof(params));
+  fd = (int) syscall(__NR_io_uring_setup, RSYNC_FILEIO_RING_SIZE, &params);
+  if (fd < 0) {
+    return -1;
+  }
+
+  memset(ring, 0, sizeof(struct fileio_ring));
+  ring->fd = fd;
+  ring->entries = params.sq_entries;
+
+  ring->sq_len = params.sq_off.array +
+    (params.sq_entries * sizeof(unsigned int));
+  ring->cq_len = params.cq_off.cqes +
+    (params.cq_entries * sizeof(struct io_uring_cqe));
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_len > ring->sq_len) {
+      ring->sq_len = ring->cq_len;
+    }
+
+    ring->cq_len = ring->sq_len;
+  }
+
+  ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ|PROT_WRITE,
+    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) {
+    ring->sq_ptr = NULL;
+    goto fail;
+  }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ptr = ring->sq_ptr;
+
+  } else {
+    ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ|PROT_WRITE,
+      MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) {
+      ring->cq_ptr = NULL;
+      goto fail;
+    }
+  }
+
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ|PROT_WRITE,
+    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto fail;
+  }
+
+  sq = ring->sq_ptr;
+  ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+
+  cq = ring->cq_ptr;
+  ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  /* Reading and writing are required; the rest is optional. */
+  memset(probebuf, 0, sizeof(probebuf));
+  probe = (struct io_uring_probe *) probebuf;
+
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+      256) < 0) {
+    goto fail;
+  }
+
+#define FILEIO_HAVE_OP(op) \
+  ((op) <= probe->last_op && (probe->ops[(op)].flags & IO_URING_OP_SUPPORTED))
+
+  if (!FILEIO_HAVE_OP(IORING_OP_READ) ||
+      !FILEIO_HAVE_OP(IORING_OP_WRITE)) {
+    errno = ENOSYS;
+    goto fail;
+  }
+
+  ring->have_open = FILEIO_HAVE_OP(IORING_OP_OPENAT);
+  ring->have_stat = FILEIO_HAVE_OP(IORING_OP_STATX);
+  ring->have_close = FILEIO_HAVE_OP(IORING_OP_CLOSE);
+#undef FILEIO_HAVE_OP
+
+  pr_trace_msg(trace_channel, 9, "using io_uring with %u entries",
+    ring->entries);
+  return 0;
+
+fail:
+  xerrno = errno;
+  ring_close(ring);
+  errno = xerrno;
+  return -1;
+}
+
+static struct fileio_ring *get_ring(void) {
+  if (fileio_backend == RSYNC_FILEIO_BACKEND_POSIX) {
+    return NULL;
+  }
+
+  if (fileio_ring_ok == TRUE) {
+    return &fileio_ring;
+  }
+
+  if (fileio_ring_failed == TRUE) {
+    return NULL;
+  }
+
+  if (ring_open(&fileio_ring) < 0) {
+    pr_trace_msg(trace_channel, 3,
+      "unable to use io_uring (%s), using POSIX file I/O", strerror(errno));
+    fileio_ring_failed = TRUE;
+    return NULL;
+  }
+
+  fileio_ring_ok = TRUE;
+  return &fileio_ring;
+}
+#endif /* HAVE_IO_URING */
+
+static void posix_run(struct rsync_fileio_op *op) {
+  for (;;) {
+    switch (op->type) {
+      case RSYNC_FILEIO_OP_OPEN:
+        op->res = openat(op->dirfd, op->path, op->flags, op->mode);
+        if (op->res >= 0) {
+          op->fd = (int) op->res;
+        }
+        break;
+
+      case RSYNC_FILEIO_OP_STAT:
+        op->res = fstatat(op->dirfd, op->path, op->st, op->flags);
+        break;
+
+      case RSYNC_FILEIO_OP_CLOSE:
+        /* Per close(2), the descriptor is gone even if interrupted. */
+        op->res = close(op->fd);
+        if (op->res < 0 &&
+            errno == EINTR) {
+          op->res = 0;
+        }
+        break;
+
+      case RSYNC_FILEIO_OP_READ:
+        op->res = pread(op->fd, op->buf, op->len, op->offset);
+        break;
+
+      case RSYNC_FILEIO_OP_WRITE:
+        op->res = pwrite(op->fd, op->buf, op->len, op->offset);
+        break;
+
+      default:
+        op->res = -1;
+        errno = EINVAL;
+        break;
+    }
+
+    if (op->res < 0 &&
+        errno == EINTR) {
+      pr_signals_handle();
+      continue;
+    }
+
+    break;
+  }
+
+  op->xerrno = op->res < 0 ? errno : 0;
+  if (op->res < 0) {
+    op->res = -1;
+  }
+}
+
+#ifdef HAVE_IO_URING
+static void statx_to_stat(const struct statx *stx, struct stat *st) {
+  memset(st, 0, sizeof(struct stat));
+  st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+  st->st_ino = stx->stx_ino;
+  st->st_mode = stx->stx_mode;
+  st->st_nlink = stx->stx_nlink;
+  st->st_uid = stx->stx_uid;
+  st->st_gid = stx->stx_gid;
+  st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+  st->st_size = stx->stx_size;
+  st->st_blksize = stx->stx_blksize;
+  st->st_blocks = stx->stx_blocks;
+  st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+  st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+  st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+  st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+  st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/* Waits for (at least) one of the operations in flight to complete. */
+static void ring_wait(struct fileio_ring *ring) {
+  if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS,
+      NULL, 0) < 0) {
+    if (errno == EINTR) {
+      pr_signals_handle();
+      return;
+    }
+
+    /* Completions are still posted, as we return from system calls; so
+     * poll for them.
+     */
+    (void) pr_timer_usleep(1000);
+  }
+}
+
+/* Submits up to a ring's worth of operations with one system call, and waits
+ * for them all to complete.  Operations the kernel will not take are run
+ * here instead; if the ring fails, it is not used again, but the operations
+ * already in flight (which may be using the caller's buffers) are still
+ * waited for.
+ */
+static int ring_run(struct fileio_ring *ring, struct rsync_fileio_op *ops,
+    unsigned int nops) {
+  register unsigned int i;
+  struct statx stxs[RSYNC_FILEIO_RING_SIZE];
+  unsigned int head, tail, pending = 0;
+  int failed = FALSE, nfailed = 0;
+
+  tail = *(ring->sq_tail);
+
+  for (i = 0; i < nops; i++) {
+    struct rsync_fileio_op *op;
+    struct io_uring_sqe *sqe;
+    unsigned int idx;
+
+    op = &(ops[i]);
+
+    if ((op->type == RSYNC_FILEIO_OP_OPEN && ring->have_open == FALSE) ||
+        (op->type == RSYNC_FILEIO_OP_STAT && ring->have_stat == FALSE) ||
+        (op->type == RSYNC_FILEIO_OP_CLOSE && ring->have_close == FALSE) ||
+        op->type < RSYNC_FILEIO_OP_OPEN ||
+        op->type > RSYNC_FILEIO_OP_WRITE) {
+      posix_run(op);
+      continue;
+    }
+
+    idx = tail & *(ring->sq_mask);
+    sqe = &(ring->sqes[idx]);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = i;
+
+    switch (op->type) {
+      case RSYNC_FILEIO_OP_OPEN:
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = op->dirfd;
+        sqe->addr = (unsigned long) op->path;
+        sqe->len = op->mode;
+        sqe->open_flags = op->flags;
+        break;
+
+      case RSYNC_FILEIO_OP_STAT:
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = op->dirfd;
+        sqe->addr = (unsigned long) op->path;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (unsigned long) &(stxs[i]);
+        sqe->statx_flags = op->flags;
+        break;
+
+      case RSYNC_FILEIO_OP_CLOSE:
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = op->fd;
+        break;
+
+      case RSYNC_FILEIO_OP_READ:
+      case RSYNC_FILEIO_OP_WRITE:
+        sqe->opcode = op->type == RSYNC_FILEIO_OP_READ ? IORING_OP_READ :
+          IORING_OP_WRITE;
+        sqe->fd = op->fd;
+        sqe->addr = (unsigned long) op->buf;
+        sqe->len = (unsigned int) op->len;
+        sqe->off = (unsigned long long) op->offset;
+        break;
+    }
+
+    ring->sq_array[idx] = idx;
+    tail++;
+    pending++;
+  }
+
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+  head = *(ring->cq_head);
+
+  while (pending > 0) {
+    unsigned int cq_tail, sq_head, to_submit;
+    int res;
+
+    cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != cq_tail) {
+      struct io_uring_cqe *cqe;
+      struct rsync_fileio_op *op;
+
+      cqe = &(ring->cqes[head & *(ring->cq_mask)]);
+      op = &(ops[cqe->user_data]);
+      head++;
+      pending--;
+
+      if (cqe->res == -EINTR ||
+          cqe->res == -EAGAIN) {
+        posix_run(op);
+        continue;
+      }
+
+      if (cqe->res < 0) {
+        op->res = -1;
+        op->xerrno = -(cqe->res);
+        continue;
+      }
+
+      op->res = cqe->res;
+      op->xerrno = 0;
+
+      if (op->type == RSYNC_FILEIO_OP_OPEN) {
+        op->fd = cqe->res;
+
+      } else if (op->type == RSYNC_FILEIO_OP_STAT) {
+        statx_to_stat(&(stxs[cqe->user_data]), op->st);
+      }
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    if (pending == 0) {
+      break;
+    }
+
+    if (failed == TRUE) {
+      ring_wait(ring);
+      continue;
+    }
+
+    sq_head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    to_submit = tail - sq_head;
+    res = (int) syscall(__NR_io_uring_enter, ring->fd, to_submit, 1,
+      IORING_ENTER_GETEVENTS, NULL, 0);
+    if (res >= 0) {
+      continue;
+    }
+
+    if (errno == EINTR) {
+      pr_signals_handle();
+      continue;
+    }
+
+    if (errno != EAGAIN &&
+        errno != EBUSY) {
+      pr_trace_msg(trace_channel, 1,
+        "error using io_uring (%s), using POSIX file I/O", strerror(errno));
+      failed = TRUE;
+      fileio_ring_ok = FALSE;
+      fileio_ring_failed = TRUE;
+
+    } else if (to_submit < pending) {
+      /* The kernel is busy with what it has; reap some of that, and try
+       * again.
+       */
+      ring_wait(ring);
+      continue;
+    }
+
+    /* Take back the operations the kernel has not taken, and run them
+     * here.
+     */
+    sq_head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    while (tail != sq_head) {
+      unsigned int idx;
+
+      tail--;
+      idx = ring->sq_array[tail & *(ring->sq_mask)];
+      posix_run(&(ops[ring->sqes[idx].user_data]));
+      pending--;
+    }
+
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+  }
+
+  for (i = 0; i < nops; i++) {
+    if (ops[i].res < 0) {
+      nfailed++;
+    }
+  }
+
+  return nfailed;
+}
+#endif /* HAVE_IO_URING */
+
+int rsync_fileio_set_backend(int backend) {
+  switch (backend) {
+    case RSYNC_FILEIO_BACKEND_AUTO:
+    case RSYNC_FILEIO_BACKEND_POSIX:
+      break;
+
+    case RSYNC_FILEIO_BACKEND_URING:
+#ifdef HAVE_IO_URING
+      fileio_backend = backend;
+      fileio_ring_failed = FALSE;
+      if (get_ring() == NULL) {
+        fileio_backend = RSYNC_FILEIO_BACKEND_AUTO;
+        errno = ENOSYS;
+        return -1;
+      }
+
+      return 0;
+#else
+      errno = ENOSYS;
+      return -1;
+#endif /* HAVE_IO_URING */
+
+    default:
+      errno = EINVAL;
+      return -1;
+  }
+
+#ifdef HAVE_IO_URING
+  if (backend == RSYNC_FILEIO_BACKEND_POSIX &&
+      fileio_ring_ok == TRUE) {
+    ring_close(&fileio_ring);
+  }
+
+  fileio_ring_failed = FALSE;
+#endif /* HAVE_IO_URING */
+
+  fileio_backend = backend;
+  return 0;
+}
+
+int rsync_fileio_get_backend(void) {
+#ifdef HAVE_IO_URING
+  if (get_ring() != NULL) {
+    return RSYNC_FILEIO_BACKEND_URING;
+  }
+#endif /* HAVE_IO_URING */
+
+  return RSYNC_FILEIO_BACKEND_POSIX;
+}
+
+int rsync_fileio_run(struct rsync_fileio_op *ops, unsigned int nops) {
+  register unsigned int i = 0;
+  int nfailed = 0;
+#ifdef HAVE_IO_URING
+  struct fileio_ring *ring;
+#endif /* HAVE_IO_URING */
+
+  if (ops == NULL &&
+      nops > 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+#ifdef HAVE_IO_URING
+  ring = get_ring();
+  if (ring != NULL) {
+    /* If the ring fails part-way, the rest are run with POSIX calls. */
+    for (i = 0; i < nops && fileio_ring_ok == TRUE;
+        i += RSYNC_FILEIO_RING_SIZE) {
+      unsigned int n;
+
+      n = nops - i;
+      if (n > RSYNC_FILEIO_RING_SIZE) {
+        n = RSYNC_FILEIO_RING_SIZE;
+      }
+
+      nfailed += ring_run(ring, ops + i, n);
+    }
+  }
+#endif /* HAVE_IO_URING */
+
+  for (; i < nops; i++) {
+    posix_run(&(ops[i]));
+    if (ops[i].res < 0) {
+      nfailed++;
+    }
+  }
+
+  return nfailed;
+}
+
+/* Transfers the data in pieces, all in flight at once; a piece which comes
+ * up short is carried on from where it stopped.  Without a ring, there is
+ * nothing to gain from splitting the data.
+ */
+static ssize_t transfer_data(int type, int fd, unsigned char *buf,
+    size_t len, off_t offset) {
+  struct rsync_fileio_op ops[RSYNC_FILEIO_RING_SIZE];
+  size_t chunk_len = len, done = 0;
+
+#ifdef HAVE_IO_URING
+  if (get_ring() != NULL) {
+    chunk_len = RSYNC_FILEIO_CHUNK_SIZE;
+  }
+#endif /* HAVE_IO_URING */
+
+  while (done < len) {
+    register unsigned int i;
+    unsigned int nops = 0;
+    size_t batch_done = 0;
+    int more = TRUE;
+
+    memset(ops, 0, sizeof(ops));
+
+    while (nops < RSYNC_FILEIO_RING_SIZE &&
+           done + batch_done < len) {
+      struct rsync_fileio_op *op;
+
+      op = &(ops[nops++]);
+      op->type = type;
+      op->fd = fd;
+      op->buf = buf + done + batch_done;
+      op->len = len - done - batch_done;
+      if (op->len > chunk_len) {
+        op->len = chunk_len;
+      }
+      op->offset = offset + done + batch_done;
+
+      batch_done += op->len;
+    }
+
+    if (rsync_fileio_run(ops, nops) < 0) {
+      return -1;
+    }
+
+    for (i = 0; i < nops && more; i++) {
+      if (ops[i].res < 0) {
+        errno = ops[i].xerrno;
+        return -1;
+      }
+
+      done += ops[i].res;
+
+      if ((size_t) ops[i].res < ops[i].len) {
+        if (ops[i].res == 0) {
+          if (type == RSYNC_FILEIO_OP_READ) {
+            /* End of file. */
+            return (ssize_t) done;
+          }
+
+          errno = EIO;
+          return -1;
+        }
+
+        more = FALSE;
+      }
+    }
+  }
+
+  return (ssize_t) done;
+}
+
+ssize_t rsync_fileio_read(int fd, void *buf, size_t len, off_t offset) {
+  if (fd < 0 ||
+      (buf == NULL && len > 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return transfer_data(RSYNC_FILEIO_OP_READ, fd, buf, len, offset);
+}
+
+int rsync_fileio_write(int fd, const void *buf, size_t len, off_t offset) {
+  if (fd < 0 ||
+      (buf == NULL && len > 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (transfer_data(RSYNC_FILEIO_OP_WRITE, fd, (unsigned char *) buf, len,
+      offset) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * ProFTPD - mod_rsync file I/O
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+#ifndef MOD_RSYNC_FILEIO_H
+#define MOD_RSYNC_FILEIO_H
+
+#include "mod_rsync.h"
+
+/* File data is read and written, and files opened, stat'd and closed, either
+ * with the plain POSIX calls, or through an io_uring(7) instance, where the
+ * kernel supports it.  With io_uring, a batch of operations (e.g. opening
+ * and stat'ing many small files, or the pieces of a large read) is submitted
+ * with one system call, and the kernel has them all in flight at once.
+ *
+ * The ring belongs to the session process's main thread; worker threads use
+ * the POSIX calls.
+ */
+
+#define RSYNC_FILEIO_BACKEND_AUTO		0
+#define RSYNC_FILEIO_BACKEND_POSIX		1
+#define RSYNC_FILEIO_BACKEND_URING		2
+
+/* Operations which may be submitted at once. */
+#define RSYNC_FILEIO_RING_SIZE			64
+
+/* Large reads and writes are split into pieces of this size, submitted
+ * together, for a deeper queue on the device.
+ */
+#define RSYNC_FILEIO_CHUNK_SIZE			(256 * 1024)
+
+/* Operations */
+#define RSYNC_FILEIO_OP_OPEN			1
+#define RSYNC_FILEIO_OP_STAT			2
+#define RSYNC_FILEIO_OP_CLOSE			3
+#define RSYNC_FILEIO_OP_READ			4
+#define RSYNC_FILEIO_OP_WRITE			5
+
+struct rsync_fileio_op {
+  int type;
+
+  /* OPEN and STAT: the path, relative to dirfd (e.g. AT_FDCWD), and the
+   * open(2) flags and mode, or fstatat(2) flags (e.g. AT_SYMLINK_NOFOLLOW).
+   */
+  int dirfd;
+  const char *path;
+  int flags;
+  mode_t mode;
+  struct stat *st;
+
+  /* CLOSE, READ and WRITE; set by OPEN. */
+  int fd;
+
+  /* READ and WRITE.  A single read or write may transfer less than asked. */
+  void *buf;
+  size_t len;
+  off_t offset;
+
+  /* The result (e.g. bytes read), or -1 and the errno. */
+  ssize_t res;
+  int xerrno;
+};
+
+/* Selects the backend; AUTO, the default, uses io_uring if the kernel
+ * supports it.  Returns ENOSYS if io_uring is wanted but not supported.
+ */
+int rsync_fileio_set_backend(int backend);
+
+/* Returns the backend in use, i.e. never AUTO. */
+int rsync_fileio_get_backend(void);
+
+/* Performs the operations, in no particular order, and returns the number
+ * which failed; each operation's result is filled in.
+ */
+int rsync_fileio_run(struct rsync_fileio_op *ops, unsigned int nops);
+
+/* Reads len bytes from the given offset; returns the number of bytes read,
+ * which is less than len only at the end of the file.
+ */
+ssize_t rsync_fileio_read(int fd, void *buf, size_t len, off_t offset);
+
+/* Writes all len bytes at the given offset. */
+int rsync_fileio_write(int fd, const void *buf, size_t len, off_t offset);
+
+#endif /* MOD_RSYNC_FILEIO_H */
@@ -0,0 +1,241 @@
+/*
+ * ProFTPD - mod_rsync file maps
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_rsync.h"
+#include "fmap.h"
+#include "fileio.h"
+
+#include <sys/mman.h>
+
+static const char *trace_channel = "rsync.fmap";
+
+struct rsync_fmap {
+  pool *pool;
+  int fd;
+  off_t size;
+  size_t window_len;
+  long pagesz;
+
+  /* The current window: len bytes of the file, starting at offset. */
+  const unsigned char *data;
+  off_t offset;
+  size_t len;
+
+  /* When mapped, the mapping (which starts on a page boundary). */
+  int use_mmap;
+  void *map;
+  size_t maplen;
+
+  /* When read, the buffer (allocated only if needed). */
+  unsigned char *buf;
+};
+
+static void fmap_unmap(struct rsync_fmap *map) {
+  if (map->map != NULL) {
+    (void) munmap(map->map, map->maplen);
+    map->map = NULL;
+    map->maplen = 0;
+  }
+}
+
+static void fmap_cleanup_cb(void *data) {
+  fmap_unmap(data);
+}
+
+struct rsync_fmap *rsync_fmap_open(pool *p, int fd, off_t size,
+    size_t window_len) {
+  struct rsync_fmap *map;
+
+  if (p == NULL ||
+      fd < 0 ||
+      size < 0 ||
+      window_len == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  map = pcalloc(p, sizeof(struct rsync_fmap));
+  map->pool = p;
+  map->fd = fd;
+  map->size = size;
+  map->window_len = window_len;
+  map->use_mmap = TRUE;
+
+  map->pagesz = sysconf(_SC_PAGESIZE);
+  if (map->pagesz <= 0) {
+    map->pagesz = 4096;
+  }
+
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_SEQUENTIAL)
+  (void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif /* HAVE_POSIX_FADVISE and POSIX_FADV_SEQUENTIAL */
+
+  register_cleanup(p, map, fmap_cleanup_cb, fmap_cleanup_cb);
+  return map;
+}
+
+static int fmap_mmap(struct rsync_fmap *map, off_t offset, size_t len) {
+  struct stat st;
+  off_t map_offset;
+  size_t maplen;
+  void *ptr;
+
+  /* Touching a mapping beyond the end of the file raises SIGBUS; if the file
+   * has shrunk, read it instead.
+   */
+  if (fstat(map->fd, &st) < 0) {
+    return -1;
+  }
+
+  if (st.st_size < offset + (off_t) len) {
+    pr_trace_msg(trace_channel, 3,
+      "file shrank while mapping (to %" PR_LU " bytes), reading it instead",
+      (pr_off_t) st.st_size);
+    return -1;
+  }
+
+  map_offset = offset - (offset % map->pagesz);
+  maplen = (size_t) (offset - map_offset) + len;
+
+  ptr = mmap(NULL, maplen, PROT_READ, MAP_SHARED, map->fd, map_offset);
+  if (ptr == MAP_FAILED) {
+    pr_trace_msg(trace_channel, 9,
+      "unable to map file (%s), reading it instead", strerror(errno));
+    return -1;
+  }
+
+#ifdef MADV_SEQUENTIAL
+  (void) madvise(ptr, maplen, MADV_SEQUENTIAL);
+#endif /* MADV_SEQUENTIAL */
+
+  fmap_unmap(map);
+  map->map = ptr;
+  map->maplen = maplen;
+  map->data = ((const unsigned char *) ptr) + (offset - map_offset);
+  return 0;
+}
+
+static int fmap_read(struct rsync_fmap *map, off_t offset, size_t len) {
+  size_t have = 0;
+
+  if (map->buf == NULL) {
+    map->buf = palloc(map->pool, map->window_len);
+  }
+
+  /* Keep whatever part of the current window we still need. */
+  if (map->data == map->buf &&
+      offset >= map->offset &&
+      offset < map->offset + (off_t) map->len) {
+    have = (size_t) ((map->offset + (off_t) map->len) - offset);
+    if (have > len) {
+      have = len;
+    }
+
+    memmove(map->buf, map->buf + (offset - map->offset), have);
+  }
+
+  if (have < len) {
+    ssize_t res;
+
+    res = rsync_fileio_read(map->fd, map->buf + have, len - have,
+      offset + have);
+    if (res < 0) {
+      return -1;
+    }
+
+    have += res;
+    if (have < len) {
+      pr_trace_msg(trace_channel, 3,
+        "file shrank while reading (at offset %" PR_LU "), zeroing remaining "
+        "%lu bytes", (pr_off_t) (offset + have), (unsigned long) (len - have));
+      memset(map->buf + have, 0, len - have);
+    }
+  }
+
+  map->data = map->buf;
+  return 0;
+}
+
+const unsigned char *rsync_fmap_ptr(struct rsync_fmap *map, off_t offset,
+    size_t len) {
+  size_t window_len;
+
+  if (map == NULL ||
+      offset < 0 ||
+      len > map->window_len ||
+      offset + (off_t) len > map->size) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (map->data != NULL &&
+      offset >= map->offset &&
+      offset + (off_t) len <= map->offset + (off_t) map->len) {
+    return map->data + (offset - map->offset);
+  }
+
+  window_len = map->window_len;
+  if (offset + (off_t) window_len > map->size) {
+    window_len = (size_t) (map->size - offset);
+  }
+
+  if (window_len == 0) {
+    /* Nothing to map, at the end of the file. */
+    return (const unsigned char *) "";
+  }
+
+  if (map->use_mmap &&
+      fmap_mmap(map, offset, window_len) < 0) {
+    fmap_unmap(map);
+    map->data = NULL;
+    map->use_mmap = FALSE;
+  }
+
+  if (!map->use_mmap &&
+      fmap_read(map, offset, window_len) < 0) {
+    int xerrno = errno;
+
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "error reading file: %s", strerror(xerrno));
+
+    map->data = NULL;
+    errno = xerrno;
+    return NULL;
+  }
+
+  map->offset = offset;
+  map->len = window_len;
+  return map->data;
+}
+
+int rsync_fmap_close(struct rsync_fmap *map) {
+  if (map == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  fmap_unmap(map);
+  map->data = NULL;
+  return 0;
+}
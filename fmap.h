@@ -0,0 +1,54 @@
+/*
+ * ProFTPD - mod_rsync file maps
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_RSYNC_FMAP_H
+#define MOD_RSYNC_FMAP_H
+
+#include "mod_rsync.h"
+
+/* A sliding window onto a file, per rsync-${version}/fileio.c#map_ptr():
+ * the file is mapped (or, failing that, read) a window at a time, as it is
+ * walked through, so that memory use does not grow with the file's size.
+ */
+
+struct rsync_fmap;
+
+/* Opens a map of the file open on the given descriptor, with the given
+ * size, using windows of (at least) window_len bytes.  The map is closed when
+ * the pool is destroyed, if not before.
+ */
+struct rsync_fmap *rsync_fmap_open(pool *p, int fd, off_t size,
+  size_t window_len);
+
+/* Returns a pointer to the len bytes of the file at the given offset, moving
+ * the window if necessary; len may not exceed the window length.  The pointer
+ * is valid until the next call.  If the file has shrunk since being opened,
+ * the missing data reads as zeroes.
+ */
+const unsigned char *rsync_fmap_ptr(struct rsync_fmap *map, off_t offset,
+  size_t len);
+
+int rsync_fmap_close(struct rsync_fmap *map);
+
+#endif /* MOD_RSYNC_FMAP_H */
@@ -0,0 +1,448 @@
+/*
+ * ProFTPD - mod_rsync fuzzy basis lookup
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_rsync.h"
+#include "fuzzy.h"
+#include "fileio.h"
+
+#include <dirent.h>
+
+static const char *trace_channel = "rsync.fuzzy";
+
+/* Directory indexes are found by their path in a table of this size. */
+#define FUZZY_DIR_TABLE_SIZE		256
+
+/* Distances are in units of one edit; the characters involved break ties,
+ * per rsync-${version}/util1.c.
+ */
+#define FUZZY_UNIT			(1 << 16)
+
+struct fuzzy_file {
+  const char *name;
+  size_t namelen;
+  const char *suffix;
+  size_t suffixlen;
+  off_t size;
+  time_t mtime;
+};
+
+struct fuzzy_dir {
+  struct fuzzy_dir *next;
+  const char *path;
+  struct fuzzy_file *files;
+  unsigned int nfiles;
+};
+
+struct rsync_fuzzy {
+  pool *pool;
+  struct fuzzy_dir *dirs[FUZZY_DIR_TABLE_SIZE];
+  unsigned int ndirs;
+
+  /* Files are usually looked up a directory at a time. */
+  struct fuzzy_dir *last_dir;
+};
+
+struct rsync_fuzzy *rsync_fuzzy_create(pool *p) {
+  struct rsync_fuzzy *fuzzy;
+  pool *sub_pool;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  sub_pool = make_sub_pool(p);
+  pr_pool_tag(sub_pool, "rsync fuzzy pool");
+
+  fuzzy = pcalloc(sub_pool, sizeof(struct rsync_fuzzy));
+  fuzzy->pool = sub_pool;
+  return fuzzy;
+}
+
+unsigned int rsync_fuzzy_get_dir_count(struct rsync_fuzzy *fuzzy) {
+  if (fuzzy == NULL) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  return fuzzy->ndirs;
+}
+
+static unsigned int get_dir_hash(const char *path, size_t pathlen) {
+  uint32_t h = 2166136261U;
+  register size_t i;
+
+  for (i = 0; i < pathlen; i++) {
+    h = (h ^ (unsigned char) path[i]) * 16777619U;
+  }
+
+  return h % FUZZY_DIR_TABLE_SIZE;
+}
+
+static int is_backup_suffix(const char *suffix, size_t len) {
+  return (len == 4 && strncmp(suffix, ".bak", 4) == 0) ||
+         (len == 4 && strncmp(suffix, ".old", 4) == 0) ||
+         (len == 5 && strncmp(suffix, ".orig", 5) == 0);
+}
+
+/* Finds the suffix (e.g. ".tar") of the name, per rsync's
+ * find_filename_suffix(): leading dots, a trailing "~", and backup suffixes
+ * (e.g. ".bak") are ignored, and an all-digit suffix (e.g. the ".3" of
+ * "foo-1.2.3") is only used if there is no other.
+ */
+static const char *get_suffix(const char *name, size_t namelen,
+    size_t *suffixlen) {
+  const char *suffix = "", *ptr;
+
+  *suffixlen = 0;
+
+  while (namelen > 0 &&
+         *name == '.') {
+    name++;
+    namelen--;
+  }
+
+  if (namelen > 1 &&
+      name[namelen-1] == '~') {
+    namelen--;
+  }
+
+  while (namelen > 1) {
+    size_t len;
+    register size_t i;
+    int digits = TRUE;
+
+    for (ptr = name + namelen - 1; ptr != name && *ptr != '.'; ptr--) {
+    }
+
+    if (ptr == name) {
+      break;
+    }
+
+    len = namelen - (ptr - name);
+    namelen = ptr - name;
+
+    if (is_backup_suffix(ptr, len)) {
+      continue;
+    }
+
+    suffix = ptr;
+    *suffixlen = len;
+
+    for (i = 1; i < len; i++) {
+      if (!isdigit((int) ptr[i])) {
+        digits = FALSE;
+        break;
+      }
+    }
+
+    if (!digits ||
+        len == 1) {
+      break;
+    }
+  }
+
+  return suffix;
+}
+
+/* The edit distance between the strings, per rsync's fuzzy_distance(): in
+ * FUZZY_UNITs per insertion, deletion or substitution, plus the difference
+ * (or value) of the characters involved.
+ */
+static uint32_t get_distance(const char *s1, size_t len1, const char *s2,
+    size_t len2) {
+  uint32_t a[RSYNC_FUZZY_MAX_NAME_LEN + 1], diag, above, left, diag_inc,
+    above_inc, left_inc;
+  int32_t cost;
+  register size_t i1, i2;
+
+  if (len1 == 0 ||
+      len2 == 0) {
+    if (len1 == 0) {
+      s1 = s2;
+      len1 = len2;
+    }
+
+    for (i1 = 0, cost = 0; i1 < len1; i1++) {
+      cost += (unsigned char) s1[i1];
+    }
+
+    return ((uint32_t) len1 * FUZZY_UNIT) + cost;
+  }
+
+  for (i2 = 0; i2 < len2; i2++) {
+    a[i2] = (i2 + 1) * FUZZY_UNIT;
+  }
+
+  for (i1 = 0; i1 < len1; i1++) {
+    diag = i1 * FUZZY_UNIT;
+    above = (i1 + 1) * FUZZY_UNIT;
+
+    for (i2 = 0; i2 < len2; i2++) {
+      left = a[i2];
+
+      cost = (unsigned char) s1[i1] - (unsigned char) s2[i2];
+      if (cost < 0) {
+        cost = FUZZY_UNIT - cost;
+
+      } else if (cost > 0) {
+        cost = FUZZY_UNIT + cost;
+      }
+
+      diag_inc = diag + cost;
+      left_inc = left + FUZZY_UNIT + (unsigned char) s1[i1];
+      above_inc = above + FUZZY_UNIT + (unsigned char) s2[i2];
+
+      if (left < above) {
+        above = left_inc < diag_inc ? left_inc : diag_inc;
+
+      } else {
+        above = above_inc < diag_inc ? above_inc : diag_inc;
+      }
+
+      a[i2] = above;
+      diag = left;
+    }
+  }
+
+  return a[len2 - 1];
+}
+
+/* Lists the directory, stat'ing its entries in batches, and keeps the
+ * regular, non-empty files.  An unreadable directory gets an empty index,
+ * so that it is not tried again.
+ */
+static struct fuzzy_dir *index_dir(struct rsync_fuzzy *fuzzy,
+    const char *dir_path, unsigned int hash) {
+  struct fuzzy_dir *dir;
+  struct rsync_fileio_op ops[RSYNC_FILEIO_RING_SIZE];
+  struct stat st[RSYNC_FILEIO_RING_SIZE];
+  const char **names = NULL;
+  unsigned int i, count = 0, namesz = 0;
+  DIR *dirh;
+  struct dirent *dent;
+
+  dir = pcalloc(fuzzy->pool, sizeof(struct fuzzy_dir));
+  dir->path = pstrdup(fuzzy->pool, dir_path);
+  dir->next = fuzzy->dirs[hash];
+  fuzzy->dirs[hash] = dir;
+  fuzzy->ndirs++;
+
+  dirh = opendir(*dir_path != '\0' ? dir_path : ".");
+  if (dirh == NULL) {
+    pr_trace_msg(trace_channel, 9, "unable to index directory '%s': %s",
+      dir_path, strerror(errno));
+    return dir;
+  }
+
+  while ((dent = readdir(dirh)) != NULL) {
+#ifdef DT_REG
+    if (dent->d_type != DT_REG &&
+        dent->d_type != DT_UNKNOWN) {
+      continue;
+    }
+#endif /* DT_REG */
+
+    if (strlen(dent->d_name) > RSYNC_FUZZY_MAX_NAME_LEN) {
+      continue;
+    }
+
+    if (count == namesz) {
+      const char **new_names;
+
+      namesz = namesz > 0 ? namesz * 2 : 64;
+      new_names = palloc(fuzzy->pool, namesz * sizeof(const char *));
+      if (count > 0) {
+        memcpy(new_names, names, count * sizeof(const char *));
+      }
+
+      names = new_names;
+    }
+
+    names[count++] = pstrdup(fuzzy->pool, dent->d_name);
+  }
+
+  dir->files = palloc(fuzzy->pool,
+    (count > 0 ? count : 1) * sizeof(struct fuzzy_file));
+
+  for (i = 0; i < count; i += RSYNC_FILEIO_RING_SIZE) {
+    unsigned int j, nops;
+
+    nops = count - i;
+    if (nops > RSYNC_FILEIO_RING_SIZE) {
+      nops = RSYNC_FILEIO_RING_SIZE;
+    }
+
+    memset(ops, 0, nops * sizeof(struct rsync_fileio_op));
+    for (j = 0; j < nops; j++) {
+      ops[j].type = RSYNC_FILEIO_OP_STAT;
+      ops[j].dirfd = dirfd(dirh);
+      ops[j].path = names[i + j];
+      ops[j].flags = AT_SYMLINK_NOFOLLOW;
+      ops[j].st = &(st[j]);
+    }
+
+    (void) rsync_fileio_run(ops, nops);
+
+    for (j = 0; j < nops; j++) {
+      struct fuzzy_file *file;
+
+      if (ops[j].res < 0 ||
+          !S_ISREG(st[j].st_mode) ||
+          st[j].st_size == 0) {
+        continue;
+      }
+
+      file = &(dir->files[dir->nfiles++]);
+      file->name = names[i + j];
+      file->namelen = strlen(file->name);
+      file->suffix = get_suffix(file->name, file->namelen,
+        &(file->suffixlen));
+      file->size = st[j].st_size;
+      file->mtime = st[j].st_mtime;
+    }
+  }
+
+  (void) closedir(dirh);
+
+  pr_trace_msg(trace_channel, 15, "indexed directory '%s': %u of %u entries",
+    dir_path, dir->nfiles, count);
+  return dir;
+}
+
+static struct fuzzy_dir *get_dir(struct rsync_fuzzy *fuzzy,
+    const char *dir_path) {
+  struct fuzzy_dir *dir;
+  unsigned int hash;
+
+  if (fuzzy->last_dir != NULL &&
+      strcmp(fuzzy->last_dir->path, dir_path) == 0) {
+    return fuzzy->last_dir;
+  }
+
+  hash = get_dir_hash(dir_path, strlen(dir_path));
+  for (dir = fuzzy->dirs[hash]; dir != NULL; dir = dir->next) {
+    if (strcmp(dir->path, dir_path) == 0) {
+      break;
+    }
+  }
+
+  if (dir == NULL) {
+    dir = index_dir(fuzzy, dir_path, hash);
+  }
+
+  fuzzy->last_dir = dir;
+  return dir;
+}
+
+const char *rsync_fuzzy_find(pool *p, struct rsync_fuzzy *fuzzy,
+    const char *path, off_t size, time_t mtime) {
+  struct fuzzy_dir *dir;
+  char dir_path[PR_TUNABLE_PATH_MAX+1];
+  const char *name, *suffix;
+  struct fuzzy_file *best = NULL;
+  size_t namelen, suffixlen;
+  uint32_t best_dist;
+  register unsigned int i;
+
+  if (p == NULL ||
+      fuzzy == NULL ||
+      path == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  name = strrchr(path, '/');
+  if (name != NULL) {
+    size_t dir_len;
+
+    dir_len = name - path;
+    if (dir_len == 0) {
+      dir_len = 1;
+
+    } else if (dir_len > PR_TUNABLE_PATH_MAX) {
+      errno = ENAMETOOLONG;
+      return NULL;
+    }
+
+    memcpy(dir_path, path, dir_len);
+    dir_path[dir_len] = '\0';
+    name++;
+
+  } else {
+    dir_path[0] = '\0';
+    name = path;
+  }
+
+  namelen = strlen(name);
+  if (namelen == 0 ||
+      namelen > RSYNC_FUZZY_MAX_NAME_LEN) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  dir = get_dir(fuzzy, dir_path);
+  suffix = get_suffix(name, namelen, &suffixlen);
+  best_dist = RSYNC_FUZZY_MAX_DISTANCE * FUZZY_UNIT;
+
+  for (i = 0; i < dir->nfiles; i++) {
+    struct fuzzy_file *file;
+    uint32_t dist;
+
+    file = &(dir->files[i]);
+
+    if (file->namelen == namelen &&
+        strcmp(file->name, name) == 0) {
+      continue;
+    }
+
+    if (file->size == size &&
+        file->mtime == mtime) {
+      best = file;
+      break;
+    }
+
+    /* How well the suffixes match counts for more. */
+    dist = get_distance(file->name, file->namelen, name, namelen) +
+      (get_distance(file->suffix, file->suffixlen, suffix, suffixlen) * 10);
+    if (dist <= best_dist) {
+      best_dist = dist;
+      best = file;
+    }
+  }
+
+  if (best == NULL) {
+    pr_trace_msg(trace_channel, 17, "no fuzzy basis for '%s'", path);
+    errno = ENOENT;
+    return NULL;
+  }
+
+  pr_trace_msg(trace_channel, 17, "using '%s' as fuzzy basis for '%s'",
+    best->name, path);
+  if (*dir_path == '\0') {
+    return pstrdup(p, best->name);
+  }
+
+  return pdircat(p, dir_path, best->name, NULL);
+}
@@ -0,0 +1,63 @@
+/*
+ * ProFTPD - mod_rsync fuzzy basis lookup
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_RSYNC_FUZZY_H
+#define MOD_RSYNC_FUZZY_H
+
+#include "mod_rsync.h"
+
+/* With --fuzzy, a file which we do not have yet gets, as its basis, the
+ * most similar file in the same directory, per rsync-${version}/generator.c:
+ * a file of the same size and modification time, if any; otherwise, the
+ * file whose name is closest, with the suffix counting for most.  A renamed
+ * version (e.g. "foo-1.2.4.tar", given "foo-1.2.3.tar") is then sent as a
+ * delta, rather than whole.
+ *
+ * Each directory is listed (and its files stat'd) once, the first time a
+ * file in it is looked up; the index is then a snapshot of the directory,
+ * which does not see files received into it since.
+ */
+
+/* Names further apart than this many edits are not similar. */
+#define RSYNC_FUZZY_MAX_DISTANCE		25
+
+/* Names longer than this are not compared. */
+#define RSYNC_FUZZY_MAX_NAME_LEN		255
+
+struct rsync_fuzzy;
+
+struct rsync_fuzzy *rsync_fuzzy_create(pool *p);
+
+/* Returns the path, allocated from the given pool, of the best basis file
+ * for the given path (which does not exist), given the size and modification
+ * time of the sender's file; or NULL, with errno set to ENOENT, if no file in
+ * the directory is similar.
+ */
+const char *rsync_fuzzy_find(pool *p, struct rsync_fuzzy *fuzzy,
+  const char *path, off_t size, time_t mtime);
+
+/* Returns the number of directories indexed so far. */
+unsigned int rsync_fuzzy_get_dir_count(struct rsync_fuzzy *fuzzy);
+
+#endif /* MOD_RSYNC_FUZZY_H */
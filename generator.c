@@ -0,0 +1,952 @@
+/*
+ * ProFTPD - mod_rsync signature generator
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_rsync.h"
+#include "generator.h"
+#include "options.h"
+#include "msg.h"
+#include "checksum.h"
+#include "rolling.h"
+#include "sigcache.h"
+#include "workers.h"
+#include "helpers.h"
+#include "blocksize.h"
+#include "policy.h"
+#include "fileio.h"
+
+#include <sys/mman.h>
+
+static const char *trace_channel = "rsync.generator";
+
+/* Per rsync-${version}/rsync.h. */
+#define RSYNC_GENERATOR_BLOCKSUM_BIAS		10
+#define RSYNC_GENERATOR_SHORT_SUM_LENGTH	2
+
+/* Returns the length of strong checksum to send for each block, per
+ * rsync-${version}/generator.c#sum_sizes_sqroot().
+ */
+static int32_t get_s2len(off_t len, int32_t block_len, size_t digest_len,
+    int flags) {
+  int32_t s2len;
+
+  if (flags & RSYNC_GENERATOR_FL_FULL_SUMS) {
+    s2len = (int32_t) digest_len;
+
+  } else {
+    int32_t c;
+    int b = RSYNC_GENERATOR_BLOCKSUM_BIAS;
+    off_t l;
+
+    /* Enough bits that a false match over the whole file is unlikely: two
+     * bits per bit of file length, less one per bit of block length, less
+     * the 32 bits of the rolling checksum.
+     */
+    for (l = len; l >>= 1; b += 2) {
+    }
+
+    for (c = block_len; (c >>= 1) && b; b--) {
+    }
+
+    s2len = (b + 1 - 32 + 7) / 8;
+    if (s2len < RSYNC_GENERATOR_SHORT_SUM_LENGTH) {
+      s2len = RSYNC_GENERATOR_SHORT_SUM_LENGTH;
+    }
+  }
+
+  if ((size_t) s2len > digest_len) {
+    s2len = (int32_t) digest_len;
+  }
+
+  return s2len;
+}
+
+static int get_sum_head(struct rsync_session *sess, const char *path,
+    off_t len, int flags, struct rsync_sum_head *head) {
+  struct rsync_options *opts;
+  int32_t block_len, max_block_len, s2len;
+  size_t digest_len;
+  int64_t count;
+  off_t l;
+
+  if (sess == NULL ||
+      len < 0 ||
+      head == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  opts = sess->options;
+
+  digest_len = rsync_checksum_get_digest_len(sess->checksum_algo);
+  if (digest_len == 0) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  max_block_len = sess->protocol_version < 30 ?
+    RSYNC_GENERATOR_OLD_MAX_BLOCK_SIZE : RSYNC_GENERATOR_MAX_BLOCK_SIZE;
+
+  if (opts != NULL &&
+      opts->block_size > 0) {
+    block_len = opts->block_size > max_block_len ? max_block_len :
+      (int32_t) opts->block_size;
+
+  } else if (len <= (RSYNC_GENERATOR_BLOCK_SIZE * RSYNC_GENERATOR_BLOCK_SIZE)) {
+    block_len = RSYNC_GENERATOR_BLOCK_SIZE;
+
+  } else {
+    int64_t c;
+
+    /* Start with the power of two nearest the square root of the length,
+     * then find the largest multiple of 8 whose square does not exceed it.
+     */
+    for (c = 1, l = len; l >>= 2; c <<= 1) {
+    }
+
+    if (c >= max_block_len) {
+      block_len = max_block_len;
+
+    } else {
+      block_len = 0;
+
+      do {
+        block_len |= (int32_t) c;
+        if (len < (off_t) block_len * block_len) {
+          block_len &= ~((int32_t) c);
+        }
+
+        c >>= 1;
+      } while (c >= 8);
+
+      if (block_len < RSYNC_GENERATOR_BLOCK_SIZE) {
+        block_len = RSYNC_GENERATOR_BLOCK_SIZE;
+      }
+    }
+  }
+
+  s2len = get_s2len(len, block_len, digest_len, flags);
+
+  /* Unless the client asked for a block size, the history of the file may
+   * suggest a better one (see blocksize.h).
+   */
+  if (path != NULL &&
+      len > 0 &&
+      (opts == NULL ||
+       opts->block_size == 0)) {
+    int32_t adaptive_len;
+
+    adaptive_len = rsync_blocksize_choose(path, len,
+      sizeof(uint32_t) + s2len, max_block_len);
+    if (adaptive_len > 0) {
+      block_len = adaptive_len;
+      s2len = get_s2len(len, block_len, digest_len, flags);
+    }
+  }
+
+  count = (len / block_len) + ((len % block_len) != 0);
+  if (count > INT32_MAX) {
+    errno = EFBIG;
+    return -1;
+  }
+
+  head->count = (int32_t) count;
+  head->block_len = block_len;
+  head->s2len = s2len;
+  head->remainder = (int32_t) (len % block_len);
+
+  pr_trace_msg(trace_channel, 17,
+    "sum head for length %" PR_LU ": count = %ld, block length = %ld, "
+    "s2length = %ld, remainder = %ld", (pr_off_t) len, (long) head->count,
+    (long) head->block_len, (long) head->s2len, (long) head->remainder);
+  return 0;
+}
+
+int rsync_generator_get_sum_head(struct rsync_session *sess, off_t len,
+    int flags, struct rsync_sum_head *head) {
+  return get_sum_head(sess, NULL, len, flags, head);
+}
+
+int rsync_generator_write_sum_head(struct rsync_session *sess,
+    unsigned char **buf, uint32_t *buflen, const struct rsync_sum_head *head) {
+  struct rsync_sum_head empty;
+
+  if (sess == NULL ||
+      buf == NULL ||
+      buflen == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (head == NULL) {
+    memset(&empty, 0, sizeof(empty));
+    head = &empty;
+  }
+
+  rsync_msg_write_int(buf, buflen, head->count);
+  rsync_msg_write_int(buf, buflen, head->block_len);
+  rsync_msg_write_int(buf, buflen, head->s2len);
+  rsync_msg_write_int(buf, buflen, head->remainder);
+
+  return 0;
+}
+
+off_t rsync_generator_get_basis_len(const struct rsync_sum_head *head) {
+  off_t len;
+
+  if (head == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  len = (off_t) head->count * head->block_len;
+  if (head->remainder != 0) {
+    len -= head->block_len - head->remainder;
+  }
+
+  return len;
+}
+
+/* Reads a window of the basis file, for when it cannot be mapped.  If the
+ * file has shrunk since we looked at it, the rest of the window is zeroed,
+ * as rsync does.
+ */
+static int read_window(int fd, unsigned char *buf, size_t buflen,
+    off_t offset) {
+  ssize_t len;
+
+  len = rsync_fileio_read(fd, buf, buflen, offset);
+  if (len < 0) {
+    return -1;
+  }
+
+  if ((size_t) len < buflen) {
+    pr_trace_msg(trace_channel, 3,
+      "basis file shrank while reading (at offset %" PR_LU "), zeroing "
+      "remaining %lu bytes", (pr_off_t) (offset + len),
+      (unsigned long) (buflen - len));
+    memset(buf + len, 0, buflen - len);
+  }
+
+  return 0;
+}
+
+static int write_sums(pool *p, struct rsync_session *sess,
+    unsigned char *data, uint32_t datalen) {
+  if ((rsync_write_data)(p, sess->channel_id, data, datalen) < 0) {
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "error sending block checksums: %s", strerror(errno));
+    errno = EIO;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Computes the sums of the blocks in the next window of the basis file,
+ * mapping it if possible, and reading it otherwise.  If have_weak is TRUE,
+ * the rolling checksums are already known.
+ */
+static int sum_window(struct rsync_session *sess, int fd, off_t offset,
+    size_t datalen, uint32_t block_len, int *use_mmap, unsigned char **readbuf,
+    size_t readbufsz, pool *p, int have_weak, uint32_t *sums,
+    unsigned char *digests) {
+  unsigned char *data = NULL;
+  void *map = NULL;
+  size_t maplen = 0;
+  int nblocks, xerrno;
+
+  if (*use_mmap) {
+    off_t map_offset;
+    long pagesz;
+
+    pagesz = sysconf(_SC_PAGESIZE);
+    if (pagesz <= 0) {
+      pagesz = 4096;
+    }
+
+    map_offset = offset - (offset % pagesz);
+    maplen = datalen + (size_t) (offset - map_offset);
+
+    map = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, map_offset);
+    if (map == MAP_FAILED) {
+      pr_trace_msg(trace_channel, 9,
+        "unable to map basis file (%s), reading it instead", strerror(errno));
+      map = NULL;
+      *use_mmap = FALSE;
+
+    } else {
+#ifdef MADV_SEQUENTIAL
+      (void) madvise(map, maplen, MADV_SEQUENTIAL);
+#endif /* MADV_SEQUENTIAL */
+      data = ((unsigned char *) map) + (offset - map_offset);
+    }
+  }
+
+  if (!*use_mmap) {
+    if (*readbuf == NULL) {
+      *readbuf = palloc(p, readbufsz);
+    }
+
+    if (read_window(fd, *readbuf, datalen, offset) < 0) {
+      xerrno = errno;
+
+      (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+        "error reading basis file: %s", strerror(xerrno));
+
+      errno = xerrno;
+      return -1;
+    }
+
+    data = *readbuf;
+  }
+
+  nblocks = rsync_checksum_blocks(sess, data, datalen, block_len, digests);
+  if (nblocks >= 0 &&
+      have_weak == FALSE) {
+    nblocks = rsync_rolling_block_sums(data, datalen, block_len, sums);
+  }
+
+  xerrno = errno;
+
+  if (map != NULL) {
+    (void) munmap(map, maplen);
+  }
+
+  errno = xerrno;
+  return nblocks;
+}
+
+/* With worker threads, the sums of the coming windows are computed by the
+ * workers, a window each, while we send those already done.
+ */
+struct sums_job {
+  struct rsync_workers_job job;
+  struct rsync_session *sess;
+  int fd;
+  off_t offset;
+  size_t datalen;
+  uint32_t block_len;
+  int have_weak;
+
+  unsigned char *buf;
+  uint32_t *sums;
+  unsigned char *digests;
+};
+
+struct sums_offload {
+  struct rsync_workers *workers;
+  struct sums_job *jobs;
+  unsigned int njobs;
+
+  /* The queued jobs, oldest first, and the window to queue next. */
+  unsigned int first, nqueued, nsubmitted;
+  off_t next_offset;
+  int32_t next_idx;
+};
+
+static int sums_job_run(struct rsync_workers_job *job) {
+  struct sums_job *sj;
+  size_t len = 0;
+  int nblocks;
+
+  sj = (struct sums_job *) job;
+
+  /* As for read_window(), but without calling into proftpd. */
+  while (len < sj->datalen) {
+    ssize_t res;
+
+    res = pread(sj->fd, sj->buf + len, sj->datalen - len, sj->offset + len);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return -1;
+    }
+
+    if (res == 0) {
+      memset(sj->buf + len, 0, sj->datalen - len);
+      break;
+    }
+
+    len += res;
+  }
+
+  nblocks = rsync_checksum_blocks(sj->sess, sj->buf, sj->datalen,
+    sj->block_len, sj->digests);
+  if (nblocks >= 0 &&
+      sj->have_weak == FALSE) {
+    nblocks = rsync_rolling_block_sums(sj->buf, sj->datalen, sj->block_len,
+      sj->sums);
+  }
+
+  return nblocks;
+}
+
+static struct sums_offload *create_offload(pool *p,
+    struct rsync_session *sess, int fd, const struct rsync_sum_head *head,
+    size_t window_len, uint32_t window_blocks, size_t digest_len) {
+  register unsigned int i;
+  struct sums_offload *off;
+  struct rsync_workers *workers;
+
+  workers = sess->workers;
+  if (workers == NULL ||
+      window_len > RSYNC_GENERATOR_WINDOW_SIZE * 2 ||
+      (off_t) head->count <= (off_t) window_blocks) {
+    return NULL;
+  }
+
+  off = pcalloc(p, sizeof(struct sums_offload));
+  off->workers = workers;
+  off->njobs = rsync_workers_get_lanes(workers) + 1;
+  off->jobs = pcalloc(p, off->njobs * sizeof(struct sums_job));
+
+  for (i = 0; i < off->njobs; i++) {
+    struct sums_job *sj;
+
+    sj = &(off->jobs[i]);
+    sj->job.run = sums_job_run;
+    sj->sess = sess;
+    sj->fd = fd;
+    sj->block_len = head->block_len;
+    sj->buf = palloc(p, window_len);
+    sj->sums = palloc(p, window_blocks * sizeof(uint32_t));
+    sj->digests = palloc(p, window_blocks * digest_len);
+  }
+
+  return off;
+}
+
+/* Returns the sums of the window at the given offset, queueing the windows
+ * after it.  The rolling checksums are taken from the cache, if it has them.
+ */
+static int offload_window(struct sums_offload *off, off_t offset,
+    int32_t idx, off_t size, size_t window_len,
+    struct rsync_sigcache *cache, int cache_flags, uint32_t **sums,
+    unsigned char **digests) {
+  struct sums_job *sj;
+  int nblocks;
+
+  if (off->nqueued == 0) {
+    off->next_offset = offset;
+    off->next_idx = idx;
+  }
+
+  while (off->nqueued < off->njobs &&
+         off->next_offset < size) {
+    uint32_t count;
+
+    sj = &(off->jobs[(off->first + off->nqueued) % off->njobs]);
+    sj->offset = off->next_offset;
+    sj->datalen = (size_t) (size - off->next_offset);
+    if (sj->datalen > window_len) {
+      sj->datalen = window_len;
+    }
+
+    count = (uint32_t) ((sj->datalen + sj->block_len - 1) / sj->block_len);
+
+    sj->have_weak = FALSE;
+    if ((cache_flags & RSYNC_SIGCACHE_FL_WEAK) &&
+        rsync_sigcache_get_sums(cache, off->next_idx, count,
+          sj->sums) == 0) {
+      sj->have_weak = TRUE;
+    }
+
+    if (rsync_workers_submit(off->workers, off->nsubmitted, &(sj->job)) < 0) {
+      return -1;
+    }
+
+    off->nsubmitted++;
+    off->nqueued++;
+    off->next_offset += sj->datalen;
+    off->next_idx += count;
+  }
+
+  sj = &(off->jobs[off->first]);
+  if (sj->offset != offset) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  off->first = (off->first + 1) % off->njobs;
+  off->nqueued--;
+
+  nblocks = rsync_workers_wait(off->workers, &(sj->job));
+  if (nblocks < 0) {
+    int xerrno = errno;
+
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "error reading basis file: %s", strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  *sums = sj->sums;
+  *digests = sj->digests;
+  return nblocks;
+}
+
+/* Waits for any queued jobs, before their buffers are freed. */
+static void drain_offload(struct sums_offload *off) {
+  while (off->nqueued > 0) {
+    (void) rsync_workers_wait(off->workers, &(off->jobs[off->first].job));
+    off->first = (off->first + 1) % off->njobs;
+    off->nqueued--;
+  }
+}
+
+/* With helper processes, shared by all sessions, the sums of the coming
+ * windows are computed by the helpers instead; each window is read into a
+ * helper job's slot.
+ */
+struct helpers_window {
+  struct rsync_helpers_job *job;
+  unsigned char *buf;
+  off_t offset;
+  size_t datalen;
+  int weak;
+};
+
+struct sums_helpers {
+  struct rsync_session *sess;
+  int fd;
+  uint32_t block_len;
+  struct helpers_window *windows;
+  unsigned int nwindows;
+
+  /* The queued windows, oldest first, and the window to queue next. */
+  unsigned int first, nqueued;
+  off_t next_offset;
+  int32_t next_idx;
+
+  /* The job whose sums were last returned; released once they are sent. */
+  struct rsync_helpers_job *current;
+};
+
+static struct sums_helpers *create_helpers(pool *p,
+    struct rsync_session *sess, int fd, const struct rsync_sum_head *head,
+    uint32_t window_blocks) {
+  struct sums_helpers *hs;
+  unsigned int count;
+
+  count = rsync_helpers_get_count();
+  if (count == 0 ||
+      window_blocks > rsync_helpers_get_max_blocks(head->block_len) ||
+      (off_t) head->count <= (off_t) window_blocks) {
+    return NULL;
+  }
+
+  hs = pcalloc(p, sizeof(struct sums_helpers));
+  hs->sess = sess;
+  hs->fd = fd;
+  hs->block_len = head->block_len;
+
+  /* Queue enough windows to keep the helpers busy, but leave slots for the
+   * other sessions.
+   */
+  hs->nwindows = count < 2 ? 2 : count;
+  hs->windows = pcalloc(p, hs->nwindows * sizeof(struct helpers_window));
+
+  return hs;
+}
+
+/* Returns the sums of the window at the given offset, queueing the windows
+ * after it, as there are slots free.  The rolling checksums are taken from
+ * the cache, if it has them.
+ */
+static int helpers_window(struct sums_helpers *hs, off_t offset,
+    int32_t idx, off_t size, size_t window_len,
+    struct rsync_sigcache *cache, int cache_flags, uint32_t **sums,
+    unsigned char **digests) {
+  struct helpers_window *hw;
+  int nblocks, xerrno;
+
+  rsync_helpers_release(hs->current);
+  hs->current = NULL;
+
+  if (hs->nqueued == 0) {
+    hs->next_offset = offset;
+    hs->next_idx = idx;
+  }
+
+  while (hs->nqueued < hs->nwindows &&
+         hs->next_offset < size) {
+    uint32_t count;
+
+    hw = &(hs->windows[(hs->first + hs->nqueued) % hs->nwindows]);
+
+    /* Only wait for a slot if we have nothing queued already. */
+    hw->job = rsync_helpers_get_job(hs->sess, hs->nqueued == 0, &(hw->buf));
+    if (hw->job == NULL) {
+      if (errno == EAGAIN &&
+          hs->nqueued > 0) {
+        break;
+      }
+
+      return -1;
+    }
+
+    hw->offset = hs->next_offset;
+    hw->datalen = (size_t) (size - hs->next_offset);
+    if (hw->datalen > window_len) {
+      hw->datalen = window_len;
+    }
+
+    if (read_window(hs->fd, hw->buf, hw->datalen, hw->offset) < 0) {
+      xerrno = errno;
+
+      rsync_helpers_release(hw->job);
+      (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+        "error reading basis file: %s", strerror(xerrno));
+
+      errno = xerrno;
+      return -1;
+    }
+
+    count = (uint32_t) ((hw->datalen + hs->block_len - 1) / hs->block_len);
+    hw->weak = (cache_flags & RSYNC_SIGCACHE_FL_WEAK) ? FALSE : TRUE;
+
+    if (rsync_helpers_submit(hw->job, hw->datalen, hs->block_len,
+        hw->weak) < 0) {
+      xerrno = errno;
+
+      rsync_helpers_release(hw->job);
+      errno = xerrno;
+      return -1;
+    }
+
+    hs->nqueued++;
+    hs->next_offset += hw->datalen;
+    hs->next_idx += count;
+  }
+
+  hw = &(hs->windows[hs->first]);
+  if (hs->nqueued == 0 ||
+      hw->offset != offset) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  hs->first = (hs->first + 1) % hs->nwindows;
+  hs->nqueued--;
+
+  nblocks = rsync_helpers_wait(hw->job, sums, digests);
+  if (nblocks < 0) {
+    xerrno = errno;
+
+    rsync_helpers_release(hw->job);
+    errno = xerrno;
+    return -1;
+  }
+
+  hs->current = hw->job;
+
+  if (hw->weak == FALSE &&
+      rsync_sigcache_get_sums(cache, idx, nblocks, *sums) < 0) {
+    (void) rsync_rolling_block_sums(hw->buf, hw->datalen, hs->block_len,
+      *sums);
+  }
+
+  return nblocks;
+}
+
+/* Releases any queued jobs; the helpers free their slots when done. */
+static void drain_helpers(struct sums_helpers *hs) {
+  rsync_helpers_release(hs->current);
+  hs->current = NULL;
+
+  while (hs->nqueued > 0) {
+    rsync_helpers_release(hs->windows[hs->first].job);
+    hs->first = (hs->first + 1) % hs->nwindows;
+    hs->nqueued--;
+  }
+}
+
+int rsync_generator_send_file_sums(pool *p, struct rsync_session *sess,
+    int fd, const char *path, int flags) {
+  struct rsync_options *opts;
+  struct rsync_sum_head head;
+  struct rsync_sigcache *cache = NULL;
+  struct sums_offload *off = NULL;
+  struct sums_helpers *hs = NULL;
+  struct stat st;
+  pool *tmp_pool;
+  unsigned char *buf, *ptr, *digests, *readbuf = NULL;
+  uint32_t buflen, bufsz, *sums, window_blocks;
+  size_t digest_len, window_len;
+  off_t offset = 0;
+  int32_t idx = 0;
+  int cache_flags = 0, use_mmap = TRUE, whole = FALSE, xerrno;
+
+  if (p == NULL ||
+      sess == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (fd < 0) {
+    /* No basis file; the sender will send the whole file. */
+    bufsz = buflen = sizeof(struct rsync_sum_head);
+    ptr = buf = palloc(p, bufsz);
+
+    rsync_generator_write_sum_head(sess, &buf, &buflen, NULL);
+    return write_sums(p, sess, ptr, bufsz - buflen);
+  }
+
+  if (fstat(fd, &st) < 0) {
+    return -1;
+  }
+
+  if (get_sum_head(sess, path, st.st_size, flags, &head) < 0) {
+    return -1;
+  }
+
+  /* When appending (--append, --append-verify), the sender only needs to
+   * know how much of the file we already have; per rsync, no sums follow the
+   * header.
+   */
+  opts = sess->options;
+  if (opts != NULL &&
+      opts->append_mode > 0) {
+    bufsz = buflen = sizeof(struct rsync_sum_head);
+    ptr = buf = palloc(p, bufsz);
+
+    rsync_generator_write_sum_head(sess, &buf, &buflen, &head);
+    return write_sums(p, sess, ptr, bufsz - buflen);
+  }
+
+  /* A small file costs more to sum (and search) than to send whole, as does
+   * a file which has not matched its sums before (see policy.h); we send the
+   * empty header, as if there were no basis file.
+   */
+  if (st.st_size < rsync_small_file_size) {
+    pr_trace_msg(trace_channel, 19,
+      "basis file is small (%" PR_LU " bytes), sending no sums",
+      (pr_off_t) st.st_size);
+    whole = TRUE;
+
+  } else if (path != NULL &&
+             (rsync_policy_get_flags(path) & RSYNC_POLICY_FL_WHOLE_FILE)) {
+    pr_trace_msg(trace_channel, 19,
+      "basis file '%s' has not matched before, sending no sums", path);
+    whole = TRUE;
+  }
+
+  if (whole) {
+    bufsz = buflen = sizeof(struct rsync_sum_head);
+    ptr = buf = palloc(p, bufsz);
+
+    rsync_generator_write_sum_head(sess, &buf, &buflen, NULL);
+    return write_sums(p, sess, ptr, bufsz - buflen);
+  }
+
+  digest_len = rsync_checksum_get_digest_len(sess->checksum_algo);
+
+  tmp_pool = make_sub_pool(p);
+  pr_pool_tag(tmp_pool, "rsync generator pool");
+
+  /* The full-length sums of a redo are not worth caching. */
+  if (!(flags & RSYNC_GENERATOR_FL_FULL_SUMS) &&
+      head.count > 0) {
+    cache = rsync_sigcache_open(tmp_pool, sess, &st, &head);
+    if (cache != NULL) {
+      cache_flags = rsync_sigcache_get_flags(cache);
+    }
+  }
+
+  /* Each window holds a whole number of blocks; when the helpers sum the
+   * basis file, a window must fit in one of their jobs.
+   */
+  window_blocks = RSYNC_GENERATOR_WINDOW_SIZE / head.block_len;
+  if (rsync_helpers_get_count() > 0) {
+    uint32_t max_blocks;
+
+    max_blocks = rsync_helpers_get_max_blocks(head.block_len);
+    if (max_blocks > 0 &&
+        window_blocks > max_blocks) {
+      window_blocks = max_blocks;
+    }
+  }
+
+  if (window_blocks == 0) {
+    window_blocks = 1;
+  }
+
+  window_len = (size_t) window_blocks * head.block_len;
+
+  sums = palloc(tmp_pool, window_blocks * sizeof(uint32_t));
+  digests = palloc(tmp_pool, window_blocks * digest_len);
+
+  bufsz = buflen = sizeof(struct rsync_sum_head) +
+    (window_blocks * (sizeof(uint32_t) + head.s2len));
+  ptr = buf = palloc(tmp_pool, bufsz);
+
+  rsync_generator_write_sum_head(sess, &buf, &buflen, &head);
+
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_SEQUENTIAL)
+  (void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif /* HAVE_POSIX_FADVISE and POSIX_FADV_SEQUENTIAL */
+
+  hs = create_helpers(tmp_pool, sess, fd, &head, window_blocks);
+  if (hs == NULL) {
+    off = create_offload(tmp_pool, sess, fd, &head, window_len,
+      window_blocks, digest_len);
+  }
+
+  while (idx < head.count) {
+    register int i;
+    uint32_t *window_sums = sums;
+    unsigned char *window_digests = digests;
+    size_t datalen;
+    int nblocks = -1;
+
+    pr_signals_handle();
+
+    datalen = (size_t) (st.st_size - offset);
+    if (datalen > window_len) {
+      datalen = window_len;
+    }
+
+    if (hs != NULL) {
+      nblocks = helpers_window(hs, offset, idx, st.st_size, window_len,
+        cache, cache_flags, &window_sums, &window_digests);
+      if (nblocks < 0) {
+        /* Sum the rest of the file ourselves. */
+        pr_trace_msg(trace_channel, 3,
+          "error summing basis file using helpers (%s), summing it here "
+          "instead", strerror(errno));
+        drain_helpers(hs);
+        hs = NULL;
+
+        window_sums = sums;
+        window_digests = digests;
+
+      } else if (cache != NULL) {
+        (void) rsync_sigcache_put_sums(cache, idx, nblocks, window_sums);
+      }
+    }
+
+    if (nblocks < 0 &&
+        off != NULL) {
+      nblocks = offload_window(off, offset, idx, st.st_size, window_len,
+        cache, cache_flags, &window_sums, &window_digests);
+      if (nblocks < 0) {
+        xerrno = errno;
+
+        drain_offload(off);
+        destroy_pool(tmp_pool);
+        errno = xerrno;
+        return -1;
+      }
+
+      if (cache != NULL) {
+        (void) rsync_sigcache_put_sums(cache, idx, nblocks, window_sums);
+      }
+
+    } else if (nblocks < 0) {
+      int have_weak = FALSE;
+
+      if (cache_flags & RSYNC_SIGCACHE_FL_WEAK) {
+        uint32_t count;
+
+        count = (uint32_t) ((datalen + head.block_len - 1) / head.block_len);
+        if (rsync_sigcache_get_sums(cache, idx, count, sums) == 0) {
+          have_weak = TRUE;
+
+        } else {
+          cache_flags = 0;
+        }
+      }
+
+      nblocks = sum_window(sess, fd, offset, datalen, head.block_len,
+        &use_mmap, &readbuf, window_len, tmp_pool, have_weak, sums, digests);
+      if (nblocks < 0) {
+        xerrno = errno;
+
+        destroy_pool(tmp_pool);
+        errno = xerrno;
+        return -1;
+      }
+
+      if (cache != NULL) {
+        (void) rsync_sigcache_put_sums(cache, idx, nblocks, sums);
+      }
+    }
+
+    for (i = 0; i < nblocks; i++) {
+      rsync_msg_write_int(&buf, &buflen, (int32_t) window_sums[i]);
+      rsync_msg_write_data(&buf, &buflen, window_digests + (i * digest_len),
+        head.s2len);
+    }
+
+    if (write_sums(p, sess, ptr, bufsz - buflen) < 0) {
+      if (hs != NULL) {
+        drain_helpers(hs);
+      }
+
+      if (off != NULL) {
+        drain_offload(off);
+      }
+
+      destroy_pool(tmp_pool);
+      return -1;
+    }
+
+    buf = ptr;
+    buflen = bufsz;
+
+    offset += datalen;
+    idx += nblocks;
+  }
+
+  if (hs != NULL) {
+    drain_helpers(hs);
+  }
+
+  /* An empty basis file has only the header to send. */
+  if (buflen < bufsz) {
+    if (write_sums(p, sess, ptr, bufsz - buflen) < 0) {
+      destroy_pool(tmp_pool);
+      return -1;
+    }
+  }
+
+  if (cache != NULL) {
+    (void) rsync_sigcache_close(cache, fd);
+  }
+
+  pr_trace_msg(trace_channel, 9, "sent %ld block checksums (%" PR_LU
+    " bytes of basis file%s)", (long) head.count, (pr_off_t) st.st_size,
+    (cache_flags & RSYNC_SIGCACHE_FL_WEAK) ? ", rolling sums from cache" : "");
+
+  destroy_pool(tmp_pool);
+  return 0;
+}
+
+int rsync_generator_send_sums(pool *p, struct rsync_session *sess, int fd,
+    int flags) {
+  return rsync_generator_send_file_sums(p, sess, fd, NULL, flags);
+}
@@ -0,0 +1,97 @@
+/*
+ * ProFTPD - mod_rsync signature generator
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_RSYNC_GENERATOR_H
+#define MOD_RSYNC_GENERATOR_H
+
+#include "mod_rsync.h"
+#include "session.h"
+
+/* As the receiver, we generate the "signature" of each basis file: a header
+ * describing the blocks, followed by the weak (rolling) and strong checksums
+ * of each block.  The sender uses these to find the blocks it need not send.
+ */
+
+/* Block lengths, per rsync-${version}/rsync.h. */
+#define RSYNC_GENERATOR_BLOCK_SIZE		700
+#define RSYNC_GENERATOR_MAX_BLOCK_SIZE		(1 << 17)
+
+/* Protocols prior to 30 allowed much larger blocks. */
+#define RSYNC_GENERATOR_OLD_MAX_BLOCK_SIZE	(1 << 29)
+
+/* The basis file is read through a window of (about) this size. */
+#define RSYNC_GENERATOR_WINDOW_SIZE		(4 * 1024 * 1024)
+
+struct rsync_sum_head {
+  int32_t count;
+  int32_t block_len;
+
+  /* Length of the (truncated) strong checksum sent for each block. */
+  int32_t s2len;
+
+  /* Length of the last, short block, if any. */
+  int32_t remainder;
+};
+
+/* Flags for rsync_generator_get_sum_head(). */
+
+/* Use the full strong checksum, e.g. when redoing a file whose whole-file
+ * checksum did not match.
+ */
+#define RSYNC_GENERATOR_FL_FULL_SUMS		0x001
+
+/* Fills in the sum header for a basis file of the given length, per
+ * rsync-${version}/generator.c#sum_sizes_sqroot(): the block length grows
+ * with the square root of the file length (unless a block size was
+ * requested), and the strong checksum length with the number of blocks.
+ */
+int rsync_generator_get_sum_head(struct rsync_session *sess, off_t len,
+  int flags, struct rsync_sum_head *head);
+
+/* Writes the given sum header to the buffer; a NULL header writes the
+ * all-zero header used when there is no basis file.
+ */
+int rsync_generator_write_sum_head(struct rsync_session *sess,
+  unsigned char **buf, uint32_t *buflen, const struct rsync_sum_head *head);
+
+/* Returns the length of the basis file described by the given sum header. */
+off_t rsync_generator_get_basis_len(const struct rsync_sum_head *head);
+
+/* Sends the sum header and block checksums for the basis file open on the
+ * given descriptor; a descriptor of -1, or a file smaller than
+ * rsync_small_file_size, sends the empty header.  The file is mapped a window
+ * at a time, so memory use does not grow with its size.  When appending, only
+ * the header (i.e. the file's length) is sent.
+ */
+int rsync_generator_send_sums(pool *p, struct rsync_session *sess, int fd,
+  int flags);
+
+/* As rsync_generator_send_sums(), for the basis file of the given path,
+ * whose history may then inform the choice of block length (see
+ * blocksize.h), or whether to send its sums at all (see policy.h).
+ */
+int rsync_generator_send_file_sums(pool *p, struct rsync_session *sess,
+  int fd, const char *path, int flags);
+
+#endif /* MOD_RSYNC_GENERATOR_H */
@@ -0,0 +1,806 @@
+/*
+ * ProFTPD - mod_rsync helpers
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+#include "mod_rsync.h"
+#include "helpers.h"
+#include "options.h"
+#include "rolling.h"
+
+#ifdef HAVE_SEM_TIMEDWAIT
+# include <sched.h>
+# include <semaphore.h>
+# include <signal.h>
+# include <sys/mman.h>
+# include <sys/wait.h>
+#endif /* HAVE_SEM_TIMEDWAIT */
+
+static const char *trace_channel = "rsync.helpers";
+
+#ifdef HAVE_SEM_TIMEDWAIT
+/* Slot states.  A slot is only freed by whoever last has it: the owner, once
+ * it has the results (or gave up before the job was queued), or the helper,
+ * if the owner gave up, or went away, while the job was queued.  Whoever
+ * frees the slot holds it, while freeing, so that only one of them clears
+ * its owner and counts it as free.
+ */
+#define HELPERS_SLOT_FREE		0
+#define HELPERS_SLOT_FILLING		1
+#define HELPERS_SLOT_QUEUED		2
+#define HELPERS_SLOT_RUNNING		3
+#define HELPERS_SLOT_DONE		4
+#define HELPERS_SLOT_FREEING		5
+
+struct rsync_helpers_job {
+  int state;
+
+  /* The session which has the slot (0 once it no longer wants it, and while
+   * the slot is free, or being claimed), and the helper running its job.
+   */
+  pid_t owner;
+  pid_t helper;
+
+  /* Posted by the helper when the job is done. */
+  sem_t done;
+
+  /* The owner's checksum parameters. */
+  int checksum_algo;
+  int32_t compat_flags;
+  int32_t checksum_seed;
+
+  uint32_t block_len;
+  size_t datalen;
+  int weak;
+
+  /* The number of blocks summed, or -1 and the errno. */
+  int nblocks;
+  int xerrno;
+
+  uint32_t sums[RSYNC_HELPERS_MAX_BLOCKS];
+  unsigned char digests[RSYNC_HELPERS_MAX_BLOCKS *
+    RSYNC_CHECKSUM_MAX_DIGEST_LEN];
+  unsigned char data[RSYNC_HELPERS_DATA_SIZE];
+};
+
+/* The queued slots are kept in a bounded multi-producer, multi-consumer ring,
+ * per Dmitry Vyukov: each cell's sequence number says whether the cell is
+ * ready to be written, or read, at a given position.  There are as many
+ * cells as slots, and a slot is queued at most once, so the ring is never
+ * full.
+ */
+struct helpers_cell {
+  unsigned int seq;
+  unsigned int slot;
+};
+
+struct helpers_shm {
+  pid_t master;
+  int stopping;
+
+  unsigned int nhelpers;
+  pid_t helpers[RSYNC_HELPERS_MAX_COUNT];
+
+  /* Counts of the free, and of the queued, slots. */
+  sem_t free_slots;
+  sem_t queued_slots;
+
+  unsigned int nslots;
+  unsigned char pad1[64];
+  unsigned int enqueue_pos;
+  unsigned char pad2[64 - sizeof(unsigned int)];
+  unsigned int dequeue_pos;
+  unsigned char pad3[64 - sizeof(unsigned int)];
+  struct helpers_cell cells[RSYNC_HELPERS_MAX_COUNT * 2];
+};
+
+static struct helpers_shm *helpers_shm = NULL;
+static struct rsync_helpers_job *helpers_slots = NULL;
+static size_t helpers_maplen = 0;
+
+static void get_deadline(struct timespec *ts) {
+  if (clock_gettime(CLOCK_REALTIME, ts) < 0) {
+    ts->tv_sec = time(NULL);
+    ts->tv_nsec = 0;
+  }
+
+  ts->tv_sec += RSYNC_HELPERS_POLL_INTERVAL;
+}
+
+/* Note that a live process which we may not signal (e.g. a session running
+ * as another user) gives EPERM, not ESRCH.
+ */
+static int is_gone(pid_t pid) {
+  if (pid == 0) {
+    return TRUE;
+  }
+
+  if (kill(pid, 0) < 0 &&
+      errno == ESRCH) {
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+static void free_slot(struct helpers_shm *shm, struct rsync_helpers_job *slot,
+    int state) {
+  if (__atomic_compare_exchange_n(&(slot->state), &state,
+      HELPERS_SLOT_FREEING, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    __atomic_store_n(&(slot->owner), 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&(slot->state), HELPERS_SLOT_FREE, __ATOMIC_SEQ_CST);
+    (void) sem_post(&(shm->free_slots));
+  }
+}
+
+static void enqueue_slot(struct helpers_shm *shm, unsigned int idx) {
+  struct helpers_cell *cell;
+  unsigned int mask, pos;
+
+  mask = shm->nslots - 1;
+  pos = __atomic_load_n(&(shm->enqueue_pos), __ATOMIC_RELAXED);
+
+  for (;;) {
+    unsigned int seq;
+    int diff;
+
+    cell = &(shm->cells[pos & mask]);
+    seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+    diff = (int) (seq - pos);
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&(shm->enqueue_pos), &pos, pos + 1,
+          TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+
+    } else {
+      pos = __atomic_load_n(&(shm->enqueue_pos), __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->slot = idx;
+  __atomic_store_n(&(cell->seq), pos + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns -1 if the ring is empty, or the cell at its head is not yet
+ * written.
+ */
+static int dequeue_slot(struct helpers_shm *shm) {
+  struct helpers_cell *cell;
+  unsigned int mask, pos;
+  int idx;
+
+  mask = shm->nslots - 1;
+  pos = __atomic_load_n(&(shm->dequeue_pos), __ATOMIC_RELAXED);
+
+  for (;;) {
+    unsigned int seq;
+    int diff;
+
+    cell = &(shm->cells[pos & mask]);
+    seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+    diff = (int) (seq - (pos + 1));
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&(shm->dequeue_pos), &pos, pos + 1,
+          TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+
+    } else if (diff < 0) {
+      return -1;
+
+    } else {
+      pos = __atomic_load_n(&(shm->dequeue_pos), __ATOMIC_RELAXED);
+    }
+  }
+
+  idx = (int) cell->slot;
+  __atomic_store_n(&(cell->seq), pos + mask + 1, __ATOMIC_RELEASE);
+  return idx;
+}
+
+static void run_job(struct helpers_shm *shm, struct rsync_helpers_job *slot) {
+  struct rsync_session sess;
+  struct rsync_options opts;
+  int nblocks;
+
+  slot->helper = getpid();
+  __atomic_store_n(&(slot->state), HELPERS_SLOT_RUNNING, __ATOMIC_SEQ_CST);
+
+  /* Just enough of a session for the checksum functions. */
+  memset(&sess, 0, sizeof(sess));
+  memset(&opts, 0, sizeof(opts));
+  opts.checksum_seed = slot->checksum_seed;
+  sess.options = &opts;
+  sess.checksum_algo = slot->checksum_algo;
+  sess.compat_flags = slot->compat_flags;
+
+  nblocks = rsync_checksum_blocks(&sess, slot->data, slot->datalen,
+    slot->block_len, slot->digests);
+  if (nblocks >= 0 &&
+      slot->weak == TRUE) {
+    nblocks = rsync_rolling_block_sums(slot->data, slot->datalen,
+      slot->block_len, slot->sums);
+  }
+
+  slot->nblocks = nblocks;
+  slot->xerrno = nblocks < 0 ? errno : 0;
+
+  /* Once the job is done, the owner may free the slot, and another session
+   * take it; so the results are posted before then, not after.  If the owner
+   * no longer wants them, the post is drained by the slot's next owner.
+   */
+  (void) sem_post(&(slot->done));
+  __atomic_store_n(&(slot->state), HELPERS_SLOT_DONE, __ATOMIC_SEQ_CST);
+
+  /* If another session has the slot by now, this fails, as the slot is no
+   * longer done.
+   */
+  if (is_gone(__atomic_load_n(&(slot->owner), __ATOMIC_SEQ_CST))) {
+    free_slot(shm, slot, HELPERS_SLOT_DONE);
+  }
+}
+
+/* Helpers are forked from the master daemon, but are not part of proftpd
+ * proper: they do not log, allocate from pools, or handle signals (beyond
+ * dying of them).  They exit when stopped, or when the master goes away.
+ */
+static void helper_main(struct helpers_shm *shm,
+    struct rsync_helpers_job *slots) {
+  sigset_t no_sigs;
+  long i, maxfd;
+
+  (void) signal(SIGHUP, SIG_IGN);
+  (void) signal(SIGINT, SIG_DFL);
+  (void) signal(SIGTERM, SIG_DFL);
+  (void) signal(SIGUSR1, SIG_IGN);
+  (void) signal(SIGUSR2, SIG_IGN);
+  (void) signal(SIGALRM, SIG_IGN);
+  (void) signal(SIGPIPE, SIG_IGN);
+  (void) signal(SIGCHLD, SIG_DFL);
+
+  sigemptyset(&no_sigs);
+  (void) sigprocmask(SIG_SETMASK, &no_sigs, NULL);
+
+  /* Don't hold on to the master's listening sockets, logs, etc. */
+  maxfd = sysconf(_SC_OPEN_MAX);
+  if (maxfd < 0 ||
+      maxfd > 65536) {
+    maxfd = 65536;
+  }
+
+  for (i = 3; i < maxfd; i++) {
+    (void) close((int) i);
+  }
+
+  while (__atomic_load_n(&(shm->stopping), __ATOMIC_SEQ_CST) == FALSE &&
+         getppid() == shm->master) {
+    struct timespec ts;
+    int idx;
+
+    get_deadline(&ts);
+    if (sem_timedwait(&(shm->queued_slots), &ts) < 0) {
+      continue;
+    }
+
+    if (__atomic_load_n(&(shm->stopping), __ATOMIC_SEQ_CST) == TRUE) {
+      break;
+    }
+
+    /* The slot was counted once queued, but an earlier position in the ring
+     * may still be being written.
+     */
+    idx = dequeue_slot(shm);
+    while (idx < 0) {
+      sched_yield();
+      idx = dequeue_slot(shm);
+    }
+
+    run_job(shm, &(slots[idx]));
+  }
+
+  _exit(0);
+}
+
+/* Frees the slots of sessions which went away without releasing them, and of
+ * helpers which died while running a job nobody is waiting for.
+ */
+static void reclaim_slots(struct helpers_shm *shm,
+    struct rsync_helpers_job *slots) {
+  register unsigned int i;
+
+  for (i = 0; i < shm->nslots; i++) {
+    struct rsync_helpers_job *slot;
+    int state;
+    pid_t owner;
+
+    slot = &(slots[i]);
+    state = __atomic_load_n(&(slot->state), __ATOMIC_SEQ_CST);
+
+    switch (state) {
+      case HELPERS_SLOT_FILLING:
+        /* With no owner yet, a session is still claiming the slot (or is
+         * releasing it, and frees it itself).
+         */
+        owner = __atomic_load_n(&(slot->owner), __ATOMIC_SEQ_CST);
+        if (owner != 0 &&
+            is_gone(owner)) {
+          free_slot(shm, slot, state);
+        }
+        break;
+
+      case HELPERS_SLOT_DONE:
+        if (is_gone(__atomic_load_n(&(slot->owner), __ATOMIC_SEQ_CST))) {
+          free_slot(shm, slot, state);
+        }
+        break;
+
+      case HELPERS_SLOT_RUNNING:
+        if (is_gone(slot->helper) &&
+            is_gone(__atomic_load_n(&(slot->owner), __ATOMIC_SEQ_CST))) {
+          free_slot(shm, slot, state);
+        }
+        break;
+
+      default:
+        break;
+    }
+  }
+}
+
+static int helpers_gone(struct helpers_shm *shm) {
+  register unsigned int i;
+
+  if (__atomic_load_n(&(shm->stopping), __ATOMIC_SEQ_CST) == TRUE) {
+    return TRUE;
+  }
+
+  for (i = 0; i < shm->nhelpers; i++) {
+    if (is_gone(shm->helpers[i]) == FALSE) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+#endif /* HAVE_SEM_TIMEDWAIT */
+
+int rsync_helpers_start(unsigned int count) {
+#ifdef HAVE_SEM_TIMEDWAIT
+  register unsigned int i;
+  struct helpers_shm *shm;
+  struct rsync_helpers_job *slots;
+  sigset_t all_sigs, saved_sigs;
+  size_t hdrlen, maplen;
+  unsigned int nslots;
+  long pagesz;
+  void *map;
+#endif /* HAVE_SEM_TIMEDWAIT */
+
+  if (count > RSYNC_HELPERS_MAX_COUNT) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  (void) rsync_helpers_stop();
+
+  if (count == 0) {
+    return 0;
+  }
+
+#ifdef HAVE_SEM_TIMEDWAIT
+  /* Two slots per helper, so that sessions can fill the next while the
+   * helpers sum the current ones.
+   */
+  nslots = 2;
+  while (nslots < count * 2) {
+    nslots <<= 1;
+  }
+
+  pagesz = sysconf(_SC_PAGESIZE);
+  if (pagesz <= 0) {
+    pagesz = 4096;
+  }
+
+  hdrlen = ((sizeof(struct helpers_shm) + pagesz - 1) / pagesz) * pagesz;
+  maplen = hdrlen + (nslots * sizeof(struct rsync_helpers_job));
+
+  map = mmap(NULL, maplen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS,
+    -1, 0);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+
+  shm = map;
+  slots = (struct rsync_helpers_job *) (((unsigned char *) map) + hdrlen);
+
+  shm->master = getpid();
+  shm->nslots = nslots;
+
+  if (sem_init(&(shm->free_slots), 1, nslots) < 0 ||
+      sem_init(&(shm->queued_slots), 1, 0) < 0) {
+    int xerrno = errno;
+
+    (void) munmap(map, maplen);
+    errno = xerrno;
+    return -1;
+  }
+
+  for (i = 0; i < nslots; i++) {
+    shm->cells[i].seq = i;
+
+    if (sem_init(&(slots[i].done), 1, 0) < 0) {
+      int xerrno = errno;
+
+      (void) munmap(map, maplen);
+      errno = xerrno;
+      return -1;
+    }
+  }
+
+  helpers_shm = shm;
+  helpers_slots = slots;
+  helpers_maplen = maplen;
+
+  /* The helpers must not run our signal handlers before they have reset
+   * them.
+   */
+  sigfillset(&all_sigs);
+  (void) sigprocmask(SIG_BLOCK, &all_sigs, &saved_sigs);
+
+  for (i = 0; i < count; i++) {
+    pid_t pid;
+
+    pid = fork();
+    if (pid == 0) {
+      helper_main(shm, slots);
+    }
+
+    if (pid < 0) {
+      int xerrno = errno;
+
+      (void) sigprocmask(SIG_SETMASK, &saved_sigs, NULL);
+      (void) rsync_helpers_stop();
+
+      pr_trace_msg(trace_channel, 1, "error forking helper: %s",
+        strerror(xerrno));
+      errno = xerrno;
+      return -1;
+    }
+
+    shm->helpers[i] = pid;
+    shm->nhelpers++;
+  }
+
+  (void) sigprocmask(SIG_SETMASK, &saved_sigs, NULL);
+
+  pr_trace_msg(trace_channel, 7, "started %u helpers, with %u job slots",
+    count, nslots);
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* HAVE_SEM_TIMEDWAIT */
+}
+
+int rsync_helpers_stop(void) {
+#ifdef HAVE_SEM_TIMEDWAIT
+  register unsigned int i;
+  struct helpers_shm *shm;
+
+  shm = helpers_shm;
+  if (shm == NULL) {
+    return 0;
+  }
+
+  __atomic_store_n(&(shm->stopping), TRUE, __ATOMIC_SEQ_CST);
+
+  for (i = 0; i < shm->nhelpers; i++) {
+    (void) sem_post(&(shm->queued_slots));
+  }
+
+  /* The helpers finish any job they are running, then exit; proftpd's
+   * SIGCHLD handling may reap them before we do.
+   */
+  for (i = 0; i < shm->nhelpers; i++) {
+    while (waitpid(shm->helpers[i], NULL, 0) < 0 &&
+           errno == EINTR) {
+    }
+  }
+
+  pr_trace_msg(trace_channel, 7, "stopped %u helpers", shm->nhelpers);
+
+  /* Any sessions still have their own mapping. */
+  (void) munmap(shm, helpers_maplen);
+  helpers_shm = NULL;
+  helpers_slots = NULL;
+  helpers_maplen = 0;
+#endif /* HAVE_SEM_TIMEDWAIT */
+
+  return 0;
+}
+
+unsigned int rsync_helpers_get_count(void) {
+#ifdef HAVE_SEM_TIMEDWAIT
+  if (helpers_shm != NULL &&
+      __atomic_load_n(&(helpers_shm->stopping), __ATOMIC_SEQ_CST) == FALSE) {
+    return helpers_shm->nhelpers;
+  }
+#endif /* HAVE_SEM_TIMEDWAIT */
+
+  return 0;
+}
+
+uint32_t rsync_helpers_get_max_blocks(uint32_t block_len) {
+  uint32_t max_blocks;
+
+  if (block_len == 0) {
+    return 0;
+  }
+
+  max_blocks = RSYNC_HELPERS_DATA_SIZE / block_len;
+  if (max_blocks > RSYNC_HELPERS_MAX_BLOCKS) {
+    max_blocks = RSYNC_HELPERS_MAX_BLOCKS;
+  }
+
+  return max_blocks;
+}
+
+struct rsync_helpers_job *rsync_helpers_get_job(struct rsync_session *sess,
+    int wait, unsigned char **buf) {
+#ifdef HAVE_SEM_TIMEDWAIT
+  register unsigned int i;
+  struct helpers_shm *shm;
+  struct rsync_helpers_job *slot = NULL;
+  struct rsync_options *opts;
+
+  shm = helpers_shm;
+  if (shm == NULL ||
+      sess == NULL ||
+      sess->options == NULL ||
+      buf == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (helpers_gone(shm)) {
+    errno = EIO;
+    return NULL;
+  }
+
+  for (;;) {
+    struct timespec ts;
+    int xerrno;
+
+    if (wait == FALSE) {
+      if (sem_trywait(&(shm->free_slots)) == 0) {
+        break;
+      }
+
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return NULL;
+    }
+
+    get_deadline(&ts);
+    if (sem_timedwait(&(shm->free_slots), &ts) == 0) {
+      break;
+    }
+
+    xerrno = errno;
+
+    if (xerrno == EINTR) {
+      pr_signals_handle();
+      continue;
+    }
+
+    if (xerrno != ETIMEDOUT) {
+      errno = xerrno;
+      return NULL;
+    }
+
+    if (helpers_gone(shm)) {
+      errno = EIO;
+      return NULL;
+    }
+
+    reclaim_slots(shm, helpers_slots);
+  }
+
+  /* Having counted a free slot, there is one to be found.  Its owner is
+   * still 0, until we set it below.
+   */
+  while (slot == NULL) {
+    for (i = 0; i < shm->nslots; i++) {
+      int state = HELPERS_SLOT_FREE;
+
+      if (__atomic_compare_exchange_n(&(helpers_slots[i].state), &state,
+          HELPERS_SLOT_FILLING, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        slot = &(helpers_slots[i]);
+        break;
+      }
+    }
+  }
+
+  /* The semaphore may still count the last owner's job, if that owner gave
+   * up on it while it was running.
+   */
+  while (sem_trywait(&(slot->done)) == 0) {
+  }
+
+  opts = sess->options;
+  slot->helper = 0;
+  slot->checksum_algo = sess->checksum_algo;
+  slot->compat_flags = sess->compat_flags;
+  slot->checksum_seed = opts->checksum_seed;
+  __atomic_store_n(&(slot->owner), getpid(), __ATOMIC_SEQ_CST);
+
+  *buf = slot->data;
+  return slot;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif /* HAVE_SEM_TIMEDWAIT */
+}
+
+int rsync_helpers_submit(struct rsync_helpers_job *job, size_t datalen,
+    uint32_t block_len, int weak) {
+#ifdef HAVE_SEM_TIMEDWAIT
+  struct helpers_shm *shm;
+
+  shm = helpers_shm;
+  if (shm == NULL ||
+      job == NULL ||
+      block_len == 0 ||
+      datalen > RSYNC_HELPERS_DATA_SIZE ||
+      (datalen + block_len - 1) / block_len > RSYNC_HELPERS_MAX_BLOCKS) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (__atomic_load_n(&(job->state), __ATOMIC_SEQ_CST) !=
+      HELPERS_SLOT_FILLING) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  job->datalen = datalen;
+  job->block_len = block_len;
+  job->weak = weak;
+  job->nblocks = -1;
+  job->xerrno = 0;
+
+  __atomic_store_n(&(job->state), HELPERS_SLOT_QUEUED, __ATOMIC_SEQ_CST);
+  enqueue_slot(shm, (unsigned int) (job - helpers_slots));
+  (void) sem_post(&(shm->queued_slots));
+
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* HAVE_SEM_TIMEDWAIT */
+}
+
+int rsync_helpers_wait(struct rsync_helpers_job *job, uint32_t **sums,
+    unsigned char **digests) {
+#ifdef HAVE_SEM_TIMEDWAIT
+  struct helpers_shm *shm;
+
+  shm = helpers_shm;
+  if (shm == NULL ||
+      job == NULL ||
+      sums == NULL ||
+      digests == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (;;) {
+    struct timespec ts;
+    int state, xerrno;
+
+    get_deadline(&ts);
+    if (sem_timedwait(&(job->done), &ts) == 0) {
+      break;
+    }
+
+    xerrno = errno;
+
+    if (xerrno == EINTR) {
+      pr_signals_handle();
+      continue;
+    }
+
+    if (xerrno != ETIMEDOUT) {
+      errno = xerrno;
+      return -1;
+    }
+
+    state = __atomic_load_n(&(job->state), __ATOMIC_SEQ_CST);
+    if (state == HELPERS_SLOT_FILLING ||
+        state == HELPERS_SLOT_FREE) {
+      /* Never submitted. */
+      errno = EINVAL;
+      return -1;
+    }
+
+    if ((state == HELPERS_SLOT_QUEUED && helpers_gone(shm)) ||
+        (state == HELPERS_SLOT_RUNNING && is_gone(job->helper))) {
+      pr_trace_msg(trace_channel, 3,
+        "helpers went away while waiting for job");
+      errno = EIO;
+      return -1;
+    }
+  }
+
+  /* The helper posts the results just before marking the job done; wait for
+   * that, so that releasing the job frees its slot.
+   */
+  while (__atomic_load_n(&(job->state), __ATOMIC_SEQ_CST) !=
+      HELPERS_SLOT_DONE) {
+    if (is_gone(job->helper)) {
+      break;
+    }
+
+    sched_yield();
+  }
+
+  if (job->nblocks < 0) {
+    errno = job->xerrno;
+    return -1;
+  }
+
+  *sums = job->sums;
+  *digests = job->digests;
+  return job->nblocks;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* HAVE_SEM_TIMEDWAIT */
+}
+
+void rsync_helpers_release(struct rsync_helpers_job *job) {
+#ifdef HAVE_SEM_TIMEDWAIT
+  int state;
+
+  if (helpers_shm == NULL ||
+      job == NULL) {
+    return;
+  }
+
+  /* If the job is still queued, or running, the helper frees the slot once
+   * it sees that we no longer want it.
+   */
+  __atomic_store_n(&(job->owner), 0, __ATOMIC_SEQ_CST);
+
+  state = __atomic_load_n(&(job->state), __ATOMIC_SEQ_CST);
+  if (state == HELPERS_SLOT_FILLING ||
+      state == HELPERS_SLOT_DONE) {
+    free_slot(helpers_shm, job, state);
+  }
+#endif /* HAVE_SEM_TIMEDWAIT */
+}
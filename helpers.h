@@ -0,0 +1,105 @@
+/*
+ * ProFTPD - mod_rsync helpers
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+#ifndef MOD_RSYNC_HELPERS_H
+#define MOD_RSYNC_HELPERS_H
+
+#include "mod_rsync.h"
+#include "session.h"
+#include "checksum.h"
+
+/* Worker threads (see workers.h) let one session use several CPUs; with many
+ * sessions at once, that can be more hashing than the server has CPUs for.
+ * Instead, the master daemon may start a fixed number of helper processes,
+ * shared by all sessions, which compute the block sums of uploaded files'
+ * existing copies.  The number of helpers then caps the CPU spent on that
+ * hashing, server-wide.
+ *
+ * The helpers and the sessions share an anonymous mapping, made before any
+ * of them are forked.  It holds a number of job slots, each with room for
+ * a window of data and its sums, and a lock-free ring of the queued slots.
+ * A session takes a free slot, reads the data into it, and queues it; a
+ * helper takes the slot off the ring, sums the data, and posts the slot's
+ * semaphore.  No file descriptors are passed between processes.
+ *
+ * Compression is not done by the helpers: a compression stream's state
+ * lives in its session, and cannot move between processes.
+ */
+
+#define RSYNC_HELPERS_MAX_COUNT			64
+
+/* Each slot holds at most this much data, and this many blocks' sums. */
+#define RSYNC_HELPERS_DATA_SIZE			(1024 * 1024)
+#define RSYNC_HELPERS_MAX_BLOCKS		4096
+
+/* How long helpers, and sessions waiting for them, sleep before checking
+ * that the other side is still there.
+ */
+#define RSYNC_HELPERS_POLL_INTERVAL		1
+
+struct rsync_helpers_job;
+
+/* Starts the given number of helper processes, e.g. from the master daemon;
+ * any sessions forked afterwards may submit jobs to them.  A count of 0
+ * stops any helpers, and is the default.  Returns ENOSYS if helpers are
+ * wanted but not supported.
+ */
+int rsync_helpers_start(unsigned int count);
+
+/* Stops the helpers, e.g. when the daemon restarts or exits.  Sessions with
+ * jobs still queued see those jobs fail.
+ */
+int rsync_helpers_stop(void);
+
+unsigned int rsync_helpers_get_count(void);
+
+/* Returns the number of blocks of the given length which fit in a job. */
+uint32_t rsync_helpers_get_max_blocks(uint32_t block_len);
+
+/* Takes a free job slot, waiting for one if the wait flag is TRUE; returns
+ * NULL, with errno set to EAGAIN, if none is free and the caller would not
+ * wait.  The data to be summed is read into the returned buffer, which holds
+ * RSYNC_HELPERS_DATA_SIZE bytes.
+ */
+struct rsync_helpers_job *rsync_helpers_get_job(struct rsync_session *sess,
+  int wait, unsigned char **buf);
+
+/* Queues the job, to compute the block sums of datalen bytes of its buffer.
+ * Unless the weak flag is TRUE, only the strong checksums are computed.
+ */
+int rsync_helpers_submit(struct rsync_helpers_job *job, size_t datalen,
+  uint32_t block_len, int weak);
+
+/* Waits for the job to finish, and returns the number of blocks; their sums
+ * are in the job's slot, until it is released.  Returns -1, with errno set
+ * to EIO, if the helpers have gone away.
+ */
+int rsync_helpers_wait(struct rsync_helpers_job *job, uint32_t **sums,
+  unsigned char **digests);
+
+/* Returns the job's slot, whether or not the job has finished. */
+void rsync_helpers_release(struct rsync_helpers_job *job);
+
+#endif /* MOD_RSYNC_HELPERS_H */
@@ -41,6 +41,8 @@
 #include "disconnect.h"
 #include "version.h"
 #include "checksum.h"
+#include "compress.h"
+#include "negotiate.h"
 #include "filters.h"
 #include "manifest.h"
 
@@ -49,6 +51,7 @@ module rsync_module;
 int rsync_logfd = -1;
 pool *rsync_pool = NULL;
 unsigned long rsync_opts = 0UL;
+off_t rsync_small_file_size = 0;
 
 /* This looks weird, I know.  Its purpose is to be a placeholder pointer;
  * when we call sftp_channel_register_exec_handler(), we give that function
@@ -122,6 +125,12 @@ static int rsync_handle_data_recv(pool *p, struct rsync_session *sess,
 
   opts = sess->options;
 
+  /* XXX Receive the file list, then walk it, requesting each file through
+   * an rsync_pipeline (pipeline.h), which generates the basis file's sums
+   * and rebuilds the file as the sender's data arrives.  Until the file
+   * list can be received, no file can be requested.
+   */
+
   errno = ENOSYS;
   return -1;
 }
@@ -138,6 +147,11 @@ static int rsync_handle_data_send(pool *p, struct rsync_session *sess,
    * and their friends.
    */
 
+  /* XXX Once the file list sent is kept in the session, read each file index
+   * requested, and the client's block sums (sumtable.h), and send that
+   * file's delta using rsync_sender_send_file().
+   */
+
   bufsz = buflen = sizeof(char);
 
   /* A byte is used to indicate end-of-list. */
@@ -191,6 +205,13 @@ static int rsync_handle_packet(pool *p, void *ssh2, uint32_t channel_id,
     }
 
     sess->state |= RSYNC_SESS_FL_PROTO_VERSION;
+
+    /* Protocol 31 clients may want to negotiate algorithms; our half of the
+     * negotiation is sent immediately after the compatibility flags.
+     */
+    if (rsync_negotiate_send(p, sess) < 0) {
+      return -1;
+    }
   }
 
   /* If we're the server, we need to send the checksum seed.  If we're the
@@ -210,6 +231,15 @@ static int rsync_handle_packet(pool *p, void *ssh2, uint32_t channel_id,
     return 0;
   }
 
+  if (!(sess->state & RSYNC_SESS_FL_NEGOTIATED)) {
+    pr_trace_msg(trace_channel, 17, "handling algorithm negotiation");
+    if (rsync_negotiate_handle_data(p, sess, &data, &datalen) < 0) {
+      return -1;
+    }
+
+    sess->state |= RSYNC_SESS_FL_NEGOTIATED;
+  }
+
   if (!(sess->state & RSYNC_SESS_FL_FILTERS)) {
 pr_trace_msg(trace_channel, 17, "handling filters");
     if (rsync_filters_handle_data(p, sess, &data, &datalen) < 0) {
@@ -248,6 +278,108 @@ pr_trace_msg(trace_channel, 17, "handling filters");
 /* Configuration handlers
  */
 
+/* usage: RSyncChecksums algo1 ... */
+MODRET set_rsyncchecksums(cmd_rec *cmd) {
+  register unsigned int i;
+  char *algos = "";
+
+  if (cmd->argc < 2) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  for (i = 1; i < cmd->argc; i++) {
+    int algo;
+
+    algo = rsync_checksum_get_algo(cmd->argv[i]);
+    if (algo < 0 ||
+        algo == RSYNC_CHECKSUM_ALGO_NONE) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "unknown checksum algorithm: ",
+        (char *) cmd->argv[i], NULL));
+    }
+
+    if (rsync_checksum_supported(algo) == FALSE) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "checksum algorithm ",
+        (char *) cmd->argv[i], " not supported by this build", NULL));
+    }
+
+    algos = pstrcat(cmd->tmp_pool, algos, *algos ? " " : "",
+      rsync_checksum_get_name(algo), NULL);
+  }
+
+  add_config_param_str(cmd->argv[0], 1, algos);
+  return PR_HANDLED(cmd);
+}
+
+/* usage: RSyncCompression algo1[:max-level] ... */
+MODRET set_rsynccompression(cmd_rec *cmd) {
+  register unsigned int i;
+  char *algos = "";
+  int *max_levels;
+  config_rec *c;
+
+  if (cmd->argc < 2) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  max_levels = pcalloc(c->pool, sizeof(int) * (RSYNC_COMPRESS_ALGO_MAX+1));
+
+  for (i = 1; i < cmd->argc; i++) {
+    char *name, *ptr;
+    int algo;
+
+    name = pstrdup(cmd->tmp_pool, cmd->argv[i]);
+
+    ptr = strchr(name, ':');
+    if (ptr != NULL) {
+      *ptr = '\0';
+    }
+
+    algo = rsync_compress_get_algo(name);
+    if (algo < 0) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "unknown compression algorithm: ",
+        name, NULL));
+    }
+
+    if (rsync_compress_supported(algo) == FALSE) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "compression algorithm ", name,
+        " not supported by this build", NULL));
+    }
+
+    if (ptr != NULL) {
+      int level;
+      char *endp = NULL;
+
+      level = (int) strtol(ptr + 1, &endp, 10);
+      if (endp == NULL ||
+          *endp != '\0' ||
+          level < 1) {
+        CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid maximum level for ",
+          name, ": ", ptr + 1, NULL));
+      }
+
+      if (rsync_compress_get_level(algo, level) < 0) {
+        CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "maximum level ", ptr + 1,
+          " not valid for ", name, NULL));
+      }
+
+      max_levels[algo] = level;
+    }
+
+    algos = pstrcat(cmd->tmp_pool, algos, *algos ? " " : "",
+      rsync_compress_get_name(algo), NULL);
+  }
+
+  c->argv[0] = pstrdup(c->pool, algos);
+  c->argv[1] = max_levels;
+
+  return PR_HANDLED(cmd);
+}
+
 /* usage: RSyncEngine on|off */
 MODRET set_rsyncengine(cmd_rec *cmd) {
   int engine;
@@ -374,6 +506,32 @@ static int rsync_sess_init(void) {
   rsync_pool = make_sub_pool(session.pool);
   pr_pool_tag(rsync_pool, MOD_RSYNC_VERSION);
 
+  c = find_config(main_server->conf, CONF_PARAM, "RSyncChecksums", FALSE);
+  if (c != NULL) {
+    if (rsync_checksum_set_preferred(rsync_pool, c->argv[0]) < 0) {
+      (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+        "error using RSyncChecksums '%s': %s", (char *) c->argv[0],
+        strerror(errno));
+    }
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "RSyncCompression", FALSE);
+  if (c != NULL) {
+    register unsigned int i;
+    int *max_levels;
+
+    if (rsync_compress_set_preferred(rsync_pool, c->argv[0]) < 0) {
+      (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+        "error using RSyncCompression '%s': %s", (char *) c->argv[0],
+        strerror(errno));
+    }
+
+    max_levels = c->argv[1];
+    for (i = 0; i <= RSYNC_COMPRESS_ALGO_MAX; i++) {
+      (void) rsync_compress_set_max_level(i, max_levels[i]);
+    }
+  }
+
   /* Note: The registered 'command' here, "rsync", is meant to be a literal
    * match for the path/command that the SSH client requests in its exec
    * command.
@@ -404,6 +562,8 @@ static int rsync_sess_init(void) {
  */
 
 static conftable rsync_conftab[] = {
+  { "RSyncChecksums",		set_rsyncchecksums,		NULL },
+  { "RSyncCompression",		set_rsynccompression,		NULL },
   { "RSyncEngine",		set_rsyncengine,		NULL },
   { "RSyncLog",			set_rsynclog,			NULL },
   { "RSyncOptions",		set_rsyncoptions,		NULL },
@@ -413,6 +413,33 @@ char *rsync_msg_read_string(pool *p, unsigned char **buf, uint32_t *buflen,
   return s;
 }
 
+/* A "vstring" is a string prefixed by its length, using one byte for lengths
+ * up to 0x7f, and two bytes (high bit set in the first) otherwise.  See
+ * rsync-${version}/io.c#read_vstring().
+ */
+char *rsync_msg_read_vstring(pool *p, unsigned char **buf, uint32_t *buflen) {
+  size_t len;
+
+  if (p == NULL ||
+      buf == NULL ||
+      buflen == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  len = (unsigned char) rsync_msg_read_byte(p, buf, buflen);
+  if (len & 0x80) {
+    len = ((len & ~0x80) * 0x100) +
+      (unsigned char) rsync_msg_read_byte(p, buf, buflen);
+  }
+
+  if (len == 0) {
+    return pstrdup(p, "");
+  }
+
+  return rsync_msg_read_string(p, buf, buflen, len);
+}
+
 uint32_t rsync_msg_write_byte(unsigned char **buf, uint32_t *buflen,
     char byte) {
   uint32_t len;
@@ -674,3 +701,31 @@ uint32_t rsync_msg_write_string(unsigned char **buf, uint32_t *buflen,
   len = strlen(s);
   return rsync_msg_write_data(buf, buflen, (const unsigned char *) s, len);
 }
+
+uint32_t rsync_msg_write_vstring(unsigned char **buf, uint32_t *buflen,
+    const char *s) {
+  size_t len;
+  uint32_t res = 0;
+
+  if (buf == NULL ||
+      buflen == NULL ||
+      s == NULL) {
+    return 0;
+  }
+
+  len = strlen(s);
+  if (len > RSYNC_MSG_MAX_VSTRING_LEN) {
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "IO error: unable to write vstring (len %lu too long)",
+      (unsigned long) len);
+    return 0;
+  }
+
+  if (len > 0x7f) {
+    res += rsync_msg_write_byte(buf, buflen, (char) ((len / 0x100) + 0x80));
+  }
+
+  res += rsync_msg_write_byte(buf, buflen, (char) (len & 0xff));
+  res += rsync_msg_write_data(buf, buflen, (const unsigned char *) s, len);
+  return res;
+}
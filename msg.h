@@ -38,6 +38,7 @@ unsigned char *rsync_msg_read_data(pool *p, unsigned char **buf,
   uint32_t *buflen, size_t datalen);
 char *rsync_msg_read_string(pool *p, unsigned char **buf, uint32_t *buflen,
   size_t datalen);
+char *rsync_msg_read_vstring(pool *p, unsigned char **buf, uint32_t *buflen);
 
 uint32_t rsync_msg_write_byte(unsigned char **buf, uint32_t *buflen, char val);
 uint32_t rsync_msg_write_short(unsigned char **buf, uint32_t *buflen,
@@ -54,5 +55,10 @@ uint32_t rsync_msg_write_data(unsigned char **buf, uint32_t *buflen,
   const unsigned char *data, size_t datalen);
 uint32_t rsync_msg_write_string(unsigned char **buf, uint32_t *buflen,
   const char *str);
+uint32_t rsync_msg_write_vstring(unsigned char **buf, uint32_t *buflen,
+  const char *str);
+
+/* Longest string that can be encoded as a vstring. */
+#define RSYNC_MSG_MAX_VSTRING_LEN	0x7fff
 
 #endif /* MOD_RSYNC_MSG_H */
@@ -0,0 +1,525 @@
+/*
+ * ProFTPD - mod_rsync multi-buffer digests
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_rsync.h"
+#include "multibuf.h"
+#include "checksum.h"
+
+/* The SIMD kernels are written using the compiler's vector extensions, and
+ * rely on its support for per-function target attributes and for runtime
+ * CPU feature detection.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+# define RSYNC_MULTIBUF_X86	1
+#endif
+
+static const char *trace_channel = "rsync.multibuf";
+
+/* The most lanes used by any kernel. */
+#define MULTIBUF_MAX_LANES	16
+
+/* The kernels work on the state of N messages at once, stored as four
+ * arrays (A, B, C, D) of N words each, and on one 64-byte chunk of each
+ * message.
+ */
+typedef void (*multibuf_fn)(uint32_t *state, const unsigned char **chunks);
+
+#define MB_ROTL(x, s)		(((x) << (s)) | ((x) >> (32 - (s))))
+
+/* MD4, per RFC 1320. */
+#define MB_MD4_F(x, y, z)	((z) ^ ((x) & ((y) ^ (z))))
+#define MB_MD4_G(x, y, z)	(((x) & (y)) | ((x) & (z)) | ((y) & (z)))
+#define MB_MD4_H(x, y, z)	((x) ^ (y) ^ (z))
+
+#define MB_MD4_STEP(f, a, b, c, d, k, t, s) \
+  (a) += f((b), (c), (d)) + M[k] + (uint32_t) (t); \
+  (a) = MB_ROTL((a), (s));
+
+#define MB_MD4_ROUNDS \
+  MB_MD4_STEP(MB_MD4_F, a, b, c, d,  0, 0,  3) \
+  MB_MD4_STEP(MB_MD4_F, d, a, b, c,  1, 0,  7) \
+  MB_MD4_STEP(MB_MD4_F, c, d, a, b,  2, 0, 11) \
+  MB_MD4_STEP(MB_MD4_F, b, c, d, a,  3, 0, 19) \
+  MB_MD4_STEP(MB_MD4_F, a, b, c, d,  4, 0,  3) \
+  MB_MD4_STEP(MB_MD4_F, d, a, b, c,  5, 0,  7) \
+  MB_MD4_STEP(MB_MD4_F, c, d, a, b,  6, 0, 11) \
+  MB_MD4_STEP(MB_MD4_F, b, c, d, a,  7, 0, 19) \
+  MB_MD4_STEP(MB_MD4_F, a, b, c, d,  8, 0,  3) \
+  MB_MD4_STEP(MB_MD4_F, d, a, b, c,  9, 0,  7) \
+  MB_MD4_STEP(MB_MD4_F, c, d, a, b, 10, 0, 11) \
+  MB_MD4_STEP(MB_MD4_F, b, c, d, a, 11, 0, 19) \
+  MB_MD4_STEP(MB_MD4_F, a, b, c, d, 12, 0,  3) \
+  MB_MD4_STEP(MB_MD4_F, d, a, b, c, 13, 0,  7) \
+  MB_MD4_STEP(MB_MD4_F, c, d, a, b, 14, 0, 11) \
+  MB_MD4_STEP(MB_MD4_F, b, c, d, a, 15, 0, 19) \
+  MB_MD4_STEP(MB_MD4_G, a, b, c, d,  0, 0x5a827999,  3) \
+  MB_MD4_STEP(MB_MD4_G, d, a, b, c,  4, 0x5a827999,  5) \
+  MB_MD4_STEP(MB_MD4_G, c, d, a, b,  8, 0x5a827999,  9) \
+  MB_MD4_STEP(MB_MD4_G, b, c, d, a, 12, 0x5a827999, 13) \
+  MB_MD4_STEP(MB_MD4_G, a, b, c, d,  1, 0x5a827999,  3) \
+  MB_MD4_STEP(MB_MD4_G, d, a, b, c,  5, 0x5a827999,  5) \
+  MB_MD4_STEP(MB_MD4_G, c, d, a, b,  9, 0x5a827999,  9) \
+  MB_MD4_STEP(MB_MD4_G, b, c, d, a, 13, 0x5a827999, 13) \
+  MB_MD4_STEP(MB_MD4_G, a, b, c, d,  2, 0x5a827999,  3) \
+  MB_MD4_STEP(MB_MD4_G, d, a, b, c,  6, 0x5a827999,  5) \
+  MB_MD4_STEP(MB_MD4_G, c, d, a, b, 10, 0x5a827999,  9) \
+  MB_MD4_STEP(MB_MD4_G, b, c, d, a, 14, 0x5a827999, 13) \
+  MB_MD4_STEP(MB_MD4_G, a, b, c, d,  3, 0x5a827999,  3) \
+  MB_MD4_STEP(MB_MD4_G, d, a, b, c,  7, 0x5a827999,  5) \
+  MB_MD4_STEP(MB_MD4_G, c, d, a, b, 11, 0x5a827999,  9) \
+  MB_MD4_STEP(MB_MD4_G, b, c, d, a, 15, 0x5a827999, 13) \
+  MB_MD4_STEP(MB_MD4_H, a, b, c, d,  0, 0x6ed9eba1,  3) \
+  MB_MD4_STEP(MB_MD4_H, d, a, b, c,  8, 0x6ed9eba1,  9) \
+  MB_MD4_STEP(MB_MD4_H, c, d, a, b,  4, 0x6ed9eba1, 11) \
+  MB_MD4_STEP(MB_MD4_H, b, c, d, a, 12, 0x6ed9eba1, 15) \
+  MB_MD4_STEP(MB_MD4_H, a, b, c, d,  2, 0x6ed9eba1,  3) \
+  MB_MD4_STEP(MB_MD4_H, d, a, b, c, 10, 0x6ed9eba1,  9) \
+  MB_MD4_STEP(MB_MD4_H, c, d, a, b,  6, 0x6ed9eba1, 11) \
+  MB_MD4_STEP(MB_MD4_H, b, c, d, a, 14, 0x6ed9eba1, 15) \
+  MB_MD4_STEP(MB_MD4_H, a, b, c, d,  1, 0x6ed9eba1,  3) \
+  MB_MD4_STEP(MB_MD4_H, d, a, b, c,  9, 0x6ed9eba1,  9) \
+  MB_MD4_STEP(MB_MD4_H, c, d, a, b,  5, 0x6ed9eba1, 11) \
+  MB_MD4_STEP(MB_MD4_H, b, c, d, a, 13, 0x6ed9eba1, 15) \
+  MB_MD4_STEP(MB_MD4_H, a, b, c, d,  3, 0x6ed9eba1,  3) \
+  MB_MD4_STEP(MB_MD4_H, d, a, b, c, 11, 0x6ed9eba1,  9) \
+  MB_MD4_STEP(MB_MD4_H, c, d, a, b,  7, 0x6ed9eba1, 11) \
+  MB_MD4_STEP(MB_MD4_H, b, c, d, a, 15, 0x6ed9eba1, 15)
+
+/* MD5, per RFC 1321. */
+#define MB_MD5_F(x, y, z)	((z) ^ ((x) & ((y) ^ (z))))
+#define MB_MD5_G(x, y, z)	((y) ^ ((z) & ((x) ^ (y))))
+#define MB_MD5_H(x, y, z)	((x) ^ (y) ^ (z))
+#define MB_MD5_I(x, y, z)	((y) ^ ((x) | ~(z)))
+
+#define MB_MD5_STEP(f, a, b, c, d, k, t, s) \
+  (a) += f((b), (c), (d)) + M[k] + (uint32_t) (t); \
+  (a) = MB_ROTL((a), (s)) + (b);
+
+#define MB_MD5_ROUNDS \
+  MB_MD5_STEP(MB_MD5_F, a, b, c, d,  0, 0xd76aa478,  7) \
+  MB_MD5_STEP(MB_MD5_F, d, a, b, c,  1, 0xe8c7b756, 12) \
+  MB_MD5_STEP(MB_MD5_F, c, d, a, b,  2, 0x242070db, 17) \
+  MB_MD5_STEP(MB_MD5_F, b, c, d, a,  3, 0xc1bdceee, 22) \
+  MB_MD5_STEP(MB_MD5_F, a, b, c, d,  4, 0xf57c0faf,  7) \
+  MB_MD5_STEP(MB_MD5_F, d, a, b, c,  5, 0x4787c62a, 12) \
+  MB_MD5_STEP(MB_MD5_F, c, d, a, b,  6, 0xa8304613, 17) \
+  MB_MD5_STEP(MB_MD5_F, b, c, d, a,  7, 0xfd469501, 22) \
+  MB_MD5_STEP(MB_MD5_F, a, b, c, d,  8, 0x698098d8,  7) \
+  MB_MD5_STEP(MB_MD5_F, d, a, b, c,  9, 0x8b44f7af, 12) \
+  MB_MD5_STEP(MB_MD5_F, c, d, a, b, 10, 0xffff5bb1, 17) \
+  MB_MD5_STEP(MB_MD5_F, b, c, d, a, 11, 0x895cd7be, 22) \
+  MB_MD5_STEP(MB_MD5_F, a, b, c, d, 12, 0x6b901122,  7) \
+  MB_MD5_STEP(MB_MD5_F, d, a, b, c, 13, 0xfd987193, 12) \
+  MB_MD5_STEP(MB_MD5_F, c, d, a, b, 14, 0xa679438e, 17) \
+  MB_MD5_STEP(MB_MD5_F, b, c, d, a, 15, 0x49b40821, 22) \
+  MB_MD5_STEP(MB_MD5_G, a, b, c, d,  1, 0xf61e2562,  5) \
+  MB_MD5_STEP(MB_MD5_G, d, a, b, c,  6, 0xc040b340,  9) \
+  MB_MD5_STEP(MB_MD5_G, c, d, a, b, 11, 0x265e5a51, 14) \
+  MB_MD5_STEP(MB_MD5_G, b, c, d, a,  0, 0xe9b6c7aa, 20) \
+  MB_MD5_STEP(MB_MD5_G, a, b, c, d,  5, 0xd62f105d,  5) \
+  MB_MD5_STEP(MB_MD5_G, d, a, b, c, 10, 0x02441453,  9) \
+  MB_MD5_STEP(MB_MD5_G, c, d, a, b, 15, 0xd8a1e681, 14) \
+  MB_MD5_STEP(MB_MD5_G, b, c, d, a,  4, 0xe7d3fbc8, 20) \
+  MB_MD5_STEP(MB_MD5_G, a, b, c, d,  9, 0x21e1cde6,  5) \
+  MB_MD5_STEP(MB_MD5_G, d, a, b, c, 14, 0xc33707d6,  9) \
+  MB_MD5_STEP(MB_MD5_G, c, d, a, b,  3, 0xf4d50d87, 14) \
+  MB_MD5_STEP(MB_MD5_G, b, c, d, a,  8, 0x455a14ed, 20) \
+  MB_MD5_STEP(MB_MD5_G, a, b, c, d, 13, 0xa9e3e905,  5) \
+  MB_MD5_STEP(MB_MD5_G, d, a, b, c,  2, 0xfcefa3f8,  9) \
+  MB_MD5_STEP(MB_MD5_G, c, d, a, b,  7, 0x676f02d9, 14) \
+  MB_MD5_STEP(MB_MD5_G, b, c, d, a, 12, 0x8d2a4c8a, 20) \
+  MB_MD5_STEP(MB_MD5_H, a, b, c, d,  5, 0xfffa3942,  4) \
+  MB_MD5_STEP(MB_MD5_H, d, a, b, c,  8, 0x8771f681, 11) \
+  MB_MD5_STEP(MB_MD5_H, c, d, a, b, 11, 0x6d9d6122, 16) \
+  MB_MD5_STEP(MB_MD5_H, b, c, d, a, 14, 0xfde5380c, 23) \
+  MB_MD5_STEP(MB_MD5_H, a, b, c, d,  1, 0xa4beea44,  4) \
+  MB_MD5_STEP(MB_MD5_H, d, a, b, c,  4, 0x4bdecfa9, 11) \
+  MB_MD5_STEP(MB_MD5_H, c, d, a, b,  7, 0xf6bb4b60, 16) \
+  MB_MD5_STEP(MB_MD5_H, b, c, d, a, 10, 0xbebfbc70, 23) \
+  MB_MD5_STEP(MB_MD5_H, a, b, c, d, 13, 0x289b7ec6,  4) \
+  MB_MD5_STEP(MB_MD5_H, d, a, b, c,  0, 0xeaa127fa, 11) \
+  MB_MD5_STEP(MB_MD5_H, c, d, a, b,  3, 0xd4ef3085, 16) \
+  MB_MD5_STEP(MB_MD5_H, b, c, d, a,  6, 0x04881d05, 23) \
+  MB_MD5_STEP(MB_MD5_H, a, b, c, d,  9, 0xd9d4d039,  4) \
+  MB_MD5_STEP(MB_MD5_H, d, a, b, c, 12, 0xe6db99e5, 11) \
+  MB_MD5_STEP(MB_MD5_H, c, d, a, b, 15, 0x1fa27cf8, 16) \
+  MB_MD5_STEP(MB_MD5_H, b, c, d, a,  2, 0xc4ac5665, 23) \
+  MB_MD5_STEP(MB_MD5_I, a, b, c, d,  0, 0xf4292244,  6) \
+  MB_MD5_STEP(MB_MD5_I, d, a, b, c,  7, 0x432aff97, 10) \
+  MB_MD5_STEP(MB_MD5_I, c, d, a, b, 14, 0xab9423a7, 15) \
+  MB_MD5_STEP(MB_MD5_I, b, c, d, a,  5, 0xfc93a039, 21) \
+  MB_MD5_STEP(MB_MD5_I, a, b, c, d, 12, 0x655b59c3,  6) \
+  MB_MD5_STEP(MB_MD5_I, d, a, b, c,  3, 0x8f0ccc92, 10) \
+  MB_MD5_STEP(MB_MD5_I, c, d, a, b, 10, 0xffeff47d, 15) \
+  MB_MD5_STEP(MB_MD5_I, b, c, d, a,  1, 0x85845dd1, 21) \
+  MB_MD5_STEP(MB_MD5_I, a, b, c, d,  8, 0x6fa87e4f,  6) \
+  MB_MD5_STEP(MB_MD5_I, d, a, b, c, 15, 0xfe2ce6e0, 10) \
+  MB_MD5_STEP(MB_MD5_I, c, d, a, b,  6, 0xa3014314, 15) \
+  MB_MD5_STEP(MB_MD5_I, b, c, d, a, 13, 0x4e0811a1, 21) \
+  MB_MD5_STEP(MB_MD5_I, a, b, c, d,  4, 0xf7537e82,  6) \
+  MB_MD5_STEP(MB_MD5_I, d, a, b, c, 11, 0xbd3af235, 10) \
+  MB_MD5_STEP(MB_MD5_I, c, d, a, b,  2, 0x2ad7d2bb, 15) \
+  MB_MD5_STEP(MB_MD5_I, b, c, d, a,  9, 0xeb86d391, 21)
+
+/* Defines the load, MD4 and MD5 functions of a kernel, with the given vector
+ * type (of nlanes 32-bit words) and function attributes.  Since the step
+ * macros only use the plain C operators, the scalar kernel is the same code,
+ * with one lane of uint32_t.
+ */
+#define MULTIBUF_DEFINE_KERNEL(name, vtype, nlanes, attrs) \
+  attrs static void name##_load(vtype *M, const unsigned char **chunks) { \
+    register unsigned int i, l; \
+    for (i = 0; i < 16; i++) { \
+      union { vtype v; uint32_t w[nlanes]; } u; \
+      for (l = 0; l < (nlanes); l++) { \
+        const unsigned char *ptr = chunks[l] + (i * 4); \
+        u.w[l] = ((uint32_t) ptr[0]) | ((uint32_t) ptr[1] << 8) | \
+          ((uint32_t) ptr[2] << 16) | ((uint32_t) ptr[3] << 24); \
+      } \
+      M[i] = u.v; \
+    } \
+  } \
+  attrs static void name##_md4(uint32_t *state, \
+      const unsigned char **chunks) { \
+    vtype M[16], a, b, c, d, a0, b0, c0, d0; \
+    name##_load(M, chunks); \
+    memcpy(&a0, state, sizeof(vtype)); \
+    memcpy(&b0, state + (nlanes), sizeof(vtype)); \
+    memcpy(&c0, state + (2 * (nlanes)), sizeof(vtype)); \
+    memcpy(&d0, state + (3 * (nlanes)), sizeof(vtype)); \
+    a = a0; b = b0; c = c0; d = d0; \
+    MB_MD4_ROUNDS \
+    a += a0; b += b0; c += c0; d += d0; \
+    memcpy(state, &a, sizeof(vtype)); \
+    memcpy(state + (nlanes), &b, sizeof(vtype)); \
+    memcpy(state + (2 * (nlanes)), &c, sizeof(vtype)); \
+    memcpy(state + (3 * (nlanes)), &d, sizeof(vtype)); \
+  } \
+  attrs static void name##_md5(uint32_t *state, \
+      const unsigned char **chunks) { \
+    vtype M[16], a, b, c, d, a0, b0, c0, d0; \
+    name##_load(M, chunks); \
+    memcpy(&a0, state, sizeof(vtype)); \
+    memcpy(&b0, state + (nlanes), sizeof(vtype)); \
+    memcpy(&c0, state + (2 * (nlanes)), sizeof(vtype)); \
+    memcpy(&d0, state + (3 * (nlanes)), sizeof(vtype)); \
+    a = a0; b = b0; c = c0; d = d0; \
+    MB_MD5_ROUNDS \
+    a += a0; b += b0; c += c0; d += d0; \
+    memcpy(state, &a, sizeof(vtype)); \
+    memcpy(state + (nlanes), &b, sizeof(vtype)); \
+    memcpy(state + (2 * (nlanes)), &c, sizeof(vtype)); \
+    memcpy(state + (3 * (nlanes)), &d, sizeof(vtype)); \
+  }
+
+MULTIBUF_DEFINE_KERNEL(multibuf_scalar, uint32_t, 1, )
+
+#ifdef RSYNC_MULTIBUF_X86
+typedef uint32_t multibuf_v4 __attribute__((vector_size(16)));
+typedef uint32_t multibuf_v8 __attribute__((vector_size(32)));
+typedef uint32_t multibuf_v16 __attribute__((vector_size(64)));
+
+MULTIBUF_DEFINE_KERNEL(multibuf_sse2, multibuf_v4, 4,
+  __attribute__((target("sse2"))))
+MULTIBUF_DEFINE_KERNEL(multibuf_avx2, multibuf_v8, 8,
+  __attribute__((target("avx2"))))
+MULTIBUF_DEFINE_KERNEL(multibuf_avx512, multibuf_v16, 16,
+  __attribute__((target("avx512f"))))
+#endif /* RSYNC_MULTIBUF_X86 */
+
+struct multibuf_kernel {
+  const char *name;
+  const char *cpu_feature;
+  unsigned int lanes;
+  multibuf_fn md4;
+  multibuf_fn md5;
+};
+
+/* Widest first; the scalar kernel must be last. */
+static const struct multibuf_kernel multibuf_kernels[] = {
+#ifdef RSYNC_MULTIBUF_X86
+  { "avx512", "avx512f", 16, multibuf_avx512_md4, multibuf_avx512_md5 },
+  { "avx2",   "avx2",     8, multibuf_avx2_md4,   multibuf_avx2_md5 },
+  { "sse2",   "sse2",     4, multibuf_sse2_md4,   multibuf_sse2_md5 },
+#endif /* RSYNC_MULTIBUF_X86 */
+  { "scalar", NULL,       1, multibuf_scalar_md4, multibuf_scalar_md5 },
+
+  { NULL, NULL, 0, NULL, NULL }
+};
+
+static const struct multibuf_kernel *multibuf_kernel = NULL;
+
+static int kernel_supported(const struct multibuf_kernel *kernel) {
+  if (kernel->cpu_feature == NULL) {
+    return TRUE;
+  }
+
+#ifdef RSYNC_MULTIBUF_X86
+  __builtin_cpu_init();
+
+  /* Note that __builtin_cpu_supports() requires a string literal. */
+  if (strcmp(kernel->cpu_feature, "avx512f") == 0) {
+    return __builtin_cpu_supports("avx512f") ? TRUE : FALSE;
+  }
+
+  if (strcmp(kernel->cpu_feature, "avx2") == 0) {
+    return __builtin_cpu_supports("avx2") ? TRUE : FALSE;
+  }
+
+  if (strcmp(kernel->cpu_feature, "sse2") == 0) {
+    return __builtin_cpu_supports("sse2") ? TRUE : FALSE;
+  }
+#endif /* RSYNC_MULTIBUF_X86 */
+
+  return FALSE;
+}
+
+static void select_kernel(void) {
+  register unsigned int i;
+
+  for (i = 0; multibuf_kernels[i].name != NULL; i++) {
+    if (kernel_supported(&(multibuf_kernels[i])) == TRUE) {
+      multibuf_kernel = &(multibuf_kernels[i]);
+      break;
+    }
+  }
+
+  pr_trace_msg(trace_channel, 9, "using %s multi-buffer digest kernel",
+    multibuf_kernel->name);
+}
+
+int rsync_multibuf_set_kernel(const char *name) {
+  register unsigned int i;
+
+  if (name == NULL) {
+    multibuf_kernel = NULL;
+    return 0;
+  }
+
+  for (i = 0; multibuf_kernels[i].name != NULL; i++) {
+    if (strcmp(multibuf_kernels[i].name, name) == 0) {
+      if (kernel_supported(&(multibuf_kernels[i])) == FALSE) {
+        break;
+      }
+
+      multibuf_kernel = &(multibuf_kernels[i]);
+      return 0;
+    }
+  }
+
+  errno = ENOSYS;
+  return -1;
+}
+
+const char *rsync_multibuf_get_kernel(void) {
+  if (multibuf_kernel == NULL) {
+    select_kernel();
+  }
+
+  return multibuf_kernel->name;
+}
+
+/* Each block is hashed as the message: prefix + data + suffix. */
+struct multibuf_msg {
+  const unsigned char *prefix;
+  const unsigned char *suffix;
+  size_t prefix_len;
+  size_t suffix_len;
+  uint32_t datalen;
+
+  uint64_t total_len;
+  uint32_t nchunks;
+};
+
+static void init_msg(struct multibuf_msg *msg, const unsigned char *prefix,
+    const unsigned char *suffix, uint32_t datalen) {
+  msg->prefix = prefix;
+  msg->prefix_len = prefix != NULL ? 4 : 0;
+  msg->suffix = suffix;
+  msg->suffix_len = suffix != NULL ? 4 : 0;
+  msg->datalen = datalen;
+
+  msg->total_len = msg->prefix_len + datalen + msg->suffix_len;
+
+  /* Room for the 0x80 pad byte, and the 64-bit length. */
+  msg->nchunks = (uint32_t) (((msg->total_len + 8) / 64) + 1);
+}
+
+/* Returns the given 64-byte chunk of the padded message, pointing directly
+ * into the data where possible.
+ */
+static const unsigned char *get_chunk(const struct multibuf_msg *msg,
+    const unsigned char *data, uint32_t idx, unsigned char *scratch) {
+  register unsigned int i;
+  uint64_t start;
+
+  start = (uint64_t) idx * 64;
+
+  if (start >= msg->prefix_len &&
+      start + 64 <= msg->prefix_len + msg->datalen) {
+    return data + (start - msg->prefix_len);
+  }
+
+  for (i = 0; i < 64; i++) {
+    uint64_t pos;
+
+    pos = start + i;
+
+    if (pos < msg->prefix_len) {
+      scratch[i] = msg->prefix[pos];
+
+    } else if (pos < msg->prefix_len + msg->datalen) {
+      scratch[i] = data[pos - msg->prefix_len];
+
+    } else if (pos < msg->total_len) {
+      scratch[i] = msg->suffix[pos - msg->prefix_len - msg->datalen];
+
+    } else if (pos == msg->total_len) {
+      scratch[i] = 0x80;
+
+    } else {
+      scratch[i] = 0;
+    }
+  }
+
+  if (idx == msg->nchunks - 1) {
+    uint64_t bits;
+
+    bits = msg->total_len << 3;
+    for (i = 0; i < 8; i++) {
+      scratch[56 + i] = (unsigned char) (bits & 0xff);
+      bits >>= 8;
+    }
+  }
+
+  return scratch;
+}
+
+/* Hashes nlanes messages of the same length, one per lane. */
+static void digest_lanes(multibuf_fn fn, unsigned int nlanes,
+    const struct multibuf_msg *msg, const unsigned char **blocks,
+    unsigned char *digests) {
+  register unsigned int i, l;
+  uint32_t idx, state[4 * MULTIBUF_MAX_LANES];
+  unsigned char scratch[MULTIBUF_MAX_LANES][64];
+  const unsigned char *chunks[MULTIBUF_MAX_LANES];
+  static const uint32_t iv[4] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476
+  };
+
+  for (i = 0; i < 4; i++) {
+    for (l = 0; l < nlanes; l++) {
+      state[(i * nlanes) + l] = iv[i];
+    }
+  }
+
+  for (idx = 0; idx < msg->nchunks; idx++) {
+    for (l = 0; l < nlanes; l++) {
+      chunks[l] = get_chunk(msg, blocks[l], idx, scratch[l]);
+    }
+
+    fn(state, chunks);
+  }
+
+  for (l = 0; l < nlanes; l++) {
+    unsigned char *digest;
+
+    digest = digests + (l * RSYNC_MULTIBUF_DIGEST_LEN);
+    for (i = 0; i < 4; i++) {
+      uint32_t word;
+
+      word = state[(i * nlanes) + l];
+      digest[(i * 4) + 0] = (unsigned char) (word & 0xff);
+      digest[(i * 4) + 1] = (unsigned char) ((word >> 8) & 0xff);
+      digest[(i * 4) + 2] = (unsigned char) ((word >> 16) & 0xff);
+      digest[(i * 4) + 3] = (unsigned char) ((word >> 24) & 0xff);
+    }
+  }
+}
+
+int rsync_multibuf_digest(int algo, const unsigned char *data, size_t datalen,
+    uint32_t block_len, const unsigned char *prefix, const unsigned char *suffix,
+    unsigned char *digests) {
+  const struct multibuf_kernel *kernel;
+  const unsigned char *blocks[MULTIBUF_MAX_LANES];
+  struct multibuf_msg msg;
+  size_t nblocks, nfull, i = 0;
+
+  if ((data == NULL && datalen > 0) ||
+      block_len == 0 ||
+      digests == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (algo != RSYNC_CHECKSUM_ALGO_MD4 &&
+      algo != RSYNC_CHECKSUM_ALGO_MD5) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  if (multibuf_kernel == NULL) {
+    select_kernel();
+  }
+
+  nblocks = (datalen + block_len - 1) / block_len;
+  nfull = datalen / block_len;
+
+  init_msg(&msg, prefix, suffix, block_len);
+
+  /* Hash the full-size blocks as wide as possible, then use successively
+   * narrower kernels for the remainder.
+   */
+  for (kernel = multibuf_kernel; kernel->name != NULL; kernel++) {
+    if (kernel->lanes > 1 &&
+        kernel_supported(kernel) == FALSE) {
+      continue;
+    }
+
+    while (i + kernel->lanes <= nfull) {
+      register unsigned int l;
+
+      for (l = 0; l < kernel->lanes; l++) {
+        blocks[l] = data + ((i + l) * block_len);
+      }
+
+      digest_lanes(algo == RSYNC_CHECKSUM_ALGO_MD4 ? kernel->md4 : kernel->md5,
+        kernel->lanes, &msg, blocks, digests + (i * RSYNC_MULTIBUF_DIGEST_LEN));
+      i += kernel->lanes;
+    }
+  }
+
+  /* And finally the short block, if any. */
+  if (i < nblocks) {
+    init_msg(&msg, prefix, suffix, (uint32_t) (datalen - (i * block_len)));
+    blocks[0] = data + (i * block_len);
+
+    digest_lanes(algo == RSYNC_CHECKSUM_ALGO_MD4 ? multibuf_scalar_md4 :
+      multibuf_scalar_md5, 1, &msg, blocks,
+      digests + (i * RSYNC_MULTIBUF_DIGEST_LEN));
+  }
+
+  return (int) nblocks;
+}
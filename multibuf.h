@@ -0,0 +1,57 @@
+/*
+ * ProFTPD - mod_rsync multi-buffer digests
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_RSYNC_MULTIBUF_H
+#define MOD_RSYNC_MULTIBUF_H
+
+#include "mod_rsync.h"
+
+/* A file's signature needs the MD4/MD5 digests of many independent blocks of
+ * the same size.  Rather than hashing one block at a time, these kernels
+ * hash 4 (SSE2), 8 (AVX2) or 16 (AVX-512) blocks at once, one block per
+ * SIMD lane, using the widest kernel which the CPU supports.
+ */
+
+#define RSYNC_MULTIBUF_DIGEST_LEN	16
+
+/* Computes the MD4 or MD5 digest (per the RSYNC_CHECKSUM_ALGO_ values) of
+ * each consecutive block of block_len bytes in the given data; the last
+ * block may be short.  Each block is hashed with the given 4-byte prefix
+ * and/or suffix (e.g. the checksum seed), either of which may be NULL.
+ *
+ * The digests array must have room for RSYNC_MULTIBUF_DIGEST_LEN bytes per
+ * block.  Returns the number of blocks hashed.
+ */
+int rsync_multibuf_digest(int algo, const unsigned char *data, size_t datalen,
+  uint32_t block_len, const unsigned char *prefix, const unsigned char *suffix,
+  unsigned char *digests);
+
+/* Select the kernel ("scalar", "sse2", "avx2", "avx512") explicitly, e.g. for
+ * testing; a NULL name restores runtime selection.  Returns -1, with errno
+ * set to ENOSYS, if the kernel is not supported on this CPU.
+ */
+int rsync_multibuf_set_kernel(const char *name);
+const char *rsync_multibuf_get_kernel(void);
+
+#endif /* MOD_RSYNC_MULTIBUF_H */
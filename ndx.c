@@ -0,0 +1,186 @@
+/*
+ * ProFTPD - mod_rsync file list indices
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+#include "mod_rsync.h"
+#include "ndx.h"
+#include "msg.h"
+
+void rsync_ndx_init(struct rsync_ndx_state *state) {
+  if (state == NULL) {
+    return;
+  }
+
+  state->prev_positive = -1;
+  state->prev_negative = 1;
+}
+
+uint32_t rsync_ndx_write(struct rsync_session *sess,
+    struct rsync_ndx_state *state, unsigned char **buf, uint32_t *buflen,
+    int32_t ndx) {
+  unsigned char b[RSYNC_NDX_MAX_LEN];
+  uint32_t len = 0;
+  int32_t diff;
+
+  if (sess == NULL ||
+      state == NULL ||
+      buf == NULL ||
+      buflen == NULL) {
+    return 0;
+  }
+
+  if (sess->protocol_version < 30) {
+    return rsync_msg_write_int(buf, buflen, ndx);
+  }
+
+  /* RSYNC_NDX_DONE is a single zero byte, with no effect on the state.  Other
+   * negative indices are sent as positive, after a 0xff byte.
+   */
+  if (ndx >= 0) {
+    diff = ndx - state->prev_positive;
+    state->prev_positive = ndx;
+
+  } else if (ndx == RSYNC_NDX_DONE) {
+    return rsync_msg_write_byte(buf, buflen, 0);
+
+  } else {
+    b[len++] = 0xff;
+    ndx = -ndx;
+    diff = ndx - state->prev_negative;
+    state->prev_negative = ndx;
+  }
+
+  /* A difference of 1-253 is sent as a single byte; one of 254-32767, or 0,
+   * as 0xfe and two bytes; anything else as 0xfe and the whole index, with
+   * the high bit of its first byte set.
+   */
+  if (diff > 0 &&
+      diff < 0xfe) {
+    b[len++] = (unsigned char) diff;
+
+  } else if (diff < 0 ||
+             diff > 0x7fff) {
+    b[len++] = 0xfe;
+    b[len++] = (unsigned char) ((ndx >> 24) | 0x80);
+    b[len++] = (unsigned char) ndx;
+    b[len++] = (unsigned char) (ndx >> 8);
+    b[len++] = (unsigned char) (ndx >> 16);
+
+  } else {
+    b[len++] = 0xfe;
+    b[len++] = (unsigned char) (diff >> 8);
+    b[len++] = (unsigned char) diff;
+  }
+
+  return rsync_msg_write_data(buf, buflen, b, len);
+}
+
+int rsync_ndx_read(struct rsync_session *sess, struct rsync_ndx_state *state,
+    unsigned char **buf, uint32_t *buflen, int32_t *ndx) {
+  const unsigned char *b;
+  int32_t *prev, val;
+  uint32_t len = 1;
+
+  if (sess == NULL ||
+      state == NULL ||
+      buf == NULL ||
+      buflen == NULL ||
+      ndx == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (sess->protocol_version < 30) {
+    if (*buflen < sizeof(int32_t)) {
+      errno = EAGAIN;
+      return -1;
+    }
+
+    *ndx = rsync_msg_read_int(NULL, buf, buflen);
+    return 0;
+  }
+
+  if (*buflen < len) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  b = *buf;
+
+  if (b[0] == 0) {
+    (*buf)++;
+    (*buflen)--;
+
+    *ndx = RSYNC_NDX_DONE;
+    return 0;
+  }
+
+  prev = &(state->prev_positive);
+  if (b[0] == 0xff) {
+    prev = &(state->prev_negative);
+    b++;
+    len++;
+  }
+
+  /* Make sure we have all of it before consuming any of it. */
+  if (*buflen < len) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (b[0] == 0xfe) {
+    len += 2;
+    if (*buflen >= len &&
+        (b[1] & 0x80)) {
+      len += 2;
+    }
+
+    if (*buflen < len) {
+      errno = EAGAIN;
+      return -1;
+    }
+
+    if (b[1] & 0x80) {
+      val = (int32_t) (((uint32_t) (b[1] & ~0x80) << 24) |
+        (uint32_t) b[2] | ((uint32_t) b[3] << 8) | ((uint32_t) b[4] << 16));
+
+    } else {
+      val = (int32_t) (((uint32_t) b[1] << 8) | b[2]) + *prev;
+    }
+
+  } else {
+    val = (int32_t) b[0] + *prev;
+  }
+
+  (*buf) += len;
+  (*buflen) -= len;
+
+  *prev = val;
+  if (prev == &(state->prev_negative)) {
+    val = -val;
+  }
+
+  *ndx = val;
+  return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * ProFTPD - mod_rsync file list indices
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+#ifndef MOD_RSYNC_NDX_H
+#define MOD_RSYNC_NDX_H
+
+#include "mod_rsync.h"
+#include "session.h"
+
+/* Each file transferred is identified by its index ("NDX") in the file list.
+ * Prior to protocol 30, an index is sent as a plain int.  From protocol 30,
+ * per rsync-${version}/io.c#write_ndx(), it is sent as the difference from
+ * the previous index sent in the same direction: usually a single byte, when
+ * walking the file list in order.  Each direction thus needs its own state,
+ * for positive and negative indices.
+ */
+
+/* Special (negative) indices, per rsync-${version}/rsync.h. */
+#define RSYNC_NDX_DONE			-1
+#define RSYNC_NDX_FLIST_EOF		-2
+#define RSYNC_NDX_DEL_STATS		-3
+#define RSYNC_NDX_FLIST_OFFSET		-101
+
+/* From protocol 29, each index is followed by the item's flags (a short),
+ * per rsync-${version}/rsync.h.
+ */
+#define RSYNC_ITEM_REPORT_ATIME		0x0001
+#define RSYNC_ITEM_REPORT_CHANGE	0x0002
+#define RSYNC_ITEM_REPORT_SIZE		0x0004
+#define RSYNC_ITEM_REPORT_TIME		0x0008
+#define RSYNC_ITEM_REPORT_PERMS		0x0010
+#define RSYNC_ITEM_REPORT_OWNER		0x0020
+#define RSYNC_ITEM_REPORT_GROUP		0x0040
+#define RSYNC_ITEM_REPORT_ACL		0x0080
+#define RSYNC_ITEM_REPORT_XATTR		0x0100
+#define RSYNC_ITEM_REPORT_CRTIME	0x0400
+#define RSYNC_ITEM_BASIS_TYPE_FOLLOWS	0x0800
+#define RSYNC_ITEM_XNAME_FOLLOWS	0x1000
+#define RSYNC_ITEM_IS_NEW		0x2000
+#define RSYNC_ITEM_LOCAL_CHANGE		0x4000
+#define RSYNC_ITEM_TRANSFER		0x8000
+
+/* With RSYNC_ITEM_BASIS_TYPE_FOLLOWS, a byte saying which file the basis is;
+ * the fuzzy basis's name then follows (RSYNC_ITEM_XNAME_FOLLOWS).
+ */
+#define RSYNC_FNAMECMP_FUZZY		0x83
+
+/* Longest encoding of an index. */
+#define RSYNC_NDX_MAX_LEN		6
+
+struct rsync_ndx_state {
+  int32_t prev_positive;
+  int32_t prev_negative;
+};
+
+void rsync_ndx_init(struct rsync_ndx_state *state);
+
+/* Writes the given index; the buffer must have room for RSYNC_NDX_MAX_LEN
+ * bytes.  Returns the number of bytes written.
+ */
+uint32_t rsync_ndx_write(struct rsync_session *sess,
+  struct rsync_ndx_state *state, unsigned char **buf, uint32_t *buflen,
+  int32_t ndx);
+
+/* Reads an index.  Returns -1, with errno set to EAGAIN, if the buffer does
+ * not hold all of it; nothing is consumed (nor the state changed) then.
+ */
+int rsync_ndx_read(struct rsync_session *sess, struct rsync_ndx_state *state,
+  unsigned char **buf, uint32_t *buflen, int32_t *ndx);
+
+#endif /* MOD_RSYNC_NDX_H */
@@ -0,0 +1,381 @@
+/* 
+ * ProFTPD - mod_rsync algorithm negotiation
+ * Copyright (c) 2016 TJ Saunders
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA.
+ * 
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_rsync.h"
+#include "negotiate.h"
+#include "checksum.h"
+#include "compress.h"
+#include "options.h"
+#include "version.h"
+#include "msg.h"
+#include "disconnect.h"
+
+static const char *trace_channel = "rsync.negotiate";
+
+static int use_negotiation(struct rsync_session *sess) {
+  if (sess->compat_flags & RSYNC_VERSION_COMPAT_FL_VARINT_FLIST_FLAGS) {
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* The client may have explicitly chosen an algorithm, e.g. via
+ * "--checksum-choice=xxh64" or "--compress-choice=zstd", in which case there
+ * is no negotiation.  Note that a checksum choice may contain two algorithms,
+ * separated by a comma; the first is for the transfer checksums.
+ */
+static const char *get_explicit_choice(pool *p, const char *choice) {
+  char *ptr;
+
+  if (choice == NULL ||
+      strcasecmp(choice, "auto") == 0) {
+    return NULL;
+  }
+
+  ptr = strchr(choice, ',');
+  if (ptr != NULL) {
+    return pstrndup(p, choice, ptr - choice);
+  }
+
+  return choice;
+}
+
+const char *rsync_negotiate_choose(pool *p, const char *client_list,
+    const char *server_list) {
+  char *list, *name;
+
+  if (p == NULL ||
+      client_list == NULL ||
+      server_list == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  /* As the server, we stop at the first acceptable client choice; the client
+   * will arrive at the same choice by picking, from our list, the name which
+   * ranks highest in its own list.
+   */
+  list = pstrdup(p, client_list);
+  while ((name = strsep(&list, " ")) != NULL) {
+    char *ours, *our_name;
+
+    pr_signals_handle();
+
+    if (*name == '\0') {
+      continue;
+    }
+
+    ours = pstrdup(p, server_list);
+    while ((our_name = strsep(&ours, " ")) != NULL) {
+      if (strcasecmp(name, our_name) == 0) {
+        return name;
+      }
+    }
+  }
+
+  errno = ENOENT;
+  return NULL;
+}
+
+/* Compression algorithms are only negotiated if the client asked for
+ * compression, without naming an algorithm.
+ */
+static int use_compress_negotiation(pool *p, struct rsync_options *opts) {
+  if (opts->use_compression &&
+      get_explicit_choice(p, opts->compress_choice) == NULL) {
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+int rsync_negotiate_send(pool *p, struct rsync_session *sess) {
+  struct rsync_options *opts;
+  unsigned char *buf, *ptr;
+  uint32_t buflen, bufsz;
+  const char *checksums = NULL, *compressions = NULL;
+
+  if (use_negotiation(sess) == FALSE) {
+    return 0;
+  }
+
+  opts = sess->options;
+
+  /* If the client has explicitly chosen an algorithm, it will not be sending
+   * its list, so neither do we.
+   */
+  if (get_explicit_choice(p, opts->checksum_choice) == NULL) {
+    checksums = rsync_checksum_get_preferred(p);
+    if (checksums == NULL) {
+      errno = ENOENT;
+      return -1;
+    }
+  }
+
+  if (use_compress_negotiation(p, opts) == TRUE) {
+    compressions = rsync_compress_get_preferred(p);
+    if (compressions == NULL) {
+      errno = ENOENT;
+      return -1;
+    }
+  }
+
+  if (checksums == NULL &&
+      compressions == NULL) {
+    return 0;
+  }
+
+  bufsz = buflen = (checksums ? strlen(checksums) + 2 : 0) +
+    (compressions ? strlen(compressions) + 2 : 0);
+  ptr = buf = palloc(p, bufsz);
+
+  if (checksums != NULL) {
+    rsync_msg_write_vstring(&buf, &buflen, checksums);
+  }
+
+  if (compressions != NULL) {
+    rsync_msg_write_vstring(&buf, &buflen, compressions);
+  }
+
+  if ((rsync_write_data)(p, sess->channel_id, ptr, (bufsz - buflen)) < 0) {
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "error sending algorithm lists: %s", strerror(errno));
+    errno = EIO;
+    return -1;
+  }
+
+  if (checksums != NULL) {
+    pr_trace_msg(trace_channel, 9, "sent checksum algorithms '%s'",
+      checksums);
+  }
+
+  if (compressions != NULL) {
+    pr_trace_msg(trace_channel, 9, "sent compression algorithms '%s'",
+      compressions);
+  }
+
+  return 0;
+}
+
+static int set_checksum_algo(struct rsync_session *sess, const char *name) {
+  int algo;
+
+  algo = rsync_checksum_get_algo(name);
+  if (algo < 0 ||
+      rsync_checksum_supported(algo) == FALSE) {
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "unsupported checksum algorithm '%s' requested", name);
+    errno = EPERM;
+    return -1;
+  }
+
+  sess->checksum_algo = algo;
+  pr_trace_msg(trace_channel, 9, "using '%s' checksum algorithm",
+    rsync_checksum_get_name(algo));
+  return 0;
+}
+
+static int set_compress_algo(struct rsync_session *sess, const char *name) {
+  struct rsync_options *opts;
+  struct rsync_compress *comp;
+  int algo, level;
+
+  opts = sess->options;
+
+  algo = rsync_compress_get_algo(name);
+  if (algo < 0 ||
+      rsync_compress_supported(algo) == FALSE) {
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "unsupported compression algorithm '%s' requested", name);
+    errno = EPERM;
+    return -1;
+  }
+
+  sess->compress_algo = algo;
+
+  if (algo == RSYNC_COMPRESS_ALGO_NONE) {
+    opts->use_compression = FALSE;
+    pr_trace_msg(trace_channel, 9, "using no compression");
+    return 0;
+  }
+
+  level = rsync_compress_get_level(algo, opts->compression_level);
+  if (level < 0) {
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "invalid %s compression level %d requested", name,
+      opts->compression_level);
+    errno = EPERM;
+    return -1;
+  }
+
+  /* The compression stream lives for the entire session; it is reused for
+   * every file.
+   */
+  comp = rsync_compress_create(sess->pool, algo, level);
+  if (comp == NULL) {
+    return -1;
+  }
+
+  sess->compressor = comp;
+  pr_trace_msg(trace_channel, 9, "using '%s' compression (level %d)",
+    rsync_compress_get_name(algo), level);
+
+  /* Files matching the client's --skip-compress list, or our default list,
+   * are not worth compressing.
+   */
+  if (rsync_compress_set_skip_suffixes(sess->pool,
+      opts->skip_compression) < 0) {
+    pr_trace_msg(trace_channel, 3, "error using --skip-compress list: %s",
+      strerror(errno));
+  }
+
+  return 0;
+}
+
+static int handle_checksums(pool *p, struct rsync_session *sess,
+    unsigned char **data, uint32_t *datalen) {
+  struct rsync_options *opts;
+  const char *choice;
+
+  opts = sess->options;
+
+  choice = get_explicit_choice(p, opts->checksum_choice);
+  if (choice != NULL) {
+    if (set_checksum_algo(sess, choice) < 0) {
+      RSYNC_DISCONNECT("unsupported --checksum-choice algorithm");
+      return -1;
+    }
+
+  } else if (use_negotiation(sess) == TRUE) {
+    const char *client_list, *server_list;
+
+    client_list = rsync_msg_read_vstring(p, data, datalen);
+    if (client_list == NULL) {
+      return -1;
+    }
+
+    pr_trace_msg(trace_channel, 9, "client sent checksum algorithms '%s'",
+      client_list);
+
+    server_list = rsync_checksum_get_preferred(p);
+    choice = rsync_negotiate_choose(p, client_list, server_list);
+    if (choice == NULL) {
+      (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+        "no common checksum algorithm: client sent '%s', server offered '%s'",
+        client_list, server_list);
+      RSYNC_DISCONNECT("failed to negotiate checksum algorithm");
+      errno = EPERM;
+      return -1;
+    }
+
+    if (set_checksum_algo(sess, choice) < 0) {
+      return -1;
+    }
+
+  } else if (sess->protocol_version < 30) {
+    /* Prior to protocol version 30, use MD4. */
+    sess->checksum_algo = RSYNC_CHECKSUM_ALGO_MD4;
+
+  } else {
+    /* Protocol version 30 and later, use MD5. */
+    sess->checksum_algo = RSYNC_CHECKSUM_ALGO_MD5;
+  }
+
+  return 0;
+}
+
+static int handle_compressions(pool *p, struct rsync_session *sess,
+    unsigned char **data, uint32_t *datalen) {
+  struct rsync_options *opts;
+  const char *choice;
+
+  opts = sess->options;
+
+  if (!opts->use_compression) {
+    sess->compress_algo = RSYNC_COMPRESS_ALGO_NONE;
+    return 0;
+  }
+
+  choice = get_explicit_choice(p, opts->compress_choice);
+  if (choice != NULL) {
+    if (set_compress_algo(sess, choice) < 0) {
+      RSYNC_DISCONNECT("unsupported --compress-choice algorithm");
+      return -1;
+    }
+
+  } else if (use_negotiation(sess) == TRUE) {
+    const char *client_list, *server_list;
+
+    client_list = rsync_msg_read_vstring(p, data, datalen);
+    if (client_list == NULL) {
+      return -1;
+    }
+
+    pr_trace_msg(trace_channel, 9, "client sent compression algorithms '%s'",
+      client_list);
+
+    server_list = rsync_compress_get_preferred(p);
+    choice = rsync_negotiate_choose(p, client_list, server_list);
+    if (choice == NULL) {
+      (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+        "no common compression algorithm: client sent '%s', server "
+        "offered '%s'", client_list, server_list);
+      RSYNC_DISCONNECT("failed to negotiate compression algorithm");
+      errno = EPERM;
+      return -1;
+    }
+
+    if (set_compress_algo(sess, choice) < 0) {
+      RSYNC_DISCONNECT("failed to set up compression");
+      return -1;
+    }
+
+  } else {
+    /* Clients which do not negotiate use the original zlib token format. */
+    if (set_compress_algo(sess, "zlib") < 0) {
+      RSYNC_DISCONNECT("failed to set up compression");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int rsync_negotiate_handle_data(pool *p, struct rsync_session *sess,
+    unsigned char **data, uint32_t *datalen) {
+
+  /* The client sends its lists in the same order that we do: checksums,
+   * then compression.
+   */
+  if (handle_checksums(p, sess, data, datalen) < 0) {
+    return -1;
+  }
+
+  if (handle_compressions(p, sess, data, datalen) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * ProFTPD - mod_rsync algorithm negotiation
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_RSYNC_NEGOTIATE_H
+#define MOD_RSYNC_NEGOTIATE_H
+
+#include "mod_rsync.h"
+#include "session.h"
+
+/* Protocol 31 clients which advertise the 'v' capability exchange lists
+ * of supported checksum and (if compression was requested) compression
+ * algorithms with the server; see
+ * rsync-${version}/compat.c#negotiate_the_strings().
+ *
+ * Both peers send their lists before reading the other's, so we send ours
+ * as soon as the compatibility flags are sent, and read the client's lists
+ * when they arrive.
+ */
+int rsync_negotiate_send(pool *p, struct rsync_session *sess);
+int rsync_negotiate_handle_data(pool *p, struct rsync_session *sess,
+  unsigned char **data, uint32_t *datalen);
+
+/* Returns the first name in the client's list which also appears in the
+ * server's list, or NULL (with errno set to ENOENT) if there is no such name.
+ */
+const char *rsync_negotiate_choose(pool *p, const char *client_list,
+  const char *server_list);
+
+#endif /* MOD_RSYNC_NEGOTIATE_H */
@@ -54,6 +54,8 @@ enum {
   OPT_MAX_SIZE,
   OPT_NO_D,
   OPT_APPEND,
+  OPT_OLD_COMPRESS,
+  OPT_NEW_COMPRESS,
   OPT_REFUSED_BASE = 9000
 };
 
@@ -216,6 +218,10 @@ static struct poptOption long_options[] = {
   { "no-compress",      0,  POPT_ARG_VAL,    &default_options.use_compression, 0, NULL, NULL },
   { "skip-compress",    0,  POPT_ARG_STRING, &default_options.skip_compression, 0, NULL, NULL },
   { "compress-level",   0,  POPT_ARG_INT,    &default_options.compression_level, 'z', NULL, NULL },
+  { "compress-choice",  0,  POPT_ARG_STRING, &default_options.compress_choice, 'z', NULL, NULL },
+  { "zc",               0,  POPT_ARG_STRING, &default_options.compress_choice, 'z', NULL, NULL },
+  { "old-compress",     0,  POPT_ARG_NONE,   NULL, OPT_OLD_COMPRESS, NULL, NULL },
+  { "new-compress",     0,  POPT_ARG_NONE,   NULL, OPT_NEW_COMPRESS, NULL, NULL },
   { NULL,              'P', POPT_ARG_NONE,   NULL, 'P', NULL, NULL },
   { "partial",          0,  POPT_ARG_VAL,    &default_options.keep_partial, 1, NULL, NULL },
   { "no-partial",       0,  POPT_ARG_VAL,    &default_options.keep_partial, 0, NULL, NULL },
@@ -253,6 +259,13 @@ static struct poptOption long_options[] = {
   { "no-8-bit-output",  0,  POPT_ARG_VAL,    &default_options.escape_chars, 0, NULL, NULL },
   { "qsort",            0,  POPT_ARG_NONE,   &default_options.use_qsort, 0, NULL, NULL },
   { "checksum-seed",    0,  POPT_ARG_INT,    &default_options.checksum_seed, 0, NULL, NULL },
+  { "checksum-choice",  0,  POPT_ARG_STRING, &default_options.checksum_choice, 0, NULL, NULL },
+  { "cc",               0,  POPT_ARG_STRING, &default_options.checksum_choice, 0, NULL, NULL },
+
+  /* Newer rsync clients (re)use the -e option, when sent to the server, for
+   * conveying their capabilities, e.g. "-e.LsfxCIvu".
+   */
+  { "rsh",             'e', POPT_ARG_STRING, &default_options.client_info, 0, NULL, NULL },
   { "server",           0,  POPT_ARG_NONE,   &use_server, OPT_SERVER, NULL, NULL },
   { "sender",           0,  POPT_ARG_NONE,   &default_options.sender, OPT_SENDER, NULL, NULL },
 
@@ -424,11 +437,14 @@ static void dump_options(struct rsync_options *opts) {
       opts->use_compression ? "true" : "false");
 
     pr_trace_msg(trace_channel, 15, "opts.skip_compression = %s",
-      opts->skip_compression ? "true" : "false");
+      opts->skip_compression ? opts->skip_compression : "(default)");
 
     pr_trace_msg(trace_channel, 15, "opts.compression_level = %d",
       opts->compression_level);
 
+    pr_trace_msg(trace_channel, 15, "opts.compress_choice = %s",
+      opts->compress_choice ? opts->compress_choice : "(none)");
+
     pr_trace_msg(trace_channel, 15, "opts.keep_partial = %s",
       opts->keep_partial ? "true" : "false");
 
@@ -479,6 +495,12 @@ static void dump_options(struct rsync_options *opts) {
 
     pr_trace_msg(trace_channel, 15, "opts.checksum_seed = %lu",
       (unsigned long) opts->checksum_seed);
+
+    pr_trace_msg(trace_channel, 15, "opts.checksum_choice = %s",
+      opts->checksum_choice ? opts->checksum_choice : "(none)");
+
+    pr_trace_msg(trace_channel, 15, "opts.client_info = %s",
+      opts->client_info ? opts->client_info : "(none)");
   }
 }
 
@@ -618,24 +640,26 @@ int rsync_options_handle_data(pool *p, array_header *req,
         break;
 
       case 'z':
-        /* Yes, this looks weird.  But Z_DEFAULT_COMPRESSION is defined as
-         * -1 in zlib.h, so of course any explicitly requested compression
-         * level less than -1 will be invalid.
+        /* The valid range of compression levels depends on the compression
+         * algorithm, which may not be known until later; see
+         * rsync_compress_get_level().
          */
-        if (default_options.compression_level < Z_DEFAULT_COMPRESSION ||
-            default_options.compression_level > Z_BEST_COMPRESSION) {
-          pr_trace_msg(trace_channel, 2,
-            "invalid --compress-level value %d requested",
-            default_options.compression_level);
-          return -1;
-        }
-
         if (default_options.compression_level != Z_NO_COMPRESSION) {
           default_options.use_compression = 1;
         }
 
         break;
 
+      case OPT_OLD_COMPRESS:
+        default_options.compress_choice = "zlib";
+        default_options.use_compression = 1;
+        break;
+
+      case OPT_NEW_COMPRESS:
+        default_options.compress_choice = "zlibx";
+        default_options.use_compression = 1;
+        break;
+
       case OPT_MAX_SIZE:
 (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION, "--max-size option has been used!");
         break;
@@ -727,6 +751,17 @@ int rsync_options_handle_data(pool *p, array_header *req,
     default_options.keep_dirlinks = FALSE;
   }
 
+  /* Appending updates the existing file in place, per rsync. */
+  if (default_options.append_mode > 0) {
+    if (default_options.whole_file > 0) {
+      RSYNC_DISCONNECT("--append cannot be used with --whole-file");
+      errno = EINVAL;
+      return -1;
+    }
+
+    default_options.inplace = TRUE;
+  }
+
   sess->options = pcalloc(sess->pool, sizeof(struct rsync_options));
   memcpy(sess->options, &default_options, sizeof(struct rsync_options));
 
@@ -83,8 +83,9 @@ struct rsync_options {
   int whole_file;
   int fuzzy_basis;
   int use_compression;
-  int skip_compression;
+  char *skip_compression;
   int compression_level;
+  char *compress_choice;
   int keep_partial;
   char *partial_dir;
   int delay_updates;
@@ -102,7 +103,11 @@ struct rsync_options {
   int use_qsort;
   int sender;
   int32_t checksum_seed;
+  char *checksum_choice;
   char *iconv_opt;
+
+  /* Capabilities sent by the client via the "-e.xxx" option. */
+  char *client_info;
 };
 
 int rsync_options_handle_data(pool *p, array_header *req,
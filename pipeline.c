@@ -0,0 +1,546 @@
+/*
+ * ProFTPD - mod_rsync transfer pipeline
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+#include "mod_rsync.h"
+#include "pipeline.h"
+#include "ndx.h"
+#include "msg.h"
+#include "generator.h"
+#include "sumtable.h"
+#include "policy.h"
+#include "options.h"
+#include "fuzzy.h"
+
+static const char *trace_channel = "rsync.pipeline";
+
+struct pipeline_slot {
+  struct rsync_pipeline_file file;
+  int used;
+
+  /* Whether the basis file was opened (i.e. found by --fuzzy) by us. */
+  int own_basis;
+};
+
+struct rsync_pipeline {
+  pool *pool;
+  struct rsync_session *sess;
+
+  /* Indices are delta-encoded separately in each direction. */
+  struct rsync_ndx_state send_ndx;
+  struct rsync_ndx_state recv_ndx;
+
+  /* The requested files not yet received; the sender usually replies in
+   * order, but need not.
+   */
+  struct pipeline_slot *slots;
+  unsigned int window;
+  unsigned int pending;
+
+  /* The file currently being received, if any. */
+  struct pipeline_slot *current;
+  struct rsync_receiver *recv;
+  struct rsync_receiver_stats stats;
+
+  /* With --fuzzy, the index of the directories of new files. */
+  struct rsync_fuzzy *fuzzy;
+};
+
+struct rsync_pipeline *rsync_pipeline_create(pool *p,
+    struct rsync_session *sess, unsigned int window) {
+  struct rsync_pipeline *pipeline;
+  pool *sub_pool;
+
+  if (p == NULL ||
+      sess == NULL ||
+      window == 0 ||
+      window > RSYNC_PIPELINE_MAX_WINDOW) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  sub_pool = make_sub_pool(p);
+  pr_pool_tag(sub_pool, "rsync pipeline pool");
+
+  pipeline = pcalloc(sub_pool, sizeof(struct rsync_pipeline));
+  pipeline->pool = sub_pool;
+  pipeline->sess = sess;
+  pipeline->window = window;
+  pipeline->slots = pcalloc(sub_pool, window * sizeof(struct pipeline_slot));
+
+  rsync_ndx_init(&(pipeline->send_ndx));
+  rsync_ndx_init(&(pipeline->recv_ndx));
+
+  return pipeline;
+}
+
+static void add_stats(struct rsync_receiver_stats *stats,
+    const struct rsync_receiver_stats *file_stats) {
+  stats->literal_bytes += file_stats->literal_bytes;
+  stats->matched_bytes += file_stats->matched_bytes;
+  stats->literal_runs += file_stats->literal_runs;
+  stats->sum_bytes += file_stats->sum_bytes;
+  stats->cloned_bytes += file_stats->cloned_bytes;
+  stats->copied_bytes += file_stats->copied_bytes;
+  stats->unchanged_bytes += file_stats->unchanged_bytes;
+  stats->sparse_bytes += file_stats->sparse_bytes;
+}
+
+/* Writes the file's index and item flags; and, for a fuzzy basis, the basis
+ * type and name.
+ */
+static int write_request(struct rsync_pipeline *pipeline, int32_t ndx,
+    uint16_t iflags, const char *xname) {
+  unsigned char data[RSYNC_NDX_MAX_LEN + sizeof(uint16_t) + 3 +
+    RSYNC_FUZZY_MAX_NAME_LEN], *buf;
+  uint32_t buflen;
+
+  buf = data;
+  buflen = sizeof(data);
+
+  rsync_ndx_write(pipeline->sess, &(pipeline->send_ndx), &buf, &buflen, ndx);
+  if (ndx >= 0 &&
+      pipeline->sess->protocol_version >= 29) {
+    rsync_msg_write_short(&buf, &buflen, (int16_t) iflags);
+
+    if (iflags & RSYNC_ITEM_BASIS_TYPE_FOLLOWS) {
+      rsync_msg_write_byte(&buf, &buflen, (char) RSYNC_FNAMECMP_FUZZY);
+    }
+
+    if (iflags & RSYNC_ITEM_XNAME_FOLLOWS) {
+      rsync_msg_write_vstring(&buf, &buflen, xname);
+    }
+  }
+
+  if ((rsync_write_data)(pipeline->pool, pipeline->sess->channel_id, data,
+      sizeof(data) - buflen) < 0) {
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "error sending file request: %s", strerror(errno));
+    errno = EIO;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Requests the file, against the given basis file, if any; xname is the
+ * name of a fuzzy basis.
+ */
+static struct pipeline_slot *send_file(struct rsync_pipeline *pipeline,
+    int32_t ndx, const char *path, int fd, int basis_fd, const char *xname,
+    int flags) {
+  register unsigned int i;
+  struct pipeline_slot *slot = NULL;
+  pool *tmp_pool;
+  uint16_t iflags;
+  int res, xerrno;
+
+  for (i = 0; i < pipeline->window; i++) {
+    if (pipeline->slots[i].used == FALSE) {
+      slot = &(pipeline->slots[i]);
+      break;
+    }
+  }
+
+  iflags = RSYNC_ITEM_TRANSFER;
+  if (xname != NULL) {
+    iflags |= RSYNC_ITEM_BASIS_TYPE_FOLLOWS|RSYNC_ITEM_XNAME_FOLLOWS;
+
+  } else if (basis_fd < 0) {
+    iflags |= RSYNC_ITEM_IS_NEW;
+  }
+
+  if (write_request(pipeline, ndx, iflags, xname) < 0) {
+    return NULL;
+  }
+
+  tmp_pool = make_sub_pool(pipeline->pool);
+  res = rsync_generator_send_file_sums(tmp_pool, pipeline->sess, basis_fd,
+    path, flags);
+  xerrno = errno;
+  destroy_pool(tmp_pool);
+
+  if (res < 0) {
+    errno = xerrno;
+    return NULL;
+  }
+
+  slot->file.ndx = ndx;
+  slot->file.path = path;
+  slot->file.fd = fd;
+  slot->file.basis_fd = basis_fd;
+  slot->file.result = -1;
+  slot->file.block_len = 0;
+  slot->used = TRUE;
+  slot->own_basis = FALSE;
+  pipeline->pending++;
+
+  pr_trace_msg(trace_channel, 19, "requested file %ld ('%s'%s%s), %u pending",
+    (long) ndx, path, xname != NULL ? ", fuzzy basis " : "",
+    xname != NULL ? xname : "", pipeline->pending);
+  return slot;
+}
+
+int rsync_pipeline_send_file(struct rsync_pipeline *pipeline, int32_t ndx,
+    const char *path, int fd, int basis_fd, int flags) {
+
+  if (pipeline == NULL ||
+      ndx < 0 ||
+      path == NULL ||
+      fd < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (pipeline->pending == pipeline->window) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (send_file(pipeline, ndx, path, fd, basis_fd, NULL, flags) == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int rsync_pipeline_send_new_file(struct rsync_pipeline *pipeline,
+    int32_t ndx, const char *path, int fd, off_t size, time_t mtime,
+    int flags) {
+  struct rsync_options *opts;
+  struct pipeline_slot *slot;
+  const char *basis_path, *xname;
+  pool *tmp_pool;
+  int basis_fd, xerrno;
+
+  if (pipeline == NULL ||
+      ndx < 0 ||
+      path == NULL ||
+      fd < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (pipeline->pending == pipeline->window) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  opts = pipeline->sess->options;
+  if (opts == NULL ||
+      opts->fuzzy_basis == FALSE) {
+    return send_file(pipeline, ndx, path, fd, -1, NULL, flags) != NULL ?
+      0 : -1;
+  }
+
+  if (pipeline->fuzzy == NULL) {
+    pipeline->fuzzy = rsync_fuzzy_create(pipeline->pool);
+    if (pipeline->fuzzy == NULL) {
+      return -1;
+    }
+  }
+
+  tmp_pool = make_sub_pool(pipeline->pool);
+
+  basis_fd = -1;
+  basis_path = rsync_fuzzy_find(tmp_pool, pipeline->fuzzy, path, size,
+    mtime);
+  if (basis_path != NULL) {
+    basis_fd = open(basis_path, O_RDONLY|O_NOFOLLOW);
+    if (basis_fd < 0) {
+      pr_trace_msg(trace_channel, 9, "unable to open fuzzy basis '%s': %s",
+        basis_path, strerror(errno));
+    }
+  }
+
+  if (basis_fd < 0) {
+    destroy_pool(tmp_pool);
+    return send_file(pipeline, ndx, path, fd, -1, NULL, flags) != NULL ?
+      0 : -1;
+  }
+
+  xname = strrchr(basis_path, '/');
+  xname = xname != NULL ? xname + 1 : basis_path;
+
+  slot = send_file(pipeline, ndx, path, fd, basis_fd, xname, flags);
+  xerrno = errno;
+  destroy_pool(tmp_pool);
+
+  if (slot == NULL) {
+    (void) close(basis_fd);
+    errno = xerrno;
+    return -1;
+  }
+
+  slot->own_basis = TRUE;
+  return 0;
+}
+
+int rsync_pipeline_send_done(struct rsync_pipeline *pipeline) {
+  if (pipeline == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return write_request(pipeline, RSYNC_NDX_DONE, 0, NULL);
+}
+
+unsigned int rsync_pipeline_get_pending(struct rsync_pipeline *pipeline) {
+  if (pipeline == NULL) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  return pipeline->pending;
+}
+
+static struct pipeline_slot *find_slot(struct rsync_pipeline *pipeline,
+    int32_t ndx) {
+  register unsigned int i;
+
+  for (i = 0; i < pipeline->window; i++) {
+    if (pipeline->slots[i].used == TRUE &&
+        pipeline->slots[i].file.ndx == ndx) {
+      return &(pipeline->slots[i]);
+    }
+  }
+
+  return NULL;
+}
+
+/* Reads the header which the sender sends before each file's data, per
+ * rsync-${version}/sender.c: its index and item flags (and maybe more), and
+ * the sum header, which echoes ours.  Nothing is consumed until all of the
+ * header has arrived.
+ */
+static int recv_header(struct rsync_pipeline *pipeline, unsigned char **buf,
+    uint32_t *buflen, int32_t *ndx, uint16_t *iflags,
+    struct rsync_sum_head *head) {
+  struct rsync_session *sess;
+  struct rsync_ndx_state state;
+  unsigned char *ptr;
+  uint32_t len;
+
+  sess = pipeline->sess;
+  ptr = *buf;
+  len = *buflen;
+  memcpy(&state, &(pipeline->recv_ndx), sizeof(state));
+
+  if (rsync_ndx_read(sess, &state, &ptr, &len, ndx) < 0) {
+    return -1;
+  }
+
+  *iflags = RSYNC_ITEM_TRANSFER;
+
+  if (*ndx >= 0 &&
+      sess->protocol_version >= 29) {
+    if (len < sizeof(uint16_t)) {
+      errno = EAGAIN;
+      return -1;
+    }
+
+    *iflags = (uint16_t) rsync_msg_read_short(pipeline->pool, &ptr, &len);
+
+    if (*iflags & RSYNC_ITEM_BASIS_TYPE_FOLLOWS) {
+      if (len < 1) {
+        errno = EAGAIN;
+        return -1;
+      }
+
+      (void) rsync_msg_read_byte(pipeline->pool, &ptr, &len);
+    }
+
+    if (*iflags & RSYNC_ITEM_XNAME_FOLLOWS) {
+      uint32_t xlen;
+
+      if (len < 1 ||
+          ((ptr[0] & 0x80) && len < 2)) {
+        errno = EAGAIN;
+        return -1;
+      }
+
+      xlen = (ptr[0] & 0x80) ? 2 + (((ptr[0] & ~0x80) << 8) | ptr[1]) :
+        1 + ptr[0];
+      if (len < xlen) {
+        errno = EAGAIN;
+        return -1;
+      }
+
+      ptr += xlen;
+      len -= xlen;
+    }
+  }
+
+  if (*ndx >= 0 &&
+      (*iflags & RSYNC_ITEM_TRANSFER)) {
+    if (rsync_sumtable_read_head(pipeline->pool, sess, &ptr, &len,
+        head) < 0) {
+      return -1;
+    }
+  }
+
+  memcpy(&(pipeline->recv_ndx), &state, sizeof(state));
+  *buf = ptr;
+  *buflen = len;
+  return 0;
+}
+
+int rsync_pipeline_recv(struct rsync_pipeline *pipeline, unsigned char **buf,
+    uint32_t *buflen, struct rsync_pipeline_file *file) {
+  struct pipeline_slot *slot;
+  int res;
+
+  if (pipeline == NULL ||
+      buf == NULL ||
+      buflen == NULL ||
+      file == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  while (pipeline->recv == NULL) {
+    struct rsync_sum_head head;
+    int32_t ndx;
+    uint16_t iflags;
+
+    if (recv_header(pipeline, buf, buflen, &ndx, &iflags, &head) < 0) {
+      return -1;
+    }
+
+    if (ndx == RSYNC_NDX_DONE) {
+      pr_trace_msg(trace_channel, 17, "sender done, %u files pending",
+        pipeline->pending);
+      return RSYNC_PIPELINE_RECV_DONE;
+    }
+
+    slot = NULL;
+    if (ndx >= 0) {
+      slot = find_slot(pipeline, ndx);
+    }
+
+    if (slot == NULL) {
+      (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+        "received data for unrequested file index %ld", (long) ndx);
+      errno = EINVAL;
+      return -1;
+    }
+
+    /* The sender may only be reporting on the file, e.g. for
+     * --itemize-changes; the file remains pending.
+     */
+    if (!(iflags & RSYNC_ITEM_TRANSFER)) {
+      continue;
+    }
+
+    pipeline->recv = rsync_receiver_open(pipeline->pool, pipeline->sess,
+      slot->file.path, slot->file.fd, slot->file.basis_fd, &head);
+    if (pipeline->recv == NULL) {
+      return -1;
+    }
+
+    pipeline->current = slot;
+    slot->file.block_len = head.count > 0 ? head.block_len : 0;
+  }
+
+  res = rsync_receiver_recv(pipeline->recv, buf, buflen);
+  if (res < 0) {
+    return -1;
+  }
+
+  slot = pipeline->current;
+
+  memset(&(slot->file.stats), 0, sizeof(struct rsync_receiver_stats));
+  (void) rsync_receiver_close(pipeline->recv, &(slot->file.stats));
+  pipeline->recv = NULL;
+  pipeline->current = NULL;
+
+  add_stats(&(pipeline->stats), &(slot->file.stats));
+
+  /* How well the file matched its basis informs the block length chosen
+   * for it (and its like) next time, and whether to ask for its delta at
+   * all.
+   */
+  if (res == RSYNC_RECEIVER_RECV_OK &&
+      slot->file.block_len > 0) {
+    struct rsync_policy_stats policy_stats;
+
+    memset(&policy_stats, 0, sizeof(policy_stats));
+    policy_stats.total_bytes = slot->file.stats.literal_bytes +
+      slot->file.stats.matched_bytes;
+    policy_stats.matched_bytes = slot->file.stats.matched_bytes;
+    policy_stats.literal_runs = slot->file.stats.literal_runs;
+    policy_stats.block_len = slot->file.block_len;
+    (void) rsync_policy_record(slot->file.path, &policy_stats);
+  }
+
+  memcpy(file, &(slot->file), sizeof(struct rsync_pipeline_file));
+  file->result = res;
+
+  if (slot->own_basis) {
+    (void) close(slot->file.basis_fd);
+    file->basis_fd = -1;
+    slot->own_basis = FALSE;
+  }
+
+  slot->used = FALSE;
+  pipeline->pending--;
+
+  pr_trace_msg(trace_channel, 19, "received file %ld ('%s'): %s, block "
+    "length %ld, %" PR_LU " literal bytes, %" PR_LU " matched bytes, "
+    "%u pending", (long) file->ndx, file->path,
+    res == RSYNC_RECEIVER_RECV_OK ? "OK" : "failed", (long) file->block_len,
+    (pr_off_t) file->stats.literal_bytes, (pr_off_t) file->stats.matched_bytes,
+    pipeline->pending);
+  return RSYNC_PIPELINE_RECV_FILE;
+}
+
+int rsync_pipeline_destroy(struct rsync_pipeline *pipeline,
+    struct rsync_receiver_stats *stats) {
+  register unsigned int i;
+
+  if (pipeline == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (pipeline->recv != NULL) {
+    (void) rsync_receiver_close(pipeline->recv, &(pipeline->stats));
+    pipeline->recv = NULL;
+  }
+
+  for (i = 0; i < pipeline->window; i++) {
+    if (pipeline->slots[i].used == TRUE &&
+        pipeline->slots[i].own_basis == TRUE) {
+      (void) close(pipeline->slots[i].file.basis_fd);
+      pipeline->slots[i].own_basis = FALSE;
+    }
+  }
+
+  if (stats != NULL) {
+    add_stats(stats, &(pipeline->stats));
+  }
+
+  destroy_pool(pipeline->pool);
+  return 0;
+}
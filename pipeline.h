@@ -0,0 +1,121 @@
+/*
+ * ProFTPD - mod_rsync transfer pipeline
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+#ifndef MOD_RSYNC_PIPELINE_H
+#define MOD_RSYNC_PIPELINE_H
+
+#include "mod_rsync.h"
+#include "session.h"
+#include "receiver.h"
+
+/* When receiving files, rsync overlaps its generator and receiver roles: the
+ * generator asks the sender for file N+k (sending its index, and the block
+ * sums of our basis file), while the receiver is still rebuilding file N
+ * from the sender's reply.  Asking for one file at a time instead would cost
+ * a round trip per file, which, for many small files, leaves the link idle
+ * most of the time.
+ *
+ * The pipeline keeps up to a window of requested files outstanding.  The
+ * caller walks the file list, sending a request for each file needing
+ * transfer, until the window is full; then feeds the sender's data to the
+ * pipeline, which rebuilds each file in turn (see receiver.h), and returns
+ * it once complete, making room for the next request.
+ */
+
+#define RSYNC_PIPELINE_DEFAULT_WINDOW		64
+#define RSYNC_PIPELINE_MAX_WINDOW		4096
+
+/* Return values for rsync_pipeline_recv(). */
+#define RSYNC_PIPELINE_RECV_FILE		0
+#define RSYNC_PIPELINE_RECV_DONE		1
+
+struct rsync_pipeline;
+
+struct rsync_pipeline_file {
+  int32_t ndx;
+  const char *path;
+
+  /* The file being written, and the basis file (-1 if none; or, once
+   * received, if it was a fuzzy basis, which the pipeline has closed).
+   */
+  int fd;
+  int basis_fd;
+
+  /* Once received: RSYNC_RECEIVER_RECV_OK, or RSYNC_RECEIVER_RECV_FAILED if
+   * the file must be requested again.
+   */
+  int result;
+
+  /* Once received: the block length of the sums sent (0 if none were), and
+   * the counts for this file; its match ratio is matched_bytes over
+   * literal_bytes plus matched_bytes.
+   */
+  int32_t block_len;
+  struct rsync_receiver_stats stats;
+};
+
+struct rsync_pipeline *rsync_pipeline_create(pool *p,
+  struct rsync_session *sess, unsigned int window);
+
+/* Requests the file with the given index, sending the block sums of the
+ * given basis file (see rsync_generator_send_sums() for the flags).  The
+ * path, and descriptors, must remain valid until the file is returned by
+ * rsync_pipeline_recv().  Returns -1, with errno set to EAGAIN, if the window
+ * is full.
+ */
+int rsync_pipeline_send_file(struct rsync_pipeline *pipeline, int32_t ndx,
+  const char *path, int fd, int basis_fd, int flags);
+
+/* As rsync_pipeline_send_file(), for a file which we do not have, given the
+ * size and modification time of the sender's file.  With --fuzzy, the most
+ * similar file in the same directory, if any, is the basis (see fuzzy.h);
+ * the pipeline opens, and closes, that file.
+ */
+int rsync_pipeline_send_new_file(struct rsync_pipeline *pipeline,
+  int32_t ndx, const char *path, int fd, off_t size, time_t mtime, int flags);
+
+/* Tells the sender that there are no more files to request (in this phase),
+ * per rsync-${version}/generator.c.
+ */
+int rsync_pipeline_send_done(struct rsync_pipeline *pipeline);
+
+/* Returns the number of requested files not yet received. */
+unsigned int rsync_pipeline_get_pending(struct rsync_pipeline *pipeline);
+
+/* Consumes the sender's data in the given buffer.  Returns
+ * RSYNC_PIPELINE_RECV_FILE once a file has been received, filling in the
+ * given file; or RSYNC_PIPELINE_RECV_DONE when the sender has finished the
+ * phase.  Returns -1, with errno set to EAGAIN, if more data is needed.
+ */
+int rsync_pipeline_recv(struct rsync_pipeline *pipeline, unsigned char **buf,
+  uint32_t *buflen, struct rsync_pipeline_file *file);
+
+/* Releases the pipeline's resources; the counts for the files received are
+ * added to the given stats, if any.  The file descriptors are not closed.
+ */
+int rsync_pipeline_destroy(struct rsync_pipeline *pipeline,
+  struct rsync_receiver_stats *stats);
+
+#endif /* MOD_RSYNC_PIPELINE_H */
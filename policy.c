@@ -0,0 +1,478 @@
+/*
+ * ProFTPD - mod_rsync transfer policy store
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_rsync.h"
+#include "policy.h"
+
+static const char *trace_channel = "rsync.policy";
+
+#define RSYNC_POLICY_MAGIC		0x4c4f5052
+#define RSYNC_POLICY_VERSION		1
+
+/* A path, directory or extension is looked for in this many slots. */
+#define POLICY_MAX_PROBES		8
+
+/* The entry was recorded during this session, and is to be saved. */
+#define POLICY_ENTRY_FL_DIRTY		0x001
+
+/* The store file is this header, followed by the whole table of entries.
+ * It is only read by the host which wrote it, so host byte order is used.
+ */
+struct policy_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t count;
+  uint32_t entry_len;
+};
+
+/* The counts of the files transferred so far; older transfers count for
+ * less, being halved with each new one.
+ */
+struct policy_entry {
+  uint64_t key;
+  uint64_t total_bytes;
+  uint64_t matched_bytes;
+  uint64_t literal_runs;
+  uint64_t raw_bytes;
+  uint64_t compressed_bytes;
+  int32_t block_len;
+  uint32_t flags;
+};
+
+static struct policy_entry history[RSYNC_POLICY_HISTORY_SIZE];
+
+static int policy_fd = -1;
+
+/* Picks the files probed in this session. */
+static uint64_t policy_probe_salt = 0;
+
+/* FNV-1a, of the key type, then the name. */
+static uint64_t get_key(char type, const char *name, size_t namelen) {
+  uint64_t h = 14695981039346656037ULL;
+  register size_t i;
+
+  h = (h ^ (unsigned char) type) * 1099511628211ULL;
+  for (i = 0; i < namelen; i++) {
+    h = (h ^ (unsigned char) name[i]) * 1099511628211ULL;
+  }
+
+  /* Zero marks an unused entry. */
+  return h != 0 ? h : 1;
+}
+
+/* Returns the entry for the key; if there is none, and create is TRUE, an
+ * empty entry, replacing the first of those probed if need be.
+ */
+static struct policy_entry *get_entry(struct policy_entry *table,
+    uint64_t key, int create) {
+  register unsigned int i;
+  struct policy_entry *empty = NULL;
+
+  for (i = 0; i < POLICY_MAX_PROBES; i++) {
+    struct policy_entry *e;
+
+    e = &(table[(key + i) % RSYNC_POLICY_HISTORY_SIZE]);
+    if (e->key == key) {
+      return e;
+    }
+
+    if (e->key == 0 &&
+        empty == NULL) {
+      empty = e;
+    }
+  }
+
+  if (!create) {
+    return NULL;
+  }
+
+  if (empty == NULL) {
+    empty = &(table[key % RSYNC_POLICY_HISTORY_SIZE]);
+  }
+
+  memset(empty, 0, sizeof(struct policy_entry));
+  empty->key = key;
+  return empty;
+}
+
+/* Fills in the entries for the path, its parent directory, and its
+ * extension (names which start with a dot, e.g. ".profile", have none), most
+ * specific first; returns how many there are.
+ */
+static unsigned int get_entries(const char *path, struct policy_entry **entries,
+    int create) {
+  const char *name, *ext;
+  struct policy_entry *e;
+  unsigned int count = 0;
+
+  e = get_entry(history, get_key('p', path, strlen(path)), create);
+  if (e != NULL) {
+    entries[count++] = e;
+  }
+
+  name = strrchr(path, '/');
+  if (name != NULL) {
+    e = get_entry(history, get_key('d', path, name - path), create);
+    if (e != NULL) {
+      entries[count++] = e;
+    }
+
+    name++;
+
+  } else {
+    name = path;
+  }
+
+  ext = strrchr(name, '.');
+  if (ext != NULL &&
+      ext != name &&
+      ext[1] != '\0') {
+    ext++;
+
+    e = get_entry(history, get_key('e', ext, strlen(ext)), create);
+    if (e != NULL) {
+      entries[count++] = e;
+    }
+  }
+
+  return count;
+}
+
+static void update_entry(struct policy_entry *e,
+    const struct rsync_policy_stats *stats) {
+  if (stats->total_bytes > 0) {
+    e->total_bytes = (e->total_bytes / 2) + stats->total_bytes;
+    e->matched_bytes = (e->matched_bytes / 2) + stats->matched_bytes;
+    e->literal_runs = (e->literal_runs / 2) + stats->literal_runs;
+  }
+
+  if (stats->raw_bytes > 0) {
+    e->raw_bytes = (e->raw_bytes / 2) + stats->raw_bytes;
+    e->compressed_bytes = (e->compressed_bytes / 2) +
+      stats->compressed_bytes;
+  }
+
+  if (stats->block_len > 0) {
+    e->block_len = stats->block_len;
+  }
+
+  e->flags |= POLICY_ENTRY_FL_DIRTY;
+}
+
+/* Reads the table from the store file; a new (empty) or unusable file
+ * yields an empty table.
+ */
+static void read_table(int fd, struct policy_entry *table) {
+  struct policy_header hdr;
+  size_t len;
+  ssize_t res;
+  register unsigned int i;
+
+  len = sizeof(struct policy_entry) * RSYNC_POLICY_HISTORY_SIZE;
+  memset(table, 0, len);
+
+  res = pread(fd, &hdr, sizeof(hdr), 0);
+  if (res == 0) {
+    return;
+  }
+
+  if (res != (ssize_t) sizeof(hdr) ||
+      hdr.magic != RSYNC_POLICY_MAGIC ||
+      hdr.version != RSYNC_POLICY_VERSION ||
+      hdr.count != RSYNC_POLICY_HISTORY_SIZE ||
+      hdr.entry_len != sizeof(struct policy_entry)) {
+    pr_trace_msg(trace_channel, 3, "ignoring unusable policy store");
+    return;
+  }
+
+  res = pread(fd, table, len, sizeof(hdr));
+  if (res != (ssize_t) len) {
+    pr_trace_msg(trace_channel, 3, "ignoring truncated policy store");
+    memset(table, 0, len);
+    return;
+  }
+
+  for (i = 0; i < RSYNC_POLICY_HISTORY_SIZE; i++) {
+    table[i].flags = 0;
+  }
+}
+
+static int write_table(int fd, const struct policy_entry *table) {
+  struct policy_header hdr;
+  size_t len;
+
+  hdr.magic = RSYNC_POLICY_MAGIC;
+  hdr.version = RSYNC_POLICY_VERSION;
+  hdr.count = RSYNC_POLICY_HISTORY_SIZE;
+  hdr.entry_len = sizeof(struct policy_entry);
+
+  len = sizeof(struct policy_entry) * RSYNC_POLICY_HISTORY_SIZE;
+
+  if (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr) ||
+      pwrite(fd, table, len, sizeof(hdr)) != (ssize_t) len) {
+    if (errno == 0) {
+      errno = EIO;
+    }
+
+    return -1;
+  }
+
+  return 0;
+}
+
+static int lock_store(int fd, short type) {
+  struct flock lock;
+
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+
+  while (fcntl(fd, F_SETLKW, &lock) < 0) {
+    if (errno != EINTR) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int rsync_policy_open(const char *path) {
+  int fd, xerrno;
+
+  if (path == NULL ||
+      *path != '/') {
+    errno = EINVAL;
+    return -1;
+  }
+
+  fd = open(path, O_RDWR|O_CREAT|O_NOFOLLOW, 0600);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (lock_store(fd, F_RDLCK) < 0) {
+    xerrno = errno;
+
+    (void) close(fd);
+    errno = xerrno;
+    return -1;
+  }
+
+  read_table(fd, history);
+  (void) lock_store(fd, F_UNLCK);
+
+  if (policy_fd >= 0) {
+    (void) close(policy_fd);
+  }
+
+  policy_fd = fd;
+  policy_probe_salt = ((uint64_t) time(NULL) * 31) + (uint64_t) getpid();
+
+  pr_trace_msg(trace_channel, 9, "loaded policy store '%s'", path);
+  return 0;
+}
+
+int rsync_policy_close(pool *p) {
+  pool *tmp_pool;
+  struct policy_entry *saved;
+  register unsigned int i;
+  int res, xerrno;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (policy_fd < 0) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (lock_store(policy_fd, F_WRLCK) < 0) {
+    xerrno = errno;
+
+    (void) close(policy_fd);
+    policy_fd = -1;
+    errno = xerrno;
+    return -1;
+  }
+
+  tmp_pool = make_sub_pool(p);
+  pr_pool_tag(tmp_pool, "rsync policy store pool");
+
+  saved = palloc(tmp_pool,
+    sizeof(struct policy_entry) * RSYNC_POLICY_HISTORY_SIZE);
+  read_table(policy_fd, saved);
+
+  for (i = 0; i < RSYNC_POLICY_HISTORY_SIZE; i++) {
+    struct policy_entry *e;
+
+    if (!(history[i].flags & POLICY_ENTRY_FL_DIRTY)) {
+      continue;
+    }
+
+    e = get_entry(saved, history[i].key, TRUE);
+    memcpy(e, &(history[i]), sizeof(struct policy_entry));
+    e->flags = 0;
+
+    history[i].flags &= ~POLICY_ENTRY_FL_DIRTY;
+  }
+
+  errno = 0;
+  res = write_table(policy_fd, saved);
+  xerrno = errno;
+
+  destroy_pool(tmp_pool);
+  (void) close(policy_fd);
+  policy_fd = -1;
+
+  errno = xerrno;
+  return res;
+}
+
+int rsync_policy_get(const char *path, struct rsync_policy_stats *stats) {
+  struct policy_entry *entries[3];
+  unsigned int count;
+  register unsigned int i;
+
+  if (path == NULL ||
+      stats == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(stats, 0, sizeof(struct rsync_policy_stats));
+
+  count = get_entries(path, entries, FALSE);
+  for (i = 0; i < count; i++) {
+    struct policy_entry *e;
+
+    e = entries[i];
+
+    if (stats->total_bytes == 0 &&
+        e->total_bytes > 0) {
+      stats->total_bytes = e->total_bytes;
+      stats->matched_bytes = e->matched_bytes;
+      stats->literal_runs = e->literal_runs;
+    }
+
+    if (stats->raw_bytes == 0 &&
+        e->raw_bytes > 0) {
+      stats->raw_bytes = e->raw_bytes;
+      stats->compressed_bytes = e->compressed_bytes;
+    }
+
+    if (stats->block_len == 0 &&
+        e->block_len > 0) {
+      stats->block_len = e->block_len;
+    }
+  }
+
+  if (stats->total_bytes == 0 &&
+      stats->raw_bytes == 0 &&
+      stats->block_len == 0) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  return 0;
+}
+
+int rsync_policy_get_flags(const char *path) {
+  struct rsync_policy_stats stats;
+  int flags = 0;
+
+  if (path == NULL ||
+      policy_fd < 0) {
+    return 0;
+  }
+
+  /* Whether a file is probed depends only on its path (and the session), so
+   * that every decision for the file is probed together.
+   */
+  if ((get_key('p', path, strlen(path)) + policy_probe_salt) %
+      RSYNC_POLICY_PROBE_INTERVAL == 0) {
+    pr_trace_msg(trace_channel, 17, "ignoring history of '%s', as a probe",
+      path);
+    return 0;
+  }
+
+  if (rsync_policy_get(path, &stats) < 0) {
+    return 0;
+  }
+
+  if (stats.total_bytes > 0 &&
+      stats.matched_bytes * 100 <
+        stats.total_bytes * RSYNC_POLICY_MIN_MATCH_PCT) {
+    flags |= RSYNC_POLICY_FL_WHOLE_FILE;
+  }
+
+  if (stats.raw_bytes > 0 &&
+      stats.compressed_bytes * 100 >
+        stats.raw_bytes * RSYNC_POLICY_MAX_COMPRESS_PCT) {
+    flags |= RSYNC_POLICY_FL_NO_COMPRESS;
+  }
+
+  if (flags != 0) {
+    pr_trace_msg(trace_channel, 17,
+      "'%s' has matched %" PR_LU " of %" PR_LU " bytes, compressed %" PR_LU
+      " bytes to %" PR_LU ": sending it%s%s", path,
+      (pr_off_t) stats.matched_bytes, (pr_off_t) stats.total_bytes,
+      (pr_off_t) stats.raw_bytes, (pr_off_t) stats.compressed_bytes,
+      flags & RSYNC_POLICY_FL_WHOLE_FILE ? " whole" : "",
+      flags & RSYNC_POLICY_FL_NO_COMPRESS ? " uncompressed" : "");
+  }
+
+  return flags;
+}
+
+int rsync_policy_record(const char *path,
+    const struct rsync_policy_stats *stats) {
+  struct policy_entry *entries[3];
+  unsigned int count;
+  register unsigned int i;
+
+  if (path == NULL ||
+      stats == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (stats->total_bytes == 0 &&
+      stats->raw_bytes == 0 &&
+      stats->block_len <= 0) {
+    return 0;
+  }
+
+  count = get_entries(path, entries, TRUE);
+  for (i = 0; i < count; i++) {
+    update_entry(entries[i], stats);
+  }
+
+  return 0;
+}
+
+void rsync_policy_clear(void) {
+  memset(history, 0, sizeof(history));
+}
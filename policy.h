@@ -0,0 +1,111 @@
+/*
+ * ProFTPD - mod_rsync transfer policy store
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_RSYNC_POLICY_H
+#define MOD_RSYNC_POLICY_H
+
+#include "mod_rsync.h"
+
+/* The policy store remembers how the files transferred so far went, by
+ * path, by parent directory, and by extension: how much of each matched
+ * its basis file, in how many runs of literal data; how well its literal
+ * data compressed; and the block length its sums used.  A file with no
+ * history of its own takes that of its directory, then of its extension.
+ *
+ * The history is kept for the session, and may be kept across sessions in a
+ * store file (see rsync_policy_open()).  Given a store file, files which
+ * have not matched before are sent whole, and files which have not
+ * compressed are sent uncompressed; every so often these decisions are
+ * ignored, so that the history keeps up with files which change.
+ */
+
+/* The number of paths, directories and extensions remembered. */
+#define RSYNC_POLICY_HISTORY_SIZE		4096
+
+/* Files which matched less than this (in percent) are sent whole. */
+#define RSYNC_POLICY_MIN_MATCH_PCT		5
+
+/* Files whose literal data compressed to more than this (in percent) are
+ * sent uncompressed.
+ */
+#define RSYNC_POLICY_MAX_COMPRESS_PCT		95
+
+/* One in this many files, picked afresh for each session, has its flags
+ * ignored.
+ */
+#define RSYNC_POLICY_PROBE_INTERVAL		16
+
+/* How a file should be sent, per its history. */
+#define RSYNC_POLICY_FL_WHOLE_FILE		0x001
+#define RSYNC_POLICY_FL_NO_COMPRESS		0x002
+
+struct rsync_policy_stats {
+  /* The bytes of the file sent as a delta, how many of those matched, and
+   * in how many runs of literal data.
+   */
+  uint64_t total_bytes;
+  uint64_t matched_bytes;
+  uint64_t literal_runs;
+
+  /* The literal bytes compressed, and what they compressed to. */
+  uint64_t raw_bytes;
+  uint64_t compressed_bytes;
+
+  /* The block length of the basis file's sums. */
+  int32_t block_len;
+};
+
+/* Opens (creating if need be) the store file at the given path, and loads
+ * the history from it.  The file stays open for the session, so that it can
+ * be saved to after a chroot.
+ */
+int rsync_policy_open(const char *path);
+
+/* Saves the entries recorded during the session to the store file, and
+ * closes it.  Entries saved by other sessions meanwhile are kept, unless
+ * this session recorded the same path, directory or extension.
+ */
+int rsync_policy_close(pool *p);
+
+/* Looks up the history for the given path.  Each set of counts (delta,
+ * compression, block length) is taken from the most specific entry having
+ * them; returns -1, with errno set to ENOENT, if there are none at all.
+ */
+int rsync_policy_get(const char *path, struct rsync_policy_stats *stats);
+
+/* Returns the RSYNC_POLICY_FL_ flags for sending the given path; always 0
+ * without a store file, or if the path is probed in this session.
+ */
+int rsync_policy_get_flags(const char *path);
+
+/* Records how the transfer of the given file went.  Counts which are zero
+ * are not recorded; older counts are halved with each new record.
+ */
+int rsync_policy_record(const char *path,
+  const struct rsync_policy_stats *stats);
+
+/* Forgets all history (but not the store file). */
+void rsync_policy_clear(void);
+
+#endif /* MOD_RSYNC_POLICY_H */
@@ -0,0 +1,902 @@
+/*
+ * ProFTPD - mod_rsync receiver
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_rsync.h"
+#include "receiver.h"
+#include "options.h"
+#include "checksum.h"
+#include "token.h"
+#include "fmap.h"
+#include "workers.h"
+#include "fileio.h"
+
+#ifdef HAVE_LINUX_FS_H
+# include <sys/ioctl.h>
+# include <linux/fs.h>
+#endif /* HAVE_LINUX_FS_H */
+
+/* Copy at most this much per copy_file_range(2) call, so that we can handle
+ * signals in between.
+ */
+#define RECEIVER_COPY_MAX_LEN		(64 * 1024 * 1024)
+
+static const char *trace_channel = "rsync.receiver";
+
+struct rsync_receiver {
+  pool *pool;
+  struct rsync_session *sess;
+  const char *path;
+  int fd;
+
+  /* The basis file, if any. */
+  int basis_fd;
+  struct rsync_sum_head head;
+  struct rsync_fmap *map;
+
+  /* Cloned ranges must start (and, unless at the end of the source file,
+   * end) on a filesystem block boundary, in both files.
+   */
+  size_t clone_align;
+  int use_clone;
+  int use_copy;
+
+  /* Whether the basis file is the file being rebuilt; if so, matched blocks
+   * which overlap their destination are copied here before being written.
+   */
+  int inplace;
+  unsigned char *block;
+
+  /* Whether to leave holes rather than write zeroes (--sparse); if updating
+   * in place, holes must be punched.
+   */
+  int sparse;
+  size_t sparse_align;
+  int use_punch;
+
+  struct rsync_checksum *file_sum;
+  struct rsync_receiver_stats stats;
+
+  /* With worker threads, the file checksum is computed by a worker. */
+  struct rsync_workers_checksum *file_sum_offload;
+
+  /* The length of the file rebuilt so far. */
+  off_t offset;
+  int truncate;
+
+  /* Buffered literal data, to be written at the end of the file. */
+  unsigned char *buf;
+  size_t bufsz, buflen;
+
+  /* Whether the last data received was literal, for counting literal runs. */
+  int in_literal;
+
+  /* A run of consecutive matched blocks, yet to be copied to the end of the
+   * file.
+   */
+  off_t run_offset;
+  off_t run_len;
+
+  /* After the last token, our whole-file checksum, to be compared with the
+   * sender's.
+   */
+  int at_end;
+  unsigned char digest[RSYNC_CHECKSUM_MAX_DIGEST_LEN];
+  size_t digest_len;
+  unsigned char peer_digest[RSYNC_CHECKSUM_MAX_DIGEST_LEN];
+  size_t peer_digestlen;
+};
+
+/* Returns TRUE if the data is all zeroes.  Words are compared in groups,
+ * which the compiler can vectorize.
+ */
+static int is_zero(const unsigned char *data, size_t datalen) {
+  while (datalen >= 64) {
+    uint64_t words[8];
+
+    memcpy(words, data, sizeof(words));
+    if ((words[0] | words[1] | words[2] | words[3] |
+         words[4] | words[5] | words[6] | words[7]) != 0) {
+      return FALSE;
+    }
+
+    data += 64;
+    datalen -= 64;
+  }
+
+  while (datalen > 0) {
+    if (*data++ != 0) {
+      return FALSE;
+    }
+
+    datalen--;
+  }
+
+  return TRUE;
+}
+
+/* Makes a hole where the (zero) data would go; in a new file, there is
+ * nothing to do, as it is extended (by truncation) at the end.
+ */
+static int punch_hole(struct rsync_receiver *recv, const unsigned char *data,
+    size_t datalen, off_t offset) {
+
+  if (recv->inplace == FALSE) {
+    return 0;
+  }
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+  if (recv->use_punch == TRUE) {
+    if (fallocate(recv->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset,
+        datalen) == 0) {
+      return 0;
+    }
+
+    if (errno != EOPNOTSUPP &&
+        errno != ENOSYS) {
+      return -1;
+    }
+
+    pr_trace_msg(trace_channel, 9,
+      "unable to punch holes in '%s', writing zeroes instead: %s",
+      recv->path, strerror(errno));
+    recv->use_punch = FALSE;
+  }
+#endif /* HAVE_FALLOCATE and FALLOC_FL_PUNCH_HOLE */
+
+  return rsync_fileio_write(recv->fd, data, datalen, offset);
+}
+
+/* Writes the data to the file, leaving holes for any filesystem blocks'
+ * worth of zeroes, if wanted.
+ */
+static int write_file_data(struct rsync_receiver *recv,
+    const unsigned char *data, size_t datalen, off_t offset) {
+
+  if (recv->sparse == FALSE) {
+    return rsync_fileio_write(recv->fd, data, datalen, offset);
+  }
+
+  while (datalen > 0) {
+    size_t len = 0;
+    int zero = -1, res;
+
+    /* Find the run of aligned pieces which are all zero, or not. */
+    while (len < datalen) {
+      size_t piecelen;
+      int piece_zero;
+
+      piecelen = recv->sparse_align -
+        (size_t) ((offset + len) % recv->sparse_align);
+      if (piecelen > datalen - len) {
+        piecelen = datalen - len;
+      }
+
+      piece_zero = (piecelen == recv->sparse_align &&
+        is_zero(data + len, piecelen));
+      if (zero == -1) {
+        zero = piece_zero;
+
+      } else if (piece_zero != zero) {
+        break;
+      }
+
+      len += piecelen;
+    }
+
+    if (zero == TRUE) {
+      res = punch_hole(recv, data, len, offset);
+      recv->stats.sparse_bytes += len;
+
+    } else {
+      res = rsync_fileio_write(recv->fd, data, len, offset);
+    }
+
+    if (res < 0) {
+      return -1;
+    }
+
+    data += len;
+    datalen -= len;
+    offset += len;
+  }
+
+  return 0;
+}
+
+static int flush_literal(struct rsync_receiver *recv) {
+  off_t offset;
+
+  if (recv->buflen == 0) {
+    return 0;
+  }
+
+  offset = recv->offset - recv->buflen;
+  if (write_file_data(recv, recv->buf, recv->buflen, offset) < 0) {
+    int xerrno = errno;
+
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "error writing '%s': %s", recv->path, strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  recv->buflen = 0;
+  return 0;
+}
+
+/* Reads the data from the basis file, and writes it out ourselves. */
+static int copy_buffered(struct rsync_receiver *recv, off_t src, off_t dst,
+    off_t len) {
+
+  while (len > 0) {
+    const unsigned char *data;
+    size_t chunklen;
+
+    chunklen = RSYNC_RECEIVER_WINDOW_SIZE;
+    if ((off_t) chunklen > len) {
+      chunklen = (size_t) len;
+    }
+
+    data = rsync_fmap_ptr(recv->map, src, chunklen);
+    if (data == NULL ||
+        write_file_data(recv, data, chunklen, dst) < 0) {
+      return -1;
+    }
+
+    src += chunklen;
+    dst += chunklen;
+    len -= chunklen;
+  }
+
+  return 0;
+}
+
+/* Copies data from the basis file within the kernel, if possible, falling
+ * back to reading and writing it ourselves.
+ */
+static int copy_range(struct rsync_receiver *recv, off_t src, off_t dst,
+    off_t len) {
+#ifdef HAVE_COPY_FILE_RANGE
+  while (recv->use_copy == TRUE &&
+         len > 0) {
+    loff_t src_off, dst_off;
+    size_t chunklen;
+    ssize_t res;
+
+    chunklen = RECEIVER_COPY_MAX_LEN;
+    if ((off_t) chunklen > len) {
+      chunklen = (size_t) len;
+    }
+
+    src_off = src;
+    dst_off = dst;
+    res = copy_file_range(recv->basis_fd, &src_off, recv->fd, &dst_off,
+      chunklen, 0);
+    if (res < 0) {
+      int xerrno = errno;
+
+      if (xerrno == EINTR) {
+        pr_signals_handle();
+        continue;
+      }
+
+      if (xerrno != ENOSYS &&
+          xerrno != EXDEV &&
+          xerrno != EINVAL &&
+          xerrno != EOPNOTSUPP &&
+          xerrno != EBADF) {
+        (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+          "error copying basis data to '%s': %s", recv->path,
+          strerror(xerrno));
+
+        errno = xerrno;
+        return -1;
+      }
+
+      pr_trace_msg(trace_channel, 9,
+        "unable to copy_file_range() for '%s', using read/write: %s",
+        recv->path, strerror(xerrno));
+      recv->use_copy = FALSE;
+      break;
+    }
+
+    if (res == 0) {
+      /* The basis file shrank; read (i.e. zero-fill) the rest. */
+      break;
+    }
+
+    recv->stats.copied_bytes += res;
+    src += res;
+    dst += res;
+    len -= res;
+
+    pr_signals_handle();
+  }
+#endif /* HAVE_COPY_FILE_RANGE */
+
+  return copy_buffered(recv, src, dst, len);
+}
+
+#ifdef FICLONERANGE
+static int clone_range(struct rsync_receiver *recv, off_t src, off_t dst,
+    off_t len) {
+  struct file_clone_range fcr;
+
+  fcr.src_fd = recv->basis_fd;
+  fcr.src_offset = (uint64_t) src;
+  fcr.src_length = (uint64_t) len;
+  fcr.dest_offset = (uint64_t) dst;
+
+  if (ioctl(recv->fd, FICLONERANGE, &fcr) < 0) {
+    pr_trace_msg(trace_channel, 9,
+      "unable to clone basis data for '%s', copying instead: %s", recv->path,
+      strerror(errno));
+    recv->use_clone = FALSE;
+    return -1;
+  }
+
+  recv->stats.cloned_bytes += len;
+  return 0;
+}
+#endif /* FICLONERANGE */
+
+/* Writes the pending run of matched blocks to the end of the file. */
+static int flush_run(struct rsync_receiver *recv) {
+  off_t src, dst, len;
+
+  if (recv->run_len == 0) {
+    return 0;
+  }
+
+  src = recv->run_offset;
+  len = recv->run_len;
+  dst = recv->offset - len;
+  recv->run_len = 0;
+
+#ifdef FICLONERANGE
+  /* Clone whatever part of the run is block-aligned in both files, copying
+   * the unaligned ends.
+   */
+  if (recv->use_clone == TRUE &&
+      len >= RSYNC_RECEIVER_CLONE_MIN_SIZE &&
+      (src % recv->clone_align) == (dst % recv->clone_align)) {
+    off_t head_len, clone_len;
+
+    head_len = (recv->clone_align - (dst % recv->clone_align)) %
+      recv->clone_align;
+    clone_len = ((len - head_len) / recv->clone_align) * recv->clone_align;
+
+    if (clone_len >= RSYNC_RECEIVER_CLONE_MIN_SIZE) {
+      if (head_len > 0) {
+        if (copy_range(recv, src, dst, head_len) < 0) {
+          return -1;
+        }
+
+        src += head_len;
+        dst += head_len;
+        len -= head_len;
+      }
+
+      if (clone_range(recv, src, dst, clone_len) == 0) {
+        src += clone_len;
+        dst += clone_len;
+        len -= clone_len;
+      }
+    }
+  }
+#endif /* FICLONERANGE */
+
+  if (len == 0) {
+    return 0;
+  }
+
+  return copy_range(recv, src, dst, len);
+}
+
+/* Adds the data to the file checksum. */
+static int update_file_sum(struct rsync_receiver *recv,
+    const unsigned char *data, size_t len) {
+  if (recv->file_sum_offload != NULL) {
+    return rsync_workers_checksum_update(recv->file_sum_offload, data, len);
+  }
+
+  return rsync_checksum_update(recv->file_sum, data, len);
+}
+
+static int recv_literal(struct rsync_receiver *recv,
+    const unsigned char *data, uint32_t datalen) {
+
+  if (flush_run(recv) < 0) {
+    return -1;
+  }
+
+  if (update_file_sum(recv, data, datalen) < 0) {
+    return -1;
+  }
+
+  recv->stats.literal_bytes += datalen;
+  if (datalen > 0 &&
+      recv->in_literal == FALSE) {
+    recv->stats.literal_runs++;
+    recv->in_literal = TRUE;
+  }
+
+  while (datalen > 0) {
+    size_t len;
+
+    if (recv->buflen == recv->bufsz &&
+        flush_literal(recv) < 0) {
+      return -1;
+    }
+
+    len = recv->bufsz - recv->buflen;
+    if (len > datalen) {
+      len = datalen;
+    }
+
+    memcpy(recv->buf + recv->buflen, data, len);
+    recv->buflen += len;
+    recv->offset += len;
+    data += len;
+    datalen -= len;
+  }
+
+  return 0;
+}
+
+/* Writes a matched block into the file being updated in place, unless it is
+ * already there.
+ */
+static int write_block_inplace(struct rsync_receiver *recv, off_t offset,
+    const unsigned char *data, uint32_t len) {
+
+  if (offset == recv->offset) {
+    recv->stats.unchanged_bytes += len;
+    return 0;
+  }
+
+  if (offset < recv->offset) {
+    /* We have already overwritten this block. */
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "received block at offset %" PR_LU " for '%s', which has already been "
+      "updated in place past %" PR_LU, (pr_off_t) offset, recv->path,
+      (pr_off_t) recv->offset);
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (offset < recv->offset + len) {
+    /* The block overlaps its destination; don't write from the mapping of
+     * the data being overwritten.
+     */
+    if (recv->block == NULL) {
+      recv->block = palloc(recv->pool, recv->head.block_len);
+    }
+
+    memcpy(recv->block, data, len);
+    data = recv->block;
+  }
+
+  if (write_file_data(recv, data, len, recv->offset) < 0) {
+    int xerrno = errno;
+
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "error writing '%s': %s", recv->path, strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int recv_block(struct rsync_receiver *recv, int32_t token) {
+  const unsigned char *data;
+  off_t offset;
+  uint32_t len;
+
+  if (recv->map == NULL ||
+      token < 0 ||
+      token >= recv->head.count) {
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "received invalid block token %ld for '%s'", (long) token, recv->path);
+    errno = EINVAL;
+    return -1;
+  }
+
+  recv->in_literal = FALSE;
+
+  offset = (off_t) token * recv->head.block_len;
+  len = (uint32_t) recv->head.block_len;
+  if (token == recv->head.count - 1 &&
+      recv->head.remainder > 0) {
+    len = (uint32_t) recv->head.remainder;
+  }
+
+  /* We still read the block, for the file checksum (and, when compressing,
+   * the decompressor), but need not write it.
+   */
+  data = rsync_fmap_ptr(recv->map, offset, len);
+  if (data == NULL) {
+    return -1;
+  }
+
+  if (update_file_sum(recv, data, len) < 0 ||
+      rsync_token_see(recv->sess, data, len) < 0) {
+    return -1;
+  }
+
+  if (flush_literal(recv) < 0) {
+    return -1;
+  }
+
+  if (recv->inplace == TRUE) {
+    if (write_block_inplace(recv, offset, data, len) < 0) {
+      return -1;
+    }
+
+    recv->offset += len;
+    recv->stats.matched_bytes += len;
+    return 0;
+  }
+
+  if (recv->run_len > 0 &&
+      recv->run_offset + recv->run_len != offset) {
+    if (flush_run(recv) < 0) {
+      return -1;
+    }
+  }
+
+  if (recv->run_len == 0) {
+    recv->run_offset = offset;
+  }
+
+  recv->run_len += len;
+  recv->offset += len;
+  recv->stats.matched_bytes += len;
+  return 0;
+}
+
+/* With --append-verify, the data already in the file is covered by the
+ * whole-file checksum too; it is read in a single sequential pass.
+ */
+static int sum_prefix(struct rsync_receiver *recv) {
+  off_t offset = 0;
+
+  while (offset < recv->offset) {
+    const unsigned char *data;
+    size_t len;
+
+    pr_signals_handle();
+
+    len = RSYNC_RECEIVER_WINDOW_SIZE;
+    if (offset + (off_t) len > recv->offset) {
+      len = (size_t) (recv->offset - offset);
+    }
+
+    data = rsync_fmap_ptr(recv->map, offset, len);
+    if (data == NULL) {
+      int xerrno = errno;
+
+      (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+        "error reading '%s': %s", recv->path, strerror(xerrno));
+
+      errno = xerrno;
+      return -1;
+    }
+
+    if (update_file_sum(recv, data, len) < 0) {
+      return -1;
+    }
+
+    offset += len;
+  }
+
+  return 0;
+}
+
+struct rsync_receiver *rsync_receiver_open(pool *p,
+    struct rsync_session *sess, const char *path, int fd, int basis_fd,
+    const struct rsync_sum_head *head) {
+  struct rsync_receiver *recv;
+  struct rsync_options *opts;
+  struct stat st;
+  pool *sub_pool;
+  int xerrno;
+
+  if (p == NULL ||
+      sess == NULL ||
+      path == NULL ||
+      fd < 0 ||
+      (basis_fd >= 0 && head == NULL)) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  opts = sess->options;
+
+  /* The sender only avoids overwritten blocks if it knows we are updating
+   * in place.
+   */
+  if (basis_fd == fd &&
+      !opts->inplace) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  /* Likewise, when appending, the basis is the file being appended to. */
+  if (opts->append_mode > 0 &&
+      basis_fd >= 0 &&
+      basis_fd != fd) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (fstat(fd, &st) < 0) {
+    return NULL;
+  }
+
+  sub_pool = make_sub_pool(p);
+  pr_pool_tag(sub_pool, "rsync receiver pool");
+
+  recv = pcalloc(sub_pool, sizeof(struct rsync_receiver));
+  recv->pool = sub_pool;
+  recv->sess = sess;
+  recv->path = pstrdup(sub_pool, path);
+  recv->fd = fd;
+  recv->basis_fd = -1;
+  recv->clone_align = st.st_blksize > 0 ? (size_t) st.st_blksize : 4096;
+  recv->sparse = opts->sparse_files;
+  recv->sparse_align = recv->clone_align;
+
+  /* The sum header, and (unless appending) the sums which followed it. */
+  recv->stats.sum_bytes = sizeof(struct rsync_sum_head);
+  if (opts->append_mode == 0 &&
+      head != NULL &&
+      head->count > 0) {
+    recv->stats.sum_bytes += (uint64_t) head->count *
+      (sizeof(uint32_t) + head->s2len);
+  }
+
+  if (basis_fd >= 0 &&
+      head->count > 0) {
+    size_t window_len;
+
+    if (fstat(basis_fd, &st) < 0) {
+      xerrno = errno;
+
+      destroy_pool(sub_pool);
+      errno = xerrno;
+      return NULL;
+    }
+
+    /* Block sizes are powers of two, so the larger will do for both. */
+    if (st.st_blksize > 0 &&
+        (size_t) st.st_blksize > recv->clone_align) {
+      recv->clone_align = (size_t) st.st_blksize;
+    }
+
+    window_len = RSYNC_RECEIVER_WINDOW_SIZE;
+    if (window_len < (size_t) head->block_len) {
+      window_len = (size_t) head->block_len;
+    }
+
+    recv->map = rsync_fmap_open(sub_pool, basis_fd, st.st_size, window_len);
+    if (recv->map == NULL) {
+      xerrno = errno;
+
+      destroy_pool(sub_pool);
+      errno = xerrno;
+      return NULL;
+    }
+
+    recv->basis_fd = basis_fd;
+    memcpy(&(recv->head), head, sizeof(struct rsync_sum_head));
+
+    if (basis_fd == fd) {
+      recv->inplace = TRUE;
+
+    } else {
+      /* Cloning preserves the basis file's holes, but copying fills them. */
+#ifdef FICLONERANGE
+      recv->use_clone = TRUE;
+#endif /* FICLONERANGE */
+#ifdef HAVE_COPY_FILE_RANGE
+      recv->use_copy = !recv->sparse;
+#endif /* HAVE_COPY_FILE_RANGE */
+    }
+  }
+
+  recv->use_punch = TRUE;
+
+  /* Whatever was in the file beyond its new length must go; and a sparse
+   * file may end in a hole, i.e. need extending.
+   */
+  recv->truncate = (basis_fd == fd || recv->sparse);
+
+  recv->file_sum = rsync_checksum_create(sub_pool, sess->checksum_algo,
+    opts->checksum_seed);
+  if (recv->file_sum == NULL) {
+    xerrno = errno;
+
+    destroy_pool(sub_pool);
+    errno = xerrno;
+    return NULL;
+  }
+
+  if (sess->workers != NULL) {
+    recv->file_sum_offload = rsync_workers_checksum_create(sub_pool,
+      sess->workers, recv->file_sum);
+  }
+
+  /* When appending, the sender sends only the data beyond our file's
+   * length (as described by the header), and refers to no blocks.
+   */
+  if (opts->append_mode > 0 &&
+      recv->basis_fd >= 0) {
+    recv->offset = rsync_generator_get_basis_len(&(recv->head));
+
+    if (opts->append_mode == 2 &&
+        sum_prefix(recv) < 0) {
+      xerrno = errno;
+
+      if (recv->file_sum_offload != NULL) {
+        (void) rsync_workers_checksum_flush(recv->file_sum_offload);
+      }
+
+      destroy_pool(sub_pool);
+      errno = xerrno;
+      return NULL;
+    }
+  }
+
+  recv->bufsz = RSYNC_RECEIVER_BUFFER_SIZE;
+  recv->buf = palloc(sub_pool, recv->bufsz);
+
+  return recv;
+}
+
+int rsync_receiver_recv(struct rsync_receiver *recv, unsigned char **buf,
+    uint32_t *buflen) {
+  uint32_t len;
+
+  if (recv == NULL ||
+      buf == NULL ||
+      buflen == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  while (recv->at_end == FALSE) {
+    int32_t token = 0;
+    unsigned char *data = NULL;
+    uint32_t datalen = 0;
+    int res;
+
+    res = rsync_token_recv(recv->pool, recv->sess, buf, buflen, &token, &data,
+      &datalen);
+    switch (res) {
+      case RSYNC_TOKEN_RECV_DATA:
+        res = recv_literal(recv, data, datalen);
+        break;
+
+      case RSYNC_TOKEN_RECV_BLOCK:
+        res = recv_block(recv, token);
+        break;
+
+      case RSYNC_TOKEN_RECV_END:
+        if (flush_literal(recv) < 0 ||
+            flush_run(recv) < 0) {
+          return -1;
+        }
+
+        if (recv->truncate == TRUE &&
+            ftruncate(recv->fd, recv->offset) < 0) {
+          int xerrno = errno;
+
+          (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+            "error truncating '%s': %s", recv->path, strerror(xerrno));
+
+          errno = xerrno;
+          return -1;
+        }
+
+        if (recv->file_sum_offload != NULL &&
+            rsync_workers_checksum_flush(recv->file_sum_offload) < 0) {
+          return -1;
+        }
+
+        recv->digest_len = rsync_checksum_finish(recv->file_sum,
+          recv->digest);
+        recv->at_end = TRUE;
+        break;
+
+      default:
+        break;
+    }
+
+    if (res < 0) {
+      return -1;
+    }
+  }
+
+  /* The sender's checksum may arrive in pieces. */
+  len = (uint32_t) (recv->digest_len - recv->peer_digestlen);
+  if (len > *buflen) {
+    len = *buflen;
+  }
+
+  memcpy(recv->peer_digest + recv->peer_digestlen, *buf, len);
+  recv->peer_digestlen += len;
+  (*buf) += len;
+  (*buflen) -= len;
+
+  if (recv->peer_digestlen < recv->digest_len) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (memcmp(recv->digest, recv->peer_digest, recv->digest_len) != 0) {
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "'%s' failed verification: checksum mismatch", recv->path);
+    return RSYNC_RECEIVER_RECV_FAILED;
+  }
+
+  pr_trace_msg(trace_channel, 12,
+    "rebuilt '%s': %" PR_LU " bytes (%" PR_LU " literal, %" PR_LU
+    " matched, %" PR_LU " cloned, %" PR_LU " copied)", recv->path,
+    (pr_off_t) recv->offset, (pr_off_t) recv->stats.literal_bytes,
+    (pr_off_t) recv->stats.matched_bytes, (pr_off_t) recv->stats.cloned_bytes,
+    (pr_off_t) recv->stats.copied_bytes);
+
+  return RSYNC_RECEIVER_RECV_OK;
+}
+
+int rsync_receiver_close(struct rsync_receiver *recv,
+    struct rsync_receiver_stats *stats) {
+  if (recv == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (stats != NULL) {
+    stats->literal_bytes += recv->stats.literal_bytes;
+    stats->matched_bytes += recv->stats.matched_bytes;
+    stats->cloned_bytes += recv->stats.cloned_bytes;
+    stats->copied_bytes += recv->stats.copied_bytes;
+    stats->unchanged_bytes += recv->stats.unchanged_bytes;
+    stats->sparse_bytes += recv->stats.sparse_bytes;
+    stats->literal_runs += recv->stats.literal_runs;
+    stats->sum_bytes += recv->stats.sum_bytes;
+  }
+
+  /* The worker must be done with the buffers before they are freed. */
+  if (recv->file_sum_offload != NULL) {
+    (void) rsync_workers_checksum_flush(recv->file_sum_offload);
+  }
+
+  destroy_pool(recv->pool);
+  return 0;
+}
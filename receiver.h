@@ -0,0 +1,120 @@
+/*
+ * ProFTPD - mod_rsync receiver
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_RSYNC_RECEIVER_H
+#define MOD_RSYNC_RECEIVER_H
+
+#include "mod_rsync.h"
+#include "session.h"
+#include "generator.h"
+
+/* As the receiver, we rebuild each file from the sender's token stream (see
+ * token.h): literal data is written out, and matched blocks are copied from
+ * our basis file, per rsync-${version}/receiver.c#receive_data().  Runs of
+ * matched blocks are copied within the kernel: cloned (reflinked) where the
+ * filesystem supports it, else using copy_file_range(2), and only read and
+ * written by us as a last resort.
+ *
+ * When updating the file in place (--inplace), the basis file is the file
+ * being rebuilt.  The sender then only refers to blocks at or after the
+ * current offset, i.e. not yet overwritten; blocks already at the right
+ * offset are not written at all, so that only the changed data is.
+ *
+ * With --sparse, zeroes (whole filesystem blocks' worth) are not written,
+ * leaving holes, which are punched if updating in place.
+ *
+ * When appending (--append, --append-verify), the file is also updated in
+ * place: the sender sends only the data beyond its current length.  With
+ * --append-verify, the existing data is checksummed along with the new.
+ */
+
+/* The basis file is read (for the file checksum) through a window of (at
+ * least) this size.
+ */
+#define RSYNC_RECEIVER_WINDOW_SIZE		(4 * 1024 * 1024)
+
+/* Literal data is buffered, and written out in pieces of up to this size. */
+#define RSYNC_RECEIVER_BUFFER_SIZE		(256 * 1024)
+
+/* Runs of matched blocks shorter than this are copied rather than cloned, to
+ * avoid fragmenting the file into many small shared extents.
+ */
+#define RSYNC_RECEIVER_CLONE_MIN_SIZE		(64 * 1024)
+
+/* Return values for rsync_receiver_recv(). */
+#define RSYNC_RECEIVER_RECV_OK			0
+#define RSYNC_RECEIVER_RECV_FAILED		1
+
+struct rsync_receiver;
+
+struct rsync_receiver_stats {
+  uint64_t literal_bytes;
+  uint64_t matched_bytes;
+
+  /* Runs of literal data, i.e. (roughly) the number of changed regions. */
+  uint64_t literal_runs;
+
+  /* The block sums sent for the basis files. */
+  uint64_t sum_bytes;
+
+  /* Of the matched bytes, how many were cloned from the basis file, and how
+   * many copied by the kernel; the rest were read and written.
+   */
+  uint64_t cloned_bytes;
+  uint64_t copied_bytes;
+
+  /* When updating in place, matched bytes which were already in place. */
+  uint64_t unchanged_bytes;
+
+  /* With --sparse, zeroes left as holes rather than written. */
+  uint64_t sparse_bytes;
+};
+
+/* Prepares to rebuild a file into the (new, empty) file open on the given
+ * descriptor, from the basis file open on basis_fd, whose block sums (as
+ * described by the given header) were sent to the sender.  A basis_fd of -1
+ * means there is no basis file; the sender then sends only literal data.
+ * When updating in place, fd and basis_fd are the same (opened for reading
+ * and writing), and the file is truncated to its new length at the end.
+ */
+struct rsync_receiver *rsync_receiver_open(pool *p,
+  struct rsync_session *sess, const char *path, int fd, int basis_fd,
+  const struct rsync_sum_head *head);
+
+/* Consumes the tokens, and then the whole-file checksum, in the given
+ * buffer.  Returns RSYNC_RECEIVER_RECV_OK once the file is complete, or
+ * RSYNC_RECEIVER_RECV_FAILED if its checksum does not match the sender's
+ * (so that the file must be sent again).  Returns -1, with errno set to
+ * EAGAIN, if more data is needed.
+ */
+int rsync_receiver_recv(struct rsync_receiver *recv, unsigned char **buf,
+  uint32_t *buflen);
+
+/* Releases the receiver's resources; the counts for the file are added to
+ * the given stats, if any.  The file descriptors are not closed.
+ */
+int rsync_receiver_close(struct rsync_receiver *recv,
+  struct rsync_receiver_stats *stats);
+
+#endif /* MOD_RSYNC_RECEIVER_H */
@@ -0,0 +1,342 @@
+/*
+ * ProFTPD - mod_rsync rolling checksums
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_rsync.h"
+#include "rolling.h"
+
+/* The SIMD kernels rely on the compiler's support for per-function target
+ * attributes, and for runtime CPU feature detection.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+# define RSYNC_ROLLING_X86	1
+# include <immintrin.h>
+#endif
+
+static const char *trace_channel = "rsync.rolling";
+
+typedef void (*rolling_kernel_t)(const unsigned char *, uint32_t, uint32_t *,
+  uint32_t *);
+
+static rolling_kernel_t rolling_kernel = NULL;
+static const char *rolling_kernel_name = NULL;
+
+/* For a block of n (signed) bytes x[0] .. x[n-1], rsync's checksum is made
+ * of:
+ *
+ *  s1 = x[0] + x[1] + ... + x[n-1]
+ *  s2 = n*x[0] + (n-1)*x[1] + ... + 1*x[n-1]
+ *
+ * (all modulo 2^32), i.e. s2 is the sum of s1 after each byte.  The kernels
+ * compute both sums for a block.
+ */
+
+static void rolling_scalar(const unsigned char *data, uint32_t datalen,
+    uint32_t *s1p, uint32_t *s2p) {
+  const signed char *buf;
+  uint32_t i = 0, s1 = 0, s2 = 0;
+
+  buf = (const signed char *) data;
+
+  if (datalen > 4) {
+    for (; i < datalen - 4; i += 4) {
+      s2 += 4 * (s1 + buf[i]) + 3 * buf[i+1] + 2 * buf[i+2] + buf[i+3];
+      s1 += buf[i] + buf[i+1] + buf[i+2] + buf[i+3];
+    }
+  }
+
+  for (; i < datalen; i++) {
+    s1 += buf[i];
+    s2 += s1;
+  }
+
+  *s1p = s1;
+  *s2p = s2;
+}
+
+#ifdef RSYNC_ROLLING_X86
+__attribute__((target("sse2")))
+static uint32_t hsum_sse2(__m128i v) {
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (uint32_t) _mm_cvtsi128_si32(v);
+}
+
+/* Each 16-byte chunk is sign-extended to 16-bit lanes, and multiplied by
+ * its positional weights (16 .. 1) and by 1, with pairwise 32-bit sums.
+ * The s1 prefix sums, one per chunk, are accumulated separately, and scaled
+ * by the chunk size at the end.
+ */
+__attribute__((target("sse2")))
+static void rolling_sse2(const unsigned char *data, uint32_t datalen,
+    uint32_t *s1p, uint32_t *s2p) {
+  __m128i v_s1, v_s2, v_ps, ones, w_lo, w_hi, zero;
+  uint32_t i = 0, s1, s2;
+  const signed char *buf;
+
+  zero = _mm_setzero_si128();
+  ones = _mm_set1_epi16(1);
+  w_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+  w_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+
+  v_s1 = v_s2 = v_ps = zero;
+
+  for (; i + 16 <= datalen; i += 16) {
+    __m128i x, sign, lo, hi;
+
+    x = _mm_loadu_si128((const __m128i *) (data + i));
+    sign = _mm_cmpgt_epi8(zero, x);
+    lo = _mm_unpacklo_epi8(x, sign);
+    hi = _mm_unpackhi_epi8(x, sign);
+
+    v_ps = _mm_add_epi32(v_ps, v_s1);
+    v_s1 = _mm_add_epi32(v_s1,
+      _mm_add_epi32(_mm_madd_epi16(lo, ones), _mm_madd_epi16(hi, ones)));
+    v_s2 = _mm_add_epi32(v_s2,
+      _mm_add_epi32(_mm_madd_epi16(lo, w_lo), _mm_madd_epi16(hi, w_hi)));
+  }
+
+  s1 = hsum_sse2(v_s1);
+  s2 = (hsum_sse2(v_ps) << 4) + hsum_sse2(v_s2);
+
+  buf = (const signed char *) data;
+  for (; i < datalen; i++) {
+    s1 += buf[i];
+    s2 += s1;
+  }
+
+  *s1p = s1;
+  *s2p = s2;
+}
+
+__attribute__((target("avx2")))
+static uint32_t hsum_avx2(__m256i v) {
+  __m128i v128;
+
+  v128 = _mm_add_epi32(_mm256_castsi256_si128(v),
+    _mm256_extracti128_si256(v, 1));
+  v128 = _mm_add_epi32(v128,
+    _mm_shuffle_epi32(v128, _MM_SHUFFLE(1, 0, 3, 2)));
+  v128 = _mm_add_epi32(v128,
+    _mm_shuffle_epi32(v128, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (uint32_t) _mm_cvtsi128_si32(v128);
+}
+
+/* As for the SSE2 kernel, but with 32-byte chunks.  AVX2 can multiply the
+ * (signed) data bytes by the (unsigned) weights directly, with pairwise
+ * 16-bit sums; the products cannot saturate.
+ */
+__attribute__((target("avx2")))
+static void rolling_avx2(const unsigned char *data, uint32_t datalen,
+    uint32_t *s1p, uint32_t *s2p) {
+  __m256i v_s1, v_s2, v_ps, ones8, ones16, weights;
+  uint32_t i = 0, s1, s2;
+  const signed char *buf;
+
+  ones8 = _mm256_set1_epi8(1);
+  ones16 = _mm256_set1_epi16(1);
+  weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21,
+    20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+
+  v_s1 = v_s2 = v_ps = _mm256_setzero_si256();
+
+  for (; i + 32 <= datalen; i += 32) {
+    __m256i x;
+
+    x = _mm256_loadu_si256((const __m256i *) (data + i));
+
+    v_ps = _mm256_add_epi32(v_ps, v_s1);
+    v_s1 = _mm256_add_epi32(v_s1,
+      _mm256_madd_epi16(_mm256_maddubs_epi16(ones8, x), ones16));
+    v_s2 = _mm256_add_epi32(v_s2,
+      _mm256_madd_epi16(_mm256_maddubs_epi16(weights, x), ones16));
+  }
+
+  s1 = hsum_avx2(v_s1);
+  s2 = (hsum_avx2(v_ps) << 5) + hsum_avx2(v_s2);
+
+  buf = (const signed char *) data;
+  for (; i < datalen; i++) {
+    s1 += buf[i];
+    s2 += s1;
+  }
+
+  *s1p = s1;
+  *s2p = s2;
+}
+#endif /* RSYNC_ROLLING_X86 */
+
+static void select_kernel(void) {
+  rolling_kernel = rolling_scalar;
+  rolling_kernel_name = "scalar";
+
+#ifdef RSYNC_ROLLING_X86
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    rolling_kernel = rolling_avx2;
+    rolling_kernel_name = "avx2";
+
+  } else if (__builtin_cpu_supports("sse2")) {
+    rolling_kernel = rolling_sse2;
+    rolling_kernel_name = "sse2";
+  }
+#endif /* RSYNC_ROLLING_X86 */
+
+  pr_trace_msg(trace_channel, 9, "using %s rolling checksum kernel",
+    rolling_kernel_name);
+}
+
+int rsync_rolling_set_kernel(const char *name) {
+  if (name == NULL) {
+    rolling_kernel = NULL;
+    rolling_kernel_name = NULL;
+    return 0;
+  }
+
+  if (strcmp(name, "scalar") == 0) {
+    rolling_kernel = rolling_scalar;
+    rolling_kernel_name = "scalar";
+    return 0;
+  }
+
+#ifdef RSYNC_ROLLING_X86
+  __builtin_cpu_init();
+
+  if (strcmp(name, "sse2") == 0 &&
+      __builtin_cpu_supports("sse2")) {
+    rolling_kernel = rolling_sse2;
+    rolling_kernel_name = "sse2";
+    return 0;
+  }
+
+  if (strcmp(name, "avx2") == 0 &&
+      __builtin_cpu_supports("avx2")) {
+    rolling_kernel = rolling_avx2;
+    rolling_kernel_name = "avx2";
+    return 0;
+  }
+#endif /* RSYNC_ROLLING_X86 */
+
+  errno = ENOSYS;
+  return -1;
+}
+
+const char *rsync_rolling_get_kernel(void) {
+  if (rolling_kernel == NULL) {
+    select_kernel();
+  }
+
+  return rolling_kernel_name;
+}
+
+uint32_t rsync_rolling_checksum(const unsigned char *data, uint32_t datalen) {
+  uint32_t s1 = 0, s2 = 0;
+
+  if (data == NULL) {
+    return 0;
+  }
+
+  if (rolling_kernel == NULL) {
+    select_kernel();
+  }
+
+  rolling_kernel(data, datalen, &s1, &s2);
+  return (s1 & 0xffff) + (s2 << 16);
+}
+
+int rsync_rolling_block_sums(const unsigned char *data, size_t datalen,
+    uint32_t block_len, uint32_t *sums) {
+  int count = 0;
+
+  if (data == NULL ||
+      block_len == 0 ||
+      sums == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (rolling_kernel == NULL) {
+    select_kernel();
+  }
+
+  while (datalen > 0) {
+    uint32_t len, s1, s2;
+
+    len = datalen > block_len ? block_len : (uint32_t) datalen;
+    rolling_kernel(data, len, &s1, &s2);
+    sums[count++] = (s1 & 0xffff) + (s2 << 16);
+
+    data += len;
+    datalen -= len;
+  }
+
+  return count;
+}
+
+int rsync_rolling_init(struct rsync_rolling *roll, const unsigned char *data,
+    uint32_t datalen) {
+  if (roll == NULL ||
+      data == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (rolling_kernel == NULL) {
+    select_kernel();
+  }
+
+  rolling_kernel(data, datalen, &(roll->s1), &(roll->s2));
+  roll->len = datalen;
+  return 0;
+}
+
+uint32_t rsync_rolling_get(const struct rsync_rolling *roll) {
+  return (roll->s1 & 0xffff) + (roll->s2 << 16);
+}
+
+uint32_t rsync_rolling_roll(struct rsync_rolling *roll, unsigned char out,
+    unsigned char in) {
+  int32_t x, y;
+
+  x = (signed char) out;
+  y = (signed char) in;
+
+  roll->s1 += y - x;
+  roll->s2 += roll->s1 - (roll->len * x);
+
+  return (roll->s1 & 0xffff) + (roll->s2 << 16);
+}
+
+uint32_t rsync_rolling_trim(struct rsync_rolling *roll, unsigned char out) {
+  int32_t x;
+
+  x = (signed char) out;
+
+  roll->s1 -= x;
+  roll->s2 -= roll->len * x;
+  roll->len--;
+
+  return (roll->s1 & 0xffff) + (roll->s2 << 16);
+}
@@ -0,0 +1,83 @@
+/*
+ * ProFTPD - mod_rsync rolling checksums
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_RSYNC_ROLLING_H
+#define MOD_RSYNC_ROLLING_H
+
+#include "mod_rsync.h"
+
+/* The rsync "weak" checksum, per rsync-${version}/checksum.c#get_checksum1():
+ * an Adler-style pair of sums over the (signed) bytes of a block, which can
+ * be "rolled" along the data one byte at a time.
+ *
+ * Computing the checksums of whole blocks uses the fastest kernel (scalar,
+ * SSE2, AVX2) which the CPU supports, chosen at runtime.
+ */
+
+struct rsync_rolling {
+  uint32_t s1;
+  uint32_t s2;
+
+  /* Current window length. */
+  uint32_t len;
+};
+
+/* Returns the checksum of the given block. */
+uint32_t rsync_rolling_checksum(const unsigned char *data, uint32_t datalen);
+
+/* Computes the checksums of consecutive blocks of the given length, e.g. for
+ * generating the signature of a basis file; the last block may be short.
+ * The sums array must have room for (datalen + block_len - 1) / block_len
+ * checksums.  Returns the number of checksums computed.
+ */
+int rsync_rolling_block_sums(const unsigned char *data, size_t datalen,
+  uint32_t block_len, uint32_t *sums);
+
+/* Starts a rolling checksum over the given window. */
+int rsync_rolling_init(struct rsync_rolling *roll, const unsigned char *data,
+  uint32_t datalen);
+
+/* Returns the checksum of the current window. */
+uint32_t rsync_rolling_get(const struct rsync_rolling *roll);
+
+/* Slides the window along by one byte: the byte at its start (out) is
+ * removed, and the byte just past its end (in) is added.  Returns the new
+ * checksum.
+ */
+uint32_t rsync_rolling_roll(struct rsync_rolling *roll, unsigned char out,
+  unsigned char in);
+
+/* Removes the byte at the start of the window, shrinking it by one, e.g.
+ * near the end of the data.  Returns the new checksum.
+ */
+uint32_t rsync_rolling_trim(struct rsync_rolling *roll, unsigned char out);
+
+/* Select the block kernel ("scalar", "sse2", "avx2") explicitly, e.g. for
+ * testing; a NULL name restores runtime selection.  Returns -1, with errno
+ * set to ENOSYS, if the kernel is not supported on this CPU.
+ */
+int rsync_rolling_set_kernel(const char *name);
+const char *rsync_rolling_get_kernel(void);
+
+#endif /* MOD_RSYNC_ROLLING_H */
@@ -0,0 +1,1942 @@
+/*
+ * ProFTPD - mod_rsync sender
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_rsync.h"
+#include "sender.h"
+#include "options.h"
+#include "msg.h"
+#include "checksum.h"
+#include "rolling.h"
+#include "token.h"
+#include "fmap.h"
+#include "generator.h"
+#include "workers.h"
+#include "fileio.h"
+#include "policy.h"
+
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+# include <signal.h>
+#endif /* HAVE_PTHREAD */
+
+static off_t parallel_min_size = RSYNC_SENDER_DEFAULT_PARALLEL_MIN_SIZE;
+static unsigned int parallel_max_threads = 1;
+static off_t fallback_sample_size = RSYNC_SENDER_DEFAULT_FALLBACK_SAMPLE_SIZE;
+static unsigned int fallback_min_match_pct =
+  RSYNC_SENDER_DEFAULT_FALLBACK_MIN_MATCH_PCT;
+
+static const char *trace_channel = "rsync.sender";
+
+/* The next hole in a sparse file, per SEEK_HOLE/SEEK_DATA; if there is none,
+ * start and end are the file size.
+ */
+struct file_holes {
+  int fd;
+  off_t size;
+  off_t start, end;
+};
+
+/* A hole reads as zeroes, so the data at any offset (at least a block from
+ * the end of the hole) has the checksums of a block of zeroes.
+ */
+struct zero_block {
+  const unsigned char *data;
+  uint32_t weak;
+  unsigned char strong[RSYNC_CHECKSUM_MAX_DIGEST_LEN];
+
+  /* Whether any basis block has the rolling checksum of zeroes. */
+  int has;
+};
+
+struct sender_ctx {
+  pool *pool;
+  struct rsync_session *sess;
+  struct rsync_sender_stats *stats;
+  struct rsync_checksum *file_sum;
+  int direct;
+
+  /* With worker threads, the file checksum is computed by a worker. */
+  struct rsync_workers_checksum *file_sum_offload;
+
+  /* Whether the receiver is updating its file in place (--inplace). */
+  int inplace;
+
+  /* If the file has holes, their whereabouts, and the zero block sums. */
+  struct file_holes holes;
+  struct zero_block zero;
+
+  /* The file, and the part of it currently mapped. */
+  int fd;
+  struct rsync_fmap *map;
+  off_t size;
+  size_t window_len;
+  const unsigned char *win;
+  off_t win_start, win_end;
+
+  /* The output buffer, and the cursor into it. */
+  unsigned char *ptr, *buf;
+  uint32_t bufsz, buflen;
+
+  /* How much has been written for the file. */
+  uint64_t sent_bytes;
+};
+
+static int flush_output(struct sender_ctx *ctx) {
+  uint32_t len;
+
+  len = ctx->bufsz - ctx->buflen;
+  if (len == 0) {
+    return 0;
+  }
+
+  if ((rsync_write_data)(ctx->pool, ctx->sess->channel_id, ctx->ptr,
+      len) < 0) {
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "error sending file data: %s", strerror(errno));
+    errno = EIO;
+    return -1;
+  }
+
+  ctx->sent_bytes += len;
+  ctx->buf = ctx->ptr;
+  ctx->buflen = ctx->bufsz;
+  return 0;
+}
+
+/* Adds the data to the file checksum. */
+static int update_file_sum(struct sender_ctx *ctx, const unsigned char *data,
+    size_t len) {
+  if (ctx->file_sum_offload != NULL) {
+    return rsync_workers_checksum_update(ctx->file_sum_offload, data, len);
+  }
+
+  return rsync_checksum_update(ctx->file_sum, data, len);
+}
+
+static int reserve_output(struct sender_ctx *ctx, uint32_t len) {
+  if (ctx->buflen >= len) {
+    return 0;
+  }
+
+  return flush_output(ctx);
+}
+
+static int move_window(struct sender_ctx *ctx, off_t start) {
+  size_t window_len;
+
+  window_len = ctx->window_len;
+  if (start + (off_t) window_len > ctx->size) {
+    window_len = (size_t) (ctx->size - start);
+  }
+
+  ctx->win = rsync_fmap_ptr(ctx->map, start, window_len);
+  if (ctx->win == NULL) {
+    ctx->win_start = ctx->win_end = 0;
+    return -1;
+  }
+
+  ctx->win_start = start;
+  ctx->win_end = start + (off_t) window_len;
+  return 0;
+}
+
+/* Returns a pointer to the len bytes of the file at the given offset,
+ * keeping the data from start onwards (e.g. unsent literal data) mapped too.
+ * This is called for every byte searched, so the window is only moved when
+ * needed.
+ */
+static inline const unsigned char *get_window(struct sender_ctx *ctx,
+    off_t start, off_t offset, size_t len) {
+
+  if ((start < ctx->win_start ||
+       offset + (off_t) len > ctx->win_end) &&
+      move_window(ctx, start) < 0) {
+    return NULL;
+  }
+
+  return ctx->win + (offset - ctx->win_start);
+}
+
+static int send_literal_chunk(struct sender_ctx *ctx, int32_t token,
+    const unsigned char *data, uint32_t datalen, const unsigned char *block,
+    uint32_t blocklen) {
+
+  if (ctx->direct &&
+      datalen >= RSYNC_SENDER_DIRECT_MIN_SIZE) {
+    if (reserve_output(ctx, sizeof(uint32_t)) < 0 ||
+        rsync_token_send_direct(ctx->sess, &(ctx->buf), &(ctx->buflen),
+          datalen) < 0 ||
+        flush_output(ctx) < 0) {
+      return -1;
+    }
+
+    if ((rsync_write_data)(ctx->pool, ctx->sess->channel_id,
+        (unsigned char *) data, datalen) < 0) {
+      (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+        "error sending file data: %s", strerror(errno));
+      errno = EIO;
+      return -1;
+    }
+
+    ctx->sent_bytes += datalen;
+
+    if (token == RSYNC_TOKEN_DATA_ONLY) {
+      return 0;
+    }
+
+    data = NULL;
+    datalen = 0;
+  }
+
+  if (reserve_output(ctx, rsync_token_send_bound(ctx->sess, datalen)) < 0) {
+    return -1;
+  }
+
+  if (rsync_token_send(ctx->pool, ctx->sess, &(ctx->buf), &(ctx->buflen),
+      token, data, datalen, block, blocklen) < 0) {
+    int xerrno;
+
+    xerrno = errno;
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "error compressing file data: %s (%s)", strerror(xerrno),
+      rsync_token_get_error(ctx->sess));
+    errno = xerrno;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Sends the literal data from offset, for len bytes, in chunks, followed by
+ * the given token (with the matched block, if any).
+ */
+static int send_token(struct sender_ctx *ctx, off_t offset, off_t len,
+    int32_t token, const unsigned char *block, uint32_t blocklen) {
+
+  if (len > 0) {
+    ctx->stats->literal_runs++;
+  }
+
+  do {
+    const unsigned char *data = NULL;
+    uint32_t n;
+    int32_t t = token;
+
+    n = len > RSYNC_TOKEN_CHUNK_SIZE ? RSYNC_TOKEN_CHUNK_SIZE : (uint32_t) len;
+    if (n < len) {
+      t = RSYNC_TOKEN_DATA_ONLY;
+    }
+
+    if (n > 0) {
+      data = get_window(ctx, offset, offset, n);
+      if (data == NULL) {
+        return -1;
+      }
+
+      if (update_file_sum(ctx, data, n) < 0) {
+        return -1;
+      }
+
+      ctx->stats->literal_bytes += n;
+    }
+
+    if (send_literal_chunk(ctx, t, data, n,
+        t == RSYNC_TOKEN_DATA_ONLY ? NULL : block,
+        t == RSYNC_TOKEN_DATA_ONLY ? 0 : blocklen) < 0) {
+      return -1;
+    }
+
+    offset += n;
+    len -= n;
+  } while (len > 0);
+
+  return 0;
+}
+
+/* Starts the token stream for the file, given its first chunk, and checks
+ * whether literal data can be sent as-is, i.e. uncompressed.
+ */
+static int start_file(struct sender_ctx *ctx, const char *path,
+    const unsigned char *data, uint32_t datalen) {
+  unsigned char scratch[4], *ptr;
+  uint32_t len;
+
+  if (rsync_token_start_file(ctx->pool, ctx->sess, path, data, datalen) < 0) {
+    return -1;
+  }
+
+  ptr = scratch;
+  len = sizeof(scratch);
+  ctx->direct = (rsync_token_send_direct(ctx->sess, &ptr, &len, 1) == 0);
+  return 0;
+}
+
+/* Reads len bytes of the file, from the given offset, for a whole-file send.
+ * Direct reads must cover whole, aligned blocks, so they ask for the rest of
+ * the (aligned) buffer; if the filesystem refuses them, we fall back to
+ * buffered reads.
+ */
+static int read_file_data(struct sender_ctx *ctx, unsigned char *buf,
+    size_t bufsz, off_t offset, size_t len, int *odirect, int flags) {
+  size_t have = 0;
+
+  while (have < len) {
+    size_t want;
+    ssize_t res;
+
+    want = *odirect ? bufsz - have : len - have;
+    res = rsync_fileio_read(ctx->fd, buf + have, want, offset + have);
+    if (res < 0) {
+#ifdef O_DIRECT
+      if (*odirect &&
+          errno == EINVAL) {
+        pr_trace_msg(trace_channel, 9,
+          "direct read failed (at offset %" PR_LU "), using buffered reads",
+          (pr_off_t) (offset + have));
+        (void) fcntl(ctx->fd, F_SETFL, flags);
+        *odirect = FALSE;
+        continue;
+      }
+#endif /* O_DIRECT */
+
+      return -1;
+    }
+
+    have += res;
+
+    if ((size_t) res < want &&
+        have < len) {
+      pr_trace_msg(trace_channel, 3,
+        "file shrank while reading (at offset %" PR_LU "), zeroing remaining "
+        "%lu bytes", (pr_off_t) (offset + have), (unsigned long) (len - have));
+      memset(buf + have, 0, len - have);
+      break;
+    }
+  }
+
+  return 0;
+}
+
+/* With worker threads, the data of a file sent whole is compressed by a
+ * worker, a buffer at a time, while we read the next buffer; we then send
+ * the compressed data.  The worker has the token stream to itself until we
+ * have waited for it.
+ */
+struct encode_job {
+  struct rsync_workers_job job;
+  pool *pool;
+  struct rsync_session *sess;
+  int queued;
+
+  /* The data, and whether it is the end of the file. */
+  const unsigned char *data;
+  size_t datalen;
+  int end;
+
+  unsigned char *out;
+  uint32_t outsz, outlen;
+};
+
+static int encode_job_run(struct rsync_workers_job *job) {
+  struct encode_job *ej;
+  unsigned char *buf;
+  uint32_t buflen;
+  size_t sent = 0;
+
+  ej = (struct encode_job *) job;
+  buf = ej->out;
+  buflen = ej->outsz;
+
+  do {
+    uint32_t n;
+    int32_t token = RSYNC_TOKEN_DATA_ONLY;
+
+    n = ej->datalen - sent > RSYNC_TOKEN_CHUNK_SIZE ? RSYNC_TOKEN_CHUNK_SIZE :
+      (uint32_t) (ej->datalen - sent);
+    if (ej->end &&
+        sent + n == ej->datalen) {
+      token = RSYNC_TOKEN_END;
+    }
+
+    if (rsync_token_send(ej->pool, ej->sess, &buf, &buflen, token,
+        n > 0 ? ej->data + sent : NULL, n, NULL, 0) < 0) {
+      return -1;
+    }
+
+    sent += n;
+  } while (sent < ej->datalen);
+
+  ej->outlen = ej->outsz - buflen;
+  return 0;
+}
+
+/* Returns a page-aligned buffer for reading the file. */
+static unsigned char *alloc_read_buffer(struct sender_ctx *ctx, size_t bufsz,
+    long pagesz) {
+  unsigned char *buf;
+
+  buf = palloc(ctx->pool, bufsz + pagesz);
+  buf += (pagesz - ((size_t) buf % pagesz)) % pagesz;
+  return buf;
+}
+
+/* Returns the jobs with which to compress the file's data, if it is to be
+ * compressed, and there are workers to do it.  The token stream must have
+ * been started (and used) already, as compressors set themselves up on first
+ * use, which only the main thread may do.
+ */
+static struct encode_job *create_encode_jobs(struct sender_ctx *ctx,
+    size_t bufsz) {
+  register unsigned int i;
+  struct encode_job *jobs;
+  uint32_t outsz;
+
+  if (ctx->direct ||
+      ctx->sess->workers == NULL) {
+    return NULL;
+  }
+
+  outsz = (uint32_t) ((bufsz / RSYNC_TOKEN_CHUNK_SIZE) + 1) *
+    rsync_token_send_bound(ctx->sess, RSYNC_TOKEN_CHUNK_SIZE);
+
+  jobs = pcalloc(ctx->pool, 2 * sizeof(struct encode_job));
+  for (i = 0; i < 2; i++) {
+    jobs[i].job.run = encode_job_run;
+    jobs[i].pool = ctx->pool;
+    jobs[i].sess = ctx->sess;
+    jobs[i].outsz = outsz;
+    jobs[i].out = palloc(ctx->pool, outsz);
+  }
+
+  return jobs;
+}
+
+/* Waits for the job, and sends its compressed data. */
+static int finish_encode(struct sender_ctx *ctx, struct encode_job *ej) {
+  if (ej->queued == FALSE) {
+    return 0;
+  }
+
+  ej->queued = FALSE;
+  if (rsync_workers_wait(ctx->sess->workers, &(ej->job)) < 0) {
+    int xerrno;
+
+    xerrno = errno;
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "error compressing file data: %s (%s)", strerror(xerrno),
+      rsync_token_get_error(ctx->sess));
+    errno = xerrno;
+    return -1;
+  }
+
+  if (flush_output(ctx) < 0) {
+    return -1;
+  }
+
+  if (ej->outlen > 0 &&
+      (rsync_write_data)(ctx->pool, ctx->sess->channel_id, ej->out,
+        ej->outlen) < 0) {
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "error sending file data: %s", strerror(errno));
+    errno = EIO;
+    return -1;
+  }
+
+  ctx->sent_bytes += ej->outlen;
+  return 0;
+}
+
+/* Sends the file as literal data, from the given offset: the whole file,
+ * e.g. for --whole-file, or when the receiver has no basis file; or when
+ * appending, just the data beyond the receiver's length.  For
+ * --append-verify, the data the receiver already has is included in the
+ * file checksum, in the same sequential pass.
+ *
+ * There is nothing to search, so the file is simply streamed through a
+ * buffer, in large aligned reads.  The pages read are dropped from the page
+ * cache once sent (or bypass it entirely, with O_DIRECT), so that a large
+ * transfer does not evict everything else.  With worker threads, compression
+ * alternates between two buffers, so that one is read while the other is
+ * compressed.
+ */
+static int send_whole_file(struct sender_ctx *ctx, const char *path,
+    off_t start, int verify) {
+  unsigned char *bufs[2];
+  struct encode_job *jobs = NULL;
+  size_t bufsz;
+  long pagesz;
+  off_t offset;
+  unsigned int cur = 0;
+  int flags = -1, odirect = FALSE, started = FALSE, res = 0, xerrno;
+
+  pagesz = sysconf(_SC_PAGESIZE);
+  if (pagesz <= 0) {
+    pagesz = 4096;
+  }
+
+  bufsz = RSYNC_SENDER_READ_SIZE;
+  bufs[0] = alloc_read_buffer(ctx, bufsz, pagesz);
+  bufs[1] = NULL;
+
+  /* Reads start on a page boundary, for O_DIRECT. */
+  offset = verify ? 0 : start - (start % pagesz);
+
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_SEQUENTIAL)
+  (void) posix_fadvise(ctx->fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+#endif /* HAVE_POSIX_FADVISE and POSIX_FADV_SEQUENTIAL */
+
+#ifdef O_DIRECT
+  if (rsync_opts & RSYNC_OPT_WHOLE_FILE_DIRECT_IO) {
+    flags = fcntl(ctx->fd, F_GETFL);
+    if (flags >= 0 &&
+        fcntl(ctx->fd, F_SETFL, flags|O_DIRECT) == 0) {
+      odirect = TRUE;
+
+    } else {
+      pr_trace_msg(trace_channel, 9,
+        "unable to use direct reads for '%s': %s", path, strerror(errno));
+    }
+  }
+#endif /* O_DIRECT */
+
+  do {
+    unsigned char *buf;
+    size_t len, sent = 0;
+
+    pr_signals_handle();
+
+    buf = bufs[cur];
+    len = ctx->size - offset > (off_t) bufsz ? bufsz :
+      (size_t) (ctx->size - offset);
+
+    if (len > 0 &&
+        read_file_data(ctx, buf, bufsz, offset, len, &odirect, flags) < 0) {
+      res = -1;
+      break;
+    }
+
+    /* Skip (or, for --append-verify, checksum) what the receiver has. */
+    if (offset < start) {
+      sent = start - offset > (off_t) len ? len : (size_t) (start - offset);
+
+      if (verify &&
+          update_file_sum(ctx, buf, sent) < 0) {
+        res = -1;
+        break;
+      }
+    }
+
+    if (jobs != NULL &&
+        (sent < len ||
+         offset + (off_t) len == ctx->size)) {
+      struct encode_job *ej;
+
+      if (update_file_sum(ctx, buf + sent, len - sent) < 0) {
+        res = -1;
+        break;
+      }
+
+      ctx->stats->literal_bytes += len - sent;
+
+      ej = &(jobs[cur]);
+      ej->data = buf + sent;
+      ej->datalen = len - sent;
+      ej->end = (offset + (off_t) len == ctx->size);
+
+      if (rsync_workers_submit(ctx->sess->workers,
+          RSYNC_WORKERS_COMPRESS_LANE, &(ej->job)) < 0) {
+        res = -1;
+        break;
+      }
+
+      ej->queued = TRUE;
+
+      /* Send the previous buffer's data, while this one is compressed. */
+      cur = 1 - cur;
+      if (finish_encode(ctx, &(jobs[cur])) < 0) {
+        res = -1;
+        break;
+      }
+
+    } else if (sent < len ||
+               offset + (off_t) len == ctx->size) {
+
+      /* Let the token layer decide whether this file is worth compressing. */
+      if (!started) {
+        size_t n;
+
+        n = len - sent > RSYNC_TOKEN_CHUNK_SIZE ? RSYNC_TOKEN_CHUNK_SIZE :
+          len - sent;
+        if (start_file(ctx, path, buf + sent, (uint32_t) n) < 0) {
+          res = -1;
+          break;
+        }
+
+        started = TRUE;
+      }
+
+      do {
+        uint32_t n;
+        int32_t token = RSYNC_TOKEN_DATA_ONLY;
+
+        n = len - sent > RSYNC_TOKEN_CHUNK_SIZE ? RSYNC_TOKEN_CHUNK_SIZE :
+          (uint32_t) (len - sent);
+        if (offset + (off_t) (sent + n) == ctx->size) {
+          token = RSYNC_TOKEN_END;
+        }
+
+        if (n > 0) {
+          if (update_file_sum(ctx, buf + sent, n) < 0) {
+            res = -1;
+            break;
+          }
+
+          ctx->stats->literal_bytes += n;
+        }
+
+        res = send_literal_chunk(ctx, token, n > 0 ? buf + sent : NULL, n,
+          NULL, 0);
+        if (res < 0) {
+          break;
+        }
+
+        sent += n;
+      } while (sent < len);
+
+      if (res < 0) {
+        break;
+      }
+
+      /* The first buffer has been compressed here; the workers can take
+       * over the rest.
+       */
+      if (offset + (off_t) len < ctx->size) {
+        jobs = create_encode_jobs(ctx, bufsz);
+        if (jobs != NULL) {
+          bufs[1] = alloc_read_buffer(ctx, bufsz, pagesz);
+        }
+      }
+    }
+
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_DONTNEED)
+    if (!odirect &&
+        len > 0) {
+      (void) posix_fadvise(ctx->fd, offset, (off_t) len, POSIX_FADV_DONTNEED);
+    }
+#endif /* HAVE_POSIX_FADVISE and POSIX_FADV_DONTNEED */
+
+    offset += len;
+  } while (offset < ctx->size);
+
+  xerrno = errno;
+
+  if (jobs != NULL) {
+    register unsigned int i;
+
+    /* Send the last buffer's data (or, on error, just wait for it). */
+    for (i = 0; i < 2; i++) {
+      struct encode_job *ej;
+
+      ej = &(jobs[(cur + i) % 2]);
+      if (res == 0) {
+        res = finish_encode(ctx, ej);
+        xerrno = errno;
+
+      } else if (ej->queued) {
+        ej->queued = FALSE;
+        (void) rsync_workers_wait(ctx->sess->workers, &(ej->job));
+      }
+    }
+  }
+
+#ifdef O_DIRECT
+  if (odirect) {
+    (void) fcntl(ctx->fd, F_SETFL, flags);
+  }
+#endif /* O_DIRECT */
+
+  errno = xerrno;
+  return res;
+}
+
+/* Sends a small file (see rsync_small_file_size) whole.  None of the
+ * streaming of send_whole_file() pays for itself at this size: the file is
+ * read with one call, into a buffer of its size, and its literal data, end
+ * token and checksum are sent in a single write.
+ */
+static int send_small_file(struct sender_ctx *ctx, const char *path) {
+  unsigned char *buf;
+  size_t len, sent = 0;
+  uint32_t n;
+
+  len = (size_t) ctx->size;
+  buf = palloc(ctx->pool, len > 0 ? len : 1);
+
+  if (len > 0) {
+    ssize_t res;
+
+    res = rsync_fileio_read(ctx->fd, buf, len, 0);
+    if (res < 0) {
+      return -1;
+    }
+
+    if ((size_t) res < len) {
+      pr_trace_msg(trace_channel, 3,
+        "file shrank while reading (at offset %" PR_LU "), zeroing remaining "
+        "%lu bytes", (pr_off_t) res, (unsigned long) (len - res));
+      memset(buf + res, 0, len - res);
+    }
+  }
+
+  n = len > RSYNC_TOKEN_CHUNK_SIZE ? RSYNC_TOKEN_CHUNK_SIZE : (uint32_t) len;
+  if (start_file(ctx, path, buf, n) < 0) {
+    return -1;
+  }
+
+  /* Copying the data into the output buffer is cheaper than another write. */
+  ctx->direct = FALSE;
+
+  do {
+    int32_t token = RSYNC_TOKEN_DATA_ONLY;
+
+    n = len - sent > RSYNC_TOKEN_CHUNK_SIZE ? RSYNC_TOKEN_CHUNK_SIZE :
+      (uint32_t) (len - sent);
+    if (sent + n == len) {
+      token = RSYNC_TOKEN_END;
+    }
+
+    if (n > 0) {
+      if (update_file_sum(ctx, buf + sent, n) < 0) {
+        return -1;
+      }
+
+      ctx->stats->literal_bytes += n;
+    }
+
+    if (send_literal_chunk(ctx, token, n > 0 ? buf + sent : NULL, n, NULL,
+        0) < 0) {
+      return -1;
+    }
+
+    sent += n;
+  } while (sent < len);
+
+  return 0;
+}
+
+/* The state of the search through a file, per rsync-${version}/match.c. */
+struct search_state {
+  const struct rsync_sum_head *head;
+
+  /* Past this offset, there is no room left for even the last block. */
+  off_t end;
+
+  off_t offset;
+  off_t last_match;
+
+  /* The block following the previous match; it is preferred if it matches
+   * again.
+   */
+  int32_t want;
+
+  /* The rolling checksum, if valid for the current offset. */
+  struct rsync_rolling roll;
+  off_t roll_offset;
+
+  /* Where next to check whether the search is paying off; where, and with
+   * how many bytes matched, it was last checked; and how many checks in a
+   * row have found too little matching since the one before.
+   */
+  off_t next_check;
+  off_t last_check;
+  uint64_t last_check_matched;
+  unsigned int nlow_checks;
+};
+
+static void init_search(struct sender_ctx *ctx, struct rsync_sumtable *tab,
+    struct search_state *st) {
+  uint32_t last_len;
+
+  memset(st, 0, sizeof(struct search_state));
+  st->head = rsync_sumtable_get_head(tab);
+
+  last_len = st->head->remainder ? (uint32_t) st->head->remainder :
+    (uint32_t) st->head->block_len;
+  st->end = ctx->size + 1 - last_len;
+  st->roll_offset = -1;
+  st->next_check = fallback_sample_size;
+}
+
+/* Returns TRUE if so little of the last few samples of the file searched
+ * has matched that the rest is better sent as literal data, e.g. for a
+ * compressed or encrypted file which has changed throughout.  Each sample is
+ * judged on its own, so that a file which changed at the start, but not
+ * after, is still searched.
+ */
+static int search_not_paying(struct sender_ctx *ctx,
+    struct search_state *st) {
+  uint64_t matched;
+  off_t searched;
+
+  if (st->offset < st->next_check ||
+      fallback_min_match_pct == 0) {
+    return FALSE;
+  }
+
+  matched = ctx->stats->matched_bytes - st->last_check_matched;
+  searched = st->offset - st->last_check;
+
+  st->next_check = st->offset + fallback_sample_size;
+  st->last_check = st->offset;
+  st->last_check_matched = ctx->stats->matched_bytes;
+
+  if (matched * 100 >= (uint64_t) searched * fallback_min_match_pct) {
+    st->nlow_checks = 0;
+    return FALSE;
+  }
+
+  st->nlow_checks++;
+  if (st->nlow_checks < RSYNC_SENDER_FALLBACK_SAMPLES) {
+    return FALSE;
+  }
+
+  pr_trace_msg(trace_channel, 9,
+    "less than %u%% of each of the last %u samples searched matched, "
+    "sending the remaining %" PR_LU " bytes as literal data",
+    fallback_min_match_pct, st->nlow_checks,
+    (pr_off_t) (ctx->size - st->last_match));
+  ctx->stats->fallbacks++;
+  return TRUE;
+}
+
+/* Returns the length of the data compared against the blocks at the given
+ * offset: a block's worth, unless near the end of the file.
+ */
+static inline uint32_t get_search_len(off_t size, uint32_t block_len,
+    off_t offset) {
+  return (off_t) block_len > size - offset ? (uint32_t) (size - offset) :
+    block_len;
+}
+
+/* Returns the index of the block matching the data at the given offset, if
+ * any, per rsync_sumtable_match().
+ *
+ * When the receiver updates its file in place, it has already overwritten
+ * the blocks before the offset, so they cannot be used; and the block
+ * already at the offset (if it matches) is preferred, as it need not be
+ * written at all.  Either way, whether there is a match depends only on the
+ * offset, not on the search state.
+ */
+static inline int32_t match_block(struct rsync_sumtable *tab,
+    uint32_t block_len, int inplace, off_t offset, uint32_t weak,
+    const unsigned char *strong, uint32_t len, int32_t want) {
+  int32_t min_idx;
+
+  if (inplace == FALSE) {
+    return rsync_sumtable_match(tab, weak, strong, len, want);
+  }
+
+  min_idx = (int32_t) ((offset + block_len - 1) / block_len);
+  if (offset % block_len == 0) {
+    want = min_idx;
+  }
+
+  return rsync_sumtable_match_from(tab, weak, strong, len, want, min_idx);
+}
+
+/* Sends the literal data since the last match, and the matched block, then
+ * moves on past the block.
+ */
+static int send_match(struct sender_ctx *ctx, struct search_state *st,
+    int32_t idx, const unsigned char *data, uint32_t len) {
+
+  if (send_token(ctx, st->last_match, st->offset - st->last_match, idx, data,
+      len) < 0) {
+    return -1;
+  }
+
+  if (update_file_sum(ctx, data, len) < 0) {
+    return -1;
+  }
+
+  ctx->stats->matched_blocks++;
+  ctx->stats->matched_bytes += len;
+
+  st->offset += len;
+  st->last_match = st->offset;
+  st->want = idx + 1;
+  return 0;
+}
+
+/* Moves on to the given offset, having found no matches before it, sending
+ * literal data a chunk at a time as it accumulates.  Unsent data thus never
+ * spans more than a chunk and a block, so the window always covers it.
+ */
+static int skip_to(struct sender_ctx *ctx, struct search_state *st,
+    off_t offset) {
+
+  while (offset - st->last_match >= RSYNC_TOKEN_CHUNK_SIZE) {
+    if (send_token(ctx, st->last_match, RSYNC_TOKEN_CHUNK_SIZE,
+        RSYNC_TOKEN_DATA_ONLY, NULL, 0) < 0) {
+      return -1;
+    }
+
+    st->last_match += RSYNC_TOKEN_CHUNK_SIZE;
+  }
+
+  st->offset = offset;
+  return 0;
+}
+
+/* Finds the first hole at or after the given offset. */
+static void find_hole(struct file_holes *holes, off_t offset) {
+  holes->start = holes->end = holes->size;
+
+#if defined(SEEK_HOLE) && defined(SEEK_DATA)
+  {
+    off_t start, end;
+
+    /* Note that the file position is not otherwise used, as files are read
+     * with mmap(2) or pread(2).
+     */
+    start = lseek(holes->fd, offset, SEEK_HOLE);
+    if (start < 0 ||
+        start >= holes->size) {
+      return;
+    }
+
+    end = lseek(holes->fd, start, SEEK_DATA);
+    if (end < 0 ||
+        end > holes->size) {
+      /* ENXIO: the file ends in the hole. */
+      end = holes->size;
+    }
+
+    holes->start = start;
+    holes->end = end;
+  }
+#endif /* SEEK_HOLE and SEEK_DATA */
+}
+
+/* Returns TRUE if the len bytes at the given offset lie within a hole;
+ * offsets are expected to (mostly) increase.
+ */
+static inline int in_hole(struct file_holes *holes, off_t offset,
+    uint32_t len) {
+
+  if (offset >= holes->end) {
+    find_hole(holes, offset);
+  }
+
+  return (offset >= holes->start && offset + len <= holes->end);
+}
+
+/* Moves on through the hole at the current offset, without reading it.  At
+ * each offset, there either is a match for a block of zeroes, or there is
+ * none for the rest of the hole (when updating in place, fewer blocks can be
+ * matched as the offset increases), so this finds the same matches as
+ * search_step() would.
+ */
+static int skip_hole(struct sender_ctx *ctx, struct rsync_sumtable *tab,
+    struct search_state *st) {
+  uint32_t block_len;
+  off_t last;
+
+  block_len = (uint32_t) st->head->block_len;
+
+  /* The last offset at which a whole block lies within the hole. */
+  last = ctx->holes.end - block_len;
+
+  while (st->offset <= last) {
+    int32_t idx = -1;
+
+    if (ctx->zero.has) {
+      idx = match_block(tab, block_len, ctx->inplace, st->offset,
+        ctx->zero.weak, ctx->zero.strong, block_len, st->want);
+    }
+
+    if (idx < 0) {
+      if (skip_to(ctx, st, last + 1) < 0) {
+        return -1;
+      }
+
+      break;
+    }
+
+    if (send_match(ctx, st, idx, ctx->zero.data, block_len) < 0) {
+      return -1;
+    }
+  }
+
+  st->roll_offset = -1;
+  return 0;
+}
+
+/* Notes: see rsync-${version}/match.c#hash_search().  Searches for a match
+ * at the current offset, and moves on, either past the matched block or by
+ * one byte.
+ */
+static inline int search_step(struct sender_ctx *ctx,
+    struct rsync_sumtable *tab, struct search_state *st) {
+  unsigned char digest[RSYNC_CHECKSUM_MAX_DIGEST_LEN];
+  const unsigned char *data;
+  uint32_t k, weak;
+  int more;
+
+  k = get_search_len(ctx->size, (uint32_t) st->head->block_len, st->offset);
+  more = (st->offset + k < ctx->size);
+
+  data = get_window(ctx, st->last_match, st->offset, k + more);
+  if (data == NULL) {
+    return -1;
+  }
+
+  if (st->roll_offset != st->offset) {
+    rsync_rolling_init(&(st->roll), data, k);
+  }
+
+  weak = rsync_rolling_get(&(st->roll));
+
+  /* Roll on to the next offset now, so that its lookup can be prefetched
+   * while this one is done.
+   */
+  if (more) {
+    rsync_sumtable_prefetch(tab, rsync_rolling_roll(&(st->roll), data[0],
+      data[k]));
+
+  } else {
+    rsync_rolling_trim(&(st->roll), data[0]);
+  }
+
+  st->roll_offset = st->offset + 1;
+
+  if (rsync_sumtable_has(tab, weak)) {
+    int32_t idx;
+
+    ctx->stats->hash_hits++;
+
+    rsync_checksum_block(ctx->sess, data, k, digest);
+    idx = match_block(tab, (uint32_t) st->head->block_len, ctx->inplace,
+      st->offset, weak, digest, k, st->want);
+    if (idx >= 0) {
+      return send_match(ctx, st, idx, data, k);
+    }
+
+    ctx->stats->false_alarms++;
+  }
+
+  return skip_to(ctx, st, st->offset + 1);
+}
+
+/* Checks whether the file has any holes; if so, gets the sums of a block of
+ * zeroes, with which to skip through them.
+ */
+static void init_holes(struct sender_ctx *ctx, struct rsync_sumtable *tab,
+    const struct rsync_sum_head *head) {
+  unsigned char *zeroes;
+  uint32_t block_len;
+
+  ctx->holes.fd = ctx->fd;
+  ctx->holes.size = ctx->size;
+  find_hole(&(ctx->holes), 0);
+
+  if (ctx->holes.start >= ctx->size) {
+    return;
+  }
+
+  block_len = (uint32_t) head->block_len;
+  zeroes = pcalloc(ctx->pool, block_len);
+
+  ctx->zero.weak = rsync_rolling_checksum(zeroes, block_len);
+  rsync_checksum_block(ctx->sess, zeroes, block_len, ctx->zero.strong);
+  ctx->zero.has = rsync_sumtable_has(tab, ctx->zero.weak);
+  ctx->zero.data = zeroes;
+
+  pr_trace_msg(trace_channel, 12,
+    "file has holes (first at %" PR_LU "), basis %s zero blocks",
+    (pr_off_t) ctx->holes.start, ctx->zero.has ? "may have" : "has no");
+}
+
+static int search_file(struct sender_ctx *ctx, struct rsync_sumtable *tab) {
+  struct search_state st;
+
+  init_search(ctx, tab, &st);
+
+  while (st.offset < st.end) {
+    int res;
+
+    if (ctx->zero.data != NULL &&
+        in_hole(&(ctx->holes), st.offset, (uint32_t) st.head->block_len)) {
+      res = skip_hole(ctx, tab, &st);
+
+    } else {
+      res = search_step(ctx, tab, &st);
+    }
+
+    if (res < 0) {
+      return -1;
+    }
+
+    if (search_not_paying(ctx, &st)) {
+      break;
+    }
+  }
+
+  /* Whatever is left over is literal data. */
+  return send_token(ctx, st.last_match, ctx->size - st.last_match,
+    RSYNC_TOKEN_END, NULL, 0);
+}
+
+#ifdef HAVE_PTHREAD
+/* A huge file can be searched in parallel: worker threads each search a
+ * region of the file, much as the serial search would, recording where
+ * blocks match.  The results are then stitched together, in order, by
+ * replaying the serial search's decisions, so that the token stream is
+ * exactly that of the serial search.
+ *
+ * Whether a block matches at a given offset does not depend on the search
+ * state (only which of several identical blocks is chosen does), so a
+ * worker's matches are the serial search's, provided that the serial search
+ * visits the same offsets.  It does, except where it enters a region part-way
+ * through a block the worker matched; it then searches serially itself, until
+ * it is back in step.
+ */
+
+struct search_match {
+  off_t offset;
+  uint32_t weak;
+  unsigned char digest[RSYNC_CHECKSUM_MAX_DIGEST_LEN];
+};
+
+struct search_region {
+  off_t start, stop;
+
+  /* Written by the worker; read once done. */
+  struct search_match *matches;
+  size_t nmatches, matchsz;
+  uint64_t hash_hits, false_alarms;
+  int xerrno;
+  int done;
+};
+
+struct parallel_search {
+  struct rsync_session *sess;
+  struct rsync_sumtable *tab;
+  int fd;
+  off_t size;
+  uint32_t block_len;
+  int inplace;
+  const struct zero_block *zero;
+
+  struct search_region *regions;
+  unsigned int nregions;
+
+  /* Protected by the mutex. */
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  unsigned int next_region;
+  unsigned int nstitched;
+  unsigned int max_ahead;
+  int abort;
+};
+
+static int read_region_data(int fd, unsigned char *buf, size_t len,
+    off_t offset) {
+  size_t have = 0;
+
+  /* Note that this runs in the worker threads, which must not call into the
+   * rest of proftpd (e.g. to handle signals, or log).
+   */
+  while (have < len) {
+    ssize_t res;
+
+    res = pread(fd, buf + have, len - have, offset + have);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return -1;
+    }
+
+    if (res == 0) {
+      /* The file shrank; as for fmap, the missing data reads as zeroes. */
+      memset(buf + have, 0, len - have);
+      break;
+    }
+
+    have += res;
+  }
+
+  return 0;
+}
+
+static int add_region_match(struct search_region *region, off_t offset,
+    uint32_t weak, const unsigned char *digest) {
+  struct search_match *m;
+
+  if (region->nmatches == region->matchsz) {
+    size_t matchsz;
+
+    matchsz = region->matchsz ? region->matchsz * 2 : 1024;
+    m = realloc(region->matches, matchsz * sizeof(struct search_match));
+    if (m == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+
+    region->matches = m;
+    region->matchsz = matchsz;
+  }
+
+  m = &(region->matches[region->nmatches++]);
+  m->offset = offset;
+  m->weak = weak;
+  memcpy(m->digest, digest, sizeof(m->digest));
+  return 0;
+}
+
+static int search_region(struct parallel_search *ps,
+    struct search_region *region, unsigned char *buf, size_t bufsz) {
+  struct rsync_rolling roll;
+  struct file_holes holes;
+  unsigned char digest[RSYNC_CHECKSUM_MAX_DIGEST_LEN];
+  off_t offset, buf_start = 0, buf_end = 0;
+  int roll_valid = FALSE;
+
+  offset = region->start;
+
+  holes.fd = ps->fd;
+  holes.size = ps->size;
+  holes.start = holes.end = 0;
+
+  while (offset < region->stop) {
+    const unsigned char *data;
+    uint32_t k, weak;
+    int more;
+
+    k = get_search_len(ps->size, ps->block_len, offset);
+    more = (offset + k < ps->size);
+
+    /* As for skip_hole(). */
+    if (ps->zero->data != NULL &&
+        in_hole(&holes, offset, ps->block_len)) {
+      if (ps->zero->has &&
+          match_block(ps->tab, ps->block_len, ps->inplace, offset,
+            ps->zero->weak, ps->zero->strong, ps->block_len, -1) >= 0) {
+        if (add_region_match(region, offset, ps->zero->weak,
+            ps->zero->strong) < 0) {
+          return -1;
+        }
+
+        offset += ps->block_len;
+
+      } else {
+        offset = holes.end - ps->block_len + 1;
+      }
+
+      roll_valid = FALSE;
+      continue;
+    }
+
+    if (offset < buf_start ||
+        offset + k + more > buf_end) {
+      size_t len;
+
+      len = bufsz;
+      if (offset + (off_t) len > ps->size) {
+        len = (size_t) (ps->size - offset);
+      }
+
+      if (read_region_data(ps->fd, buf, len, offset) < 0) {
+        return -1;
+      }
+
+      buf_start = offset;
+      buf_end = offset + len;
+    }
+
+    data = buf + (offset - buf_start);
+
+    if (roll_valid == FALSE) {
+      rsync_rolling_init(&roll, data, k);
+      roll_valid = TRUE;
+    }
+
+    weak = rsync_rolling_get(&roll);
+
+    if (more) {
+      rsync_sumtable_prefetch(ps->tab, rsync_rolling_roll(&roll, data[0],
+        data[k]));
+
+    } else {
+      rsync_rolling_trim(&roll, data[0]);
+    }
+
+    if (rsync_sumtable_has(ps->tab, weak)) {
+      region->hash_hits++;
+
+      rsync_checksum_block(ps->sess, data, k, digest);
+      if (match_block(ps->tab, ps->block_len, ps->inplace, offset, weak,
+          digest, k, -1) >= 0) {
+        if (add_region_match(region, offset, weak, digest) < 0) {
+          return -1;
+        }
+
+        offset += k;
+        roll_valid = FALSE;
+        continue;
+      }
+
+      region->false_alarms++;
+    }
+
+    offset++;
+  }
+
+  return 0;
+}
+
+static void *search_thread(void *data) {
+  struct parallel_search *ps;
+  unsigned char *buf;
+  size_t bufsz;
+
+  ps = data;
+
+  /* Room for a block (and the byte after it) beyond the searched data. */
+  bufsz = RSYNC_SENDER_REGION_BUFFER_SIZE + ps->block_len + 1;
+  buf = malloc(bufsz);
+
+  pthread_mutex_lock(&(ps->mutex));
+
+  while (TRUE) {
+    struct search_region *region;
+    int res, xerrno = 0;
+
+    while (ps->abort == FALSE &&
+           ps->next_region < ps->nregions &&
+           ps->next_region >= ps->nstitched + ps->max_ahead) {
+      pthread_cond_wait(&(ps->cond), &(ps->mutex));
+    }
+
+    if (ps->abort == TRUE ||
+        ps->next_region >= ps->nregions) {
+      break;
+    }
+
+    region = &(ps->regions[ps->next_region++]);
+    pthread_mutex_unlock(&(ps->mutex));
+
+    if (buf != NULL) {
+      res = search_region(ps, region, buf, bufsz);
+      if (res < 0) {
+        xerrno = errno;
+      }
+
+    } else {
+      xerrno = ENOMEM;
+    }
+
+    pthread_mutex_lock(&(ps->mutex));
+    region->xerrno = xerrno;
+    region->done = TRUE;
+    pthread_cond_broadcast(&(ps->cond));
+  }
+
+  pthread_mutex_unlock(&(ps->mutex));
+
+  if (buf != NULL) {
+    free(buf);
+  }
+
+  return NULL;
+}
+
+/* Replays the serial search through the given region, using the worker's
+ * matches.
+ */
+static int stitch_region(struct sender_ctx *ctx, struct rsync_sumtable *tab,
+    struct search_state *st, struct search_region *region) {
+  uint32_t block_len;
+  size_t i = 0;
+
+  block_len = (uint32_t) st->head->block_len;
+
+  while (st->offset < region->stop) {
+    struct search_match *m = NULL;
+    const unsigned char *data;
+    uint32_t len;
+    int32_t idx;
+
+    /* Skip the matches we have already passed. */
+    while (i < region->nmatches) {
+      m = &(region->matches[i]);
+      if (m->offset + get_search_len(ctx->size, block_len, m->offset) >
+          st->offset) {
+        break;
+      }
+
+      m = NULL;
+      i++;
+    }
+
+    if (m != NULL &&
+        m->offset < st->offset) {
+      /* We are part-way through a block which the worker matched, so the
+       * worker did not search here.
+       */
+      if (search_step(ctx, tab, st) < 0) {
+        return -1;
+      }
+
+      continue;
+    }
+
+    if (m == NULL ||
+        m->offset > st->offset) {
+      /* The worker found no matches between here and there. */
+      if (skip_to(ctx, st, m != NULL ? m->offset : region->stop) < 0) {
+        return -1;
+      }
+
+      continue;
+    }
+
+    len = get_search_len(ctx->size, block_len, st->offset);
+
+    data = get_window(ctx, st->last_match, st->offset, len);
+    if (data == NULL) {
+      return -1;
+    }
+
+    idx = match_block(tab, block_len, ctx->inplace, st->offset, m->weak,
+      m->digest, len, st->want);
+    if (send_match(ctx, st, idx, data, len) < 0) {
+      return -1;
+    }
+
+    i++;
+  }
+
+  return 0;
+}
+
+static int parallel_search_file(struct sender_ctx *ctx,
+    struct rsync_sumtable *tab, unsigned int nthreads) {
+  struct parallel_search ps;
+  struct search_state st;
+  pthread_t *threads;
+  sigset_t all_sigs, saved_sigs;
+  off_t region_len, min_len;
+  unsigned int i, nstarted = 0;
+  int res = 0, xerrno = 0;
+
+  init_search(ctx, tab, &st);
+
+  memset(&ps, 0, sizeof(ps));
+  ps.sess = ctx->sess;
+  ps.tab = tab;
+  ps.fd = ctx->fd;
+  ps.size = ctx->size;
+  ps.block_len = (uint32_t) st.head->block_len;
+  ps.inplace = ctx->inplace;
+  ps.zero = &(ctx->zero);
+
+  /* Enough regions to keep the workers busy, even if they find them
+   * unevenly hard to search.
+   */
+  region_len = st.end / (nthreads * 8);
+  min_len = RSYNC_SENDER_MIN_REGION_SIZE;
+  if (min_len < (off_t) ps.block_len * 16) {
+    min_len = (off_t) ps.block_len * 16;
+  }
+
+  if (region_len < min_len) {
+    region_len = min_len;
+
+  } else if (region_len > RSYNC_SENDER_MAX_REGION_SIZE) {
+    region_len = RSYNC_SENDER_MAX_REGION_SIZE;
+  }
+
+  ps.nregions = (unsigned int) ((st.end + region_len - 1) / region_len);
+  if (ps.nregions < 2) {
+    return search_file(ctx, tab);
+  }
+
+  if (nthreads > ps.nregions) {
+    nthreads = ps.nregions;
+  }
+
+  ps.regions = pcalloc(ctx->pool,
+    ps.nregions * sizeof(struct search_region));
+  for (i = 0; i < ps.nregions; i++) {
+    ps.regions[i].start = (off_t) i * region_len;
+    ps.regions[i].stop = ps.regions[i].start + region_len;
+    if (ps.regions[i].stop > st.end) {
+      ps.regions[i].stop = st.end;
+    }
+  }
+
+  ps.max_ahead = nthreads * 2;
+  pthread_mutex_init(&(ps.mutex), NULL);
+  pthread_cond_init(&(ps.cond), NULL);
+
+  /* Make sure the rolling checksum kernel is chosen before the workers use
+   * it.
+   */
+  (void) rsync_rolling_get_kernel();
+
+  /* Signals are for the main thread to handle, not the workers. */
+  sigfillset(&all_sigs);
+  pthread_sigmask(SIG_BLOCK, &all_sigs, &saved_sigs);
+
+  threads = pcalloc(ctx->pool, nthreads * sizeof(pthread_t));
+  for (i = 0; i < nthreads; i++) {
+    int xerrno;
+
+    xerrno = pthread_create(&(threads[nstarted]), NULL, search_thread, &ps);
+    if (xerrno != 0) {
+      pr_trace_msg(trace_channel, 3,
+        "error starting search thread: %s", strerror(xerrno));
+      break;
+    }
+
+    nstarted++;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &saved_sigs, NULL);
+
+  pr_trace_msg(trace_channel, 12,
+    "searching %" PR_LU " bytes in %u regions using %u threads",
+    (pr_off_t) ctx->size, ps.nregions, nstarted);
+
+  if (nstarted == 0) {
+    pthread_cond_destroy(&(ps.cond));
+    pthread_mutex_destroy(&(ps.mutex));
+    return search_file(ctx, tab);
+  }
+
+  for (i = 0; i < ps.nregions; i++) {
+    struct search_region *region;
+
+    region = &(ps.regions[i]);
+
+    pthread_mutex_lock(&(ps.mutex));
+    while (region->done == FALSE) {
+      pthread_cond_wait(&(ps.cond), &(ps.mutex));
+    }
+    pthread_mutex_unlock(&(ps.mutex));
+
+    if (region->xerrno != 0) {
+      xerrno = region->xerrno;
+      (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+        "error searching file: %s", strerror(xerrno));
+      res = -1;
+      break;
+    }
+
+    pr_signals_handle();
+
+    ctx->stats->hash_hits += region->hash_hits;
+    ctx->stats->false_alarms += region->false_alarms;
+
+    if (stitch_region(ctx, tab, &st, region) < 0) {
+      xerrno = errno;
+      res = -1;
+      break;
+    }
+
+    if (region->matches != NULL) {
+      free(region->matches);
+      region->matches = NULL;
+    }
+
+    /* The workers are stopped below. */
+    if (search_not_paying(ctx, &st)) {
+      break;
+    }
+
+    pthread_mutex_lock(&(ps.mutex));
+    ps.nstitched = i + 1;
+    pthread_cond_broadcast(&(ps.cond));
+    pthread_mutex_unlock(&(ps.mutex));
+  }
+
+  pthread_mutex_lock(&(ps.mutex));
+  ps.abort = TRUE;
+  pthread_cond_broadcast(&(ps.cond));
+  pthread_mutex_unlock(&(ps.mutex));
+
+  for (i = 0; i < nstarted; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (i = 0; i < ps.nregions; i++) {
+    if (ps.regions[i].matches != NULL) {
+      free(ps.regions[i].matches);
+    }
+  }
+
+  pthread_cond_destroy(&(ps.cond));
+  pthread_mutex_destroy(&(ps.mutex));
+
+  if (res < 0) {
+    errno = xerrno;
+    return -1;
+  }
+
+  /* Whatever is left over is literal data. */
+  return send_token(ctx, st.last_match, ctx->size - st.last_match,
+    RSYNC_TOKEN_END, NULL, 0);
+}
+
+/* Returns the number of threads with which to search the file, if it is big
+ * enough to be worth searching in parallel.
+ */
+static unsigned int get_search_threads(struct sender_ctx *ctx,
+    const struct rsync_sum_head *head) {
+  unsigned int nthreads;
+  long ncpus;
+
+  if (parallel_max_threads < 2 ||
+      ctx->size < parallel_min_size ||
+      head->block_len > RSYNC_GENERATOR_MAX_BLOCK_SIZE) {
+    return 1;
+  }
+
+  nthreads = parallel_max_threads;
+
+  ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpus > 0 &&
+      nthreads > (unsigned int) ncpus) {
+    nthreads = (unsigned int) ncpus;
+  }
+
+  return nthreads;
+}
+#endif /* HAVE_PTHREAD */
+
+int rsync_sender_set_parallel(off_t min_size, unsigned int max_threads) {
+  if (min_size < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+#ifndef HAVE_PTHREAD
+  if (max_threads > 1) {
+    errno = ENOSYS;
+    return -1;
+  }
+#endif /* !HAVE_PTHREAD */
+
+  parallel_min_size = min_size;
+  parallel_max_threads = max_threads;
+  return 0;
+}
+
+int rsync_sender_set_fallback(off_t sample_size,
+    unsigned int min_match_pct) {
+  if (sample_size <= 0 ||
+      min_match_pct > 100) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  fallback_sample_size = sample_size;
+  fallback_min_match_pct = min_match_pct;
+  return 0;
+}
+
+int rsync_sender_prefetch_file(int fd, off_t size) {
+  if (fd < 0 ||
+      size < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (size > RSYNC_SENDER_PREFETCH_SIZE) {
+    size = RSYNC_SENDER_PREFETCH_SIZE;
+  }
+
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+  if (size > 0) {
+    int res;
+
+    /* Note that posix_fadvise(3) returns the error, rather than setting
+     * errno.
+     */
+    res = posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+    if (res != 0) {
+      errno = res;
+      return -1;
+    }
+  }
+#endif /* HAVE_POSIX_FADVISE and POSIX_FADV_WILLNEED */
+
+  return 0;
+}
+
+/* Records how the file's transfer went, for next time (see policy.h). */
+static void record_policy(struct sender_ctx *ctx, const char *path,
+    const struct rsync_sum_head *head, int whole) {
+  struct rsync_policy_stats policy_stats;
+
+  memset(&policy_stats, 0, sizeof(policy_stats));
+
+  if (!whole) {
+    policy_stats.total_bytes = ctx->stats->literal_bytes +
+      ctx->stats->matched_bytes;
+    policy_stats.matched_bytes = ctx->stats->matched_bytes;
+    policy_stats.literal_runs = ctx->stats->literal_runs;
+    policy_stats.block_len = head->block_len;
+  }
+
+  /* A little data says little about how well the rest would compress. */
+  if (ctx->stats->literal_bytes >= RSYNC_TOKEN_CHUNK_SIZE &&
+      rsync_token_is_compressing(ctx->sess) == TRUE) {
+    policy_stats.raw_bytes = ctx->stats->literal_bytes;
+    policy_stats.compressed_bytes = ctx->sent_bytes;
+  }
+
+  (void) rsync_policy_record(path, &policy_stats);
+}
+
+int rsync_sender_send_file(pool *p, struct rsync_session *sess, int fd,
+    const char *path, struct rsync_sumtable *tab,
+    struct rsync_sender_stats *stats) {
+  struct rsync_options *opts;
+  struct rsync_sender_stats file_stats;
+  struct sender_ctx ctx;
+  const struct rsync_sum_head *head = NULL;
+  struct stat st;
+  pool *tmp_pool;
+  unsigned char digest[RSYNC_CHECKSUM_MAX_DIGEST_LEN];
+  size_t digest_len;
+  off_t start = 0;
+  int res, small = FALSE, whole, xerrno;
+
+  if (p == NULL ||
+      sess == NULL ||
+      fd < 0 ||
+      path == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (fstat(fd, &st) < 0) {
+    return -1;
+  }
+
+  opts = sess->options;
+
+  if (tab != NULL) {
+    head = rsync_sumtable_get_head(tab);
+    if (head->count == 0) {
+      tab = NULL;
+    }
+  }
+
+  /* Without a basis file to match against, there is nothing to search.
+   * When appending, the receiver's file is assumed to be a prefix of ours;
+   * we send only what follows it.
+   */
+  whole = (tab == NULL || opts->whole_file);
+
+  if (tab != NULL &&
+      opts->append_mode > 0) {
+    start = rsync_generator_get_basis_len(head);
+    if (start > st.st_size) {
+      pr_trace_msg(trace_channel, 3,
+        "cannot append to '%s': receiver has %" PR_LU " bytes, we have only "
+        "%" PR_LU, path, (pr_off_t) start, (pr_off_t) st.st_size);
+      errno = ERANGE;
+      return -1;
+    }
+
+    whole = TRUE;
+
+  } else if (st.st_size < rsync_small_file_size) {
+    /* Sending a small file whole costs less than searching it. */
+    small = whole = TRUE;
+
+  } else if (!whole &&
+             (rsync_policy_get_flags(path) & RSYNC_POLICY_FL_WHOLE_FILE)) {
+    /* Nor is searching a file which has not matched before worth it. */
+    pr_trace_msg(trace_channel, 15,
+      "'%s' has not matched before, sending it whole", path);
+    whole = TRUE;
+  }
+
+  tmp_pool = make_sub_pool(p);
+  pr_pool_tag(tmp_pool, "rsync sender pool");
+
+  memset(&file_stats, 0, sizeof(file_stats));
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.pool = tmp_pool;
+  ctx.sess = sess;
+  ctx.stats = &file_stats;
+  ctx.fd = fd;
+  ctx.size = st.st_size;
+  ctx.inplace = opts->inplace;
+
+  ctx.file_sum = rsync_checksum_create(tmp_pool, sess->checksum_algo,
+    opts->checksum_seed);
+  if (ctx.file_sum == NULL) {
+    xerrno = errno;
+
+    destroy_pool(tmp_pool);
+    errno = xerrno;
+    return -1;
+  }
+
+  if (sess->workers != NULL &&
+      !small) {
+    ctx.file_sum_offload = rsync_workers_checksum_create(tmp_pool,
+      sess->workers, ctx.file_sum);
+  }
+
+  /* The output buffer holds a chunk of data (or, for a small file, all of
+   * it), and the file checksum.
+   */
+  ctx.bufsz = ctx.buflen = rsync_token_send_bound(sess,
+    small && st.st_size < RSYNC_TOKEN_CHUNK_SIZE ? (uint32_t) st.st_size :
+      RSYNC_TOKEN_CHUNK_SIZE) + RSYNC_CHECKSUM_MAX_DIGEST_LEN;
+  ctx.ptr = ctx.buf = palloc(tmp_pool, ctx.bufsz);
+
+  if (small) {
+    res = send_small_file(&ctx, path);
+
+  } else if (whole) {
+    res = send_whole_file(&ctx, path, start, opts->append_mode == 2);
+
+  } else {
+    const unsigned char *data;
+    size_t min_len;
+    uint32_t len;
+#ifdef HAVE_PTHREAD
+    unsigned int nthreads;
+#endif /* HAVE_PTHREAD */
+
+    /* The window must hold a chunk of unsent literal data, plus a block; make
+     * it big enough that it moves (relatively) rarely.
+     */
+    ctx.window_len = RSYNC_SENDER_WINDOW_SIZE;
+    min_len = 2 * (RSYNC_TOKEN_CHUNK_SIZE + (size_t) head->block_len);
+    if (ctx.window_len < min_len) {
+      ctx.window_len = min_len;
+    }
+
+    ctx.map = rsync_fmap_open(tmp_pool, fd, st.st_size, ctx.window_len);
+    if (ctx.map == NULL) {
+      xerrno = errno;
+
+      destroy_pool(tmp_pool);
+      errno = xerrno;
+      return -1;
+    }
+
+    /* Let the token layer decide whether this file is worth compressing. */
+    len = st.st_size > RSYNC_TOKEN_CHUNK_SIZE ? RSYNC_TOKEN_CHUNK_SIZE :
+      (uint32_t) st.st_size;
+    data = get_window(&ctx, 0, 0, len);
+    if (data == NULL ||
+        start_file(&ctx, path, data, len) < 0) {
+      xerrno = errno;
+
+      destroy_pool(tmp_pool);
+      errno = xerrno;
+      return -1;
+    }
+
+#ifdef HAVE_PTHREAD
+    init_holes(&ctx, tab, head);
+
+    nthreads = get_search_threads(&ctx, head);
+    if (nthreads > 1) {
+      res = parallel_search_file(&ctx, tab, nthreads);
+
+    } else {
+      res = search_file(&ctx, tab);
+    }
+#else
+    init_holes(&ctx, tab, head);
+    res = search_file(&ctx, tab);
+#endif /* HAVE_PTHREAD */
+  }
+
+  /* Even on error, the worker must be done with the buffers before they are
+   * freed.
+   */
+  if (ctx.file_sum_offload != NULL) {
+    xerrno = errno;
+
+    if (rsync_workers_checksum_flush(ctx.file_sum_offload) < 0 &&
+        res == 0) {
+      xerrno = errno;
+      res = -1;
+    }
+
+    errno = xerrno;
+  }
+
+  if (res == 0) {
+    digest_len = rsync_checksum_finish(ctx.file_sum, digest);
+
+    res = reserve_output(&ctx, (uint32_t) digest_len);
+    if (res == 0) {
+      rsync_msg_write_data(&(ctx.buf), &(ctx.buflen), digest, digest_len);
+      res = flush_output(&ctx);
+    }
+  }
+
+  xerrno = errno;
+
+  if (res == 0 &&
+      opts->append_mode == 0) {
+    record_policy(&ctx, path, tab != NULL ? head : NULL, whole);
+  }
+
+  pr_trace_msg(trace_channel, 15,
+    "sent '%s': %" PR_LU " literal bytes, %" PR_LU " matched bytes "
+    "(%" PR_LU " blocks), %" PR_LU " hash hits, %" PR_LU " false alarms%s",
+    path, (pr_off_t) file_stats.literal_bytes,
+    (pr_off_t) file_stats.matched_bytes, (pr_off_t) file_stats.matched_blocks,
+    (pr_off_t) file_stats.hash_hits, (pr_off_t) file_stats.false_alarms,
+    file_stats.fallbacks > 0 ? " (search abandoned)" : "");
+
+  if (stats != NULL) {
+    stats->literal_bytes += file_stats.literal_bytes;
+    stats->matched_bytes += file_stats.matched_bytes;
+    stats->matched_blocks += file_stats.matched_blocks;
+    stats->hash_hits += file_stats.hash_hits;
+    stats->false_alarms += file_stats.false_alarms;
+    stats->fallbacks += file_stats.fallbacks;
+    stats->literal_runs += file_stats.literal_runs;
+  }
+
+  destroy_pool(tmp_pool);
+  errno = xerrno;
+  return res;
+}
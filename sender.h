@@ -0,0 +1,131 @@
+/*
+ * ProFTPD - mod_rsync sender
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_RSYNC_SENDER_H
+#define MOD_RSYNC_SENDER_H
+
+#include "mod_rsync.h"
+#include "session.h"
+#include "sumtable.h"
+
+/* As the sender, we walk through each file, looking for data matching the
+ * blocks of the receiver's basis file, per rsync-${version}/match.c.  The
+ * file's delta is sent as a token stream (see token.h): literal data, and
+ * references to the matched blocks; then the whole-file checksum.
+ */
+
+/* The file is mapped through a window of (at least) this size. */
+#define RSYNC_SENDER_WINDOW_SIZE		(4 * 1024 * 1024)
+
+/* Without compression, literal chunks of at least this size are sent
+ * straight from the mapped file, rather than copied into the output buffer.
+ */
+#define RSYNC_SENDER_DIRECT_MIN_SIZE		(4 * 1024)
+
+/* A huge file may be searched in parallel by worker threads, each taking a
+ * region of the file at a time; see rsync_sender_set_parallel().  Regions are
+ * sized to give each thread several, within these limits.
+ */
+#define RSYNC_SENDER_DEFAULT_PARALLEL_MIN_SIZE	(((off_t) 1) << 30)
+#define RSYNC_SENDER_MIN_REGION_SIZE		(256 * 1024)
+#define RSYNC_SENDER_MAX_REGION_SIZE		(64 * 1024 * 1024)
+
+/* A file whose delta is hardly matching is not worth searching: the search
+ * is checked after each sample of this size, and if less than the given
+ * percentage of each of several samples in a row matched, the rest of the
+ * file is sent as literal data; see rsync_sender_set_fallback().  By
+ * default, the whole file is always searched, as rsync does.
+ */
+#define RSYNC_SENDER_DEFAULT_FALLBACK_SAMPLE_SIZE	(8 * 1024 * 1024)
+#define RSYNC_SENDER_DEFAULT_FALLBACK_MIN_MATCH_PCT	0
+#define RSYNC_SENDER_FALLBACK_SAMPLES			4
+
+/* Each worker reads its region through a buffer of this size. */
+#define RSYNC_SENDER_REGION_BUFFER_SIZE		(1024 * 1024)
+
+/* Files sent whole (i.e. with no basis file, or --whole-file) are read
+ * through a buffer of this size.
+ */
+#define RSYNC_SENDER_READ_SIZE			(1024 * 1024)
+
+/* How much of the next file to send is read ahead, while sending this one. */
+#define RSYNC_SENDER_PREFETCH_SIZE		(4 * 1024 * 1024)
+
+struct rsync_sender_stats {
+  uint64_t literal_bytes;
+  uint64_t matched_bytes;
+  uint64_t matched_blocks;
+
+  /* The runs of literal data, i.e. the changed regions, sent. */
+  uint64_t literal_runs;
+
+  /* Rolling checksum matches, and how many of those then failed to match
+   * the strong checksum.
+   */
+  uint64_t hash_hits;
+  uint64_t false_alarms;
+
+  /* Files whose search was abandoned part-way, as not paying off. */
+  uint64_t fallbacks;
+};
+
+/* Sends the delta of the file open on the given descriptor against the
+ * receiver's block sums; a NULL table (no basis file), or --whole-file, sends
+ * the whole file as literal data, without the page cache holding on to it.
+ * A file smaller than rsync_small_file_size is always sent whole, in a single
+ * write.  A file which has not matched before is sent whole too (see
+ * policy.h), which also records how this file's transfer went.
+ * When appending, the table need only have its header, and just the data
+ * beyond the receiver's length is sent; if the file is shorter than that,
+ * nothing is sent, and -1 is returned with errno set to ERANGE.  The counts
+ * for this file are added to the given stats, if any.
+ */
+int rsync_sender_send_file(pool *p, struct rsync_session *sess, int fd,
+  const char *path, struct rsync_sumtable *tab,
+  struct rsync_sender_stats *stats);
+
+/* Asks the kernel to start reading the given file (the next one to be sent),
+ * up to RSYNC_SENDER_PREFETCH_SIZE bytes of it, in the background.
+ */
+int rsync_sender_prefetch_file(int fd, off_t size);
+
+/* Searches files of at least the given size using up to the given number of
+ * threads (limited to the number of CPUs); fewer than 2 threads disables
+ * parallel searching, which is the default.  The token stream sent is the
+ * same either way, unless the search is abandoned (see
+ * rsync_sender_set_fallback()): a parallel search is only checked after each
+ * region, so may be abandoned later.  Returns ENOSYS if threads are wanted
+ * but not supported.
+ */
+int rsync_sender_set_parallel(off_t min_size, unsigned int max_threads);
+
+/* Abandons the search of a file, sending the rest of it as literal data, if
+ * less than min_match_pct percent of each of the last
+ * RSYNC_SENDER_FALLBACK_SAMPLES samples of sample_size bytes searched
+ * matched.  A min_match_pct of 0 (the default) always searches the whole
+ * file.
+ */
+int rsync_sender_set_fallback(off_t sample_size, unsigned int min_match_pct);
+
+#endif /* MOD_RSYNC_SENDER_H */
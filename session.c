@@ -24,6 +24,7 @@
 
 #include "mod_rsync.h"
 #include "session.h"
+#include "workers.h"
 
 static struct rsync_session *rsync_sessions = NULL;
 
@@ -77,6 +78,15 @@ int rsync_session_open(uint32_t channel_id) {
   sess->pool = sub_pool;
   sess->channel_id = channel_id;
 
+  if (rsync_workers_get_count() > 0) {
+    sess->workers = rsync_workers_create(sub_pool, rsync_workers_get_count());
+    if (sess->workers == NULL) {
+      (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+        "error starting worker threads, continuing without them: %s",
+        strerror(errno));
+    }
+  }
+
   if (last) {
     last->next = sess;
     sess->prev = last;
@@ -111,6 +121,11 @@ int rsync_session_close(uint32_t channel_id) {
 
       /* XXX Perform any necessarily cleanup/checks here */
 
+      if (sess->workers != NULL) {
+        (void) rsync_workers_destroy(sess->workers);
+        sess->workers = NULL;
+      }
+
       pr_session_set_protocol("ssh2");
       return 0;
     }
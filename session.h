@@ -39,6 +39,9 @@ struct rsync_session {
 
   unsigned int protocol_version;
 
+  /* Compatibility flags sent to the client (protocol 30 and later). */
+  int32_t compat_flags;
+
   /* Opaque pointer to a struct rsync_options; will be filled in later. */
   void *options;
 
@@ -48,6 +51,23 @@ struct rsync_session {
   /* Checksum seed */
   int32_t checksum_seed;
 
+  /* Checksum algorithm used for block and file checksums; see checksum.h. */
+  int checksum_algo;
+
+  /* Compression algorithm, and opaque pointer to the session's
+   * struct rsync_compress stream; see compress.h.
+   */
+  int compress_algo;
+  void *compressor;
+
+  /* Opaque pointer to the session's token stream state; see token.h. */
+  void *tokens;
+
+  /* Opaque pointer to the session's struct rsync_workers pool, if any; see
+   * workers.h.
+   */
+  void *workers;
+
   /* Filters */
   array_header *filters;
 };
@@ -59,6 +79,7 @@ struct rsync_session {
 #define RSYNC_SESS_FL_SENT_MANIFEST	0x008
 
 #define RSYNC_SESS_FL_RECVD_DATA	0x010
+#define RSYNC_SESS_FL_NEGOTIATED	0x020
 
 struct rsync_session *rsync_session_get(uint32_t channel_id);
 int rsync_session_open(uint32_t channel_id);
@@ -0,0 +1,371 @@
+/*
+ * ProFTPD - mod_rsync signature cache
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_rsync.h"
+#include "sigcache.h"
+#include "checksum.h"
+
+static const char *trace_channel = "rsync.sigcache";
+
+static const char *sigcache_dir = NULL;
+
+#define RSYNC_SIGCACHE_MAGIC		0x47495352
+#define RSYNC_SIGCACHE_VERSION		2
+
+/* Each entry is this header, followed by the rolling checksums of all of the
+ * blocks.  Entries are only read by the host which wrote them, so host byte
+ * order is used.
+ */
+struct sigcache_header {
+  uint32_t magic;
+  uint32_t version;
+
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+
+  int32_t block_len;
+  int32_t algo;
+  int32_t count;
+};
+
+struct rsync_sigcache {
+  pool *pool;
+  struct sigcache_header hdr;
+  int flags;
+
+  /* The existing entry, if any. */
+  const char *path;
+  int fd;
+
+  /* The new entry, if any, written to a temporary file. */
+  char *tmp_path;
+  int tmp_fd;
+  uint32_t nput;
+};
+
+int rsync_sigcache_set_dir(pool *p, const char *path) {
+  if (path == NULL) {
+    sigcache_dir = NULL;
+    return 0;
+  }
+
+  if (p == NULL ||
+      *path != '/') {
+    errno = EINVAL;
+    return -1;
+  }
+
+  sigcache_dir = pstrdup(p, path);
+  return 0;
+}
+
+static int64_t get_mtime_nsec(const struct stat *st) {
+#if defined(__APPLE__)
+  return st->st_mtimespec.tv_nsec;
+#elif defined(st_mtime)
+  /* POSIX.1-2008 systems define st_mtime in terms of st_mtim. */
+  return st->st_mtim.tv_nsec;
+#else
+  return 0;
+#endif
+}
+
+static void set_key(struct rsync_session *sess, const struct stat *st,
+    const struct rsync_sum_head *head, struct sigcache_header *hdr) {
+  memset(hdr, 0, sizeof(struct sigcache_header));
+  hdr->magic = RSYNC_SIGCACHE_MAGIC;
+  hdr->version = RSYNC_SIGCACHE_VERSION;
+  hdr->dev = (uint64_t) st->st_dev;
+  hdr->ino = (uint64_t) st->st_ino;
+  hdr->size = (uint64_t) st->st_size;
+  hdr->mtime_sec = (int64_t) st->st_mtime;
+  hdr->mtime_nsec = get_mtime_nsec(st);
+  hdr->block_len = head->block_len;
+  hdr->algo = sess->checksum_algo;
+  hdr->count = head->count;
+}
+
+static off_t get_entry_size(const struct sigcache_header *hdr) {
+  return (off_t) sizeof(struct sigcache_header) +
+    ((off_t) hdr->count * sizeof(uint32_t));
+}
+
+/* Checks the existing entry, if any, against the expected key. */
+static int read_entry(struct rsync_sigcache *cache) {
+  struct sigcache_header hdr;
+  struct stat st;
+  ssize_t res;
+
+  cache->fd = open(cache->path, O_RDONLY|O_NOFOLLOW);
+  if (cache->fd < 0) {
+    return -1;
+  }
+
+  res = pread(cache->fd, &hdr, sizeof(hdr), 0);
+  if (res != (ssize_t) sizeof(hdr) ||
+      fstat(cache->fd, &st) < 0 ||
+      hdr.magic != cache->hdr.magic ||
+      hdr.version != cache->hdr.version ||
+      hdr.dev != cache->hdr.dev ||
+      hdr.ino != cache->hdr.ino ||
+      hdr.size != cache->hdr.size ||
+      hdr.mtime_sec != cache->hdr.mtime_sec ||
+      hdr.mtime_nsec != cache->hdr.mtime_nsec ||
+      hdr.block_len != cache->hdr.block_len ||
+      hdr.algo != cache->hdr.algo ||
+      hdr.count != cache->hdr.count ||
+      st.st_size != get_entry_size(&hdr)) {
+    pr_trace_msg(trace_channel, 9, "ignoring stale cache entry '%s'",
+      cache->path);
+    (void) close(cache->fd);
+    cache->fd = -1;
+    return -1;
+  }
+
+  cache->flags = RSYNC_SIGCACHE_FL_WEAK;
+  return 0;
+}
+
+static int create_entry(struct rsync_sigcache *cache) {
+  ssize_t res;
+
+  cache->tmp_path = pstrcat(cache->pool, cache->path, ".XXXXXX", NULL);
+  cache->tmp_fd = mkstemp(cache->tmp_path);
+  if (cache->tmp_fd < 0) {
+    pr_trace_msg(trace_channel, 3,
+      "unable to create cache entry '%s': %s", cache->tmp_path,
+      strerror(errno));
+    cache->tmp_path = NULL;
+    return -1;
+  }
+
+  res = pwrite(cache->tmp_fd, &(cache->hdr), sizeof(cache->hdr), 0);
+  if (res != (ssize_t) sizeof(cache->hdr)) {
+    int xerrno = errno;
+
+    (void) close(cache->tmp_fd);
+    (void) unlink(cache->tmp_path);
+    cache->tmp_fd = -1;
+    cache->tmp_path = NULL;
+
+    errno = xerrno;
+    return -1;
+  }
+
+  return 0;
+}
+
+static void discard_entry(struct rsync_sigcache *cache) {
+  if (cache->tmp_fd >= 0) {
+    (void) close(cache->tmp_fd);
+    cache->tmp_fd = -1;
+  }
+
+  if (cache->tmp_path != NULL) {
+    (void) unlink(cache->tmp_path);
+    cache->tmp_path = NULL;
+  }
+}
+
+static void sigcache_cleanup_cb(void *data) {
+  struct rsync_sigcache *cache;
+
+  cache = data;
+
+  if (cache->fd >= 0) {
+    (void) close(cache->fd);
+    cache->fd = -1;
+  }
+
+  discard_entry(cache);
+}
+
+struct rsync_sigcache *rsync_sigcache_open(pool *p,
+    struct rsync_session *sess, const struct stat *st,
+    const struct rsync_sum_head *head) {
+  struct rsync_sigcache *cache;
+  char name[128];
+
+  if (p == NULL ||
+      sess == NULL ||
+      st == NULL ||
+      head == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (sigcache_dir == NULL) {
+    errno = ENOSYS;
+    return NULL;
+  }
+
+  cache = pcalloc(p, sizeof(struct rsync_sigcache));
+  cache->pool = p;
+  cache->fd = cache->tmp_fd = -1;
+  set_key(sess, st, head, &(cache->hdr));
+
+  memset(name, '\0', sizeof(name));
+  pr_snprintf(name, sizeof(name)-1, "%llx-%llx-%s.sig",
+    (unsigned long long) cache->hdr.dev, (unsigned long long) cache->hdr.ino,
+    rsync_checksum_get_name(sess->checksum_algo));
+  cache->path = pdircat(p, sigcache_dir, name, NULL);
+
+  register_cleanup(p, cache, sigcache_cleanup_cb, sigcache_cleanup_cb);
+
+  /* A valid entry is never rewritten; only a missing or stale one is. */
+  if (read_entry(cache) == 0) {
+    pr_trace_msg(trace_channel, 9, "found cached sums in '%s'", cache->path);
+
+  } else {
+    (void) create_entry(cache);
+  }
+
+  return cache;
+}
+
+int rsync_sigcache_get_flags(struct rsync_sigcache *cache) {
+  if (cache == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return cache->flags;
+}
+
+int rsync_sigcache_get_sums(struct rsync_sigcache *cache, uint32_t idx,
+    uint32_t count, uint32_t *sums) {
+  off_t offset;
+  size_t len;
+
+  if (cache == NULL ||
+      sums == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (cache->fd < 0) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  if ((uint64_t) idx + count > (uint64_t) cache->hdr.count) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  offset = (off_t) sizeof(struct sigcache_header) +
+    ((off_t) idx * sizeof(uint32_t));
+  len = count * sizeof(uint32_t);
+  if (pread(cache->fd, sums, len, offset) != (ssize_t) len) {
+    errno = EIO;
+    return -1;
+  }
+
+  return 0;
+}
+
+int rsync_sigcache_put_sums(struct rsync_sigcache *cache, uint32_t idx,
+    uint32_t count, const uint32_t *sums) {
+  off_t offset;
+  size_t len;
+
+  if (cache == NULL ||
+      sums == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (cache->tmp_fd < 0) {
+    /* Not writing a new entry. */
+    return 0;
+  }
+
+  if (idx != cache->nput ||
+      (uint64_t) idx + count > (uint64_t) cache->hdr.count) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  offset = (off_t) sizeof(struct sigcache_header) +
+    ((off_t) idx * sizeof(uint32_t));
+  len = count * sizeof(uint32_t);
+  if (pwrite(cache->tmp_fd, sums, len, offset) != (ssize_t) len) {
+    pr_trace_msg(trace_channel, 3, "error writing cache entry '%s': %s",
+      cache->tmp_path, strerror(errno));
+    discard_entry(cache);
+    return 0;
+  }
+
+  cache->nput += count;
+  return 0;
+}
+
+int rsync_sigcache_close(struct rsync_sigcache *cache, int fd) {
+  if (cache == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (cache->fd >= 0) {
+    (void) close(cache->fd);
+    cache->fd = -1;
+  }
+
+  if (cache->tmp_fd >= 0) {
+    struct stat st;
+
+    /* Make sure that the basis file did not change while we read it. */
+    if (cache->nput != (uint32_t) cache->hdr.count ||
+        fd < 0 ||
+        fstat(fd, &st) < 0 ||
+        (uint64_t) st.st_size != cache->hdr.size ||
+        (int64_t) st.st_mtime != cache->hdr.mtime_sec ||
+        get_mtime_nsec(&st) != cache->hdr.mtime_nsec) {
+      pr_trace_msg(trace_channel, 9,
+        "basis file changed or sums incomplete, discarding cache entry '%s'",
+        cache->tmp_path);
+      discard_entry(cache);
+      return 0;
+    }
+
+    (void) close(cache->tmp_fd);
+    cache->tmp_fd = -1;
+
+    if (rename(cache->tmp_path, cache->path) < 0) {
+      pr_trace_msg(trace_channel, 3, "error renaming '%s' to '%s': %s",
+        cache->tmp_path, cache->path, strerror(errno));
+      (void) unlink(cache->tmp_path);
+
+    } else {
+      pr_trace_msg(trace_channel, 9, "stored cache entry '%s'", cache->path);
+    }
+
+    cache->tmp_path = NULL;
+  }
+
+  return 0;
+}
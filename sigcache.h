@@ -0,0 +1,78 @@
+/*
+ * ProFTPD - mod_rsync signature cache
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_RSYNC_SIGCACHE_H
+#define MOD_RSYNC_SIGCACHE_H
+
+#include "mod_rsync.h"
+#include "session.h"
+#include "generator.h"
+
+/* An on-disk cache of basis file signatures, for clients which upload the
+ * same (large) files to the same paths repeatedly.  Entries are keyed by the
+ * basis file's identity (device, inode, size, and modification time), the
+ * block length, and the checksum algorithm.
+ *
+ * Only the rolling checksums are cached, as they do not depend on the
+ * checksum seed.  The strong checksums do, and the seed differs for every
+ * session unless the client pins it (--checksum-seed), so the basis file is
+ * still read for those; caching them would only pay off for clients which
+ * always pin the same seed.
+ */
+
+/* Which sums a cache entry can supply. */
+#define RSYNC_SIGCACHE_FL_WEAK		0x001
+
+struct rsync_sigcache;
+
+/* Configures the cache directory; a NULL path disables the cache. */
+int rsync_sigcache_set_dir(pool *p, const char *path);
+
+/* Opens the cache entry for the given basis file and sum header; if there
+ * is no valid entry, a new one is started.  Returns NULL, with errno set to
+ * ENOSYS, if the cache is disabled.
+ */
+struct rsync_sigcache *rsync_sigcache_open(pool *p,
+  struct rsync_session *sess, const struct stat *st,
+  const struct rsync_sum_head *head);
+
+/* Returns the RSYNC_SIGCACHE_FL_ flags for the sums which the entry has. */
+int rsync_sigcache_get_flags(struct rsync_sigcache *cache);
+
+/* Reads the rolling checksums of count blocks, starting at the given block. */
+int rsync_sigcache_get_sums(struct rsync_sigcache *cache, uint32_t idx,
+  uint32_t count, uint32_t *sums);
+
+/* Records the rolling checksums of count blocks, starting at the given block,
+ * for a new entry; does nothing if the entry already exists.
+ */
+int rsync_sigcache_put_sums(struct rsync_sigcache *cache, uint32_t idx,
+  uint32_t count, const uint32_t *sums);
+
+/* Closes the entry.  A new entry is only stored if fd still refers to the
+ * same, unmodified basis file, and all of its sums were recorded.
+ */
+int rsync_sigcache_close(struct rsync_sigcache *cache, int fd);
+
+#endif /* MOD_RSYNC_SIGCACHE_H */
@@ -0,0 +1,363 @@
+/*
+ * ProFTPD - mod_rsync block sum table
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_rsync.h"
+#include "sumtable.h"
+#include "checksum.h"
+#include "msg.h"
+
+static const char *trace_channel = "rsync.sumtable";
+
+struct rsync_sumtable {
+  pool *pool;
+  struct rsync_sum_head head;
+
+  /* Truncated strong checksums, in block order. */
+  unsigned char *strong;
+
+  /* Each slot holds the rolling checksum in its high 32 bits, and the block
+   * index + 1 in its low 32 bits; zero marks an empty slot.
+   */
+  uint64_t *slots;
+  uint32_t nslots;
+
+  /* Most lookups miss; a bitmap of the (mixed) rolling checksums present,
+   * at about 16 bits per block, answers most of those with a single bit
+   * test, rather than a probe sequence.
+   */
+  uint64_t *filter;
+  unsigned int filter_shift;
+
+  /* Blocks decoded so far, and any partially received sum. */
+  int32_t ndecoded;
+  unsigned char pending[4 + RSYNC_CHECKSUM_MAX_DIGEST_LEN];
+  uint32_t pendinglen;
+};
+
+/* The rolling checksum's two halves are simple sums, so it is mixed before
+ * use as a hash.
+ */
+static inline uint32_t mix_weak(uint32_t weak) {
+  return weak * 0x9e3779b1U;
+}
+
+/* Maps the rolling checksum onto the slots; multiplying by the number of
+ * slots avoids needing a power-of-two table size.
+ */
+static inline uint32_t get_slot(const struct rsync_sumtable *tab,
+    uint32_t weak) {
+  return (uint32_t) (((uint64_t) mix_weak(weak) * tab->nslots) >> 32);
+}
+
+static inline uint32_t get_filter_bit(const struct rsync_sumtable *tab,
+    uint32_t weak) {
+  return mix_weak(weak) >> tab->filter_shift;
+}
+
+int rsync_sumtable_read_head(pool *p, struct rsync_session *sess,
+    unsigned char **buf, uint32_t *buflen, struct rsync_sum_head *head) {
+  int32_t max_block_len;
+
+  if (p == NULL ||
+      sess == NULL ||
+      buf == NULL ||
+      buflen == NULL ||
+      head == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (*buflen < sizeof(struct rsync_sum_head)) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  head->count = rsync_msg_read_int(p, buf, buflen);
+  head->block_len = rsync_msg_read_int(p, buf, buflen);
+  head->s2len = rsync_msg_read_int(p, buf, buflen);
+  head->remainder = rsync_msg_read_int(p, buf, buflen);
+
+  max_block_len = sess->protocol_version < 30 ?
+    RSYNC_GENERATOR_OLD_MAX_BLOCK_SIZE : RSYNC_GENERATOR_MAX_BLOCK_SIZE;
+
+  if (head->count < 0 ||
+      head->block_len < 0 ||
+      head->block_len > max_block_len ||
+      (head->count > 0 && head->block_len == 0) ||
+      head->s2len < 0 ||
+      head->s2len > RSYNC_CHECKSUM_MAX_DIGEST_LEN ||
+      head->remainder < 0 ||
+      head->remainder > head->block_len) {
+    (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+      "received invalid sum header (count = %ld, block length = %ld, "
+      "s2length = %ld, remainder = %ld)", (long) head->count,
+      (long) head->block_len, (long) head->s2len, (long) head->remainder);
+    errno = EINVAL;
+    return -1;
+  }
+
+  pr_trace_msg(trace_channel, 17,
+    "received sum head: count = %ld, block length = %ld, s2length = %ld, "
+    "remainder = %ld", (long) head->count, (long) head->block_len,
+    (long) head->s2len, (long) head->remainder);
+  return 0;
+}
+
+struct rsync_sumtable *rsync_sumtable_create(pool *p,
+    const struct rsync_sum_head *head) {
+  struct rsync_sumtable *tab;
+  unsigned int filter_bits = 9;
+
+  if (p == NULL ||
+      head == NULL ||
+      head->count < 0 ||
+      head->s2len < 0 ||
+      head->s2len > RSYNC_CHECKSUM_MAX_DIGEST_LEN) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  tab = pcalloc(p, sizeof(struct rsync_sumtable));
+  tab->pool = p;
+  memcpy(&(tab->head), head, sizeof(struct rsync_sum_head));
+
+  /* A load factor of about 2/3 keeps the probe sequences for misses short. */
+  tab->nslots = (uint32_t) head->count + ((uint32_t) head->count / 2) + 1;
+
+  while (filter_bits < 32 &&
+         ((uint64_t) 1 << filter_bits) < (uint64_t) head->count * 16) {
+    filter_bits++;
+  }
+
+  tab->filter_shift = 32 - filter_bits;
+
+  /* The slots, strong checksums and filter are allocated when the sums are
+   * decoded; when appending, there are none.
+   */
+  return tab;
+}
+
+static void alloc_sums(struct rsync_sumtable *tab) {
+  tab->slots = pcalloc(tab->pool, (size_t) tab->nslots * sizeof(uint64_t));
+  tab->strong = palloc(tab->pool,
+    ((size_t) tab->head.count * tab->head.s2len) + 1);
+  tab->filter = pcalloc(tab->pool,
+    ((size_t) 1 << (32 - tab->filter_shift)) / 8);
+}
+
+static void insert_sum(struct rsync_sumtable *tab, uint32_t weak,
+    const unsigned char *strong) {
+  uint32_t bit, slot;
+
+  bit = get_filter_bit(tab, weak);
+  tab->filter[bit >> 6] |= ((uint64_t) 1 << (bit & 63));
+
+  memcpy(tab->strong + ((size_t) tab->ndecoded * tab->head.s2len), strong,
+    tab->head.s2len);
+
+  slot = get_slot(tab, weak);
+  while (tab->slots[slot] != 0) {
+    if (++slot == tab->nslots) {
+      slot = 0;
+    }
+  }
+
+  tab->slots[slot] = ((uint64_t) weak << 32) | (uint32_t) (tab->ndecoded + 1);
+  tab->ndecoded++;
+}
+
+int rsync_sumtable_decode(struct rsync_sumtable *tab, unsigned char **buf,
+    uint32_t *buflen) {
+  uint32_t reclen;
+
+  if (tab == NULL ||
+      buf == NULL ||
+      buflen == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (tab->slots == NULL) {
+    alloc_sums(tab);
+  }
+
+  reclen = sizeof(uint32_t) + tab->head.s2len;
+
+  /* First, complete any partial sum from the previous call. */
+  if (tab->pendinglen > 0 &&
+      tab->ndecoded < tab->head.count) {
+    uint32_t len;
+    unsigned char *ptr;
+
+    len = reclen - tab->pendinglen;
+    if (len > *buflen) {
+      len = *buflen;
+    }
+
+    memcpy(tab->pending + tab->pendinglen, *buf, len);
+    tab->pendinglen += len;
+    (*buf) += len;
+    (*buflen) -= len;
+
+    if (tab->pendinglen < reclen) {
+      errno = EAGAIN;
+      return -1;
+    }
+
+    ptr = tab->pending;
+    reclen = tab->pendinglen;
+    insert_sum(tab, (uint32_t) rsync_msg_read_int(tab->pool, &ptr, &reclen),
+      ptr);
+    tab->pendinglen = 0;
+    reclen = sizeof(uint32_t) + tab->head.s2len;
+  }
+
+  while (tab->ndecoded < tab->head.count &&
+         *buflen >= reclen) {
+    uint32_t weak;
+
+    weak = (uint32_t) rsync_msg_read_int(tab->pool, buf, buflen);
+    insert_sum(tab, weak, *buf);
+    (*buf) += tab->head.s2len;
+    (*buflen) -= tab->head.s2len;
+  }
+
+  if (tab->ndecoded < tab->head.count) {
+    /* Keep the partial sum for next time. */
+    memcpy(tab->pending, *buf, *buflen);
+    tab->pendinglen = *buflen;
+    (*buf) += *buflen;
+    *buflen = 0;
+
+    errno = EAGAIN;
+    return -1;
+  }
+
+  pr_trace_msg(trace_channel, 17, "decoded %ld block sums into %lu slots",
+    (long) tab->ndecoded, (unsigned long) tab->nslots);
+  return 0;
+}
+
+const struct rsync_sum_head *rsync_sumtable_get_head(
+    const struct rsync_sumtable *tab) {
+  if (tab == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return &(tab->head);
+}
+
+uint32_t rsync_sumtable_get_block_len(const struct rsync_sumtable *tab,
+    int32_t idx) {
+  if (idx == tab->head.count - 1 &&
+      tab->head.remainder != 0) {
+    return (uint32_t) tab->head.remainder;
+  }
+
+  return (uint32_t) tab->head.block_len;
+}
+
+void rsync_sumtable_prefetch(const struct rsync_sumtable *tab, uint32_t weak) {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(&(tab->filter[get_filter_bit(tab, weak) >> 6]));
+#endif
+}
+
+int rsync_sumtable_has(const struct rsync_sumtable *tab, uint32_t weak) {
+  uint32_t bit, slot;
+
+  bit = get_filter_bit(tab, weak);
+  if (!(tab->filter[bit >> 6] & ((uint64_t) 1 << (bit & 63)))) {
+    return FALSE;
+  }
+
+  slot = get_slot(tab, weak);
+
+  for (;;) {
+    uint64_t val;
+
+    val = tab->slots[slot];
+    if (val == 0) {
+      return FALSE;
+    }
+
+    if ((uint32_t) (val >> 32) == weak) {
+      return TRUE;
+    }
+
+    if (++slot == tab->nslots) {
+      slot = 0;
+    }
+  }
+}
+
+int32_t rsync_sumtable_match(const struct rsync_sumtable *tab, uint32_t weak,
+    const unsigned char *strong, uint32_t len, int32_t want) {
+  return rsync_sumtable_match_from(tab, weak, strong, len, want, 0);
+}
+
+int32_t rsync_sumtable_match_from(const struct rsync_sumtable *tab,
+    uint32_t weak, const unsigned char *strong, uint32_t len, int32_t want,
+    int32_t min_idx) {
+  uint32_t slot;
+  int32_t found = -1;
+
+  slot = get_slot(tab, weak);
+
+  for (;;) {
+    uint64_t val;
+
+    val = tab->slots[slot];
+    if (val == 0) {
+      break;
+    }
+
+    if ((uint32_t) (val >> 32) == weak) {
+      int32_t idx;
+
+      idx = (int32_t) (val & 0xffffffff) - 1;
+
+      if (idx >= min_idx &&
+          rsync_sumtable_get_block_len(tab, idx) == len &&
+          memcmp(tab->strong + ((size_t) idx * tab->head.s2len), strong,
+            tab->head.s2len) == 0) {
+        if (idx == want) {
+          return idx;
+        }
+
+        /* Blocks with the same rolling checksum are found in index order. */
+        if (found < 0) {
+          found = idx;
+        }
+      }
+    }
+
+    if (++slot == tab->nslots) {
+      slot = 0;
+    }
+  }
+
+  return found;
+}
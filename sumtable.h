@@ -0,0 +1,97 @@
+/*
+ * ProFTPD - mod_rsync block sum table
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_RSYNC_SUMTABLE_H
+#define MOD_RSYNC_SUMTABLE_H
+
+#include "mod_rsync.h"
+#include "session.h"
+#include "generator.h"
+
+/* As the sender, we look up the rolling checksum at every byte offset of the
+ * file in the receiver's block sums.  Most lookups miss, so the table is
+ * built for those: open addressing, with each slot holding a block's rolling
+ * checksum and index, so that a miss usually touches a single cache line.
+ * The (truncated) strong checksums are kept separately, in block order, and
+ * only examined on a rolling checksum match.  A small bitmap in front of the
+ * slots lets most misses be answered without probing at all.
+ *
+ * A table uses 12 bytes per block for its slots, 2 to 4 for the bitmap (it
+ * is rounded up to a power of two), plus the strong checksum length.
+ */
+
+struct rsync_sumtable;
+
+/* Reads the sum header which precedes the block sums.  Returns -1, with
+ * errno set to EAGAIN, if more data is needed, or to EINVAL if the header is
+ * not valid.
+ */
+int rsync_sumtable_read_head(pool *p, struct rsync_session *sess,
+  unsigned char **buf, uint32_t *buflen, struct rsync_sum_head *head);
+
+struct rsync_sumtable *rsync_sumtable_create(pool *p,
+  const struct rsync_sum_head *head);
+
+/* Decodes block sums from the given buffer directly into the table.  Returns
+ * 0 once all of the blocks' sums have been read, or -1, with errno set to
+ * EAGAIN, if more data is needed; any partial sum is retained until the next
+ * call.  When appending, no sums follow the header, and a table is only used
+ * for its header; it need not be decoded.
+ */
+int rsync_sumtable_decode(struct rsync_sumtable *tab, unsigned char **buf,
+  uint32_t *buflen);
+
+const struct rsync_sum_head *rsync_sumtable_get_head(
+  const struct rsync_sumtable *tab);
+
+/* Returns the length of the given block; the last block may be short. */
+uint32_t rsync_sumtable_get_block_len(const struct rsync_sumtable *tab,
+  int32_t idx);
+
+/* Hints that the given rolling checksum will be looked up soon, e.g. the
+ * checksum for the next offset.
+ */
+void rsync_sumtable_prefetch(const struct rsync_sumtable *tab, uint32_t weak);
+
+/* Returns TRUE if any block has the given rolling checksum. */
+int rsync_sumtable_has(const struct rsync_sumtable *tab, uint32_t weak);
+
+/* Returns the index of a block, of the given length, with the given rolling
+ * and strong checksums (the latter at least as long as the table's strong
+ * checksums), or -1 if there is none.  If the wanted block (e.g. the one
+ * following the previous match) matches, it is preferred; otherwise the
+ * lowest matching index is returned.
+ */
+int32_t rsync_sumtable_match(const struct rsync_sumtable *tab, uint32_t weak,
+  const unsigned char *strong, uint32_t len, int32_t want);
+
+/* As rsync_sumtable_match(), but ignoring blocks before the given index;
+ * when the receiver updates the file in place, those blocks may already have
+ * been overwritten.
+ */
+int32_t rsync_sumtable_match_from(const struct rsync_sumtable *tab,
+  uint32_t weak, const unsigned char *strong, uint32_t len, int32_t want,
+  int32_t min_idx);
+
+#endif /* MOD_RSYNC_SUMTABLE_H */
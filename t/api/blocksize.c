@@ -0,0 +1,174 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Block size selection API tests. */
+
+#include "tests.h"
+#include "blocksize.h"
+#include "policy.h"
+
+#define TEST_MAX_BLOCK_SIZE	(1 << 17)
+
+static void set_up(void) {
+  rsync_policy_clear();
+}
+
+static void tear_down(void) {
+  (void) rsync_blocksize_set_policy(RSYNC_BLOCKSIZE_POLICY_SQRT);
+  rsync_policy_clear();
+}
+
+static int record(const char *path, uint64_t literal_bytes,
+    uint64_t matched_bytes, uint64_t literal_runs) {
+  struct rsync_policy_stats stats;
+
+  memset(&stats, 0, sizeof(stats));
+  stats.total_bytes = literal_bytes + matched_bytes;
+  stats.matched_bytes = matched_bytes;
+  stats.literal_runs = literal_runs;
+  return rsync_policy_record(path, &stats);
+}
+
+START_TEST (blocksize_set_policy_test) {
+  int32_t block_len;
+  int res;
+
+  mark_point();
+  res = rsync_blocksize_set_policy(-1);
+  fail_unless(res < 0, "Failed to handle invalid policy");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  fail_unless(rsync_blocksize_get_policy() == RSYNC_BLOCKSIZE_POLICY_SQRT,
+    "Expected default policy");
+
+  /* With rsync's rule, history is ignored. */
+  res = record("/a/file.log", 1000, 1000000, 1);
+  fail_unless(res == 0, "Failed to record: %s", strerror(errno));
+
+  block_len = rsync_blocksize_choose("/a/file.log", 1000000, 6,
+    TEST_MAX_BLOCK_SIZE);
+  fail_unless(block_len == 0, "Expected no block length, got %ld",
+    (long) block_len);
+
+  res = rsync_blocksize_set_policy(RSYNC_BLOCKSIZE_POLICY_ADAPTIVE);
+  fail_unless(res == 0, "Failed to set policy: %s", strerror(errno));
+  fail_unless(rsync_blocksize_get_policy() == RSYNC_BLOCKSIZE_POLICY_ADAPTIVE,
+    "Expected adaptive policy");
+}
+END_TEST
+
+START_TEST (blocksize_choose_test) {
+  struct rsync_policy_stats stats;
+  int32_t block_len, few_len, many_len;
+
+  (void) rsync_blocksize_set_policy(RSYNC_BLOCKSIZE_POLICY_ADAPTIVE);
+
+  mark_point();
+  block_len = rsync_blocksize_choose(NULL, 0, 0, 0);
+  fail_unless(block_len == 0, "Failed to handle null path");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* Without history, rsync's rule applies. */
+  block_len = rsync_blocksize_choose("/a/file.log", 1048576, 6,
+    TEST_MAX_BLOCK_SIZE);
+  fail_unless(block_len == 0, "Expected no block length, got %ld",
+    (long) block_len);
+
+  /* One change in a megabyte: sqrt(1048576 * 6), rounded down to a multiple
+   * of 8.
+   */
+  (void) record("/a/file.log", 10000, 1038576, 1);
+  few_len = rsync_blocksize_choose("/a/file.log", 1048576, 6,
+    TEST_MAX_BLOCK_SIZE);
+  fail_unless(few_len == 2504, "Expected block length 2504, got %ld",
+    (long) few_len);
+
+  /* Many changes: shorter blocks. */
+  (void) record("/a/other.dat", 200000, 848576, 400);
+  many_len = rsync_blocksize_choose("/a/other.dat", 1048576, 6,
+    TEST_MAX_BLOCK_SIZE);
+  fail_unless(many_len > 0 && many_len < few_len,
+    "Expected block length below %ld, got %ld", (long) few_len,
+    (long) many_len);
+  fail_unless(many_len >= RSYNC_BLOCKSIZE_MIN_BLOCK_SIZE,
+    "Expected block length of at least %d, got %ld",
+    RSYNC_BLOCKSIZE_MIN_BLOCK_SIZE, (long) many_len);
+
+  /* Other files with the same extension share the history. */
+  block_len = rsync_blocksize_choose("/b/new.log", 1048576, 6,
+    TEST_MAX_BLOCK_SIZE);
+  fail_unless(block_len == few_len, "Expected block length %ld, got %ld",
+    (long) few_len, (long) block_len);
+
+  block_len = rsync_blocksize_choose("/b/new.txt", 1048576, 6,
+    TEST_MAX_BLOCK_SIZE);
+  fail_unless(block_len == 0, "Expected no block length, got %ld",
+    (long) block_len);
+
+  /* A file which hardly matched gets the longest blocks. */
+  (void) record("/a/random.bin", 1048576, 1000, 1);
+  block_len = rsync_blocksize_choose("/a/random.bin", 1048576, 6,
+    TEST_MAX_BLOCK_SIZE);
+  fail_unless(block_len == TEST_MAX_BLOCK_SIZE,
+    "Expected block length %d, got %ld", TEST_MAX_BLOCK_SIZE,
+    (long) block_len);
+
+  /* Without a delta to go by, the block length used before is reused. */
+  memset(&stats, 0, sizeof(stats));
+  stats.block_len = 4096;
+  (void) rsync_policy_record("/c/image.iso", &stats);
+  block_len = rsync_blocksize_choose("/c/image.iso", 1048576, 6,
+    TEST_MAX_BLOCK_SIZE);
+  fail_unless(block_len == 4096, "Expected block length 4096, got %ld",
+    (long) block_len);
+
+  block_len = rsync_blocksize_choose("/c/image.iso", 1048576, 6, 2048);
+  fail_unless(block_len == 2048, "Expected block length 2048, got %ld",
+    (long) block_len);
+
+  rsync_policy_clear();
+  block_len = rsync_blocksize_choose("/a/file.log", 1048576, 6,
+    TEST_MAX_BLOCK_SIZE);
+  fail_unless(block_len == 0, "Expected no block length, got %ld",
+    (long) block_len);
+}
+END_TEST
+
+Suite *tests_get_blocksize_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("blocksize");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, blocksize_set_policy_test);
+  tcase_add_test(testcase, blocksize_choose_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
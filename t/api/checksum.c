@@ -26,6 +26,13 @@
 
 #include "tests.h"
 #include "checksum.h"
+#include "options.h"
+#include "version.h"
+#include "compress.h"
+
+#ifdef HAVE_XXHASH
+# include <xxhash.h>
+#endif /* HAVE_XXHASH */
 
 static pool *p = NULL;
 
@@ -42,7 +49,228 @@ static void tear_down(void) {
   }
 }
 
+START_TEST (checksum_get_algo_test) {
+  int algo;
+  const char *name;
+
+  mark_point();
+  algo = rsync_checksum_get_algo(NULL);
+  fail_unless(algo < 0, "Failed to handle null name");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  algo = rsync_checksum_get_algo("foo");
+  fail_unless(algo < 0, "Failed to handle unknown name");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  algo = rsync_checksum_get_algo("MD5");
+  fail_unless(algo == RSYNC_CHECKSUM_ALGO_MD5, "Expected %d, got %d",
+    RSYNC_CHECKSUM_ALGO_MD5, algo);
+
+  mark_point();
+  algo = rsync_checksum_get_algo("xxh128");
+  fail_unless(algo == RSYNC_CHECKSUM_ALGO_XXH128, "Expected %d, got %d",
+    RSYNC_CHECKSUM_ALGO_XXH128, algo);
+
+  mark_point();
+  name = rsync_checksum_get_name(-1);
+  fail_unless(name == NULL, "Failed to handle unknown algorithm");
+
+  mark_point();
+  name = rsync_checksum_get_name(RSYNC_CHECKSUM_ALGO_MD4);
+  fail_unless(name != NULL, "Failed to get name for MD4: %s",
+    strerror(errno));
+  fail_unless(strcmp(name, "md4") == 0, "Expected 'md4', got '%s'", name);
+
+  mark_point();
+  fail_unless(rsync_checksum_get_digest_len(RSYNC_CHECKSUM_ALGO_XXH64) == 8,
+    "Expected digest length 8 for xxh64");
+  fail_unless(rsync_checksum_get_digest_len(RSYNC_CHECKSUM_ALGO_MD5) == 16,
+    "Expected digest length 16 for md5");
+}
+END_TEST
+
+START_TEST (checksum_preferred_test) {
+  int res;
+  const char *prefs;
+
+  mark_point();
+  res = rsync_checksum_set_preferred(NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_checksum_set_preferred(p, "foo bar");
+  fail_unless(res < 0, "Failed to handle unsupported algorithms");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_checksum_set_preferred(p, "foo,md4 md5");
+  fail_unless(res == 0, "Failed to set preferred algorithms: %s",
+    strerror(errno));
+
+  prefs = rsync_checksum_get_preferred(p);
+  fail_unless(prefs != NULL, "Failed to get preferred algorithms: %s",
+    strerror(errno));
+  fail_unless(strcmp(prefs, "md4 md5") == 0, "Expected 'md4 md5', got '%s'",
+    prefs);
+
+  mark_point();
+  res = rsync_checksum_set_preferred(p, NULL);
+  fail_unless(res == 0, "Failed to reset preferred algorithms: %s",
+    strerror(errno));
+
+  prefs = rsync_checksum_get_preferred(p);
+  fail_unless(prefs != NULL, "Failed to get preferred algorithms: %s",
+    strerror(errno));
+  fail_unless(strstr(prefs, "md5") != NULL,
+    "Expected 'md5' in default preferences, got '%s'", prefs);
+}
+END_TEST
+
 START_TEST (checksum_md5_test) {
+  struct rsync_checksum *ck;
+  unsigned char digest[RSYNC_CHECKSUM_MAX_DIGEST_LEN];
+  /* MD5("abc"), per RFC 1321. */
+  const unsigned char expected[16] = {
+    0x90, 0x01, 0x50, 0x98, 0x3c, 0xd2, 0x4f, 0xb0,
+    0xd6, 0x96, 0x3f, 0x7d, 0x28, 0xe1, 0x7f, 0x72
+  };
+  size_t digest_len;
+  int res;
+
+  mark_point();
+  ck = rsync_checksum_create(NULL, RSYNC_CHECKSUM_ALGO_MD5, 0);
+  fail_unless(ck == NULL, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  ck = rsync_checksum_create(p, -1, 0);
+  fail_unless(ck == NULL, "Failed to handle unknown algorithm");
+  fail_unless(errno == ENOSYS, "Expected ENOSYS (%d), got %s (%d)", ENOSYS,
+    strerror(errno), errno);
+
+  mark_point();
+  ck = rsync_checksum_create(p, RSYNC_CHECKSUM_ALGO_MD5, 0);
+  fail_unless(ck != NULL, "Failed to create MD5 checksum: %s",
+    strerror(errno));
+
+  mark_point();
+  res = rsync_checksum_update(ck, NULL, 1);
+  fail_unless(res < 0, "Failed to handle null data");
+
+  res = rsync_checksum_update(ck, (unsigned char *) "ab", 2);
+  fail_unless(res == 0, "Failed to update checksum: %s", strerror(errno));
+
+  res = rsync_checksum_update(ck, (unsigned char *) "c", 1);
+  fail_unless(res == 0, "Failed to update checksum: %s", strerror(errno));
+
+  mark_point();
+  digest_len = rsync_checksum_finish(ck, digest);
+  fail_unless(digest_len == 16, "Expected 16, got %lu",
+    (unsigned long) digest_len);
+  fail_unless(memcmp(digest, expected, 16) == 0,
+    "MD5 digest does not match expected value");
+}
+END_TEST
+
+START_TEST (checksum_block_md4_test) {
+  struct rsync_session *sess;
+  unsigned char digest[RSYNC_CHECKSUM_MAX_DIGEST_LEN];
+  /* MD4("abc"), per RFC 1320. */
+  const unsigned char expected[16] = {
+    0xa4, 0x48, 0x01, 0x7a, 0xaf, 0x21, 0xd8, 0x52,
+    0x5f, 0xc1, 0x0a, 0xe8, 0x7a, 0xa6, 0x72, 0x9d
+  };
+  size_t digest_len;
+
+  mark_point();
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD4,
+    RSYNC_COMPRESS_ALGO_NONE, 0);
+  digest_len = rsync_checksum_block(sess, (unsigned char *) "abc", 3, digest);
+  fail_unless(digest_len == 16, "Expected 16, got %lu",
+    (unsigned long) digest_len);
+  fail_unless(memcmp(digest, expected, 16) == 0,
+    "MD4 digest does not match expected value");
+}
+END_TEST
+
+#ifdef HAVE_XXHASH
+START_TEST (checksum_block_xxh64_test) {
+  register unsigned int i;
+  struct rsync_session *sess;
+  unsigned char digest[RSYNC_CHECKSUM_MAX_DIGEST_LEN], expected[8];
+  uint64_t hash;
+  size_t digest_len;
+
+  /* As rsync does, a negative seed is sign-extended. */
+  mark_point();
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_XXH64,
+    RSYNC_COMPRESS_ALGO_NONE, -2);
+  digest_len = rsync_checksum_block(sess, (unsigned char *) "abc", 3, digest);
+  fail_unless(digest_len == 8, "Expected 8, got %lu",
+    (unsigned long) digest_len);
+
+  hash = XXH64("abc", 3, 0xfffffffffffffffeULL);
+  for (i = 0; i < 8; i++) {
+    expected[i] = (unsigned char) (hash >> (i * 8));
+  }
+
+  fail_unless(memcmp(digest, expected, 8) == 0,
+    "XXH64 digest does not match expected value");
+}
+END_TEST
+#endif /* HAVE_XXHASH */
+
+START_TEST (checksum_blocks_test) {
+  register unsigned int i, j;
+  struct rsync_session *sess;
+  unsigned char data[5000], digests[8 * RSYNC_CHECKSUM_MAX_DIGEST_LEN];
+  unsigned char digest[RSYNC_CHECKSUM_MAX_DIGEST_LEN];
+  uint32_t block_len = 700;
+  int count, algos[] = { RSYNC_CHECKSUM_ALGO_MD4, RSYNC_CHECKSUM_ALGO_MD5,
+    RSYNC_CHECKSUM_ALGO_MD5, -1 };
+
+  for (i = 0; i < sizeof(data); i++) {
+    data[i] = (unsigned char) ((i * 7) + (i >> 8));
+  }
+
+  mark_point();
+  count = rsync_checksum_blocks(NULL, data, sizeof(data), block_len, digests);
+  fail_unless(count < 0, "Failed to handle null session");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* Each variant of seed placement must match the one-block-at-a-time
+   * digests.
+   */
+  for (i = 0; algos[i] != -1; i++) {
+    sess = tests_create_session(p, 31, algos[i], RSYNC_COMPRESS_ALGO_NONE,
+      0x12345678);
+    if (i == 2) {
+      sess->compat_flags |= RSYNC_VERSION_COMPAT_FL_CHKSUM_SEED_FIX;
+    }
+
+    mark_point();
+    count = rsync_checksum_blocks(sess, data, sizeof(data), block_len,
+      digests);
+    fail_unless(count == 8, "Expected 8 blocks, got %d", count);
+
+    for (j = 0; j < (unsigned int) count; j++) {
+      size_t len;
+
+      len = (j == 7) ? sizeof(data) - (7 * block_len) : block_len;
+      rsync_checksum_block(sess, data + (j * block_len), len, digest);
+      fail_unless(memcmp(digests + (j * 16), digest, 16) == 0,
+        "Variant %u: block %u digest does not match", i, j);
+    }
+  }
 }
 END_TEST
 
@@ -55,7 +283,14 @@ Suite *tests_get_checksum_suite(void) {
 
   tcase_add_checked_fixture(testcase, set_up, tear_down);
 
+  tcase_add_test(testcase, checksum_get_algo_test);
+  tcase_add_test(testcase, checksum_preferred_test);
   tcase_add_test(testcase, checksum_md5_test);
+  tcase_add_test(testcase, checksum_block_md4_test);
+#ifdef HAVE_XXHASH
+  tcase_add_test(testcase, checksum_block_xxh64_test);
+#endif /* HAVE_XXHASH */
+  tcase_add_test(testcase, checksum_blocks_test);
 
   suite_add_tcase(suite, testcase);
   return suite;
@@ -0,0 +1,351 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Compression API tests. */
+
+#include "tests.h"
+#include "compress.h"
+
+static pool *p = NULL;
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+}
+
+static void tear_down(void) {
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+START_TEST (compress_get_algo_test) {
+  int algo;
+  const char *name;
+
+  mark_point();
+  algo = rsync_compress_get_algo(NULL);
+  fail_unless(algo < 0, "Failed to handle null name");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  algo = rsync_compress_get_algo("foo");
+  fail_unless(algo < 0, "Failed to handle unknown name");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  algo = rsync_compress_get_algo("zlibx");
+  fail_unless(algo == RSYNC_COMPRESS_ALGO_ZLIBX, "Expected %d, got %d",
+    RSYNC_COMPRESS_ALGO_ZLIBX, algo);
+
+  mark_point();
+  name = rsync_compress_get_name(RSYNC_COMPRESS_ALGO_ZSTD);
+  fail_unless(name != NULL, "Failed to get name for zstd: %s",
+    strerror(errno));
+  fail_unless(strcmp(name, "zstd") == 0, "Expected 'zstd', got '%s'", name);
+
+  mark_point();
+  fail_unless(rsync_compress_supported(RSYNC_COMPRESS_ALGO_ZLIB) == TRUE,
+    "Expected zlib to be supported");
+  fail_unless(rsync_compress_supported(-1) == FALSE,
+    "Expected unknown algorithm to be unsupported");
+}
+END_TEST
+
+START_TEST (compress_preferred_test) {
+  int res;
+  const char *prefs;
+
+  mark_point();
+  res = rsync_compress_set_preferred(NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_compress_set_preferred(p, "foo bar");
+  fail_unless(res < 0, "Failed to handle unsupported algorithms");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_compress_set_preferred(p, "foo zlib none");
+  fail_unless(res == 0, "Failed to set preferred algorithms: %s",
+    strerror(errno));
+
+  prefs = rsync_compress_get_preferred(p);
+  fail_unless(prefs != NULL, "Failed to get preferred algorithms: %s",
+    strerror(errno));
+  fail_unless(strcmp(prefs, "zlib none") == 0,
+    "Expected 'zlib none', got '%s'", prefs);
+
+  mark_point();
+  res = rsync_compress_set_preferred(p, NULL);
+  fail_unless(res == 0, "Failed to reset preferred algorithms: %s",
+    strerror(errno));
+
+  prefs = rsync_compress_get_preferred(p);
+  fail_unless(prefs != NULL, "Failed to get preferred algorithms: %s",
+    strerror(errno));
+  fail_unless(strstr(prefs, "zlibx") != NULL,
+    "Expected 'zlibx' in default preferences, got '%s'", prefs);
+}
+END_TEST
+
+START_TEST (compress_get_level_test) {
+  int level, res;
+
+  mark_point();
+  level = rsync_compress_get_level(-1, Z_DEFAULT_COMPRESSION);
+  fail_unless(level < 0, "Failed to handle unknown algorithm");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  level = rsync_compress_get_level(RSYNC_COMPRESS_ALGO_ZLIB,
+    Z_DEFAULT_COMPRESSION);
+  fail_unless(level == 6, "Expected default level 6, got %d", level);
+
+  mark_point();
+  level = rsync_compress_get_level(RSYNC_COMPRESS_ALGO_ZLIB, 10);
+  fail_unless(level < 0, "Failed to handle invalid zlib level");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_compress_set_max_level(RSYNC_COMPRESS_ALGO_ZLIB, -1);
+  fail_unless(res < 0, "Failed to handle invalid maximum level");
+
+  res = rsync_compress_set_max_level(RSYNC_COMPRESS_ALGO_ZLIB, 2);
+  fail_unless(res == 0, "Failed to set maximum level: %s", strerror(errno));
+
+  level = rsync_compress_get_level(RSYNC_COMPRESS_ALGO_ZLIB, 9);
+  fail_unless(level == 2, "Expected capped level 2, got %d", level);
+
+  level = rsync_compress_get_level(RSYNC_COMPRESS_ALGO_ZLIB, 1);
+  fail_unless(level == 1, "Expected level 1, got %d", level);
+
+  (void) rsync_compress_set_max_level(RSYNC_COMPRESS_ALGO_ZLIB, 0);
+
+  mark_point();
+  level = rsync_compress_get_level(RSYNC_COMPRESS_ALGO_LZ4, 5);
+  fail_unless(level == 0, "Expected level 0 for lz4, got %d", level);
+}
+END_TEST
+
+static void roundtrip(struct rsync_compress *comp, const char *text) {
+  unsigned char zbuf[1024], buf[1024];
+  size_t zlen, len;
+  int res;
+
+  comp->next_in = (const unsigned char *) text;
+  comp->avail_in = strlen(text);
+  comp->next_out = zbuf;
+  comp->avail_out = sizeof(zbuf);
+
+  res = rsync_compress_deflate(comp, RSYNC_COMPRESS_FL_FLUSH);
+  fail_unless(res == 0, "Failed to compress data: %s", strerror(errno));
+  fail_unless(comp->avail_in == 0, "Expected all input to be consumed");
+  zlen = sizeof(zbuf) - comp->avail_out;
+
+  comp->next_in = zbuf;
+  comp->avail_in = zlen;
+  comp->next_out = buf;
+  comp->avail_out = sizeof(buf);
+
+  res = rsync_compress_inflate(comp);
+  fail_unless(res == 0, "Failed to decompress data: %s", strerror(errno));
+  len = sizeof(buf) - comp->avail_out;
+
+  fail_unless(len == strlen(text), "Expected %lu bytes, got %lu",
+    (unsigned long) strlen(text), (unsigned long) len);
+  fail_unless(memcmp(buf, text, len) == 0,
+    "Decompressed data does not match original");
+}
+
+START_TEST (compress_stream_test) {
+  register unsigned int i;
+  struct rsync_compress *comp;
+  int algos[] = {
+    RSYNC_COMPRESS_ALGO_ZLIB,
+    RSYNC_COMPRESS_ALGO_ZLIBX,
+    RSYNC_COMPRESS_ALGO_LZ4,
+    RSYNC_COMPRESS_ALGO_ZSTD,
+    -1
+  };
+  int res;
+
+  mark_point();
+  comp = rsync_compress_create(NULL, RSYNC_COMPRESS_ALGO_ZLIB, 6);
+  fail_unless(comp == NULL, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  comp = rsync_compress_create(p, RSYNC_COMPRESS_ALGO_NONE, 0);
+  fail_unless(comp == NULL, "Failed to handle 'none' algorithm");
+  fail_unless(errno == ENOSYS, "Expected ENOSYS (%d), got %s (%d)", ENOSYS,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_compress_deflate(NULL, RSYNC_COMPRESS_FL_FLUSH);
+  fail_unless(res < 0, "Failed to handle null compressor");
+
+  for (i = 0; algos[i] != -1; i++) {
+    int level;
+
+    if (rsync_compress_supported(algos[i]) == FALSE) {
+      continue;
+    }
+
+    mark_point();
+    level = rsync_compress_get_level(algos[i], Z_DEFAULT_COMPRESSION);
+    comp = rsync_compress_create(p, algos[i], level);
+    fail_unless(comp != NULL, "Failed to create %s compressor: %s",
+      rsync_compress_get_name(algos[i]), strerror(errno));
+
+    /* The same stream is used for consecutive "files". */
+    roundtrip(comp, "Hello, World!  Hello, World!  Hello, World!");
+    roundtrip(comp, "Goodbye, World!  Goodbye, World!");
+
+    /* Skipped files must still be readable by the receiver. */
+    mark_point();
+    res = rsync_compress_set_skip(comp, TRUE);
+    fail_unless(res == 0, "Failed to skip compression: %s", strerror(errno));
+    res = rsync_compress_reset(comp);
+    fail_unless(res == 0, "Failed to reset compressor: %s", strerror(errno));
+    roundtrip(comp, "Skipped, World!  Skipped, World!");
+  }
+}
+END_TEST
+
+START_TEST (compress_skip_path_test) {
+  int res;
+
+  mark_point();
+  res = rsync_compress_skip_path(NULL);
+  fail_unless(res < 0, "Failed to handle null path");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_compress_set_skip_suffixes(p, NULL);
+  fail_unless(res == 0, "Failed to use default suffixes: %s",
+    strerror(errno));
+
+  fail_unless(rsync_compress_skip_path("/tmp/photo.JPG") == TRUE,
+    "Expected 'photo.JPG' to be skipped");
+  fail_unless(rsync_compress_skip_path("backup.tar.gz") == TRUE,
+    "Expected 'backup.tar.gz' to be skipped");
+  fail_unless(rsync_compress_skip_path("notes.txt") == FALSE,
+    "Expected 'notes.txt' not to be skipped");
+  fail_unless(rsync_compress_skip_path("gz.d/README") == FALSE,
+    "Expected 'gz.d/README' not to be skipped");
+
+  mark_point();
+  res = rsync_compress_set_skip_suffixes(p, "mp[34]/tar.xz/[Cc][Aa][Bb]");
+  fail_unless(res == 0, "Failed to set suffixes: %s", strerror(errno));
+
+  fail_unless(rsync_compress_skip_path("song.MP3") == TRUE,
+    "Expected 'song.MP3' to be skipped");
+  fail_unless(rsync_compress_skip_path("movie.mp4") == TRUE,
+    "Expected 'movie.mp4' to be skipped");
+  fail_unless(rsync_compress_skip_path("data.tar.xz") == TRUE,
+    "Expected 'data.tar.xz' to be skipped");
+  fail_unless(rsync_compress_skip_path("setup.cab") == TRUE,
+    "Expected 'setup.cab' to be skipped");
+  fail_unless(rsync_compress_skip_path("data.xz") == FALSE,
+    "Expected 'data.xz' not to be skipped");
+  fail_unless(rsync_compress_skip_path("backup.gz") == FALSE,
+    "Expected 'backup.gz' not to be skipped");
+
+  mark_point();
+  res = rsync_compress_set_skip_suffixes(p, "");
+  fail_unless(res == 0, "Failed to set suffixes: %s", strerror(errno));
+  fail_unless(rsync_compress_skip_path("photo.jpg") == FALSE,
+    "Expected 'photo.jpg' not to be skipped");
+
+  (void) rsync_compress_set_skip_suffixes(p, NULL);
+}
+END_TEST
+
+START_TEST (compress_probe_test) {
+  register unsigned int i;
+  unsigned char data[4096];
+  uint32_t seed = 42;
+  int res;
+
+  mark_point();
+  res = rsync_compress_probe(NULL, 0);
+  fail_unless(res < 0, "Failed to handle null data");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  for (i = 0; i < sizeof(data); i++) {
+    data[i] = "The quick brown fox jumps over the lazy dog.\n"[i % 45];
+  }
+
+  mark_point();
+  res = rsync_compress_probe(data, sizeof(data));
+  fail_unless(res == TRUE, "Expected text to be compressible");
+
+  for (i = 0; i < sizeof(data); i++) {
+    seed = (seed * 1103515245) + 12345;
+    data[i] = (unsigned char) (seed >> 16);
+  }
+
+  mark_point();
+  res = rsync_compress_probe(data, sizeof(data));
+  fail_unless(res == FALSE, "Expected random data to be incompressible");
+
+  /* Too little data to judge. */
+  mark_point();
+  res = rsync_compress_probe(data, 16);
+  fail_unless(res == TRUE, "Expected small sample to be compressible");
+}
+END_TEST
+
+Suite *tests_get_compress_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("compress");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, compress_get_algo_test);
+  tcase_add_test(testcase, compress_preferred_test);
+  tcase_add_test(testcase, compress_get_level_test);
+  tcase_add_test(testcase, compress_stream_test);
+  tcase_add_test(testcase, compress_skip_path_test);
+  tcase_add_test(testcase, compress_probe_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
@@ -0,0 +1,277 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Destination file API tests. */
+
+#include "tests.h"
+#include "destfile.h"
+
+static pool *p = NULL;
+
+static const char *test_dir = "/tmp/mod_rsync-destfile";
+
+#define TEST_FILE_COUNT		10
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  (void) tests_rmpath(p, test_dir);
+  (void) mkdir(test_dir, 0755);
+}
+
+static void tear_down(void) {
+  (void) tests_rmpath(p, test_dir);
+
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+/* Returns the number of entries in the test directory. */
+static unsigned int count_entries(void) {
+  DIR *dirh;
+  struct dirent *dent;
+  unsigned int count = 0;
+
+  dirh = opendir(test_dir);
+  fail_unless(dirh != NULL, "Failed to open %s: %s", test_dir,
+    strerror(errno));
+
+  while ((dent = readdir(dirh)) != NULL) {
+    if (strcmp(dent->d_name, ".") != 0 &&
+        strcmp(dent->d_name, "..") != 0) {
+      count++;
+    }
+  }
+
+  (void) closedir(dirh);
+  return count;
+}
+
+static void write_file(const char *path, const char *data) {
+  int fd;
+
+  fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  fail_unless(fd >= 0, "Failed to open %s: %s", path, strerror(errno));
+  fail_unless(write(fd, data, strlen(data)) == (ssize_t) strlen(data),
+    "Failed to write %s: %s", path, strerror(errno));
+  (void) close(fd);
+}
+
+static void check_file(const char *path, const char *data, mode_t mode,
+    time_t mtime) {
+  struct stat st;
+  char buf[256];
+  ssize_t len;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  fail_unless(fd >= 0, "Failed to open %s: %s", path, strerror(errno));
+  len = read(fd, buf, sizeof(buf));
+  fail_unless(fstat(fd, &st) == 0, "Failed to stat %s: %s", path,
+    strerror(errno));
+  (void) close(fd);
+
+  fail_unless(len == (ssize_t) strlen(data) &&
+    memcmp(buf, data, len) == 0, "Unexpected contents of %s", path);
+  fail_unless((st.st_mode & 07777) == mode, "Expected mode %04o, got %04o",
+    (unsigned int) mode, (unsigned int) (st.st_mode & 07777));
+  fail_unless(st.st_mtime == mtime, "Expected mtime %lu, got %lu",
+    (unsigned long) mtime, (unsigned long) st.st_mtime);
+}
+
+/* Builds the file with the given data and attributes, and commits it. */
+static void put_file(const char *path, int flags, const char *data,
+    mode_t mode, time_t mtime) {
+  struct rsync_destfile *df;
+  struct timespec ts;
+  int fd, res;
+
+  df = rsync_destfile_open(p, path, flags);
+  fail_unless(df != NULL, "Failed to open destination file for %s: %s", path,
+    strerror(errno));
+
+  fd = rsync_destfile_get_fd(df);
+  fail_unless(fd >= 0, "Failed to get descriptor: %s", strerror(errno));
+  fail_unless(write(fd, data, strlen(data)) == (ssize_t) strlen(data),
+    "Failed to write %s: %s", path, strerror(errno));
+
+  ts.tv_sec = mtime;
+  ts.tv_nsec = 0;
+  res = rsync_destfile_set_attrs(df, mode, (uid_t) -1, (gid_t) -1, &ts);
+  fail_unless(res == 0, "Failed to set attributes: %s", strerror(errno));
+
+  res = rsync_destfile_commit(&df, 1);
+  fail_unless(res == 0, "Failed to commit %s: %s", path,
+    strerror(rsync_destfile_get_error(df)));
+}
+
+START_TEST (destfile_open_test) {
+  register unsigned int i;
+  struct rsync_destfile *df;
+  const char *path;
+  int res;
+
+  mark_point();
+  df = rsync_destfile_open(NULL, NULL, 0);
+  fail_unless(df == NULL, "Failed to handle null arguments");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_destfile_commit(NULL, 0);
+  fail_unless(res < 0, "Failed to handle null files");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  path = pdircat(p, test_dir, "file.dat", NULL);
+
+  /* Until committed, the destination is untouched; once aborted, nothing is
+   * left behind.
+   */
+  for (i = 0; i < 2; i++) {
+    df = rsync_destfile_open(p, path, i == 0 ? 0 : RSYNC_DESTFILE_FL_SMALL);
+    fail_unless(df != NULL, "Failed to open destination file: %s",
+      strerror(errno));
+
+    if (i == 0) {
+      fail_unless(access(path, F_OK) < 0, "Expected %s not to exist", path);
+    }
+
+    res = rsync_destfile_abort(df);
+    fail_unless(res == 0, "Failed to abort: %s", strerror(errno));
+    fail_unless(count_entries() == 0, "Expected empty directory, got %u "
+      "entries", count_entries());
+
+    res = rsync_destfile_abort(df);
+    fail_unless(res < 0, "Failed to handle aborted file");
+    fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+      strerror(errno), errno);
+  }
+}
+END_TEST
+
+START_TEST (destfile_commit_test) {
+  register unsigned int i;
+  const char *path;
+
+  path = pdircat(p, test_dir, "file.dat", NULL);
+
+  /* New files, and replaced ones, large and small; no temporary files are
+   * left behind.
+   */
+  for (i = 0; i < 2; i++) {
+    int flags;
+
+    flags = (i == 0 ? 0 : RSYNC_DESTFILE_FL_SMALL);
+    (void) unlink(path);
+
+    mark_point();
+    put_file(path, flags, "first", 0644, 1000000000);
+    check_file(path, "first", 0644, 1000000000);
+
+    mark_point();
+    put_file(path, flags, "second version", 0640, 1100000000);
+    check_file(path, "second version", 0640, 1100000000);
+
+    fail_unless(count_entries() == 1, "Expected 1 entry, got %u",
+      count_entries());
+  }
+}
+END_TEST
+
+START_TEST (destfile_commit_batch_test) {
+  register unsigned int i;
+  struct rsync_destfile *dfs[TEST_FILE_COUNT];
+  int res;
+
+  /* Half the files replace existing ones. */
+  for (i = 0; i < TEST_FILE_COUNT; i++) {
+    char name[32];
+    const char *path;
+    int fd;
+
+    pr_snprintf(name, sizeof(name), "file%u.dat", i);
+    path = pdircat(p, test_dir, name, NULL);
+    if (i % 2 == 0) {
+      write_file(path, "old");
+    }
+
+    dfs[i] = rsync_destfile_open(p, path, RSYNC_DESTFILE_FL_SMALL);
+    fail_unless(dfs[i] != NULL, "Failed to open destination file: %s",
+      strerror(errno));
+
+    fd = rsync_destfile_get_fd(dfs[i]);
+    fail_unless(write(fd, name, strlen(name)) == (ssize_t) strlen(name),
+      "Failed to write %s: %s", path, strerror(errno));
+    (void) rsync_destfile_set_attrs(dfs[i], 0604, (uid_t) -1, (gid_t) -1,
+      NULL);
+  }
+
+  mark_point();
+  res = rsync_destfile_commit(dfs, TEST_FILE_COUNT);
+  fail_unless(res == 0, "Failed to commit %d files", res);
+  fail_unless(count_entries() == TEST_FILE_COUNT, "Expected %u entries, got "
+    "%u", TEST_FILE_COUNT, count_entries());
+
+  for (i = 0; i < TEST_FILE_COUNT; i++) {
+    char name[32];
+    struct stat st;
+
+    pr_snprintf(name, sizeof(name), "file%u.dat", i);
+    fail_unless(rsync_destfile_get_error(dfs[i]) == 0,
+      "Unexpected error for %s", name);
+    fail_unless(rsync_destfile_get_fd(dfs[i]) < 0,
+      "Expected %s to be closed", name);
+
+    fail_unless(stat(pdircat(p, test_dir, name, NULL), &st) == 0,
+      "Failed to stat %s: %s", name, strerror(errno));
+    fail_unless(st.st_size == (off_t) strlen(name),
+      "Expected %lu bytes, got %lu", (unsigned long) strlen(name),
+      (unsigned long) st.st_size);
+    fail_unless((st.st_mode & 07777) == 0604, "Expected mode 0604, got %04o",
+      (unsigned int) (st.st_mode & 07777));
+  }
+}
+END_TEST
+
+Suite *tests_get_destfile_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("destfile");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, destfile_open_test);
+  tcase_add_test(testcase, destfile_commit_test);
+  tcase_add_test(testcase, destfile_commit_batch_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
@@ -0,0 +1,299 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* File I/O API tests. */
+
+#include "tests.h"
+#include "fileio.h"
+
+static pool *p = NULL;
+
+static const char *test_file = "/tmp/mod_rsync-fileio.dat";
+
+#define TEST_FILE_COUNT		10
+#define TEST_DATA_SIZE		((3 * 1024 * 1024) + 123)
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+}
+
+static void tear_down(void) {
+  register unsigned int i;
+
+  (void) rsync_fileio_set_backend(RSYNC_FILEIO_BACKEND_AUTO);
+  (void) unlink(test_file);
+
+  for (i = 0; i < TEST_FILE_COUNT; i++) {
+    char path[64];
+
+    pr_snprintf(path, sizeof(path), "%s.%u", test_file, i);
+    (void) unlink(path);
+  }
+
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+/* Returns the number of backends to test: POSIX, and io_uring, if we have
+ * it.
+ */
+static unsigned int get_backends(int *backends) {
+  unsigned int nbackends = 0;
+
+  backends[nbackends++] = RSYNC_FILEIO_BACKEND_POSIX;
+  if (rsync_fileio_set_backend(RSYNC_FILEIO_BACKEND_URING) == 0) {
+    backends[nbackends++] = RSYNC_FILEIO_BACKEND_URING;
+  }
+
+  return nbackends;
+}
+
+START_TEST (fileio_set_backend_test) {
+  int backend, res;
+
+  res = rsync_fileio_set_backend(-1);
+  fail_unless(res < 0, "Failed to handle invalid backend");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = rsync_fileio_set_backend(RSYNC_FILEIO_BACKEND_POSIX);
+  fail_unless(res == 0, "Failed to set POSIX backend: %s", strerror(errno));
+  backend = rsync_fileio_get_backend();
+  fail_unless(backend == RSYNC_FILEIO_BACKEND_POSIX,
+    "Expected POSIX backend, got %d", backend);
+
+  res = rsync_fileio_set_backend(RSYNC_FILEIO_BACKEND_AUTO);
+  fail_unless(res == 0, "Failed to set auto backend: %s", strerror(errno));
+  backend = rsync_fileio_get_backend();
+  fail_unless(backend == RSYNC_FILEIO_BACKEND_POSIX ||
+    backend == RSYNC_FILEIO_BACKEND_URING, "Unexpected backend %d", backend);
+
+  res = rsync_fileio_set_backend(RSYNC_FILEIO_BACKEND_URING);
+#ifdef HAVE_IO_URING
+  if (res == 0) {
+    backend = rsync_fileio_get_backend();
+    fail_unless(backend == RSYNC_FILEIO_BACKEND_URING,
+      "Expected io_uring backend, got %d", backend);
+
+  } else {
+    /* The kernel may not support, or allow, io_uring. */
+    fail_unless(errno == ENOSYS, "Expected ENOSYS (%d), got %s (%d)", ENOSYS,
+      strerror(errno), errno);
+  }
+#else
+  fail_unless(res < 0, "Failed to handle unsupported io_uring");
+  fail_unless(errno == ENOSYS, "Expected ENOSYS (%d), got %s (%d)", ENOSYS,
+    strerror(errno), errno);
+#endif /* HAVE_IO_URING */
+}
+END_TEST
+
+START_TEST (fileio_read_write_test) {
+  register unsigned int i, j;
+  int backends[2], fd, res;
+  unsigned int nbackends;
+  unsigned char *data, *buf;
+  uint32_t seed = 11;
+  ssize_t len;
+
+  data = palloc(p, TEST_DATA_SIZE);
+  buf = palloc(p, TEST_DATA_SIZE);
+
+  nbackends = get_backends(backends);
+  for (i = 0; i < nbackends; i++) {
+    res = rsync_fileio_set_backend(backends[i]);
+    fail_unless(res == 0, "Failed to set backend %d: %s", backends[i],
+      strerror(errno));
+
+    for (j = 0; j < TEST_DATA_SIZE; j++) {
+      seed = (seed * 1103515245) + 12345;
+      data[j] = (unsigned char) (seed >> 16);
+    }
+
+    res = rsync_fileio_write(-1, data, TEST_DATA_SIZE, 0);
+    fail_unless(res < 0, "Failed to handle bad descriptor");
+    fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+      strerror(errno), errno);
+
+    fd = open(test_file, O_CREAT|O_TRUNC|O_RDWR, 0644);
+    fail_unless(fd >= 0, "Failed to open '%s': %s", test_file,
+      strerror(errno));
+
+    /* Written in several pieces, at an offset. */
+    res = rsync_fileio_write(fd, data, TEST_DATA_SIZE, 7);
+    fail_unless(res == 0, "Failed to write data with backend %d: %s",
+      backends[i], strerror(errno));
+
+    memset(buf, 0, TEST_DATA_SIZE);
+    len = rsync_fileio_read(fd, buf, TEST_DATA_SIZE, 7);
+    fail_unless(len == TEST_DATA_SIZE, "Expected %lu bytes, got %ld (%s)",
+      (unsigned long) TEST_DATA_SIZE, (long) len, strerror(errno));
+    fail_unless(memcmp(buf, data, TEST_DATA_SIZE) == 0,
+      "Data read with backend %d differs", backends[i]);
+
+    /* Reads come up short only at the end of the file. */
+    len = rsync_fileio_read(fd, buf, TEST_DATA_SIZE, 1000007);
+    fail_unless(len == TEST_DATA_SIZE - 1000000,
+      "Expected %lu bytes, got %ld (%s)",
+      (unsigned long) TEST_DATA_SIZE - 1000000, (long) len, strerror(errno));
+    fail_unless(memcmp(buf, data + 1000000, len) == 0,
+      "Data read with backend %d differs", backends[i]);
+
+    len = rsync_fileio_read(fd, buf, 100, TEST_DATA_SIZE + 7);
+    fail_unless(len == 0, "Expected 0 bytes at end of file, got %ld",
+      (long) len);
+
+    (void) close(fd);
+
+    len = rsync_fileio_read(fd, buf, 100, 0);
+    fail_unless(len < 0, "Failed to handle closed descriptor");
+    fail_unless(errno == EBADF, "Expected EBADF (%d), got %s (%d)", EBADF,
+      strerror(errno), errno);
+  }
+}
+END_TEST
+
+START_TEST (fileio_run_test) {
+  register unsigned int i, j;
+  struct rsync_fileio_op ops[TEST_FILE_COUNT + 1];
+  struct stat st[TEST_FILE_COUNT + 1];
+  char paths[TEST_FILE_COUNT][64];
+  int backends[2], res;
+  unsigned int nbackends;
+
+  res = rsync_fileio_run(NULL, 1);
+  fail_unless(res < 0, "Failed to handle null ops");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  for (i = 0; i < TEST_FILE_COUNT; i++) {
+    pr_snprintf(paths[i], sizeof(paths[i]), "%s.%u", test_file, i);
+  }
+
+  nbackends = get_backends(backends);
+  for (i = 0; i < nbackends; i++) {
+    res = rsync_fileio_set_backend(backends[i]);
+    fail_unless(res == 0, "Failed to set backend %d: %s", backends[i],
+      strerror(errno));
+
+    /* Open the files in one batch, with one which fails. */
+    memset(ops, 0, sizeof(ops));
+    for (j = 0; j < TEST_FILE_COUNT; j++) {
+      ops[j].type = RSYNC_FILEIO_OP_OPEN;
+      ops[j].dirfd = AT_FDCWD;
+      ops[j].path = paths[j];
+      ops[j].flags = O_CREAT|O_TRUNC|O_WRONLY;
+      ops[j].mode = 0644;
+    }
+
+    ops[j].type = RSYNC_FILEIO_OP_OPEN;
+    ops[j].dirfd = AT_FDCWD;
+    ops[j].path = "/tmp/mod_rsync-fileio.d/none";
+    ops[j].flags = O_RDONLY;
+
+    res = rsync_fileio_run(ops, TEST_FILE_COUNT + 1);
+    fail_unless(res == 1, "Expected 1 failure, got %d", res);
+    fail_unless(ops[TEST_FILE_COUNT].res == -1,
+      "Expected failed open, got %ld", (long) ops[TEST_FILE_COUNT].res);
+    fail_unless(ops[TEST_FILE_COUNT].xerrno == ENOENT,
+      "Expected ENOENT (%d), got %s (%d)", ENOENT,
+      strerror(ops[TEST_FILE_COUNT].xerrno), ops[TEST_FILE_COUNT].xerrno);
+
+    /* Write each file's index as its data, then close them all. */
+    for (j = 0; j < TEST_FILE_COUNT; j++) {
+      fail_unless(ops[j].res >= 0, "Failed to open '%s': %s", paths[j],
+        strerror(ops[j].xerrno));
+
+      ops[j].type = RSYNC_FILEIO_OP_WRITE;
+      ops[j].buf = paths[j];
+      ops[j].len = j + 1;
+      ops[j].offset = 0;
+    }
+
+    res = rsync_fileio_run(ops, TEST_FILE_COUNT);
+    fail_unless(res == 0, "Expected no failures, got %d", res);
+
+    for (j = 0; j < TEST_FILE_COUNT; j++) {
+      fail_unless(ops[j].res == (ssize_t) (j + 1),
+        "Expected %u bytes written, got %ld", j + 1, (long) ops[j].res);
+      ops[j].type = RSYNC_FILEIO_OP_CLOSE;
+    }
+
+    res = rsync_fileio_run(ops, TEST_FILE_COUNT);
+    fail_unless(res == 0, "Expected no failures, got %d", res);
+
+    memset(ops, 0, sizeof(ops));
+    memset(st, 0, sizeof(st));
+    for (j = 0; j < TEST_FILE_COUNT; j++) {
+      ops[j].type = RSYNC_FILEIO_OP_STAT;
+      ops[j].dirfd = AT_FDCWD;
+      ops[j].path = paths[j];
+      ops[j].flags = AT_SYMLINK_NOFOLLOW;
+      ops[j].st = &(st[j]);
+    }
+
+    res = rsync_fileio_run(ops, TEST_FILE_COUNT);
+    fail_unless(res == 0, "Expected no failures, got %d", res);
+
+    for (j = 0; j < TEST_FILE_COUNT; j++) {
+      struct stat expected;
+
+      fail_unless(stat(paths[j], &expected) == 0, "Failed to stat '%s': %s",
+        paths[j], strerror(errno));
+      fail_unless(S_ISREG(st[j].st_mode), "Expected regular file");
+      fail_unless(st[j].st_size == (off_t) (j + 1),
+        "Expected size %u, got %lu", j + 1, (unsigned long) st[j].st_size);
+      fail_unless(st[j].st_ino == expected.st_ino &&
+        st[j].st_dev == expected.st_dev, "Stat of '%s' differs", paths[j]);
+      fail_unless(st[j].st_mtime == expected.st_mtime,
+        "Mtime of '%s' differs", paths[j]);
+#ifdef HAVE_IO_URING
+      fail_unless(st[j].st_mtim.tv_nsec == expected.st_mtim.tv_nsec,
+        "Mtime nanoseconds of '%s' differ", paths[j]);
+#endif /* HAVE_IO_URING */
+    }
+  }
+}
+END_TEST
+
+Suite *tests_get_fileio_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("fileio");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, fileio_set_backend_test);
+  tcase_add_test(testcase, fileio_read_write_test);
+  tcase_add_test(testcase, fileio_run_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
@@ -0,0 +1,216 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Fuzzy basis lookup API tests. */
+
+#include "tests.h"
+#include "fuzzy.h"
+
+static pool *p = NULL;
+
+static const char *test_dir = "/tmp/mod_rsync-fuzzy";
+static const char *test_dir2 = "/tmp/mod_rsync-fuzzy/sub";
+
+static const char *test_names[] = {
+  "foo-1.2.3.tar",
+  "foo-1.2.3.tar.gz",
+  "bar.txt",
+  "README",
+  "data.bin",
+  "empty.tar",
+  NULL
+};
+
+static const char *get_test_path(const char *dir, const char *name) {
+  return pdircat(p, dir, name, NULL);
+}
+
+static void write_file(const char *path, size_t len, time_t mtime) {
+  struct timeval tvs[2];
+  char data[1024];
+  int fd;
+
+  memset(data, 'x', sizeof(data));
+
+  fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  fail_unless(fd >= 0, "Failed to open '%s': %s", path, strerror(errno));
+  fail_unless(write(fd, data, len) == (ssize_t) len,
+    "Failed to write '%s': %s", path, strerror(errno));
+  (void) close(fd);
+
+  tvs[0].tv_sec = tvs[1].tv_sec = mtime;
+  tvs[0].tv_usec = tvs[1].tv_usec = 0;
+  fail_unless(utimes(path, tvs) == 0, "Failed to set times of '%s': %s",
+    path, strerror(errno));
+}
+
+static void set_up(void) {
+  register unsigned int i;
+
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  (void) mkdir(test_dir, 0700);
+  (void) mkdir(test_dir2, 0700);
+
+  for (i = 0; test_names[i] != NULL; i++) {
+    size_t len;
+
+    len = 100 + i;
+    if (strcmp(test_names[i], "empty.tar") == 0) {
+      len = 0;
+    }
+
+    write_file(get_test_path(test_dir, test_names[i]), len, 1000000 + i);
+  }
+}
+
+static void tear_down(void) {
+  register unsigned int i;
+
+  if (p) {
+    for (i = 0; test_names[i] != NULL; i++) {
+      (void) unlink(get_test_path(test_dir, test_names[i]));
+    }
+
+    (void) unlink(get_test_path(test_dir, "foo-1.2.5.tar"));
+    (void) unlink(get_test_path(test_dir2, "foo-1.2.3.tar"));
+    (void) rmdir(test_dir2);
+    (void) rmdir(test_dir);
+
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+START_TEST (fuzzy_create_test) {
+  struct rsync_fuzzy *fuzzy;
+
+  mark_point();
+  fuzzy = rsync_fuzzy_create(NULL);
+  fail_unless(fuzzy == NULL, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  fuzzy = rsync_fuzzy_create(p);
+  fail_unless(fuzzy != NULL, "Failed to create index: %s", strerror(errno));
+  fail_unless(rsync_fuzzy_get_dir_count(fuzzy) == 0,
+    "Expected no directories indexed");
+}
+END_TEST
+
+START_TEST (fuzzy_find_test) {
+  struct rsync_fuzzy *fuzzy;
+  const char *path, *expected;
+
+  fuzzy = rsync_fuzzy_create(p);
+
+  mark_point();
+  path = rsync_fuzzy_find(p, fuzzy, NULL, 0, 0);
+  fail_unless(path == NULL, "Failed to handle null path");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* A new version of a file gets the old one, with the same suffix. */
+  path = rsync_fuzzy_find(p, fuzzy, get_test_path(test_dir, "foo-1.2.4.tar"),
+    5000, 0);
+  expected = get_test_path(test_dir, "foo-1.2.3.tar");
+  fail_unless(path != NULL, "Failed to find basis: %s", strerror(errno));
+  fail_unless(strcmp(path, expected) == 0, "Expected '%s', got '%s'",
+    expected, path);
+
+  path = rsync_fuzzy_find(p, fuzzy,
+    get_test_path(test_dir, "foo-1.2.4.tar.gz"), 5000, 0);
+  expected = get_test_path(test_dir, "foo-1.2.3.tar.gz");
+  fail_unless(path != NULL, "Failed to find basis: %s", strerror(errno));
+  fail_unless(strcmp(path, expected) == 0, "Expected '%s', got '%s'",
+    expected, path);
+
+  /* A file of the same size and modification time, whatever its name. */
+  path = rsync_fuzzy_find(p, fuzzy,
+    get_test_path(test_dir, "something-else.iso"), 104, 1000004);
+  expected = get_test_path(test_dir, "data.bin");
+  fail_unless(path != NULL, "Failed to find basis: %s", strerror(errno));
+  fail_unless(strcmp(path, expected) == 0, "Expected '%s', got '%s'",
+    expected, path);
+
+  /* Nothing similar. */
+  path = rsync_fuzzy_find(p, fuzzy,
+    get_test_path(test_dir, "a-completely-unrelated-file-name.iso"), 5000, 0);
+  fail_unless(path == NULL, "Unexpected basis '%s'", path);
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  /* The directory was indexed once; files added since are not seen. */
+  write_file(get_test_path(test_dir, "foo-1.2.5.tar"), 100, 0);
+  path = rsync_fuzzy_find(p, fuzzy, get_test_path(test_dir, "foo-1.2.6.tar"),
+    5000, 0);
+  expected = get_test_path(test_dir, "foo-1.2.3.tar");
+  fail_unless(path != NULL, "Failed to find basis: %s", strerror(errno));
+  fail_unless(strcmp(path, expected) == 0, "Expected '%s', got '%s'",
+    expected, path);
+  fail_unless(rsync_fuzzy_get_dir_count(fuzzy) == 1,
+    "Expected 1 directory indexed, got %u",
+    rsync_fuzzy_get_dir_count(fuzzy));
+
+  /* Other directories have their own index; empty files, and directories,
+   * are never a basis.
+   */
+  path = rsync_fuzzy_find(p, fuzzy, get_test_path(test_dir2, "foo-1.2.4.tar"),
+    5000, 0);
+  fail_unless(path == NULL, "Unexpected basis '%s'", path);
+
+  write_file(get_test_path(test_dir2, "foo-1.2.3.tar"), 0, 0);
+  path = rsync_fuzzy_find(p, fuzzy, get_test_path(test_dir, "sub.tar"), 0, 0);
+  fail_unless(path == NULL || strcmp(path, test_dir2) != 0,
+    "Unexpected directory basis '%s'", path);
+  path = rsync_fuzzy_find(p, fuzzy, get_test_path(test_dir, "empty.tar.1"),
+    5000, 0);
+  fail_unless(path == NULL ||
+    strcmp(path, get_test_path(test_dir, "empty.tar")) != 0,
+    "Unexpected empty basis '%s'", path);
+
+  fail_unless(rsync_fuzzy_get_dir_count(fuzzy) == 2,
+    "Expected 2 directories indexed, got %u",
+    rsync_fuzzy_get_dir_count(fuzzy));
+}
+END_TEST
+
+Suite *tests_get_fuzzy_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("fuzzy");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, fuzzy_create_test);
+  tcase_add_test(testcase, fuzzy_find_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
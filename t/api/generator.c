@@ -0,0 +1,501 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Signature generator API tests. */
+
+#include "tests.h"
+#include "generator.h"
+#include "checksum.h"
+#include "rolling.h"
+#include "options.h"
+#include "msg.h"
+#include "workers.h"
+#include "helpers.h"
+#include "blocksize.h"
+#include "policy.h"
+#include "compress.h"
+
+static pool *p = NULL;
+
+static const char *test_file = "/tmp/mod_rsync-generator.dat";
+static const char *policy_file = "/tmp/mod_rsync-generator.policy";
+
+/* Spans two windows, with a short last block. */
+#define TEST_FILE_SIZE		(RSYNC_GENERATOR_WINDOW_SIZE + 100001)
+#define TEST_BLOCK_SIZE		3000
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  tests_writtensz = 64 * 1024;
+  tests_written = palloc(p, tests_writtensz);
+  tests_writtenlen = 0;
+  rsync_write_data = tests_capture_write_data;
+}
+
+static void tear_down(void) {
+  rsync_write_data = tests_write_data;
+  rsync_small_file_size = 0;
+  (void) rsync_blocksize_set_policy(RSYNC_BLOCKSIZE_POLICY_SQRT);
+  rsync_policy_clear();
+  (void) unlink(test_file);
+
+  if (p) {
+    (void) rsync_policy_close(p);
+    (void) unlink(policy_file);
+
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+static struct rsync_session *create_session(int protocol_version,
+    long block_size) {
+  struct rsync_session *sess;
+  struct rsync_options *opts;
+
+  sess = tests_create_session(p, protocol_version,
+    protocol_version < 30 ? RSYNC_CHECKSUM_ALGO_MD4 : RSYNC_CHECKSUM_ALGO_MD5,
+    RSYNC_COMPRESS_ALGO_NONE, 0x2468ace);
+  opts = sess->options;
+  opts->block_size = block_size;
+  return sess;
+}
+
+/* Writes the test file, returning its data. */
+static unsigned char *write_test_file(void) {
+  register unsigned int i;
+  unsigned char *data;
+  uint32_t seed = 23;
+  int fd;
+
+  data = palloc(p, TEST_FILE_SIZE);
+  for (i = 0; i < TEST_FILE_SIZE; i++) {
+    seed = (seed * 1103515245) + 12345;
+    data[i] = (unsigned char) (seed >> 16);
+  }
+
+  fd = open(test_file, O_CREAT|O_TRUNC|O_RDWR, 0644);
+  fail_unless(fd >= 0, "Failed to open '%s': %s", test_file, strerror(errno));
+  fail_unless(write(fd, data, TEST_FILE_SIZE) == TEST_FILE_SIZE,
+    "Failed to write '%s': %s", test_file, strerror(errno));
+  (void) close(fd);
+
+  return data;
+}
+
+START_TEST (generator_get_sum_head_test) {
+  struct rsync_session *sess;
+  struct rsync_sum_head head;
+  int res;
+
+  mark_point();
+  res = rsync_generator_get_sum_head(NULL, 0, 0, NULL);
+  fail_unless(res < 0, "Failed to handle null arguments");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  sess = create_session(31, 0);
+
+  mark_point();
+  res = rsync_generator_get_sum_head(sess, 0, 0, &head);
+  fail_unless(res == 0, "Failed to get sum head: %s", strerror(errno));
+  fail_unless(head.count == 0, "Expected count 0, got %ld", (long) head.count);
+  fail_unless(head.block_len == RSYNC_GENERATOR_BLOCK_SIZE,
+    "Expected block length %d, got %ld", RSYNC_GENERATOR_BLOCK_SIZE,
+    (long) head.block_len);
+  fail_unless(head.s2len == 2, "Expected s2length 2, got %ld",
+    (long) head.s2len);
+
+  /* 100 MB: sqrt(len) exactly. */
+  mark_point();
+  res = rsync_generator_get_sum_head(sess, (off_t) 104857600, 0, &head);
+  fail_unless(res == 0, "Failed to get sum head: %s", strerror(errno));
+  fail_unless(head.block_len == 10240, "Expected block length 10240, got %ld",
+    (long) head.block_len);
+  fail_unless(head.count == 10240, "Expected count 10240, got %ld",
+    (long) head.count);
+  fail_unless(head.s2len == 3, "Expected s2length 3, got %ld",
+    (long) head.s2len);
+  fail_unless(head.remainder == 0, "Expected remainder 0, got %ld",
+    (long) head.remainder);
+
+  mark_point();
+  res = rsync_generator_get_sum_head(sess, (off_t) 104857601,
+    RSYNC_GENERATOR_FL_FULL_SUMS, &head);
+  fail_unless(res == 0, "Failed to get sum head: %s", strerror(errno));
+  fail_unless(head.count == 10241, "Expected count 10241, got %ld",
+    (long) head.count);
+  fail_unless(head.s2len == 16, "Expected s2length 16, got %ld",
+    (long) head.s2len);
+  fail_unless(head.remainder == 1, "Expected remainder 1, got %ld",
+    (long) head.remainder);
+
+  /* 1 TB: capped at the maximum block length, except for older protocols. */
+  mark_point();
+  res = rsync_generator_get_sum_head(sess, ((off_t) 1) << 40, 0, &head);
+  fail_unless(res == 0, "Failed to get sum head: %s", strerror(errno));
+  fail_unless(head.block_len == RSYNC_GENERATOR_MAX_BLOCK_SIZE,
+    "Expected block length %d, got %ld", RSYNC_GENERATOR_MAX_BLOCK_SIZE,
+    (long) head.block_len);
+
+  sess = create_session(29, 0);
+
+  mark_point();
+  res = rsync_generator_get_sum_head(sess, ((off_t) 1) << 40, 0, &head);
+  fail_unless(res == 0, "Failed to get sum head: %s", strerror(errno));
+  fail_unless(head.block_len == (1 << 20),
+    "Expected block length %d, got %ld", 1 << 20, (long) head.block_len);
+
+  /* An explicit block size overrides the heuristic. */
+  sess = create_session(31, 2048);
+
+  mark_point();
+  res = rsync_generator_get_sum_head(sess, (off_t) 104857600, 0, &head);
+  fail_unless(res == 0, "Failed to get sum head: %s", strerror(errno));
+  fail_unless(head.block_len == 2048, "Expected block length 2048, got %ld",
+    (long) head.block_len);
+}
+END_TEST
+
+START_TEST (generator_send_sums_test) {
+  register unsigned int i;
+  struct rsync_session *sess;
+  struct rsync_sum_head head;
+  unsigned char *data, *buf, digest[RSYNC_CHECKSUM_MAX_DIGEST_LEN];
+  uint32_t buflen;
+  int32_t count, block_len, s2len, remainder;
+  int fd, res;
+
+  sess = create_session(31, TEST_BLOCK_SIZE);
+
+  mark_point();
+  res = rsync_generator_send_sums(NULL, NULL, -1, 0);
+  fail_unless(res < 0, "Failed to handle null arguments");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* No basis file: an empty header. */
+  mark_point();
+  res = rsync_generator_send_sums(p, sess, -1, 0);
+  fail_unless(res == 0, "Failed to send empty sums: %s", strerror(errno));
+  fail_unless(tests_writtenlen == 16, "Expected 16 bytes, got %lu",
+    (unsigned long) tests_writtenlen);
+  fail_unless(memcmp(tests_written,
+    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16) == 0,
+    "Expected all-zero sum header");
+
+  data = write_test_file();
+
+  fd = open(test_file, O_RDONLY);
+  fail_unless(fd >= 0, "Failed to open '%s': %s", test_file, strerror(errno));
+
+  mark_point();
+  tests_writtenlen = 0;
+  res = rsync_generator_send_sums(p, sess, fd, 0);
+  fail_unless(res == 0, "Failed to send sums: %s", strerror(errno));
+  (void) close(fd);
+
+  buf = tests_written;
+  buflen = tests_writtenlen;
+
+  count = rsync_msg_read_int(p, &buf, &buflen);
+  block_len = rsync_msg_read_int(p, &buf, &buflen);
+  s2len = rsync_msg_read_int(p, &buf, &buflen);
+  remainder = rsync_msg_read_int(p, &buf, &buflen);
+
+  fail_unless(block_len == TEST_BLOCK_SIZE, "Expected block length %d, got %ld",
+    TEST_BLOCK_SIZE, (long) block_len);
+  fail_unless(count == (TEST_FILE_SIZE + TEST_BLOCK_SIZE - 1) / TEST_BLOCK_SIZE,
+    "Unexpected count %ld", (long) count);
+  fail_unless(remainder == TEST_FILE_SIZE % TEST_BLOCK_SIZE,
+    "Unexpected remainder %ld", (long) remainder);
+  fail_unless(buflen == (uint32_t) (count * (4 + s2len)),
+    "Expected %lu bytes of sums, got %lu",
+    (unsigned long) (count * (4 + s2len)), (unsigned long) buflen);
+
+  for (i = 0; i < (unsigned int) count; i++) {
+    uint32_t sum, len;
+    unsigned char *sum2;
+
+    len = (i == (unsigned int) count - 1) ? (uint32_t) remainder :
+      TEST_BLOCK_SIZE;
+
+    sum = (uint32_t) rsync_msg_read_int(p, &buf, &buflen);
+    fail_unless(sum == rsync_rolling_checksum(data + (i * TEST_BLOCK_SIZE),
+      len), "Block %u: unexpected weak checksum", i);
+
+    sum2 = rsync_msg_read_data(p, &buf, &buflen, s2len);
+    rsync_checksum_block(sess, data + (i * TEST_BLOCK_SIZE), len, digest);
+    fail_unless(memcmp(sum2, digest, s2len) == 0,
+      "Block %u: unexpected strong checksum", i);
+  }
+
+  /* A basis file below the small-file threshold gets an empty header. */
+  rsync_small_file_size = TEST_FILE_SIZE + 1;
+
+  fd = open(test_file, O_RDONLY);
+  fail_unless(fd >= 0, "Failed to open '%s': %s", test_file, strerror(errno));
+
+  mark_point();
+  tests_writtenlen = 0;
+  res = rsync_generator_send_sums(p, sess, fd, 0);
+  fail_unless(res == 0, "Failed to send sums: %s", strerror(errno));
+  (void) close(fd);
+
+  fail_unless(tests_writtenlen == 16, "Expected 16 bytes, got %lu",
+    (unsigned long) tests_writtenlen);
+  fail_unless(memcmp(tests_written,
+    "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16) == 0,
+    "Expected all-zero sum header");
+
+  rsync_small_file_size = 0;
+
+  /* When appending, only the header is sent. */
+  ((struct rsync_options *) sess->options)->append_mode = 1;
+
+  fd = open(test_file, O_RDONLY);
+  fail_unless(fd >= 0, "Failed to open '%s': %s", test_file, strerror(errno));
+
+  mark_point();
+  tests_writtenlen = 0;
+  res = rsync_generator_send_sums(p, sess, fd, 0);
+  fail_unless(res == 0, "Failed to send sums: %s", strerror(errno));
+  (void) close(fd);
+
+  fail_unless(tests_writtenlen == 16, "Expected 16 bytes, got %lu",
+    (unsigned long) tests_writtenlen);
+
+  buf = tests_written;
+  buflen = tests_writtenlen;
+
+  head.count = rsync_msg_read_int(p, &buf, &buflen);
+  head.block_len = rsync_msg_read_int(p, &buf, &buflen);
+  head.s2len = rsync_msg_read_int(p, &buf, &buflen);
+  head.remainder = rsync_msg_read_int(p, &buf, &buflen);
+
+  fail_unless(rsync_generator_get_basis_len(&head) == TEST_FILE_SIZE,
+    "Expected basis length %lu, got %lu", (unsigned long) TEST_FILE_SIZE,
+    (unsigned long) rsync_generator_get_basis_len(&head));
+}
+END_TEST
+
+START_TEST (generator_send_file_sums_test) {
+  struct rsync_policy_stats stats;
+  register unsigned int i;
+  int fd, res, whole;
+
+  (void) write_test_file();
+  (void) rsync_blocksize_set_policy(RSYNC_BLOCKSIZE_POLICY_ADAPTIVE);
+
+  /* The file hardly matched last time; unless the client asked for a block
+   * size, the longest blocks are used.
+   */
+  memset(&stats, 0, sizeof(stats));
+  stats.total_bytes = TEST_FILE_SIZE;
+  stats.literal_runs = 1;
+  (void) rsync_policy_record(test_file, &stats);
+
+  for (i = 0; i < 2; i++) {
+    struct rsync_session *sess;
+    unsigned char *buf;
+    uint32_t buflen;
+    int32_t count, block_len, expected;
+
+    expected = (i == 0 ? RSYNC_GENERATOR_MAX_BLOCK_SIZE : TEST_BLOCK_SIZE);
+    sess = create_session(31, i == 0 ? 0 : TEST_BLOCK_SIZE);
+
+    fd = open(test_file, O_RDONLY);
+    fail_unless(fd >= 0, "Failed to open '%s': %s", test_file,
+      strerror(errno));
+
+    mark_point();
+    tests_writtensz = TEST_FILE_SIZE;
+    tests_written = palloc(p, tests_writtensz);
+    tests_writtenlen = 0;
+    res = rsync_generator_send_file_sums(p, sess, fd, test_file, 0);
+    fail_unless(res == 0, "Failed to send sums: %s", strerror(errno));
+    (void) close(fd);
+
+    buf = tests_written;
+    buflen = tests_writtenlen;
+
+    count = rsync_msg_read_int(p, &buf, &buflen);
+    block_len = rsync_msg_read_int(p, &buf, &buflen);
+    fail_unless(block_len == expected, "Expected block length %ld, got %ld",
+      (long) expected, (long) block_len);
+    fail_unless(count == (TEST_FILE_SIZE + expected - 1) / expected,
+      "Unexpected count %ld", (long) count);
+  }
+
+  /* With a policy store, such a file gets no sums at all (unless it is
+   * probed in this session).
+   */
+  res = rsync_policy_open(policy_file);
+  fail_unless(res == 0, "Failed to open policy store '%s': %s", policy_file,
+    strerror(errno));
+  (void) rsync_policy_record(test_file, &stats);
+  whole = rsync_policy_get_flags(test_file) & RSYNC_POLICY_FL_WHOLE_FILE;
+
+  fd = open(test_file, O_RDONLY);
+  fail_unless(fd >= 0, "Failed to open '%s': %s", test_file, strerror(errno));
+
+  mark_point();
+  tests_writtenlen = 0;
+  res = rsync_generator_send_file_sums(p, create_session(31, 0), fd,
+    test_file, 0);
+  fail_unless(res == 0, "Failed to send sums: %s", strerror(errno));
+  (void) close(fd);
+
+  if (whole) {
+    fail_unless(tests_writtenlen == 16, "Expected 16 bytes, got %lu",
+      (unsigned long) tests_writtenlen);
+
+  } else {
+    fail_unless(tests_writtenlen > 16, "Expected sums, got %lu bytes",
+      (unsigned long) tests_writtenlen);
+  }
+}
+END_TEST
+
+#ifdef HAVE_PTHREAD
+START_TEST (generator_send_sums_workers_test) {
+  register unsigned int i;
+  struct rsync_session *sess;
+  unsigned char *expected;
+  uint32_t expectedlen;
+  int fd, res;
+
+  sess = create_session(31, TEST_BLOCK_SIZE);
+  (void) write_test_file();
+
+  fd = open(test_file, O_RDONLY);
+  fail_unless(fd >= 0, "Failed to open '%s': %s", test_file, strerror(errno));
+
+  tests_writtenlen = 0;
+  res = rsync_generator_send_sums(p, sess, fd, 0);
+  fail_unless(res == 0, "Failed to send sums: %s", strerror(errno));
+
+  expectedlen = tests_writtenlen;
+  expected = palloc(p, expectedlen);
+  memcpy(expected, tests_written, expectedlen);
+
+  /* The windows are summed by the workers; the sums sent are the same. */
+  for (i = 1; i <= 3; i++) {
+    sess->workers = rsync_workers_create(p, i);
+    fail_unless(sess->workers != NULL, "Failed to create workers: %s",
+      strerror(errno));
+
+    mark_point();
+    tests_writtenlen = 0;
+    res = rsync_generator_send_sums(p, sess, fd, 0);
+    fail_unless(res == 0, "Failed to send sums with %u workers: %s", i,
+      strerror(errno));
+    fail_unless(tests_writtenlen == expectedlen,
+      "Expected %lu bytes with %u workers, got %lu",
+      (unsigned long) expectedlen, i, (unsigned long) tests_writtenlen);
+    fail_unless(memcmp(tests_written, expected, expectedlen) == 0,
+      "Sums with %u workers differ", i);
+
+    (void) rsync_workers_destroy(sess->workers);
+    sess->workers = NULL;
+  }
+
+  (void) close(fd);
+}
+END_TEST
+#endif /* HAVE_PTHREAD */
+
+#ifdef HAVE_SEM_TIMEDWAIT
+START_TEST (generator_send_sums_helpers_test) {
+  register unsigned int i;
+  struct rsync_session *sess;
+  unsigned char *expected;
+  uint32_t expectedlen;
+  int fd, res;
+
+  sess = create_session(31, TEST_BLOCK_SIZE);
+  (void) write_test_file();
+
+  fd = open(test_file, O_RDONLY);
+  fail_unless(fd >= 0, "Failed to open '%s': %s", test_file, strerror(errno));
+
+  tests_writtenlen = 0;
+  res = rsync_generator_send_sums(p, sess, fd, 0);
+  fail_unless(res == 0, "Failed to send sums: %s", strerror(errno));
+
+  expectedlen = tests_writtenlen;
+  expected = palloc(p, expectedlen);
+  memcpy(expected, tests_written, expectedlen);
+
+  /* The windows are summed by the helper processes, in windows of their job
+   * size; the sums sent are the same.
+   */
+  for (i = 1; i <= 2; i++) {
+    res = rsync_helpers_start(i);
+    fail_unless(res == 0, "Failed to start helpers: %s", strerror(errno));
+
+    mark_point();
+    tests_writtenlen = 0;
+    res = rsync_generator_send_sums(p, sess, fd, 0);
+    fail_unless(res == 0, "Failed to send sums with %u helpers: %s", i,
+      strerror(errno));
+    fail_unless(tests_writtenlen == expectedlen,
+      "Expected %lu bytes with %u helpers, got %lu",
+      (unsigned long) expectedlen, i, (unsigned long) tests_writtenlen);
+    fail_unless(memcmp(tests_written, expected, expectedlen) == 0,
+      "Sums with %u helpers differ", i);
+
+    (void) rsync_helpers_stop();
+  }
+
+  (void) close(fd);
+}
+END_TEST
+#endif /* HAVE_SEM_TIMEDWAIT */
+
+Suite *tests_get_generator_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("generator");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, generator_get_sum_head_test);
+  tcase_add_test(testcase, generator_send_sums_test);
+  tcase_add_test(testcase, generator_send_file_sums_test);
+#ifdef HAVE_PTHREAD
+  tcase_add_test(testcase, generator_send_sums_workers_test);
+#endif /* HAVE_PTHREAD */
+#ifdef HAVE_SEM_TIMEDWAIT
+  tcase_add_test(testcase, generator_send_sums_helpers_test);
+#endif /* HAVE_SEM_TIMEDWAIT */
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
@@ -0,0 +1,280 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Helper processes API tests. */
+
+#include "tests.h"
+#include "helpers.h"
+#include "checksum.h"
+#include "rolling.h"
+#include "options.h"
+#include "version.h"
+#include "compress.h"
+
+#include <sys/wait.h>
+
+static pool *p = NULL;
+
+#define TEST_BLOCK_SIZE		700
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+}
+
+static void tear_down(void) {
+  (void) rsync_helpers_stop();
+
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+START_TEST (helpers_start_test) {
+  int res;
+
+  res = rsync_helpers_start(RSYNC_HELPERS_MAX_COUNT + 1);
+  fail_unless(res < 0, "Failed to handle too many helpers");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = rsync_helpers_start(0);
+  fail_unless(res == 0, "Failed to start no helpers: %s", strerror(errno));
+  fail_unless(rsync_helpers_get_count() == 0, "Expected no helpers");
+
+#ifdef HAVE_SEM_TIMEDWAIT
+  res = rsync_helpers_start(2);
+  fail_unless(res == 0, "Failed to start helpers: %s", strerror(errno));
+  fail_unless(rsync_helpers_get_count() == 2, "Expected 2 helpers, got %u",
+    rsync_helpers_get_count());
+
+  res = rsync_helpers_stop();
+  fail_unless(res == 0, "Failed to stop helpers: %s", strerror(errno));
+  fail_unless(rsync_helpers_get_count() == 0, "Expected no helpers");
+
+  res = rsync_helpers_stop();
+  fail_unless(res == 0, "Failed to stop helpers again: %s", strerror(errno));
+#else
+  res = rsync_helpers_start(2);
+  fail_unless(res < 0, "Failed to handle unsupported helpers");
+  fail_unless(errno == ENOSYS, "Expected ENOSYS (%d), got %s (%d)", ENOSYS,
+    strerror(errno), errno);
+#endif /* HAVE_SEM_TIMEDWAIT */
+
+  fail_unless(rsync_helpers_get_max_blocks(0) == 0, "Expected no blocks");
+  fail_unless(rsync_helpers_get_max_blocks(1) == RSYNC_HELPERS_MAX_BLOCKS,
+    "Expected %u blocks", RSYNC_HELPERS_MAX_BLOCKS);
+  fail_unless(rsync_helpers_get_max_blocks(1 << 17) ==
+    RSYNC_HELPERS_DATA_SIZE / (1 << 17), "Expected %u blocks",
+    RSYNC_HELPERS_DATA_SIZE / (1 << 17));
+}
+END_TEST
+
+#ifdef HAVE_SEM_TIMEDWAIT
+START_TEST (helpers_sums_test) {
+  register unsigned int i;
+  struct rsync_session *sess;
+  struct rsync_helpers_job *jobs[8], *job;
+  unsigned char *buf, *data, *digests, *expected_digests;
+  uint32_t *sums, *expected_sums, seed = 7;
+  size_t datalen, digest_len;
+  int fds[2], nblocks, res, expected_nblocks, status;
+  pid_t pid;
+
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+    RSYNC_COMPRESS_ALGO_NONE, 0x1357);
+  sess->compat_flags = RSYNC_VERSION_COMPAT_FL_CHKSUM_SEED_FIX;
+
+  job = rsync_helpers_get_job(sess, TRUE, &buf);
+  fail_unless(job == NULL, "Failed to handle no helpers");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = rsync_helpers_start(2);
+  fail_unless(res == 0, "Failed to start helpers: %s", strerror(errno));
+
+  /* A short last block. */
+  datalen = (TEST_BLOCK_SIZE * 1000) + 123;
+  data = palloc(p, datalen);
+  for (i = 0; i < datalen; i++) {
+    seed = (seed * 1103515245) + 12345;
+    data[i] = (unsigned char) (seed >> 16);
+  }
+
+  digest_len = rsync_checksum_get_digest_len(sess->checksum_algo);
+  expected_sums = palloc(p, 1001 * sizeof(uint32_t));
+  expected_digests = palloc(p, 1001 * digest_len);
+
+  expected_nblocks = rsync_checksum_blocks(sess, data, datalen,
+    TEST_BLOCK_SIZE, expected_digests);
+  fail_unless(expected_nblocks == 1001, "Expected 1001 blocks, got %d",
+    expected_nblocks);
+  (void) rsync_rolling_block_sums(data, datalen, TEST_BLOCK_SIZE,
+    expected_sums);
+
+  job = rsync_helpers_get_job(sess, TRUE, &buf);
+  fail_unless(job != NULL, "Failed to get job: %s", strerror(errno));
+  memcpy(buf, data, datalen);
+
+  res = rsync_helpers_submit(job, RSYNC_HELPERS_DATA_SIZE + 1,
+    TEST_BLOCK_SIZE, TRUE);
+  fail_unless(res < 0, "Failed to handle too much data");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = rsync_helpers_submit(job, datalen, TEST_BLOCK_SIZE, TRUE);
+  fail_unless(res == 0, "Failed to submit job: %s", strerror(errno));
+
+  res = rsync_helpers_submit(job, datalen, TEST_BLOCK_SIZE, TRUE);
+  fail_unless(res < 0, "Failed to handle job already submitted");
+  fail_unless(errno == EBUSY, "Expected EBUSY (%d), got %s (%d)", EBUSY,
+    strerror(errno), errno);
+
+  nblocks = rsync_helpers_wait(job, &sums, &digests);
+  fail_unless(nblocks == expected_nblocks, "Expected %d blocks, got %d (%s)",
+    expected_nblocks, nblocks, strerror(errno));
+  fail_unless(memcmp(sums, expected_sums, nblocks * sizeof(uint32_t)) == 0,
+    "Rolling checksums differ");
+  fail_unless(memcmp(digests, expected_digests, nblocks * digest_len) == 0,
+    "Block checksums differ");
+
+  rsync_helpers_release(job);
+
+  /* Two slots per helper; once they are taken, there are none to be had
+   * without waiting.
+   */
+  for (i = 0; i < 4; i++) {
+    jobs[i] = rsync_helpers_get_job(sess, FALSE, &buf);
+    fail_unless(jobs[i] != NULL, "Failed to get job #%u: %s", i + 1,
+      strerror(errno));
+    memcpy(buf, data, datalen);
+  }
+
+  job = rsync_helpers_get_job(sess, FALSE, &buf);
+  fail_unless(job == NULL, "Failed to handle no free slots");
+  fail_unless(errno == EAGAIN, "Expected EAGAIN (%d), got %s (%d)", EAGAIN,
+    strerror(errno), errno);
+
+  /* Jobs released while queued free their slots once done. */
+  for (i = 0; i < 4; i++) {
+    res = rsync_helpers_submit(jobs[i], datalen, TEST_BLOCK_SIZE, FALSE);
+    fail_unless(res == 0, "Failed to submit job #%u: %s", i + 1,
+      strerror(errno));
+  }
+
+  rsync_helpers_release(jobs[0]);
+  rsync_helpers_release(jobs[1]);
+
+  for (i = 2; i < 4; i++) {
+    nblocks = rsync_helpers_wait(jobs[i], &sums, &digests);
+    fail_unless(nblocks == expected_nblocks, "Expected %d blocks, got %d (%s)",
+      expected_nblocks, nblocks, strerror(errno));
+    fail_unless(memcmp(digests, expected_digests, nblocks * digest_len) == 0,
+      "Block checksums of job #%u differ", i + 1);
+    rsync_helpers_release(jobs[i]);
+  }
+
+  for (i = 0; i < 4; i++) {
+    jobs[i] = rsync_helpers_get_job(sess, TRUE, &buf);
+    fail_unless(jobs[i] != NULL, "Failed to get job #%u again: %s", i + 1,
+      strerror(errno));
+  }
+
+  for (i = 0; i < 4; i++) {
+    rsync_helpers_release(jobs[i]);
+  }
+
+  /* Once the helpers are stopped, sessions' jobs fail.  A forked child
+   * plays the session, whose mapping outlives the stopping.
+   */
+  job = rsync_helpers_get_job(sess, TRUE, &buf);
+  fail_unless(job != NULL, "Failed to get job: %s", strerror(errno));
+  memcpy(buf, data, datalen);
+
+  fail_unless(pipe(fds) == 0, "Failed to create pipe: %s", strerror(errno));
+
+  pid = fork();
+  fail_unless(pid >= 0, "Failed to fork: %s", strerror(errno));
+
+  if (pid == 0) {
+    char c;
+
+    (void) close(fds[1]);
+    if (read(fds[0], &c, 1) != 1) {
+      _exit(1);
+    }
+
+    if (rsync_helpers_submit(job, datalen, TEST_BLOCK_SIZE, TRUE) < 0) {
+      _exit(2);
+    }
+
+    if (rsync_helpers_wait(job, &sums, &digests) >= 0 ||
+        errno != EIO) {
+      _exit(3);
+    }
+
+    if (rsync_helpers_get_job(sess, TRUE, &buf) != NULL ||
+        errno != EIO) {
+      _exit(4);
+    }
+
+    _exit(0);
+  }
+
+  (void) close(fds[0]);
+
+  res = rsync_helpers_stop();
+  fail_unless(res == 0, "Failed to stop helpers: %s", strerror(errno));
+
+  fail_unless(write(fds[1], "x", 1) == 1, "Failed to write to pipe: %s",
+    strerror(errno));
+  (void) close(fds[1]);
+
+  fail_unless(waitpid(pid, &status, 0) == pid, "Failed to wait for child: %s",
+    strerror(errno));
+  fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+    "Child failed (status %d)", status);
+}
+END_TEST
+#endif /* HAVE_SEM_TIMEDWAIT */
+
+Suite *tests_get_helpers_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("helpers");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, helpers_start_test);
+#ifdef HAVE_SEM_TIMEDWAIT
+  tcase_add_test(testcase, helpers_sums_test);
+#endif /* HAVE_SEM_TIMEDWAIT */
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
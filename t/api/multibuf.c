@@ -0,0 +1,241 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Multi-buffer digest API tests. */
+
+#include "tests.h"
+#include "multibuf.h"
+#include "checksum.h"
+
+#include <openssl/md5.h>
+
+static pool *p = NULL;
+
+#define TEST_DATA_SIZE		(16 * 1024)
+
+static unsigned char data[TEST_DATA_SIZE];
+
+static const char *kernels[] = { "scalar", "sse2", "avx2", "avx512", NULL };
+
+static void set_up(void) {
+  register unsigned int i;
+  uint32_t seed = 11;
+
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  for (i = 0; i < TEST_DATA_SIZE; i++) {
+    seed = (seed * 1103515245) + 12345;
+    data[i] = (unsigned char) (seed >> 16);
+  }
+}
+
+static void tear_down(void) {
+  (void) rsync_multibuf_set_kernel(NULL);
+
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+static void reference_md5(const unsigned char *buf, size_t len,
+    const unsigned char *prefix, const unsigned char *suffix,
+    unsigned char *digest) {
+  MD5_CTX ctx;
+
+  MD5_Init(&ctx);
+  if (prefix != NULL) {
+    MD5_Update(&ctx, prefix, 4);
+  }
+  MD5_Update(&ctx, buf, len);
+  if (suffix != NULL) {
+    MD5_Update(&ctx, suffix, 4);
+  }
+  MD5_Final(digest, &ctx);
+}
+
+START_TEST (multibuf_digest_test) {
+  unsigned char digest[RSYNC_MULTIBUF_DIGEST_LEN];
+  /* Per RFC 1320 and RFC 1321. */
+  const unsigned char md4_abc[16] = {
+    0xa4, 0x48, 0x01, 0x7a, 0xaf, 0x21, 0xd8, 0x52,
+    0x5f, 0xc1, 0x0a, 0xe8, 0x7a, 0xa6, 0x72, 0x9d
+  };
+  const unsigned char md5_abc[16] = {
+    0x90, 0x01, 0x50, 0x98, 0x3c, 0xd2, 0x4f, 0xb0,
+    0xd6, 0x96, 0x3f, 0x7d, 0x28, 0xe1, 0x7f, 0x72
+  };
+  int res;
+
+  mark_point();
+  res = rsync_multibuf_digest(RSYNC_CHECKSUM_ALGO_MD5, NULL, 1, 700, NULL,
+    NULL, digest);
+  fail_unless(res < 0, "Failed to handle null data");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_multibuf_digest(RSYNC_CHECKSUM_ALGO_XXH64, data, 1, 700, NULL,
+    NULL, digest);
+  fail_unless(res < 0, "Failed to handle unsupported algorithm");
+  fail_unless(errno == ENOSYS, "Expected ENOSYS (%d), got %s (%d)", ENOSYS,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_multibuf_digest(RSYNC_CHECKSUM_ALGO_MD5, data, 0, 700, NULL,
+    NULL, digest);
+  fail_unless(res == 0, "Expected 0 blocks, got %d", res);
+
+  mark_point();
+  res = rsync_multibuf_digest(RSYNC_CHECKSUM_ALGO_MD4,
+    (const unsigned char *) "abc", 3, 700, NULL, NULL, digest);
+  fail_unless(res == 1, "Expected 1 block, got %d", res);
+  fail_unless(memcmp(digest, md4_abc, 16) == 0,
+    "MD4 digest does not match expected value");
+
+  mark_point();
+  res = rsync_multibuf_digest(RSYNC_CHECKSUM_ALGO_MD5,
+    (const unsigned char *) "abc", 3, 700, NULL, NULL, digest);
+  fail_unless(res == 1, "Expected 1 block, got %d", res);
+  fail_unless(memcmp(digest, md5_abc, 16) == 0,
+    "MD5 digest does not match expected value");
+}
+END_TEST
+
+START_TEST (multibuf_kernels_test) {
+  register unsigned int i, j;
+  unsigned char *digests, expected[RSYNC_MULTIBUF_DIGEST_LEN];
+  const unsigned char seed[4] = { 0x78, 0x56, 0x34, 0x12 };
+  int res;
+
+  mark_point();
+  res = rsync_multibuf_set_kernel("foo");
+  fail_unless(res < 0, "Failed to handle unknown kernel");
+  fail_unless(errno == ENOSYS, "Expected ENOSYS (%d), got %s (%d)", ENOSYS,
+    strerror(errno), errno);
+
+  digests = palloc(p, TEST_DATA_SIZE * RSYNC_MULTIBUF_DIGEST_LEN);
+
+  for (i = 0; kernels[i] != NULL; i++) {
+    if (rsync_multibuf_set_kernel(kernels[i]) < 0) {
+      continue;
+    }
+
+    fail_unless(strcmp(rsync_multibuf_get_kernel(), kernels[i]) == 0,
+      "Expected kernel '%s', got '%s'", kernels[i],
+      rsync_multibuf_get_kernel());
+
+    /* Every block length around the padding boundaries, with enough blocks
+     * to fill each kernel's lanes, plus a short block.
+     */
+    for (j = 1; j <= 200; j++) {
+      register unsigned int k;
+      size_t datalen;
+      const unsigned char *prefix, *suffix;
+
+      datalen = (j * 37) + (j % 13);
+      prefix = (j % 3 == 1) ? seed : NULL;
+      suffix = (j % 3 == 2) ? seed : NULL;
+
+      res = rsync_multibuf_digest(RSYNC_CHECKSUM_ALGO_MD5, data, datalen, j,
+        prefix, suffix, digests);
+      fail_unless(res == (int) ((datalen + j - 1) / j),
+        "%s kernel: unexpected block count %d", kernels[i], res);
+
+      for (k = 0; k < (unsigned int) res; k++) {
+        size_t len;
+
+        len = (k + 1) * j > datalen ? datalen - (k * j) : j;
+        reference_md5(data + (k * j), len, prefix, suffix, expected);
+        fail_unless(memcmp(digests + (k * RSYNC_MULTIBUF_DIGEST_LEN),
+          expected, RSYNC_MULTIBUF_DIGEST_LEN) == 0,
+          "%s kernel: block length %u: block %u digest does not match",
+          kernels[i], j, k);
+      }
+    }
+  }
+
+  (void) rsync_multibuf_set_kernel(NULL);
+  fail_unless(rsync_multibuf_get_kernel() != NULL,
+    "Failed to select kernel at runtime");
+}
+END_TEST
+
+START_TEST (multibuf_md4_kernels_test) {
+  register unsigned int i, j;
+  unsigned char *expected, *digests;
+  const unsigned char seed[4] = { 0x78, 0x56, 0x34, 0x12 };
+  size_t datalen = TEST_DATA_SIZE - 3;
+  uint32_t block_len = 700;
+  int count;
+
+  /* The MD4 digests of each SIMD kernel must match the scalar kernel's. */
+  expected = palloc(p, 32 * RSYNC_MULTIBUF_DIGEST_LEN);
+  digests = palloc(p, 32 * RSYNC_MULTIBUF_DIGEST_LEN);
+
+  mark_point();
+  fail_unless(rsync_multibuf_set_kernel("scalar") == 0,
+    "Failed to select scalar kernel: %s", strerror(errno));
+  count = rsync_multibuf_digest(RSYNC_CHECKSUM_ALGO_MD4, data, datalen,
+    block_len, NULL, seed, expected);
+  fail_unless(count == 24, "Expected 24 blocks, got %d", count);
+
+  for (i = 1; kernels[i] != NULL; i++) {
+    if (rsync_multibuf_set_kernel(kernels[i]) < 0) {
+      continue;
+    }
+
+    mark_point();
+    count = rsync_multibuf_digest(RSYNC_CHECKSUM_ALGO_MD4, data, datalen,
+      block_len, NULL, seed, digests);
+    fail_unless(count == 24, "Expected 24 blocks, got %d", count);
+
+    for (j = 0; j < (unsigned int) count; j++) {
+      fail_unless(memcmp(digests + (j * RSYNC_MULTIBUF_DIGEST_LEN),
+        expected + (j * RSYNC_MULTIBUF_DIGEST_LEN),
+        RSYNC_MULTIBUF_DIGEST_LEN) == 0,
+        "%s kernel: block %u digest does not match", kernels[i], j);
+    }
+  }
+}
+END_TEST
+
+Suite *tests_get_multibuf_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("multibuf");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, multibuf_digest_test);
+  tcase_add_test(testcase, multibuf_kernels_test);
+  tcase_add_test(testcase, multibuf_md4_kernels_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
@@ -0,0 +1,189 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+/* File list index API tests. */
+
+#include "tests.h"
+#include "ndx.h"
+#include "checksum.h"
+#include "compress.h"
+
+static pool *p = NULL;
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+}
+
+static void tear_down(void) {
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+/* Indices, and their encodings (per rsync's write_ndx()), in order. */
+static const struct {
+  int32_t ndx;
+  const char *encoded;
+  uint32_t encodedlen;
+} ndx_vectors[] = {
+  { 0,			"\x01", 1 },
+  { 1,			"\x01", 1 },
+  { 5,			"\x04", 1 },
+  { 5,			"\xfe\x00\x00", 3 },
+  { 300,		"\xfe\x01\x27", 3 },
+  { 100,		"\xfe\x80\x64\x00\x00", 5 },
+  { 100000,		"\xfe\x80\xa0\x86\x01", 5 },
+  { RSYNC_NDX_DONE,	"\x00", 1 },
+  { RSYNC_NDX_FLIST_EOF, "\xff\x01", 2 },
+  { 100001,		"\x01", 1 },
+  { RSYNC_NDX_FLIST_OFFSET, "\xff\x63", 2 },
+  { 0,			NULL, 0 }
+};
+
+START_TEST (ndx_write_test) {
+  register unsigned int i;
+  struct rsync_session *sess;
+  struct rsync_ndx_state state;
+  unsigned char *buf, data[RSYNC_NDX_MAX_LEN];
+  uint32_t buflen, len;
+
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_NONE, 0);
+  rsync_ndx_init(&state);
+
+  for (i = 0; ndx_vectors[i].encoded != NULL; i++) {
+    buf = data;
+    buflen = sizeof(data);
+
+    mark_point();
+    len = rsync_ndx_write(sess, &state, &buf, &buflen, ndx_vectors[i].ndx);
+    fail_unless(len == ndx_vectors[i].encodedlen,
+      "Index %ld: expected %lu bytes, got %lu", (long) ndx_vectors[i].ndx,
+      (unsigned long) ndx_vectors[i].encodedlen, (unsigned long) len);
+    fail_unless(memcmp(data, ndx_vectors[i].encoded, len) == 0,
+      "Index %ld: unexpected encoding", (long) ndx_vectors[i].ndx);
+  }
+
+  /* Older protocols send plain ints. */
+  sess = tests_create_session(p, 29, RSYNC_CHECKSUM_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_NONE, 0);
+  rsync_ndx_init(&state);
+
+  buf = data;
+  buflen = sizeof(data);
+
+  mark_point();
+  len = rsync_ndx_write(sess, &state, &buf, &buflen, 258);
+  fail_unless(len == 4, "Expected 4 bytes, got %lu", (unsigned long) len);
+  fail_unless(memcmp(data, "\x02\x01\x00\x00", 4) == 0,
+    "Unexpected encoding");
+}
+END_TEST
+
+START_TEST (ndx_read_test) {
+  register unsigned int i;
+  struct rsync_session *sess;
+  struct rsync_ndx_state state;
+  unsigned char *buf, data[RSYNC_NDX_MAX_LEN];
+  uint32_t buflen;
+  int32_t ndx;
+  int res;
+
+  mark_point();
+  res = rsync_ndx_read(NULL, NULL, NULL, NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null arguments");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_NONE, 0);
+  rsync_ndx_init(&state);
+
+  for (i = 0; ndx_vectors[i].encoded != NULL; i++) {
+    uint32_t len;
+
+    memcpy(data, ndx_vectors[i].encoded, ndx_vectors[i].encodedlen);
+
+    /* Nothing is consumed until the whole index has arrived. */
+    for (len = 0; len < ndx_vectors[i].encodedlen; len++) {
+      buf = data;
+      buflen = len;
+
+      mark_point();
+      res = rsync_ndx_read(sess, &state, &buf, &buflen, &ndx);
+      fail_unless(res < 0, "Index %ld: failed to handle %lu bytes",
+        (long) ndx_vectors[i].ndx, (unsigned long) len);
+      fail_unless(errno == EAGAIN, "Expected EAGAIN (%d), got %s (%d)",
+        EAGAIN, strerror(errno), errno);
+      fail_unless(buf == data && buflen == len,
+        "Index %ld: consumed partial data", (long) ndx_vectors[i].ndx);
+    }
+
+    buf = data;
+    buflen = ndx_vectors[i].encodedlen;
+
+    mark_point();
+    res = rsync_ndx_read(sess, &state, &buf, &buflen, &ndx);
+    fail_unless(res == 0, "Index %ld: failed to read: %s",
+      (long) ndx_vectors[i].ndx, strerror(errno));
+    fail_unless(ndx == ndx_vectors[i].ndx, "Expected index %ld, got %ld",
+      (long) ndx_vectors[i].ndx, (long) ndx);
+    fail_unless(buflen == 0, "Index %ld: left %lu bytes unread",
+      (long) ndx_vectors[i].ndx, (unsigned long) buflen);
+  }
+
+  sess = tests_create_session(p, 29, RSYNC_CHECKSUM_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_NONE, 0);
+  rsync_ndx_init(&state);
+
+  memcpy(data, "\x02\x01\x00\x00", 4);
+  buf = data;
+  buflen = 4;
+
+  mark_point();
+  res = rsync_ndx_read(sess, &state, &buf, &buflen, &ndx);
+  fail_unless(res == 0, "Failed to read: %s", strerror(errno));
+  fail_unless(ndx == 258, "Expected index 258, got %ld", (long) ndx);
+}
+END_TEST
+
+Suite *tests_get_ndx_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("ndx");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, ndx_write_test);
+  tcase_add_test(testcase, ndx_read_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
@@ -0,0 +1,92 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Negotiation API tests. */
+
+#include "tests.h"
+#include "negotiate.h"
+
+static pool *p = NULL;
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+}
+
+static void tear_down(void) {
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+START_TEST (negotiate_choose_test) {
+  const char *res;
+
+  mark_point();
+  res = rsync_negotiate_choose(NULL, NULL, NULL);
+  fail_unless(res == NULL, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_negotiate_choose(p, NULL, NULL);
+  fail_unless(res == NULL, "Failed to handle null client list");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_negotiate_choose(p, "foo bar", "baz quxx");
+  fail_unless(res == NULL, "Failed to handle disjoint lists");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  /* The client's order of preference wins. */
+  mark_point();
+  res = rsync_negotiate_choose(p, "xxh64 md5 md4", "md4 md5 xxh64");
+  fail_unless(res != NULL, "Failed to choose: %s", strerror(errno));
+  fail_unless(strcmp(res, "xxh64") == 0, "Expected 'xxh64', got '%s'", res);
+
+  mark_point();
+  res = rsync_negotiate_choose(p, "xxh128 md5 md4", "md4 md5");
+  fail_unless(res != NULL, "Failed to choose: %s", strerror(errno));
+  fail_unless(strcmp(res, "md5") == 0, "Expected 'md5', got '%s'", res);
+}
+END_TEST
+
+Suite *tests_get_negotiate_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("negotiate");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, negotiate_choose_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
@@ -0,0 +1,583 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+/* Transfer pipeline API tests. */
+
+#include "tests.h"
+#include "pipeline.h"
+#include "ndx.h"
+#include "sender.h"
+#include "generator.h"
+#include "sumtable.h"
+#include "checksum.h"
+#include "compress.h"
+#include "options.h"
+#include "msg.h"
+#include "fuzzy.h"
+
+static pool *p = NULL;
+
+#define TEST_FILE_COUNT		20
+#define TEST_WINDOW		4
+
+static const char *src_path = "/tmp/mod_rsync-pipeline-src.%u";
+static const char *basis_path = "/tmp/mod_rsync-pipeline-basis.%u";
+static const char *dst_path = "/tmp/mod_rsync-pipeline-dst.%u";
+static const char *fuzzy_dir = "/tmp/mod_rsync-pipeline-fuzzy";
+static const char *fuzzy_basis_path =
+  "/tmp/mod_rsync-pipeline-fuzzy/foo-1.2.3.tar";
+static const char *fuzzy_dst_path =
+  "/tmp/mod_rsync-pipeline-fuzzy/foo-1.2.4.tar";
+
+/* The fuzzy basis name of the last request, if any. */
+static const char *last_xname = NULL;
+
+static const char *get_path(const char *fmt, unsigned int i) {
+  char *path;
+
+  path = pcalloc(p, PR_TUNABLE_PATH_MAX);
+  pr_snprintf(path, PR_TUNABLE_PATH_MAX-1, fmt, i);
+  return path;
+}
+
+static void set_up(void) {
+  register unsigned int i;
+  uint32_t seed = 41;
+
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  /* Files of various sizes (including empty); the odd ones have a basis,
+   * differing from them in a few places.
+   */
+  for (i = 0; i < TEST_FILE_COUNT; i++) {
+    register unsigned int j;
+    unsigned char *data;
+    uint32_t datalen;
+
+    datalen = (i * 7919) % 20000;
+    data = palloc(p, datalen + 1);
+    for (j = 0; j < datalen; j++) {
+      seed = (seed * 1103515245) + 12345;
+      data[j] = (unsigned char) (seed >> 16);
+    }
+
+    tests_write_file(get_path(src_path, i), data, datalen);
+
+    if (i % 2 == 1) {
+      for (j = 0; j < datalen; j += 3000) {
+        data[j] ^= 0xff;
+      }
+
+      tests_write_file(get_path(basis_path, i), data, datalen);
+    }
+  }
+
+  tests_writtensz = 1024 * 1024;
+  tests_written = palloc(p, tests_writtensz);
+  tests_writtenlen = 0;
+  rsync_write_data = tests_capture_write_data;
+}
+
+static void tear_down(void) {
+  register unsigned int i;
+
+  rsync_write_data = tests_write_data;
+
+  for (i = 0; i < TEST_FILE_COUNT; i++) {
+    (void) unlink(get_path(src_path, i));
+    (void) unlink(get_path(basis_path, i));
+    (void) unlink(get_path(dst_path, i));
+  }
+
+  (void) unlink(fuzzy_basis_path);
+  (void) unlink(fuzzy_dst_path);
+  (void) rmdir(fuzzy_dir);
+  last_xname = NULL;
+
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+/* Answers the requests in the given buffer, as the sender would, per
+ * rsync-${version}/sender.c#send_files(); the replies are left in the written
+ * buffer.  Returns TRUE if the requests ended with RSYNC_NDX_DONE.
+ */
+static int send_replies(struct rsync_session *sess,
+    struct rsync_ndx_state *recv_state, struct rsync_ndx_state *send_state,
+    unsigned char *buf, uint32_t buflen) {
+  tests_writtenlen = 0;
+
+  while (buflen > 0) {
+    struct rsync_sum_head head;
+    struct rsync_sumtable *tab = NULL;
+    unsigned char hdr[32 + RSYNC_FUZZY_MAX_NAME_LEN], *ptr;
+    uint32_t hdrlen;
+    int32_t ndx;
+    int16_t iflags;
+    int fd, res;
+
+    res = rsync_ndx_read(sess, recv_state, &buf, &buflen, &ndx);
+    fail_unless(res == 0, "Failed to read request: %s", strerror(errno));
+
+    ptr = hdr;
+    hdrlen = sizeof(hdr);
+
+    if (ndx == RSYNC_NDX_DONE) {
+      fail_unless(buflen == 0, "Unexpected data after done");
+      rsync_ndx_write(sess, send_state, &ptr, &hdrlen, ndx);
+      fail_unless(tests_capture_write_data(p, 0, hdr,
+        sizeof(hdr) - hdrlen) == 0, "Failed to write reply");
+      return TRUE;
+    }
+
+    fail_unless(ndx >= 0 && ndx < TEST_FILE_COUNT,
+      "Requested invalid index %ld", (long) ndx);
+
+    iflags = rsync_msg_read_short(p, &buf, &buflen);
+    fail_unless(iflags & RSYNC_ITEM_TRANSFER, "Expected transfer flag");
+
+    last_xname = NULL;
+    if (iflags & RSYNC_ITEM_BASIS_TYPE_FOLLOWS) {
+      fail_unless((unsigned char) rsync_msg_read_byte(p, &buf, &buflen) ==
+        RSYNC_FNAMECMP_FUZZY, "Expected fuzzy basis type");
+    }
+
+    if (iflags & RSYNC_ITEM_XNAME_FOLLOWS) {
+      last_xname = rsync_msg_read_vstring(p, &buf, &buflen);
+      fail_unless(last_xname != NULL, "Failed to read basis name");
+    }
+
+    res = rsync_sumtable_read_head(p, sess, &buf, &buflen, &head);
+    fail_unless(res == 0, "Failed to read sum head: %s", strerror(errno));
+
+    if (head.count > 0) {
+      fail_unless(ndx % 2 == 1, "Received sums for file without basis");
+
+      tab = rsync_sumtable_create(p, &head);
+      res = rsync_sumtable_decode(tab, &buf, &buflen);
+      fail_unless(res == 0, "Failed to decode sums: %s", strerror(errno));
+    }
+
+    rsync_ndx_write(sess, send_state, &ptr, &hdrlen, ndx);
+    rsync_msg_write_short(&ptr, &hdrlen, iflags);
+    if (iflags & RSYNC_ITEM_BASIS_TYPE_FOLLOWS) {
+      rsync_msg_write_byte(&ptr, &hdrlen, (char) RSYNC_FNAMECMP_FUZZY);
+    }
+
+    if (last_xname != NULL) {
+      rsync_msg_write_vstring(&ptr, &hdrlen, last_xname);
+    }
+
+    rsync_generator_write_sum_head(sess, &ptr, &hdrlen, &head);
+    fail_unless(tests_capture_write_data(p, 0, hdr, sizeof(hdr) - hdrlen) == 0,
+      "Failed to write reply");
+
+    fd = open(get_path(src_path, ndx), O_RDONLY);
+    fail_unless(fd >= 0, "Failed to open source file %ld: %s", (long) ndx,
+      strerror(errno));
+
+    res = rsync_sender_send_file(p, sess, fd, get_path(src_path, ndx), tab,
+      NULL);
+    fail_unless(res == 0, "Failed to send file: %s", strerror(errno));
+    (void) close(fd);
+  }
+
+  return FALSE;
+}
+
+static void check_file(unsigned int i) {
+  struct stat st;
+  unsigned char *src, *dst;
+  int fd;
+
+  fail_unless(stat(get_path(src_path, i), &st) == 0,
+    "Failed to stat source file %u: %s", i, strerror(errno));
+
+  src = palloc(p, st.st_size + 1);
+  dst = palloc(p, st.st_size + 1);
+
+  fd = open(get_path(src_path, i), O_RDONLY);
+  fail_unless(read(fd, src, st.st_size + 1) == st.st_size,
+    "Failed to read source file %u", i);
+  (void) close(fd);
+
+  fd = open(get_path(dst_path, i), O_RDONLY);
+  fail_unless(fd >= 0, "Failed to open file %u: %s", i, strerror(errno));
+  fail_unless(read(fd, dst, st.st_size + 1) == st.st_size,
+    "File %u: unexpected length", i);
+  (void) close(fd);
+
+  fail_unless(memcmp(src, dst, st.st_size) == 0, "File %u: data differs", i);
+}
+
+START_TEST (pipeline_create_test) {
+  struct rsync_session *sess;
+  struct rsync_pipeline *pipeline;
+
+  mark_point();
+  pipeline = rsync_pipeline_create(NULL, NULL, 0);
+  fail_unless(pipeline == NULL, "Failed to handle null arguments");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+    RSYNC_COMPRESS_ALGO_NONE, 0x1357);
+
+  mark_point();
+  pipeline = rsync_pipeline_create(p, sess, 0);
+  fail_unless(pipeline == NULL, "Failed to handle zero window");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  pipeline = rsync_pipeline_create(p, sess, RSYNC_PIPELINE_DEFAULT_WINDOW);
+  fail_unless(pipeline != NULL, "Failed to create pipeline: %s",
+    strerror(errno));
+  fail_unless(rsync_pipeline_get_pending(pipeline) == 0,
+    "Expected no pending files");
+
+  mark_point();
+  fail_unless(rsync_pipeline_destroy(pipeline, NULL) == 0,
+    "Failed to destroy pipeline: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (pipeline_recv_test) {
+  struct rsync_session *sess, *sender_sess;
+  struct rsync_pipeline *pipeline;
+  struct rsync_ndx_state sender_recv, sender_send;
+  struct rsync_receiver_stats stats;
+  unsigned char *requests, *replies;
+  uint32_t requestslen = 0, replieslen = 0;
+  int fds[TEST_FILE_COUNT], basis_fds[TEST_FILE_COUNT];
+  unsigned int i, next = 0, nreceived = 0, nrounds = 0;
+  int done = FALSE;
+
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+    RSYNC_COMPRESS_ALGO_NONE, 0x1357);
+  sender_sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+    RSYNC_COMPRESS_ALGO_NONE, 0x1357);
+  rsync_ndx_init(&sender_recv);
+  rsync_ndx_init(&sender_send);
+
+  requests = palloc(p, tests_writtensz);
+  replies = palloc(p, tests_writtensz);
+
+  for (i = 0; i < TEST_FILE_COUNT; i++) {
+    fds[i] = open(get_path(dst_path, i), O_RDWR|O_CREAT|O_TRUNC,
+      0600);
+    fail_unless(fds[i] >= 0, "Failed to open file %u: %s", i,
+      strerror(errno));
+
+    basis_fds[i] = -1;
+    if (i % 2 == 1) {
+      basis_fds[i] = open(get_path(basis_path, i), O_RDONLY);
+      fail_unless(basis_fds[i] >= 0, "Failed to open basis %u: %s", i,
+        strerror(errno));
+    }
+  }
+
+  pipeline = rsync_pipeline_create(p, sess, TEST_WINDOW);
+  fail_unless(pipeline != NULL, "Failed to create pipeline: %s",
+    strerror(errno));
+
+  while (!done) {
+    unsigned char *buf;
+    uint32_t buflen;
+
+    /* Request files until the window is full. */
+    tests_writtenlen = 0;
+    while (next < TEST_FILE_COUNT) {
+      if (rsync_pipeline_send_file(pipeline, next,
+          get_path(dst_path, next), fds[next], basis_fds[next], 0) < 0) {
+        fail_unless(errno == EAGAIN, "Failed to request file %u: %s", next,
+          strerror(errno));
+        break;
+      }
+
+      next++;
+    }
+
+    if (next == TEST_FILE_COUNT &&
+        nreceived + rsync_pipeline_get_pending(pipeline) ==
+          TEST_FILE_COUNT) {
+      fail_unless(rsync_pipeline_send_done(pipeline) == 0,
+        "Failed to send done: %s", strerror(errno));
+    }
+
+    fail_unless(rsync_pipeline_get_pending(pipeline) <= TEST_WINDOW,
+      "Too many files pending: %u", rsync_pipeline_get_pending(pipeline));
+
+    /* The window is filled before anything comes back. */
+    if (nrounds == 0) {
+      fail_unless(rsync_pipeline_get_pending(pipeline) == TEST_WINDOW,
+        "Expected %u pending files, got %u", TEST_WINDOW,
+        rsync_pipeline_get_pending(pipeline));
+    }
+
+    memcpy(requests, tests_written, tests_writtenlen);
+    requestslen = tests_writtenlen;
+
+    (void) send_replies(sender_sess, &sender_recv, &sender_send, requests,
+      requestslen);
+    memcpy(replies, tests_written, tests_writtenlen);
+    replieslen = tests_writtenlen;
+
+    /* Feed the replies to the pipeline in pieces. */
+    buf = replies;
+    buflen = 0;
+
+    while (buf + buflen < replies + replieslen) {
+      struct rsync_pipeline_file file;
+      int res;
+
+      buflen += ((replies + replieslen) - (buf + buflen)) > 1000 ? 1000 :
+        (uint32_t) ((replies + replieslen) - (buf + buflen));
+
+      while (buflen > 0) {
+        res = rsync_pipeline_recv(pipeline, &buf, &buflen, &file);
+        if (res < 0) {
+          fail_unless(errno == EAGAIN, "Failed to receive: %s",
+            strerror(errno));
+          break;
+        }
+
+        if (res == RSYNC_PIPELINE_RECV_DONE) {
+          done = TRUE;
+          break;
+        }
+
+        fail_unless(file.ndx == (int32_t) nreceived,
+          "Expected file %u, got %ld", nreceived, (long) file.ndx);
+        fail_unless(file.fd == fds[nreceived], "Unexpected descriptor");
+        fail_unless(file.result == RSYNC_RECEIVER_RECV_OK,
+          "File %u failed verification", nreceived);
+
+        /* Only the files with a basis had sums sent for them. */
+        fail_unless((file.block_len > 0) == (basis_fds[nreceived] >= 0),
+          "Unexpected block length %ld for file %u", (long) file.block_len,
+          nreceived);
+        nreceived++;
+      }
+    }
+
+    fail_unless(buflen == 0, "Left %lu bytes unread", (unsigned long) buflen);
+    nrounds++;
+  }
+
+  fail_unless(nreceived == TEST_FILE_COUNT, "Expected %u files, got %u",
+    TEST_FILE_COUNT, nreceived);
+  fail_unless(nrounds == TEST_FILE_COUNT / TEST_WINDOW,
+    "Expected %u rounds, got %u", TEST_FILE_COUNT / TEST_WINDOW, nrounds);
+
+  memset(&stats, 0, sizeof(stats));
+  fail_unless(rsync_pipeline_destroy(pipeline, &stats) == 0,
+    "Failed to destroy pipeline: %s", strerror(errno));
+  fail_unless(stats.matched_bytes > 0, "Expected some matched data");
+  fail_unless(stats.sum_bytes > 0, "Expected some block sums");
+
+  for (i = 0; i < TEST_FILE_COUNT; i++) {
+    (void) close(fds[i]);
+    if (basis_fds[i] >= 0) {
+      (void) close(basis_fds[i]);
+    }
+
+    check_file(i);
+  }
+}
+END_TEST
+
+START_TEST (pipeline_send_new_file_test) {
+  register unsigned int i;
+  struct rsync_session *sess, *sender_sess;
+  struct rsync_pipeline *pipeline;
+  struct rsync_ndx_state sender_recv, sender_send;
+  struct rsync_pipeline_file file;
+  struct stat st;
+  unsigned char *requests, *src, *dst;
+  uint32_t requestslen;
+  int fd, res;
+
+  mark_point();
+  res = rsync_pipeline_send_new_file(NULL, 0, NULL, -1, 0, 0, 0);
+  fail_unless(res < 0, "Failed to handle null arguments");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* A renamed version of the file gets the old version as its basis. */
+  fail_unless(mkdir(fuzzy_dir, 0700) == 0, "Failed to create '%s': %s",
+    fuzzy_dir, strerror(errno));
+  fail_unless(rename(get_path(basis_path, 1), fuzzy_basis_path) == 0,
+    "Failed to rename basis: %s", strerror(errno));
+  fail_unless(stat(get_path(src_path, 1), &st) == 0,
+    "Failed to stat source file: %s", strerror(errno));
+
+  /* Without --fuzzy, the file is new; with it, the basis is found. */
+  for (i = 0; i < 2; i++) {
+    sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+      RSYNC_COMPRESS_ALGO_NONE, 0x1357);
+    ((struct rsync_options *) sess->options)->fuzzy_basis = (i == 1);
+    sender_sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+      RSYNC_COMPRESS_ALGO_NONE, 0x1357);
+    rsync_ndx_init(&sender_recv);
+    rsync_ndx_init(&sender_send);
+
+    fd = open(fuzzy_dst_path, O_RDWR|O_CREAT|O_TRUNC, 0600);
+    fail_unless(fd >= 0, "Failed to open '%s': %s", fuzzy_dst_path,
+      strerror(errno));
+
+    pipeline = rsync_pipeline_create(p, sess, TEST_WINDOW);
+    fail_unless(pipeline != NULL, "Failed to create pipeline: %s",
+      strerror(errno));
+
+    mark_point();
+    tests_writtenlen = 0;
+    res = rsync_pipeline_send_new_file(pipeline, 1, fuzzy_dst_path, fd,
+      st.st_size, st.st_mtime, 0);
+    fail_unless(res == 0, "Failed to request file: %s", strerror(errno));
+    fail_unless(rsync_pipeline_send_done(pipeline) == 0,
+      "Failed to send done: %s", strerror(errno));
+
+    requestslen = tests_writtenlen;
+    requests = palloc(p, requestslen);
+    memcpy(requests, tests_written, requestslen);
+
+    (void) send_replies(sender_sess, &sender_recv, &sender_send, requests,
+      requestslen);
+
+    if (i == 0) {
+      fail_unless(last_xname == NULL, "Unexpected basis name '%s'",
+        last_xname);
+
+    } else {
+      fail_unless(last_xname != NULL, "Expected fuzzy basis name");
+      fail_unless(strcmp(last_xname, "foo-1.2.3.tar") == 0,
+        "Expected basis 'foo-1.2.3.tar', got '%s'", last_xname);
+    }
+
+    requests = tests_written;
+    requestslen = tests_writtenlen;
+
+    res = rsync_pipeline_recv(pipeline, &requests, &requestslen, &file);
+    fail_unless(res == RSYNC_PIPELINE_RECV_FILE, "Failed to receive: %s",
+      strerror(errno));
+    fail_unless(file.result == RSYNC_RECEIVER_RECV_OK,
+      "File failed verification");
+    fail_unless(file.basis_fd == -1, "Expected basis to be closed");
+    fail_unless((file.block_len > 0) == (i == 1),
+      "Unexpected block length %ld", (long) file.block_len);
+    fail_unless((file.stats.matched_bytes > 0) == (i == 1),
+      "Unexpected matched bytes %lu",
+      (unsigned long) file.stats.matched_bytes);
+
+    fail_unless(rsync_pipeline_destroy(pipeline, NULL) == 0,
+      "Failed to destroy pipeline: %s", strerror(errno));
+    (void) close(fd);
+
+    src = palloc(p, st.st_size + 1);
+    dst = palloc(p, st.st_size + 1);
+
+    fd = open(get_path(src_path, 1), O_RDONLY);
+    fail_unless(read(fd, src, st.st_size + 1) == st.st_size,
+      "Failed to read source file");
+    (void) close(fd);
+
+    fd = open(fuzzy_dst_path, O_RDONLY);
+    fail_unless(read(fd, dst, st.st_size + 1) == st.st_size,
+      "Unexpected file length");
+    (void) close(fd);
+
+    fail_unless(memcmp(src, dst, st.st_size) == 0, "File data differs");
+    (void) unlink(fuzzy_dst_path);
+  }
+}
+END_TEST
+
+START_TEST (pipeline_recv_unrequested_test) {
+  struct rsync_session *sess;
+  struct rsync_pipeline *pipeline;
+  struct rsync_pipeline_file file;
+  struct rsync_ndx_state state;
+  unsigned char data[32], *buf;
+  uint32_t buflen;
+  int fd, res;
+
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+    RSYNC_COMPRESS_ALGO_NONE, 0x1357);
+  pipeline = rsync_pipeline_create(p, sess, TEST_WINDOW);
+  fail_unless(pipeline != NULL, "Failed to create pipeline: %s",
+    strerror(errno));
+
+  fd = open(get_path(dst_path, 0), O_RDWR|O_CREAT|O_TRUNC, 0600);
+  fail_unless(fd >= 0, "Failed to open file: %s", strerror(errno));
+
+  mark_point();
+  res = rsync_pipeline_send_file(pipeline, 3, get_path(dst_path, 0), fd, -1,
+    0);
+  fail_unless(res == 0, "Failed to request file: %s", strerror(errno));
+
+  /* A reply for a file which was not requested. */
+  rsync_ndx_init(&state);
+  buf = data;
+  buflen = sizeof(data);
+  rsync_ndx_write(sess, &state, &buf, &buflen, 7);
+  rsync_msg_write_short(&buf, &buflen, RSYNC_ITEM_TRANSFER);
+  rsync_generator_write_sum_head(sess, &buf, &buflen, NULL);
+
+  buflen = sizeof(data) - buflen;
+  buf = data;
+
+  mark_point();
+  res = rsync_pipeline_recv(pipeline, &buf, &buflen, &file);
+  fail_unless(res < 0, "Failed to handle unrequested file");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  (void) rsync_pipeline_destroy(pipeline, NULL);
+  (void) close(fd);
+}
+END_TEST
+
+Suite *tests_get_pipeline_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("pipeline");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, pipeline_create_test);
+  tcase_add_test(testcase, pipeline_recv_test);
+  tcase_add_test(testcase, pipeline_send_new_file_test);
+  tcase_add_test(testcase, pipeline_recv_unrequested_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
@@ -0,0 +1,302 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Transfer policy store API tests. */
+
+#include "tests.h"
+#include "policy.h"
+
+static pool *p = NULL;
+
+static const char *policy_file = "/tmp/mod_rsync-policy.dat";
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  rsync_policy_clear();
+  (void) unlink(policy_file);
+}
+
+static void tear_down(void) {
+  if (p) {
+    (void) rsync_policy_close(p);
+    destroy_pool(p);
+    p = NULL;
+  }
+
+  rsync_policy_clear();
+  (void) unlink(policy_file);
+}
+
+static int record_delta(const char *path, uint64_t total_bytes,
+    uint64_t matched_bytes) {
+  struct rsync_policy_stats stats;
+
+  memset(&stats, 0, sizeof(stats));
+  stats.total_bytes = total_bytes;
+  stats.matched_bytes = matched_bytes;
+  stats.literal_runs = 1;
+  return rsync_policy_record(path, &stats);
+}
+
+START_TEST (policy_record_test) {
+  struct rsync_policy_stats stats;
+  int res;
+
+  mark_point();
+  res = rsync_policy_record(NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null path");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_policy_get("/a/file.log", NULL);
+  fail_unless(res < 0, "Failed to handle null stats");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = rsync_policy_get("/a/file.log", &stats);
+  fail_unless(res < 0, "Failed to handle missing history");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  res = record_delta("/a/file.log", 1000, 800);
+  fail_unless(res == 0, "Failed to record: %s", strerror(errno));
+
+  res = rsync_policy_get("/a/file.log", &stats);
+  fail_unless(res == 0, "Failed to get history: %s", strerror(errno));
+  fail_unless(stats.total_bytes == 1000, "Expected 1000 bytes, got %lu",
+    (unsigned long) stats.total_bytes);
+  fail_unless(stats.matched_bytes == 800, "Expected 800 bytes, got %lu",
+    (unsigned long) stats.matched_bytes);
+
+  /* Older counts are halved with each new record. */
+  (void) record_delta("/a/file.log", 1000, 0);
+  res = rsync_policy_get("/a/file.log", &stats);
+  fail_unless(res == 0, "Failed to get history: %s", strerror(errno));
+  fail_unless(stats.total_bytes == 1500, "Expected 1500 bytes, got %lu",
+    (unsigned long) stats.total_bytes);
+  fail_unless(stats.matched_bytes == 400, "Expected 400 bytes, got %lu",
+    (unsigned long) stats.matched_bytes);
+
+  /* Other files in the same directory, then with the same extension, share
+   * the history.
+   */
+  (void) record_delta("/b/other.dat", 2000, 2000);
+
+  res = rsync_policy_get("/b/new.log", &stats);
+  fail_unless(res == 0, "Failed to get history: %s", strerror(errno));
+  fail_unless(stats.total_bytes == 2000, "Expected 2000 bytes, got %lu",
+    (unsigned long) stats.total_bytes);
+
+  res = rsync_policy_get("/c/new.log", &stats);
+  fail_unless(res == 0, "Failed to get history: %s", strerror(errno));
+  fail_unless(stats.total_bytes == 1500, "Expected 1500 bytes, got %lu",
+    (unsigned long) stats.total_bytes);
+
+  res = rsync_policy_get("/c/.log", &stats);
+  fail_unless(res < 0, "Expected no history for '/c/.log'");
+  fail_unless(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  /* Each set of counts comes from the most specific entry having them. */
+  memset(&stats, 0, sizeof(stats));
+  stats.raw_bytes = 4000;
+  stats.compressed_bytes = 1000;
+  (void) rsync_policy_record("/b/other.dat", &stats);
+
+  res = rsync_policy_get("/b/new.dat", &stats);
+  fail_unless(res == 0, "Failed to get history: %s", strerror(errno));
+  fail_unless(stats.total_bytes == 2000, "Expected 2000 bytes, got %lu",
+    (unsigned long) stats.total_bytes);
+  fail_unless(stats.raw_bytes == 4000, "Expected 4000 bytes, got %lu",
+    (unsigned long) stats.raw_bytes);
+  fail_unless(stats.compressed_bytes == 1000, "Expected 1000 bytes, got %lu",
+    (unsigned long) stats.compressed_bytes);
+
+  rsync_policy_clear();
+  res = rsync_policy_get("/a/file.log", &stats);
+  fail_unless(res < 0, "Expected no history after clearing");
+}
+END_TEST
+
+START_TEST (policy_get_flags_test) {
+  struct rsync_policy_stats stats;
+  register unsigned int i;
+  unsigned int nprobes = 0;
+  int flags, res;
+
+  mark_point();
+  flags = rsync_policy_get_flags(NULL);
+  fail_unless(flags == 0, "Expected no flags for null path");
+
+  /* Without a store, history changes nothing. */
+  (void) record_delta("/a/random.bin", 1000000, 1000);
+  flags = rsync_policy_get_flags("/a/random.bin");
+  fail_unless(flags == 0, "Expected no flags without a store, got %d",
+    flags);
+
+  mark_point();
+  res = rsync_policy_open("policy.dat");
+  fail_unless(res < 0, "Failed to handle relative path");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = rsync_policy_open(policy_file);
+  fail_unless(res == 0, "Failed to open '%s': %s", policy_file,
+    strerror(errno));
+
+  (void) record_delta("/a/random.bin", 1000000, 1000);
+  (void) record_delta("/b/text.txt", 1000000, 900000);
+
+  memset(&stats, 0, sizeof(stats));
+  stats.raw_bytes = 1000000;
+  stats.compressed_bytes = 999000;
+  (void) rsync_policy_record("/a/random.bin", &stats);
+
+  flags = rsync_policy_get_flags("/a/random.bin");
+  fail_unless(flags == (RSYNC_POLICY_FL_WHOLE_FILE|RSYNC_POLICY_FL_NO_COMPRESS),
+    "Expected whole-file, no-compress flags, got %d", flags);
+
+  flags = rsync_policy_get_flags("/b/text.txt");
+  fail_unless(flags == 0, "Expected no flags, got %d", flags);
+
+  flags = rsync_policy_get_flags("/c/new.txt");
+  fail_unless(flags == 0, "Expected no flags, got %d", flags);
+
+  /* Some files (which take their history from their directory here) have
+   * it ignored; always, for the session.
+   */
+  for (i = 0; i < RSYNC_POLICY_PROBE_INTERVAL * 16; i++) {
+    char path[64];
+
+    pr_snprintf(path, sizeof(path), "/a/random-%u.bin", i);
+    flags = rsync_policy_get_flags(path);
+    if (flags == 0) {
+      nprobes++;
+    }
+
+    fail_unless(rsync_policy_get_flags(path) == flags,
+      "Expected same flags for '%s' again", path);
+  }
+
+  fail_unless(nprobes > 0 && nprobes < RSYNC_POLICY_PROBE_INTERVAL * 4,
+    "Expected about 16 probes, got %u", nprobes);
+}
+END_TEST
+
+START_TEST (policy_store_test) {
+  struct rsync_policy_stats stats;
+  int fd, res;
+
+  mark_point();
+  res = rsync_policy_close(p);
+  fail_unless(res < 0, "Failed to handle unopened store");
+  fail_unless(errno == EBADF, "Expected EBADF (%d), got %s (%d)", EBADF,
+    strerror(errno), errno);
+
+  res = rsync_policy_open(policy_file);
+  fail_unless(res == 0, "Failed to open '%s': %s", policy_file,
+    strerror(errno));
+
+  (void) record_delta("/a/file.log", 1000, 800);
+
+  mark_point();
+  res = rsync_policy_close(NULL);
+  fail_unless(res < 0, "Failed to handle null pool");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = rsync_policy_close(p);
+  fail_unless(res == 0, "Failed to save store: %s", strerror(errno));
+
+  /* The next session loads the history... */
+  rsync_policy_clear();
+  res = rsync_policy_open(policy_file);
+  fail_unless(res == 0, "Failed to open '%s': %s", policy_file,
+    strerror(errno));
+
+  res = rsync_policy_get("/a/file.log", &stats);
+  fail_unless(res == 0, "Failed to get history: %s", strerror(errno));
+  fail_unless(stats.total_bytes == 1000, "Expected 1000 bytes, got %lu",
+    (unsigned long) stats.total_bytes);
+
+  /* ...and saving its own keeps the entries it did not record. */
+  rsync_policy_clear();
+  (void) record_delta("/b/other.dat", 2000, 2000);
+  res = rsync_policy_close(p);
+  fail_unless(res == 0, "Failed to save store: %s", strerror(errno));
+
+  res = rsync_policy_open(policy_file);
+  fail_unless(res == 0, "Failed to open '%s': %s", policy_file,
+    strerror(errno));
+
+  res = rsync_policy_get("/a/file.log", &stats);
+  fail_unless(res == 0, "Failed to get history: %s", strerror(errno));
+  fail_unless(stats.total_bytes == 1000, "Expected 1000 bytes, got %lu",
+    (unsigned long) stats.total_bytes);
+
+  res = rsync_policy_get("/b/other.dat", &stats);
+  fail_unless(res == 0, "Failed to get history: %s", strerror(errno));
+  fail_unless(stats.total_bytes == 2000, "Expected 2000 bytes, got %lu",
+    (unsigned long) stats.total_bytes);
+
+  (void) rsync_policy_close(p);
+
+  /* An unusable store is ignored. */
+  fd = open(policy_file, O_WRONLY|O_TRUNC);
+  fail_unless(fd >= 0, "Failed to open '%s': %s", policy_file,
+    strerror(errno));
+  fail_unless(write(fd, "garbage", 7) == 7, "Failed to write '%s': %s",
+    policy_file, strerror(errno));
+  (void) close(fd);
+
+  rsync_policy_clear();
+  res = rsync_policy_open(policy_file);
+  fail_unless(res == 0, "Failed to open '%s': %s", policy_file,
+    strerror(errno));
+
+  res = rsync_policy_get("/a/file.log", &stats);
+  fail_unless(res < 0, "Expected no history from unusable store");
+}
+END_TEST
+
+Suite *tests_get_policy_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("policy");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, policy_record_test);
+  tcase_add_test(testcase, policy_get_flags_test);
+  tcase_add_test(testcase, policy_store_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
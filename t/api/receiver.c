@@ -0,0 +1,735 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Receiver API tests. */
+
+#include "tests.h"
+#include "receiver.h"
+#include "sender.h"
+#include "generator.h"
+#include "sumtable.h"
+#include "checksum.h"
+#include "compress.h"
+#include "options.h"
+#include "token.h"
+#include "workers.h"
+
+static pool *p = NULL;
+
+static const char *basis_file = "/tmp/mod_rsync-receiver-basis.dat";
+static const char *target_file = "/tmp/mod_rsync-receiver-target.dat";
+static const char *output_file = "/tmp/mod_rsync-receiver-output.dat";
+
+#define TEST_BASIS_SIZE		(1024 * 1024)
+#define TEST_BLOCK_SIZE		4096
+
+static unsigned char *basis = NULL, *target = NULL;
+static uint32_t targetlen = 0;
+
+static void set_up(void) {
+  register unsigned int i;
+  uint32_t seed = 29;
+
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  basis = palloc(p, TEST_BASIS_SIZE);
+  for (i = 0; i < TEST_BASIS_SIZE; i++) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    basis[i] = (unsigned char) seed;
+  }
+
+  /* The target inserts a block's worth of new data, keeping the long runs of
+   * matched blocks around it aligned, then some data which is not, then
+   * drops the end of the basis, with a short last block.
+   */
+  target = palloc(p, TEST_BASIS_SIZE * 2);
+  targetlen = 0;
+
+  memcpy(target, basis, 300 * 1024);
+  targetlen += 300 * 1024;
+
+  for (i = 0; i < TEST_BLOCK_SIZE; i++) {
+    target[targetlen++] = (unsigned char) i;
+  }
+
+  memcpy(target + targetlen, basis + (300 * 1024), 500 * 1024);
+  targetlen += 500 * 1024;
+
+  for (i = 0; i < 1000; i++) {
+    target[targetlen++] = (unsigned char) (i * 7);
+  }
+
+  memcpy(target + targetlen, basis + (100 * 1024), 100 * 1024 + 123);
+  targetlen += 100 * 1024 + 123;
+
+  tests_write_file(basis_file, basis, TEST_BASIS_SIZE);
+  tests_write_file(target_file, target, targetlen);
+
+  tests_writtensz = 4 * 1024 * 1024;
+  tests_written = palloc(p, tests_writtensz);
+  tests_writtenlen = 0;
+  rsync_write_data = tests_capture_write_data;
+}
+
+static void tear_down(void) {
+  rsync_write_data = tests_write_data;
+  (void) unlink(basis_file);
+  (void) unlink(target_file);
+  (void) unlink(output_file);
+
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+static struct rsync_session *create_session(int compress_algo) {
+  struct rsync_session *sess;
+  struct rsync_options *opts;
+
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5, compress_algo,
+    0x1357);
+  opts = sess->options;
+  opts->block_size = TEST_BLOCK_SIZE;
+  return sess;
+}
+
+/* Sends the target's delta against the basis (if any), as the sender would,
+ * leaving the token stream in the written buffer.
+ */
+static void send_target(struct rsync_session *sess, int use_basis,
+    struct rsync_sum_head *head) {
+  struct rsync_sumtable *tab = NULL;
+  unsigned char *buf;
+  uint32_t buflen;
+  int fd, res;
+
+  memset(head, 0, sizeof(struct rsync_sum_head));
+
+  if (use_basis) {
+    fd = open(basis_file, O_RDONLY);
+    fail_unless(fd >= 0, "Failed to open %s: %s", basis_file,
+      strerror(errno));
+
+    tests_writtenlen = 0;
+    res = rsync_generator_send_sums(p, sess, fd, 0);
+    fail_unless(res == 0, "Failed to send sums: %s", strerror(errno));
+    (void) close(fd);
+
+    buf = tests_written;
+    buflen = tests_writtenlen;
+
+    res = rsync_sumtable_read_head(p, sess, &buf, &buflen, head);
+    fail_unless(res == 0, "Failed to read sum head: %s", strerror(errno));
+
+    tab = rsync_sumtable_create(p, head);
+    fail_unless(tab != NULL, "Failed to create sum table: %s",
+      strerror(errno));
+
+    /* When appending, only the header is sent. */
+    if (((struct rsync_options *) sess->options)->append_mode == 0) {
+      res = rsync_sumtable_decode(tab, &buf, &buflen);
+      fail_unless(res == 0, "Failed to decode sums: %s", strerror(errno));
+    }
+
+    fail_unless(buflen == 0, "Expected no more sums, got %lu bytes",
+      (unsigned long) buflen);
+  }
+
+  fd = open(target_file, O_RDONLY);
+  fail_unless(fd >= 0, "Failed to open %s: %s", target_file, strerror(errno));
+
+  tests_writtenlen = 0;
+  res = rsync_sender_send_file(p, sess, fd, target_file, tab, NULL);
+  fail_unless(res == 0, "Failed to send file: %s", strerror(errno));
+  (void) close(fd);
+}
+
+/* Rebuilds the target from the written token stream, fed to the receiver
+ * in pieces of the given size.
+ */
+static int recv_target(struct rsync_session *sess, int use_basis,
+    const struct rsync_sum_head *head, uint32_t piecelen,
+    struct rsync_receiver_stats *stats) {
+  struct rsync_receiver *recv;
+  unsigned char *buf;
+  uint32_t buflen;
+  int basis_fd = -1, fd, res = -1;
+
+  if (use_basis) {
+    basis_fd = open(basis_file, O_RDONLY);
+    fail_unless(basis_fd >= 0, "Failed to open %s: %s", basis_file,
+      strerror(errno));
+  }
+
+  fd = open(output_file, O_RDWR|O_CREAT|O_TRUNC, 0600);
+  fail_unless(fd >= 0, "Failed to open %s: %s", output_file, strerror(errno));
+
+  recv = rsync_receiver_open(p, sess, output_file, fd, basis_fd, head);
+  fail_unless(recv != NULL, "Failed to open receiver: %s", strerror(errno));
+
+  buf = tests_written;
+  buflen = 0;
+
+  while (buf + buflen < tests_written + tests_writtenlen) {
+    uint32_t len;
+
+    len = (uint32_t) ((tests_written + tests_writtenlen) - (buf + buflen));
+    if (len > piecelen) {
+      len = piecelen;
+    }
+
+    buflen += len;
+
+    res = rsync_receiver_recv(recv, &buf, &buflen);
+    if (res < 0) {
+      fail_unless(errno == EAGAIN, "Failed to receive file: %s",
+        strerror(errno));
+      continue;
+    }
+
+    break;
+  }
+
+  fail_unless(res >= 0, "Receiver wanted more data than was sent");
+  fail_unless(buflen == 0, "Receiver left %lu bytes unread",
+    (unsigned long) buflen);
+
+  fail_unless(rsync_receiver_close(recv, stats) == 0,
+    "Failed to close receiver: %s", strerror(errno));
+
+  (void) close(fd);
+  if (basis_fd >= 0) {
+    (void) close(basis_fd);
+  }
+
+  return res;
+}
+
+static void check_output(void) {
+  unsigned char *data;
+  struct stat st;
+  int fd;
+
+  fail_unless(stat(output_file, &st) == 0, "Failed to stat %s: %s",
+    output_file, strerror(errno));
+  fail_unless(st.st_size == (off_t) targetlen, "Expected %lu bytes, got %lu",
+    (unsigned long) targetlen, (unsigned long) st.st_size);
+
+  data = palloc(p, targetlen);
+
+  fd = open(output_file, O_RDONLY);
+  fail_unless(fd >= 0, "Failed to open %s: %s", output_file, strerror(errno));
+  fail_unless(read(fd, data, targetlen) == (ssize_t) targetlen,
+    "Failed to read %s: %s", output_file, strerror(errno));
+  (void) close(fd);
+
+  fail_unless(memcmp(data, target, targetlen) == 0,
+    "Rebuilt file does not match target");
+}
+
+START_TEST (receiver_open_test) {
+  struct rsync_receiver *recv;
+  struct rsync_session *sess;
+  int res;
+
+  mark_point();
+  recv = rsync_receiver_open(NULL, NULL, NULL, -1, -1, NULL);
+  fail_unless(recv == NULL, "Failed to handle null arguments");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  sess = create_session(RSYNC_COMPRESS_ALGO_NONE);
+
+  mark_point();
+  recv = rsync_receiver_open(p, sess, output_file, 0, 0, NULL);
+  fail_unless(recv == NULL, "Failed to handle basis without sum head");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_receiver_recv(NULL, NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null arguments");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_receiver_close(NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null receiver");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+}
+END_TEST
+
+START_TEST (receiver_recv_literal_test) {
+  struct rsync_sum_head head;
+  struct rsync_receiver_stats stats;
+  int res;
+
+  send_target(create_session(RSYNC_COMPRESS_ALGO_NONE), FALSE, &head);
+
+  mark_point();
+  memset(&stats, 0, sizeof(stats));
+  res = recv_target(create_session(RSYNC_COMPRESS_ALGO_NONE), FALSE, NULL,
+    tests_writtenlen, &stats);
+  fail_unless(res == RSYNC_RECEIVER_RECV_OK, "Expected OK, got %d", res);
+  fail_unless(stats.literal_bytes == targetlen,
+    "Expected %lu literal bytes, got %lu", (unsigned long) targetlen,
+    (unsigned long) stats.literal_bytes);
+  check_output();
+}
+END_TEST
+
+START_TEST (receiver_recv_delta_test) {
+  register unsigned int i;
+  int algos[] = {
+    RSYNC_COMPRESS_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_ZLIB,
+    -1
+  };
+
+  for (i = 0; algos[i] != -1; i++) {
+    struct rsync_sum_head head;
+    struct rsync_receiver_stats stats;
+    int res;
+
+    send_target(create_session(algos[i]), TRUE, &head);
+
+    /* Feed the stream in awkward pieces, to split tokens and checksums. */
+    mark_point();
+    memset(&stats, 0, sizeof(stats));
+    res = recv_target(create_session(algos[i]), TRUE, &head, 7777, &stats);
+    fail_unless(res == RSYNC_RECEIVER_RECV_OK, "Expected OK, got %d", res);
+    check_output();
+
+    fail_unless(stats.literal_bytes + stats.matched_bytes == targetlen,
+      "Expected %lu bytes in total, got %lu", (unsigned long) targetlen,
+      (unsigned long) (stats.literal_bytes + stats.matched_bytes));
+    fail_unless(stats.literal_bytes <= TEST_BLOCK_SIZE * 3,
+      "Too many literal bytes: %lu", (unsigned long) stats.literal_bytes);
+    fail_unless(stats.cloned_bytes + stats.copied_bytes <= stats.matched_bytes,
+      "Cloned/copied more than matched: %lu + %lu > %lu",
+      (unsigned long) stats.cloned_bytes, (unsigned long) stats.copied_bytes,
+      (unsigned long) stats.matched_bytes);
+  }
+}
+END_TEST
+
+START_TEST (receiver_recv_mismatch_test) {
+  struct rsync_sum_head head;
+  int res;
+
+  send_target(create_session(RSYNC_COMPRESS_ALGO_NONE), TRUE, &head);
+
+  /* Corrupt the sender's whole-file checksum, at the end of the stream. */
+  tests_written[tests_writtenlen - 1] ^= 0xff;
+
+  mark_point();
+  res = recv_target(create_session(RSYNC_COMPRESS_ALGO_NONE), TRUE, &head,
+    tests_writtenlen, NULL);
+  fail_unless(res == RSYNC_RECEIVER_RECV_FAILED, "Expected FAILED, got %d",
+    res);
+}
+END_TEST
+
+START_TEST (receiver_recv_inplace_test) {
+  register unsigned int i;
+  struct rsync_session *sess;
+  struct rsync_sum_head head;
+  struct rsync_receiver_stats stats;
+  struct rsync_receiver *recv;
+  unsigned char *buf;
+  uint32_t buflen;
+  int fd, res;
+
+  /* The target changes some data in the middle of the basis, moves a later
+   * region forward, and drops the end of the basis.
+   */
+  memcpy(target, basis, TEST_BASIS_SIZE);
+  for (i = 0; i < 5000; i++) {
+    target[(500 * 1024) + i] ^= 0x5a;
+  }
+
+  memcpy(target + (600 * 1024), basis + (700 * 1024), 2 * TEST_BLOCK_SIZE);
+  targetlen = (900 * 1024) + 77;
+  tests_write_file(target_file, target, targetlen);
+
+  sess = create_session(RSYNC_COMPRESS_ALGO_NONE);
+  ((struct rsync_options *) sess->options)->inplace = TRUE;
+  send_target(sess, TRUE, &head);
+
+  /* The file to be updated is the basis. */
+  tests_write_file(output_file, basis, TEST_BASIS_SIZE);
+
+  fd = open(output_file, O_RDWR);
+  fail_unless(fd >= 0, "Failed to open %s: %s", output_file, strerror(errno));
+
+  /* Updating in place requires the sender to know about it. */
+  mark_point();
+  recv = rsync_receiver_open(p, create_session(RSYNC_COMPRESS_ALGO_NONE),
+    output_file, fd, fd, &head);
+  fail_unless(recv == NULL, "Failed to handle in-place without --inplace");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  sess = create_session(RSYNC_COMPRESS_ALGO_NONE);
+  ((struct rsync_options *) sess->options)->inplace = TRUE;
+
+  mark_point();
+  recv = rsync_receiver_open(p, sess, output_file, fd, fd, &head);
+  fail_unless(recv != NULL, "Failed to open receiver: %s", strerror(errno));
+
+  buf = tests_written;
+  buflen = tests_writtenlen;
+
+  mark_point();
+  res = rsync_receiver_recv(recv, &buf, &buflen);
+  fail_unless(res == RSYNC_RECEIVER_RECV_OK, "Expected OK, got %d", res);
+
+  memset(&stats, 0, sizeof(stats));
+  fail_unless(rsync_receiver_close(recv, &stats) == 0,
+    "Failed to close receiver: %s", strerror(errno));
+  (void) close(fd);
+
+  check_output();
+
+  /* Only the changed blocks, the moved region, and the short last block are
+   * written.
+   */
+  fail_unless(stats.unchanged_bytes >= targetlen - (5 * TEST_BLOCK_SIZE),
+    "Expected at least %lu unchanged bytes, got %lu",
+    (unsigned long) (targetlen - (5 * TEST_BLOCK_SIZE)),
+    (unsigned long) stats.unchanged_bytes);
+  fail_unless(stats.cloned_bytes == 0 && stats.copied_bytes == 0,
+    "Expected no cloned/copied bytes when updating in place");
+}
+END_TEST
+
+/* Appends the target's new data to a copy of the basis, which has the given
+ * byte changed (if not -1).
+ */
+static int append_target(int append_mode, int compress_algo, long changed,
+    struct rsync_receiver_stats *stats) {
+  struct rsync_session *sess;
+  struct rsync_sum_head head;
+  struct rsync_receiver *recv;
+  unsigned char *buf;
+  uint32_t buflen;
+  int fd, res;
+
+  sess = create_session(compress_algo);
+  ((struct rsync_options *) sess->options)->append_mode = append_mode;
+  ((struct rsync_options *) sess->options)->inplace = TRUE;
+  send_target(sess, TRUE, &head);
+
+  if (changed >= 0) {
+    basis[changed] ^= 0xff;
+  }
+
+  tests_write_file(output_file, basis, TEST_BASIS_SIZE);
+
+  if (changed >= 0) {
+    basis[changed] ^= 0xff;
+  }
+
+  fd = open(output_file, O_RDWR);
+  fail_unless(fd >= 0, "Failed to open %s: %s", output_file, strerror(errno));
+
+  sess = create_session(compress_algo);
+  ((struct rsync_options *) sess->options)->append_mode = append_mode;
+  ((struct rsync_options *) sess->options)->inplace = TRUE;
+
+  mark_point();
+  recv = rsync_receiver_open(p, sess, output_file, fd, fd, &head);
+  fail_unless(recv != NULL, "Failed to open receiver: %s", strerror(errno));
+
+  buf = tests_written;
+  buflen = tests_writtenlen;
+
+  mark_point();
+  res = rsync_receiver_recv(recv, &buf, &buflen);
+  fail_unless(res >= 0, "Failed to receive file: %s", strerror(errno));
+  fail_unless(buflen == 0, "Receiver left %lu bytes unread",
+    (unsigned long) buflen);
+
+  memset(stats, 0, sizeof(struct rsync_receiver_stats));
+  fail_unless(rsync_receiver_close(recv, stats) == 0,
+    "Failed to close receiver: %s", strerror(errno));
+  (void) close(fd);
+
+  return res;
+}
+
+START_TEST (receiver_recv_append_test) {
+  register unsigned int i;
+  struct rsync_session *sess;
+  struct rsync_sum_head head;
+  struct rsync_receiver_stats stats;
+  struct rsync_receiver *recv;
+  uint32_t seed = 5;
+  int basis_fd, fd, res;
+
+  /* The target is the basis, with new data appended, e.g. a log file. */
+  memcpy(target, basis, TEST_BASIS_SIZE);
+  targetlen = TEST_BASIS_SIZE;
+
+  for (i = 0; i < (300 * 1024) + 55; i++) {
+    seed = (seed * 1103515245) + 12345;
+    target[targetlen++] = (unsigned char) (seed >> 16);
+  }
+
+  tests_write_file(target_file, target, targetlen);
+
+  /* Appending requires the basis to be the file appended to. */
+  sess = create_session(RSYNC_COMPRESS_ALGO_NONE);
+  ((struct rsync_options *) sess->options)->append_mode = 1;
+  ((struct rsync_options *) sess->options)->inplace = TRUE;
+  send_target(sess, TRUE, &head);
+
+  basis_fd = open(basis_file, O_RDONLY);
+  fail_unless(basis_fd >= 0, "Failed to open %s: %s", basis_file,
+    strerror(errno));
+
+  fd = open(output_file, O_RDWR|O_CREAT|O_TRUNC, 0600);
+  fail_unless(fd >= 0, "Failed to open %s: %s", output_file, strerror(errno));
+
+  mark_point();
+  recv = rsync_receiver_open(p, sess, output_file, fd, basis_fd, &head);
+  fail_unless(recv == NULL, "Failed to handle append to another file");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+  (void) close(fd);
+  (void) close(basis_fd);
+
+  /* Only the new data is sent, checked by itself, or (for --append-verify)
+   * with the existing data.
+   */
+  mark_point();
+  res = append_target(1, RSYNC_COMPRESS_ALGO_NONE, -1, &stats);
+  fail_unless(res == RSYNC_RECEIVER_RECV_OK, "Expected OK, got %d", res);
+  check_output();
+  fail_unless(stats.literal_bytes == targetlen - TEST_BASIS_SIZE,
+    "Expected %lu literal bytes, got %lu",
+    (unsigned long) (targetlen - TEST_BASIS_SIZE),
+    (unsigned long) stats.literal_bytes);
+  fail_unless(stats.matched_bytes == 0, "Expected no matched bytes, got %lu",
+    (unsigned long) stats.matched_bytes);
+
+  mark_point();
+  res = append_target(2, RSYNC_COMPRESS_ALGO_ZLIB, -1, &stats);
+  fail_unless(res == RSYNC_RECEIVER_RECV_OK, "Expected OK, got %d", res);
+  check_output();
+  fail_unless(stats.literal_bytes == targetlen - TEST_BASIS_SIZE,
+    "Expected %lu literal bytes, got %lu",
+    (unsigned long) (targetlen - TEST_BASIS_SIZE),
+    (unsigned long) stats.literal_bytes);
+
+  /* A difference in the existing data goes unnoticed, unless verified. */
+  mark_point();
+  res = append_target(1, RSYNC_COMPRESS_ALGO_NONE, 12345, &stats);
+  fail_unless(res == RSYNC_RECEIVER_RECV_OK, "Expected OK, got %d", res);
+
+  mark_point();
+  res = append_target(2, RSYNC_COMPRESS_ALGO_NONE, 12345, &stats);
+  fail_unless(res == RSYNC_RECEIVER_RECV_FAILED, "Expected FAILED, got %d",
+    res);
+}
+END_TEST
+
+START_TEST (receiver_recv_sparse_test) {
+  struct rsync_session *sess;
+  struct rsync_sum_head head;
+  struct rsync_receiver_stats stats;
+  struct rsync_receiver *recv;
+  struct stat st;
+  unsigned char *buf;
+  uint32_t buflen;
+  int fd, res;
+
+  /* The target zeroes a large region in the middle of the basis, and ends in
+   * zeroes.
+   */
+  memcpy(target, basis, TEST_BASIS_SIZE);
+  memset(target + (100 * 1024), 0, 600 * 1024);
+  targetlen = TEST_BASIS_SIZE + (200 * 1024);
+  memset(target + TEST_BASIS_SIZE, 0, 200 * 1024);
+  tests_write_file(target_file, target, targetlen);
+
+  sess = create_session(RSYNC_COMPRESS_ALGO_NONE);
+  ((struct rsync_options *) sess->options)->sparse_files = TRUE;
+  send_target(sess, TRUE, &head);
+
+  mark_point();
+  sess = create_session(RSYNC_COMPRESS_ALGO_NONE);
+  ((struct rsync_options *) sess->options)->sparse_files = TRUE;
+  memset(&stats, 0, sizeof(stats));
+  res = recv_target(sess, TRUE, &head, tests_writtenlen, &stats);
+  fail_unless(res == RSYNC_RECEIVER_RECV_OK, "Expected OK, got %d", res);
+  check_output();
+
+  fail_unless(stats.sparse_bytes >= 790 * 1024,
+    "Expected at least %lu sparse bytes, got %lu",
+    (unsigned long) (790 * 1024), (unsigned long) stats.sparse_bytes);
+
+  fail_unless(stat(output_file, &st) == 0, "Failed to stat %s: %s",
+    output_file, strerror(errno));
+  fail_unless((off_t) st.st_blocks * 512 < (off_t) targetlen / 2,
+    "Expected a sparse file, got %lu blocks for %lu bytes",
+    (unsigned long) st.st_blocks, (unsigned long) targetlen);
+
+  /* Updating the basis in place punches the holes. */
+  sess = create_session(RSYNC_COMPRESS_ALGO_NONE);
+  ((struct rsync_options *) sess->options)->sparse_files = TRUE;
+  ((struct rsync_options *) sess->options)->inplace = TRUE;
+  send_target(sess, TRUE, &head);
+
+  tests_write_file(output_file, basis, TEST_BASIS_SIZE);
+
+  fd = open(output_file, O_RDWR);
+  fail_unless(fd >= 0, "Failed to open %s: %s", output_file, strerror(errno));
+
+  sess = create_session(RSYNC_COMPRESS_ALGO_NONE);
+  ((struct rsync_options *) sess->options)->sparse_files = TRUE;
+  ((struct rsync_options *) sess->options)->inplace = TRUE;
+
+  recv = rsync_receiver_open(p, sess, output_file, fd, fd, &head);
+  fail_unless(recv != NULL, "Failed to open receiver: %s", strerror(errno));
+
+  buf = tests_written;
+  buflen = tests_writtenlen;
+
+  mark_point();
+  res = rsync_receiver_recv(recv, &buf, &buflen);
+  fail_unless(res == RSYNC_RECEIVER_RECV_OK, "Expected OK, got %d", res);
+  (void) rsync_receiver_close(recv, NULL);
+  (void) close(fd);
+
+  check_output();
+
+  fail_unless(stat(output_file, &st) == 0, "Failed to stat %s: %s",
+    output_file, strerror(errno));
+  fail_unless((off_t) st.st_blocks * 512 < (off_t) targetlen / 2,
+    "Expected holes to be punched, got %lu blocks for %lu bytes",
+    (unsigned long) st.st_blocks, (unsigned long) targetlen);
+}
+END_TEST
+
+#ifdef HAVE_PTHREAD
+START_TEST (receiver_recv_workers_test) {
+  register unsigned int i;
+  unsigned char *data;
+  uint32_t datalen;
+  int algos[] = {
+    RSYNC_COMPRESS_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_ZLIB,
+    -1
+  };
+
+  /* A compressible target, big enough to be read (and compressed) in several
+   * pieces, with the usual target in the middle.
+   */
+  datalen = (3 * RSYNC_SENDER_READ_SIZE) - 4321;
+  data = palloc(p, datalen);
+  for (i = 0; i < datalen; i++) {
+    data[i] = (unsigned char) ('a' + ((i / 13) % 26));
+  }
+
+  memcpy(data + RSYNC_SENDER_READ_SIZE, target, targetlen);
+  target = data;
+  targetlen = datalen;
+  tests_write_file(target_file, target, targetlen);
+
+  /* With worker threads doing the checksums and compression on both sides,
+   * whether the file is sent whole or as a delta.
+   */
+  for (i = 0; algos[i] != -1; i++) {
+    register unsigned int j;
+
+    for (j = 0; j < 2; j++) {
+      struct rsync_session *sess;
+      struct rsync_sum_head head;
+      struct rsync_receiver_stats stats;
+      int res, use_basis;
+
+      use_basis = (j == 1);
+
+      sess = create_session(algos[i]);
+      sess->workers = rsync_workers_create(p, 2);
+      fail_unless(sess->workers != NULL, "Failed to create workers: %s",
+        strerror(errno));
+
+      send_target(sess, use_basis, &head);
+      (void) rsync_workers_destroy(sess->workers);
+
+      sess = create_session(algos[i]);
+      sess->workers = rsync_workers_create(p, 1);
+      fail_unless(sess->workers != NULL, "Failed to create workers: %s",
+        strerror(errno));
+
+      mark_point();
+      memset(&stats, 0, sizeof(stats));
+      res = recv_target(sess, use_basis, use_basis ? &head : NULL, 10000,
+        &stats);
+      fail_unless(res == RSYNC_RECEIVER_RECV_OK,
+        "Compression %d, basis %d: expected OK, got %d", algos[i], use_basis,
+        res);
+      fail_unless(stats.literal_bytes + stats.matched_bytes == targetlen,
+        "Expected %lu bytes, got %lu", (unsigned long) targetlen,
+        (unsigned long) (stats.literal_bytes + stats.matched_bytes));
+      check_output();
+
+      (void) rsync_workers_destroy(sess->workers);
+    }
+  }
+}
+END_TEST
+#endif /* HAVE_PTHREAD */
+
+Suite *tests_get_receiver_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("receiver");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, receiver_open_test);
+  tcase_add_test(testcase, receiver_recv_literal_test);
+  tcase_add_test(testcase, receiver_recv_delta_test);
+  tcase_add_test(testcase, receiver_recv_mismatch_test);
+  tcase_add_test(testcase, receiver_recv_inplace_test);
+  tcase_add_test(testcase, receiver_recv_append_test);
+  tcase_add_test(testcase, receiver_recv_sparse_test);
+#ifdef HAVE_PTHREAD
+  tcase_add_test(testcase, receiver_recv_workers_test);
+#endif /* HAVE_PTHREAD */
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
@@ -0,0 +1,209 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Rolling checksum API tests. */
+
+#include "tests.h"
+#include "rolling.h"
+
+static pool *p = NULL;
+
+#define TEST_DATA_SIZE		(64 * 1024)
+
+static unsigned char data[TEST_DATA_SIZE];
+
+static void set_up(void) {
+  register unsigned int i;
+  uint32_t seed = 7;
+
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  /* Include bytes >= 0x80, which rsync treats as signed. */
+  for (i = 0; i < TEST_DATA_SIZE; i++) {
+    seed = (seed * 1103515245) + 12345;
+    data[i] = (unsigned char) (seed >> 16);
+  }
+}
+
+static void tear_down(void) {
+  (void) rsync_rolling_set_kernel(NULL);
+
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+/* A straightforward transcription of rsync's get_checksum1(). */
+static uint32_t reference_checksum(const unsigned char *buf, uint32_t len) {
+  register unsigned int i;
+  uint32_t s1 = 0, s2 = 0;
+
+  for (i = 0; i < len; i++) {
+    s1 += (signed char) buf[i];
+    s2 += s1;
+  }
+
+  return (s1 & 0xffff) + (s2 << 16);
+}
+
+START_TEST (rolling_checksum_test) {
+  uint32_t sum, expected;
+
+  mark_point();
+  sum = rsync_rolling_checksum((const unsigned char *) "a", 1);
+  fail_unless(sum == 0x00610061, "Expected 0x00610061, got 0x%08x", sum);
+
+  mark_point();
+  sum = rsync_rolling_checksum((const unsigned char *) "\xff", 1);
+  fail_unless(sum == 0xffffffff, "Expected 0xffffffff, got 0x%08x", sum);
+
+  mark_point();
+  sum = rsync_rolling_checksum(data, TEST_DATA_SIZE);
+  expected = reference_checksum(data, TEST_DATA_SIZE);
+  fail_unless(sum == expected, "Expected 0x%08x, got 0x%08x", expected, sum);
+}
+END_TEST
+
+START_TEST (rolling_kernels_test) {
+  register unsigned int i, j;
+  const char *kernels[] = { "scalar", "sse2", "avx2", NULL };
+  int res;
+
+  mark_point();
+  res = rsync_rolling_set_kernel("foo");
+  fail_unless(res < 0, "Failed to handle unknown kernel");
+  fail_unless(errno == ENOSYS, "Expected ENOSYS (%d), got %s (%d)", ENOSYS,
+    strerror(errno), errno);
+
+  for (i = 0; kernels[i] != NULL; i++) {
+    if (rsync_rolling_set_kernel(kernels[i]) < 0) {
+      continue;
+    }
+
+    fail_unless(strcmp(rsync_rolling_get_kernel(), kernels[i]) == 0,
+      "Expected kernel '%s', got '%s'", kernels[i],
+      rsync_rolling_get_kernel());
+
+    /* Exercise every alignment, and every tail length. */
+    for (j = 0; j < 300; j++) {
+      uint32_t sum, expected;
+
+      sum = rsync_rolling_checksum(data + (j % 37), j);
+      expected = reference_checksum(data + (j % 37), j);
+      fail_unless(sum == expected,
+        "%s kernel: length %u: expected 0x%08x, got 0x%08x", kernels[i], j,
+        expected, sum);
+    }
+  }
+
+  (void) rsync_rolling_set_kernel(NULL);
+  fail_unless(rsync_rolling_get_kernel() != NULL,
+    "Failed to select kernel at runtime");
+}
+END_TEST
+
+START_TEST (rolling_block_sums_test) {
+  register unsigned int i;
+  uint32_t sums[100];
+  int count;
+
+  mark_point();
+  count = rsync_rolling_block_sums(NULL, 0, 0, NULL);
+  fail_unless(count < 0, "Failed to handle null data");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* 64K in blocks of 700 bytes: 93 full blocks, and one short block. */
+  mark_point();
+  count = rsync_rolling_block_sums(data, TEST_DATA_SIZE, 700, sums);
+  fail_unless(count == 94, "Expected 94 sums, got %d", count);
+
+  for (i = 0; i < (unsigned int) count; i++) {
+    uint32_t len, expected;
+
+    len = (i == 93) ? TEST_DATA_SIZE - (93 * 700) : 700;
+    expected = reference_checksum(data + (i * 700), len);
+    fail_unless(sums[i] == expected,
+      "Block %u: expected 0x%08x, got 0x%08x", i, expected, sums[i]);
+  }
+}
+END_TEST
+
+START_TEST (rolling_roll_test) {
+  register unsigned int i;
+  struct rsync_rolling roll;
+  uint32_t block_len = 700, sum, expected;
+  int res;
+
+  mark_point();
+  res = rsync_rolling_init(NULL, NULL, 0);
+  fail_unless(res < 0, "Failed to handle null arguments");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_rolling_init(&roll, data, block_len);
+  fail_unless(res == 0, "Failed to init rolling checksum: %s",
+    strerror(errno));
+  fail_unless(rsync_rolling_get(&roll) == reference_checksum(data, block_len),
+    "Unexpected initial checksum");
+
+  for (i = 1; i + block_len <= 5000; i++) {
+    sum = rsync_rolling_roll(&roll, data[i-1], data[i+block_len-1]);
+    expected = reference_checksum(data + i, block_len);
+    fail_unless(sum == expected, "Offset %u: expected 0x%08x, got 0x%08x", i,
+      expected, sum);
+  }
+
+  /* Shrink the window, as at the end of the data. */
+  mark_point();
+  for (i = 5000 - block_len; i < 4990; i++) {
+    sum = rsync_rolling_trim(&roll, data[i]);
+    expected = reference_checksum(data + i + 1, 4999 - i);
+    fail_unless(sum == expected, "Trim %u: expected 0x%08x, got 0x%08x", i,
+      expected, sum);
+  }
+}
+END_TEST
+
+Suite *tests_get_rolling_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("rolling");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, rolling_checksum_test);
+  tcase_add_test(testcase, rolling_kernels_test);
+  tcase_add_test(testcase, rolling_block_sums_test);
+  tcase_add_test(testcase, rolling_roll_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
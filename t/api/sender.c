@@ -0,0 +1,935 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Sender API tests. */
+
+#include "tests.h"
+#include "sender.h"
+#include "generator.h"
+#include "sumtable.h"
+#include "checksum.h"
+#include "compress.h"
+#include "options.h"
+#include "token.h"
+#include "policy.h"
+
+static pool *p = NULL;
+
+static const char *basis_file = "/tmp/mod_rsync-sender-basis.dat";
+static const char *target_file = "/tmp/mod_rsync-sender-target.dat";
+static const char *policy_file = "/tmp/mod_rsync-sender.policy";
+
+#define TEST_BASIS_SIZE		(300 * 1024)
+#define TEST_PARALLEL_SIZE	(3 * 1024 * 1024)
+#define TEST_SPARSE_SIZE	(4 * 1024 * 1024)
+#define TEST_WHOLE_SIZE		((2 * RSYNC_SENDER_READ_SIZE) + 12345)
+
+static unsigned char *basis = NULL, *target = NULL;
+static uint32_t targetlen = 0;
+
+static unsigned int nwrites = 0;
+
+static int count_write_data(pool *p, uint32_t channel_id,
+    unsigned char *buf, uint32_t buflen) {
+  nwrites++;
+  return tests_capture_write_data(p, channel_id, buf, buflen);
+}
+
+static void set_up(void) {
+  register unsigned int i;
+  uint32_t seed = 23;
+
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  basis = palloc(p, TEST_BASIS_SIZE);
+  for (i = 0; i < TEST_BASIS_SIZE; i++) {
+    seed = (seed * 1103515245) + 12345;
+    basis[i] = (unsigned char) (seed >> 16);
+  }
+
+  /* The target inserts some new data, overwrites some, repeats a region of
+   * the basis, and drops the end of the basis.
+   */
+  target = palloc(p, TEST_BASIS_SIZE * 2);
+  targetlen = 0;
+
+  memcpy(target, basis, 5000);
+  targetlen += 5000;
+
+  for (i = 0; i < 1000; i++) {
+    target[targetlen++] = (unsigned char) i;
+  }
+
+  memcpy(target + targetlen, basis + 5000, 95000);
+  targetlen += 95000;
+
+  for (i = 0; i < 50000; i++) {
+    target[targetlen++] = (unsigned char) (i * 7);
+  }
+
+  memcpy(target + targetlen, basis + 150000, 100000);
+  targetlen += 100000;
+
+  memcpy(target + targetlen, basis + 20000, 30000);
+  targetlen += 30000;
+
+  tests_write_file(basis_file, basis, TEST_BASIS_SIZE);
+  tests_write_file(target_file, target, targetlen);
+
+  tests_writtensz = 2 * 1024 * 1024;
+  tests_written = palloc(p, tests_writtensz);
+  tests_writtenlen = 0;
+  rsync_write_data = count_write_data;
+}
+
+static void tear_down(void) {
+  rsync_write_data = tests_write_data;
+  rsync_opts = 0UL;
+  rsync_small_file_size = 0;
+  (void) rsync_sender_set_parallel(RSYNC_SENDER_DEFAULT_PARALLEL_MIN_SIZE, 1);
+  (void) rsync_sender_set_fallback(RSYNC_SENDER_DEFAULT_FALLBACK_SAMPLE_SIZE,
+    RSYNC_SENDER_DEFAULT_FALLBACK_MIN_MATCH_PCT);
+  rsync_policy_clear();
+  (void) unlink(basis_file);
+  (void) unlink(target_file);
+
+  if (p) {
+    (void) rsync_policy_close(p);
+    (void) unlink(policy_file);
+
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+/* Generates the receiver's block sums for the basis file. */
+static struct rsync_sumtable *get_basis_sums(struct rsync_session *sess) {
+  struct rsync_sumtable *tab;
+  struct rsync_sum_head head;
+  unsigned char *buf;
+  uint32_t buflen;
+  int fd, res;
+
+  fd = open(basis_file, O_RDONLY);
+  fail_unless(fd >= 0, "Failed to open %s: %s", basis_file, strerror(errno));
+
+  tests_writtenlen = 0;
+  res = rsync_generator_send_sums(p, sess, fd, 0);
+  fail_unless(res == 0, "Failed to send sums: %s", strerror(errno));
+  (void) close(fd);
+
+  buf = tests_written;
+  buflen = tests_writtenlen;
+
+  res = rsync_sumtable_read_head(p, sess, &buf, &buflen, &head);
+  fail_unless(res == 0, "Failed to read sum head: %s", strerror(errno));
+
+  tab = rsync_sumtable_create(p, &head);
+  fail_unless(tab != NULL, "Failed to create sum table: %s", strerror(errno));
+
+  /* When appending, only the header is sent. */
+  if (((struct rsync_options *) sess->options)->append_mode == 0) {
+    res = rsync_sumtable_decode(tab, &buf, &buflen);
+    fail_unless(res == 0, "Failed to decode sums: %s", strerror(errno));
+  }
+
+  tests_writtenlen = 0;
+  return tab;
+}
+
+/* Rebuilds the target from the basis and the sent tokens, and checks the
+ * whole-file checksum which follows them.
+ */
+static void check_delta(struct rsync_session *sess,
+    struct rsync_sumtable *tab) {
+  struct rsync_checksum *ck;
+  const struct rsync_sum_head *head = NULL;
+  unsigned char *buf, *output, digest[RSYNC_CHECKSUM_MAX_DIGEST_LEN];
+  uint32_t buflen, outputlen = 0;
+  size_t digest_len;
+
+  if (tab != NULL) {
+    head = rsync_sumtable_get_head(tab);
+  }
+
+  buf = tests_written;
+  buflen = tests_writtenlen;
+  output = palloc(p, targetlen);
+
+  while (TRUE) {
+    int32_t token = 0;
+    unsigned char *data = NULL;
+    uint32_t datalen = 0;
+    int res;
+
+    res = rsync_token_recv(p, sess, &buf, &buflen, &token, &data, &datalen);
+    fail_unless(res >= 0, "Failed to receive token: %s", strerror(errno));
+
+    if (res == RSYNC_TOKEN_RECV_END) {
+      break;
+    }
+
+    if (res == RSYNC_TOKEN_RECV_BLOCK) {
+      fail_unless(head != NULL, "Received block token without basis");
+      fail_unless(token >= 0 && token < head->count,
+        "Received invalid block token %d", token);
+
+      data = basis + ((size_t) token * head->block_len);
+      datalen = rsync_sumtable_get_block_len(tab, token);
+      (void) rsync_token_see(sess, data, datalen);
+    }
+
+    fail_unless(outputlen + datalen <= targetlen,
+      "Reconstructed file too long");
+    memcpy(output + outputlen, data, datalen);
+    outputlen += datalen;
+  }
+
+  fail_unless(outputlen == targetlen, "Expected %lu bytes, got %lu",
+    (unsigned long) targetlen, (unsigned long) outputlen);
+  fail_unless(memcmp(output, target, targetlen) == 0,
+    "Reconstructed file does not match target");
+
+  ck = rsync_checksum_create(p, sess->checksum_algo,
+    ((struct rsync_options *) sess->options)->checksum_seed);
+  rsync_checksum_update(ck, target, targetlen);
+  digest_len = rsync_checksum_finish(ck, digest);
+
+  fail_unless(buflen == digest_len, "Expected %lu bytes of checksum, got %lu",
+    (unsigned long) digest_len, (unsigned long) buflen);
+  fail_unless(memcmp(buf, digest, digest_len) == 0,
+    "Whole-file checksum does not match");
+}
+
+START_TEST (sender_send_file_test) {
+  struct rsync_session *sess;
+  struct rsync_sender_stats stats;
+  int fd, res;
+
+  mark_point();
+  res = rsync_sender_send_file(NULL, NULL, -1, NULL, NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null arguments");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+    RSYNC_COMPRESS_ALGO_NONE, 0x1357);
+
+  fd = open(target_file, O_RDONLY);
+  fail_unless(fd >= 0, "Failed to open %s: %s", target_file, strerror(errno));
+
+  /* Without a basis file, everything is literal data. */
+  mark_point();
+  memset(&stats, 0, sizeof(stats));
+  res = rsync_sender_send_file(p, sess, fd, target_file, NULL, &stats);
+  fail_unless(res == 0, "Failed to send file: %s", strerror(errno));
+  fail_unless(stats.literal_bytes == targetlen,
+    "Expected %lu literal bytes, got %lu", (unsigned long) targetlen,
+    (unsigned long) stats.literal_bytes);
+  fail_unless(stats.matched_bytes == 0, "Expected no matched bytes, got %lu",
+    (unsigned long) stats.matched_bytes);
+  check_delta(sess, NULL);
+
+  (void) close(fd);
+}
+END_TEST
+
+START_TEST (sender_send_delta_test) {
+  register unsigned int i;
+  int algos[] = {
+    RSYNC_COMPRESS_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_ZLIB,
+    -1
+  };
+
+  for (i = 0; algos[i] != -1; i++) {
+    struct rsync_session *sess;
+    struct rsync_sumtable *tab;
+    struct rsync_sender_stats stats;
+    int fd, res;
+
+    sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5, algos[i],
+      0x1357);
+    tab = get_basis_sums(sess);
+
+    fd = open(target_file, O_RDONLY);
+    fail_unless(fd >= 0, "Failed to open %s: %s", target_file,
+      strerror(errno));
+
+    mark_point();
+    memset(&stats, 0, sizeof(stats));
+    res = rsync_sender_send_file(p, sess, fd, target_file, tab, &stats);
+    fail_unless(res == 0, "Failed to send file: %s", strerror(errno));
+    (void) close(fd);
+
+    fail_unless(stats.literal_bytes + stats.matched_bytes == targetlen,
+      "Expected %lu bytes in total, got %lu", (unsigned long) targetlen,
+      (unsigned long) (stats.literal_bytes + stats.matched_bytes));
+
+    /* Only the new data, and the partial blocks around it, are literal. */
+    fail_unless(stats.literal_bytes < 51000 + (8 * 700),
+      "Too many literal bytes: %lu", (unsigned long) stats.literal_bytes);
+
+    check_delta(sess, tab);
+  }
+}
+END_TEST
+
+START_TEST (sender_send_whole_file_test) {
+  register unsigned int i;
+  uint32_t seed = 17;
+  int algos[] = {
+    RSYNC_COMPRESS_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_ZLIB,
+    -1
+  };
+
+  /* Several read buffers' worth, ending in a partial one. */
+  target = palloc(p, TEST_WHOLE_SIZE);
+  targetlen = TEST_WHOLE_SIZE;
+  memcpy(target, basis, TEST_BASIS_SIZE);
+  for (i = TEST_BASIS_SIZE; i < targetlen; i++) {
+    seed = (seed * 1103515245) + 12345;
+    target[i] = (unsigned char) (seed >> 24);
+  }
+  tests_write_file(target_file, target, targetlen);
+
+  tests_writtensz = targetlen + (64 * 1024);
+  tests_written = palloc(p, tests_writtensz);
+
+  for (i = 0; algos[i] != -1; i++) {
+    register unsigned int j;
+
+    /* With --whole-file, the basis is ignored, even though it matches; the
+     * file is the same whether read directly or not (where supported).
+     */
+    for (j = 0; j < 2; j++) {
+      struct rsync_session *sess;
+      struct rsync_sumtable *tab;
+      struct rsync_sender_stats stats;
+      int fd, res;
+
+      sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5, algos[i],
+        0x1357);
+      ((struct rsync_options *) sess->options)->whole_file = TRUE;
+      tab = get_basis_sums(sess);
+
+      rsync_opts = (j == 0 ? 0UL : RSYNC_OPT_WHOLE_FILE_DIRECT_IO);
+
+      fd = open(target_file, O_RDONLY);
+      fail_unless(fd >= 0, "Failed to open %s: %s", target_file,
+        strerror(errno));
+
+      mark_point();
+      memset(&stats, 0, sizeof(stats));
+      res = rsync_sender_send_file(p, sess, fd, target_file, tab, &stats);
+      fail_unless(res == 0, "Failed to send file: %s", strerror(errno));
+      fail_unless(stats.literal_bytes == targetlen,
+        "Expected %lu literal bytes, got %lu", (unsigned long) targetlen,
+        (unsigned long) stats.literal_bytes);
+      fail_unless(stats.matched_bytes == 0,
+        "Expected no matched bytes, got %lu",
+        (unsigned long) stats.matched_bytes);
+
+#ifdef O_DIRECT
+      /* The descriptor is left as it was. */
+      fail_unless((fcntl(fd, F_GETFL) & O_DIRECT) == 0,
+        "Expected O_DIRECT to be cleared");
+#endif /* O_DIRECT */
+      (void) close(fd);
+
+      check_delta(sess, NULL);
+    }
+  }
+}
+END_TEST
+
+START_TEST (sender_send_small_file_test) {
+  register unsigned int i;
+  int algos[] = {
+    RSYNC_COMPRESS_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_ZLIB,
+    -1
+  };
+
+  /* A small file which matches the start of the basis. */
+  targetlen = 3000;
+  memcpy(target, basis, targetlen);
+  tests_write_file(target_file, target, targetlen);
+
+  rsync_small_file_size = 4096;
+
+  for (i = 0; algos[i] != -1; i++) {
+    struct rsync_session *sess;
+    struct rsync_sumtable *tab;
+    struct rsync_sender_stats stats;
+    int fd, res;
+
+    sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5, algos[i],
+      0x1357);
+    tab = get_basis_sums(sess);
+
+    fd = open(target_file, O_RDONLY);
+    fail_unless(fd >= 0, "Failed to open %s: %s", target_file,
+      strerror(errno));
+
+    /* It is sent whole, despite the matching basis, in a single write. */
+    mark_point();
+    memset(&stats, 0, sizeof(stats));
+    nwrites = 0;
+    res = rsync_sender_send_file(p, sess, fd, target_file, tab, &stats);
+    fail_unless(res == 0, "Failed to send file: %s", strerror(errno));
+    (void) close(fd);
+
+    fail_unless(stats.literal_bytes == targetlen,
+      "Expected %lu literal bytes, got %lu", (unsigned long) targetlen,
+      (unsigned long) stats.literal_bytes);
+    fail_unless(nwrites == 1, "Expected 1 write, got %u", nwrites);
+
+    check_delta(sess, NULL);
+  }
+}
+END_TEST
+
+START_TEST (sender_send_fallback_test) {
+  register unsigned int i;
+  uint32_t seed = 29;
+  struct rsync_session *sess;
+  struct rsync_sumtable *tab;
+  struct rsync_sender_stats stats;
+  int fd, res;
+
+  mark_point();
+  fail_unless(rsync_sender_set_fallback(0, 2) < 0,
+    "Failed to handle zero sample size");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* A file which has changed throughout, bar its start. */
+  target = palloc(p, TEST_PARALLEL_SIZE);
+  targetlen = TEST_PARALLEL_SIZE;
+  memcpy(target, basis, 5000);
+  for (i = 5000; i < targetlen; i++) {
+    seed = (seed * 1103515245) + 12345;
+    target[i] = (unsigned char) (seed >> 24);
+  }
+  tests_write_file(target_file, target, targetlen);
+
+  tests_writtensz = targetlen + (64 * 1024);
+  tests_written = palloc(p, tests_writtensz);
+
+  /* The search is abandoned after the first sample, whether serial or
+   * parallel; unless never abandoned.
+   */
+  for (i = 0; i < 3; i++) {
+    (void) rsync_sender_set_fallback(256 * 1024, i < 2 ? 2 : 0);
+    (void) rsync_sender_set_parallel(1, i == 1 ? 4 : 1);
+
+    sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+      RSYNC_COMPRESS_ALGO_NONE, 0x1357);
+    tab = get_basis_sums(sess);
+
+    fd = open(target_file, O_RDONLY);
+    fail_unless(fd >= 0, "Failed to open %s: %s", target_file,
+      strerror(errno));
+
+    mark_point();
+    memset(&stats, 0, sizeof(stats));
+    res = rsync_sender_send_file(p, sess, fd, target_file, tab, &stats);
+    fail_unless(res == 0, "Failed to send file: %s", strerror(errno));
+    (void) close(fd);
+
+    fail_unless(stats.fallbacks == (i < 2 ? 1 : 0),
+      "Unexpected fallback count %lu", (unsigned long) stats.fallbacks);
+    fail_unless(stats.matched_bytes > 0, "Expected some matched bytes");
+    fail_unless(stats.literal_bytes + stats.matched_bytes == targetlen,
+      "Expected %lu bytes in total, got %lu", (unsigned long) targetlen,
+      (unsigned long) (stats.literal_bytes + stats.matched_bytes));
+
+    check_delta(sess, tab);
+  }
+
+  /* A file which has changed at the start, but not after, is still
+   * searched.
+   */
+  targetlen = 0;
+  for (i = 0; i < 64 * 1024; i++) {
+    seed = (seed * 1103515245) + 12345;
+    target[targetlen++] = (unsigned char) (seed >> 24);
+  }
+
+  while (targetlen + TEST_BASIS_SIZE <= TEST_PARALLEL_SIZE) {
+    memcpy(target + targetlen, basis, TEST_BASIS_SIZE);
+    targetlen += TEST_BASIS_SIZE;
+  }
+  tests_write_file(target_file, target, targetlen);
+
+  (void) rsync_sender_set_fallback(64 * 1024, 2);
+  (void) rsync_sender_set_parallel(RSYNC_SENDER_DEFAULT_PARALLEL_MIN_SIZE, 1);
+
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+    RSYNC_COMPRESS_ALGO_NONE, 0x1357);
+  tab = get_basis_sums(sess);
+
+  fd = open(target_file, O_RDONLY);
+  fail_unless(fd >= 0, "Failed to open %s: %s", target_file, strerror(errno));
+
+  mark_point();
+  memset(&stats, 0, sizeof(stats));
+  res = rsync_sender_send_file(p, sess, fd, target_file, tab, &stats);
+  fail_unless(res == 0, "Failed to send file: %s", strerror(errno));
+  (void) close(fd);
+
+  fail_unless(stats.fallbacks == 0, "Unexpected fallback count %lu",
+    (unsigned long) stats.fallbacks);
+  fail_unless(stats.literal_bytes < 128 * 1024,
+    "Expected less than 128KB of literal data, got %lu",
+    (unsigned long) stats.literal_bytes);
+
+  check_delta(sess, tab);
+}
+END_TEST
+
+START_TEST (sender_send_policy_test) {
+  register unsigned int i;
+  struct rsync_policy_stats policy_stats;
+  int whole = FALSE;
+
+  /* The first send records how the delta went; with a store, the second
+   * is sent whole, as the file has since been recorded as not matching
+   * (unless the file is probed in this session).
+   */
+  for (i = 0; i < 2; i++) {
+    struct rsync_session *sess;
+    struct rsync_sumtable *tab;
+    struct rsync_sender_stats stats;
+    int fd, res;
+
+    sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+      RSYNC_COMPRESS_ALGO_NONE, 0x1357);
+    tab = get_basis_sums(sess);
+
+    if (i == 1) {
+      res = rsync_policy_open(policy_file);
+      fail_unless(res == 0, "Failed to open '%s': %s", policy_file,
+        strerror(errno));
+
+      memset(&policy_stats, 0, sizeof(policy_stats));
+      policy_stats.total_bytes = 100 * targetlen;
+      policy_stats.literal_runs = 1;
+      (void) rsync_policy_record(target_file, &policy_stats);
+
+      whole = rsync_policy_get_flags(target_file) & RSYNC_POLICY_FL_WHOLE_FILE;
+    }
+
+    fd = open(target_file, O_RDONLY);
+    fail_unless(fd >= 0, "Failed to open %s: %s", target_file,
+      strerror(errno));
+
+    mark_point();
+    tests_writtenlen = 0;
+    memset(&stats, 0, sizeof(stats));
+    res = rsync_sender_send_file(p, sess, fd, target_file, tab, &stats);
+    fail_unless(res == 0, "Failed to send file: %s", strerror(errno));
+    (void) close(fd);
+
+    check_delta(sess, tab);
+
+    if (i == 0) {
+      /* At least the inserted and the overwritten data. */
+      fail_unless(stats.literal_runs >= 2,
+        "Expected at least 2 literal runs, got %lu",
+        (unsigned long) stats.literal_runs);
+
+      res = rsync_policy_get(target_file, &policy_stats);
+      fail_unless(res == 0, "Failed to get history: %s", strerror(errno));
+      fail_unless(policy_stats.total_bytes == targetlen,
+        "Expected %lu bytes, got %lu", (unsigned long) targetlen,
+        (unsigned long) policy_stats.total_bytes);
+      fail_unless(policy_stats.matched_bytes == stats.matched_bytes,
+        "Expected %lu matched bytes, got %lu",
+        (unsigned long) stats.matched_bytes,
+        (unsigned long) policy_stats.matched_bytes);
+      fail_unless(policy_stats.literal_runs == stats.literal_runs,
+        "Expected %lu literal runs, got %lu",
+        (unsigned long) stats.literal_runs,
+        (unsigned long) policy_stats.literal_runs);
+      fail_unless(policy_stats.block_len ==
+        rsync_sumtable_get_head(tab)->block_len,
+        "Unexpected block length %ld", (long) policy_stats.block_len);
+
+    } else if (whole) {
+      fail_unless(stats.matched_bytes == 0,
+        "Expected no matched bytes, got %lu",
+        (unsigned long) stats.matched_bytes);
+      fail_unless(stats.literal_bytes == targetlen,
+        "Expected %lu literal bytes, got %lu", (unsigned long) targetlen,
+        (unsigned long) stats.literal_bytes);
+
+    } else {
+      fail_unless(stats.matched_bytes > 0, "Expected matched bytes");
+    }
+  }
+}
+END_TEST
+
+START_TEST (sender_send_append_test) {
+  register unsigned int i;
+  struct rsync_session *sess;
+  struct rsync_sumtable *tab;
+  struct rsync_sender_stats stats;
+  int fd, res;
+
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+    RSYNC_COMPRESS_ALGO_NONE, 0x1357);
+  ((struct rsync_options *) sess->options)->append_mode = 1;
+  tab = get_basis_sums(sess);
+
+  /* The target is shorter than the basis: nothing to append to. */
+  fd = open(target_file, O_RDONLY);
+  fail_unless(fd >= 0, "Failed to open %s: %s", target_file, strerror(errno));
+
+  mark_point();
+  res = rsync_sender_send_file(p, sess, fd, target_file, tab, NULL);
+  fail_unless(res < 0, "Failed to handle target shorter than basis");
+  fail_unless(errno == ERANGE, "Expected ERANGE (%d), got %s (%d)", ERANGE,
+    strerror(errno), errno);
+  fail_unless(tests_writtenlen == 0, "Expected nothing sent, got %lu bytes",
+    (unsigned long) tests_writtenlen);
+  (void) close(fd);
+
+  /* Only the data beyond the basis is sent, with or without verifying the
+   * rest.
+   */
+  memcpy(target, basis, TEST_BASIS_SIZE);
+  targetlen = TEST_BASIS_SIZE;
+  for (i = 0; i < 70000; i++) {
+    target[targetlen++] = (unsigned char) (i * 13);
+  }
+  tests_write_file(target_file, target, targetlen);
+
+  for (i = 1; i <= 2; i++) {
+    ((struct rsync_options *) sess->options)->append_mode = i;
+
+    fd = open(target_file, O_RDONLY);
+    fail_unless(fd >= 0, "Failed to open %s: %s", target_file,
+      strerror(errno));
+
+    mark_point();
+    memset(&stats, 0, sizeof(stats));
+    tests_writtenlen = 0;
+    res = rsync_sender_send_file(p, sess, fd, target_file, tab, &stats);
+    fail_unless(res == 0, "Failed to send file: %s", strerror(errno));
+    (void) close(fd);
+
+    fail_unless(stats.literal_bytes == 70000,
+      "Expected 70000 literal bytes, got %lu",
+      (unsigned long) stats.literal_bytes);
+    fail_unless(tests_writtenlen < 70000 + 1024, "Sent too much: %lu bytes",
+      (unsigned long) tests_writtenlen);
+  }
+}
+END_TEST
+
+START_TEST (sender_prefetch_file_test) {
+  int fd, res;
+
+  mark_point();
+  res = rsync_sender_prefetch_file(-1, 0);
+  fail_unless(res < 0, "Failed to handle invalid descriptor");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  fd = open(target_file, O_RDONLY);
+  fail_unless(fd >= 0, "Failed to open %s: %s", target_file, strerror(errno));
+
+  mark_point();
+  res = rsync_sender_prefetch_file(fd, -1);
+  fail_unless(res < 0, "Failed to handle invalid size");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_sender_prefetch_file(fd, targetlen);
+  fail_unless(res == 0, "Failed to prefetch file: %s", strerror(errno));
+
+  (void) close(fd);
+}
+END_TEST
+
+START_TEST (sender_send_parallel_test) {
+  register unsigned int i;
+  int algos[] = {
+    RSYNC_COMPRESS_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_ZLIB,
+    -1
+  };
+  uint32_t seed = 17;
+  int res;
+
+  mark_point();
+  res = rsync_sender_set_parallel(-1, 4);
+  fail_unless(res < 0, "Failed to handle negative size");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* Give the basis a run of zeroes, so that the target has many duplicate
+   * blocks to choose between.
+   */
+  memset(basis + 100000, 0, 20000);
+  tests_write_file(basis_file, basis, TEST_BASIS_SIZE);
+
+  /* A target spanning many regions, made of pieces of the basis, runs of
+   * zeroes, and new data, so that matched blocks often straddle the region
+   * boundaries.
+   */
+  target = palloc(p, TEST_PARALLEL_SIZE + 30000);
+  targetlen = 0;
+
+  while (targetlen < TEST_PARALLEL_SIZE) {
+    uint32_t len;
+
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    len = 1000 + (seed % 20000);
+
+    switch ((seed >> 24) % 4) {
+      case 0:
+      case 1:
+        memcpy(target + targetlen,
+          basis + ((seed >> 8) % (TEST_BASIS_SIZE - len)), len);
+        break;
+
+      case 2:
+        memset(target + targetlen, 0, len);
+        break;
+
+      default:
+        for (i = 0; i < len; i++) {
+          target[targetlen + i] = (unsigned char) (seed + (i * 13));
+        }
+        break;
+    }
+
+    targetlen += len;
+  }
+
+  tests_write_file(target_file, target, targetlen);
+
+  tests_writtensz = TEST_PARALLEL_SIZE * 2;
+  tests_written = palloc(p, tests_writtensz);
+
+  for (i = 0; algos[i] != -1; i++) {
+    struct rsync_session *sess;
+    struct rsync_sumtable *tab;
+    struct rsync_sender_stats stats, serial_stats;
+    unsigned char *serial;
+    uint32_t seriallen;
+    int fd;
+
+    sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5, algos[i],
+      0x1357);
+    tab = get_basis_sums(sess);
+
+    fd = open(target_file, O_RDONLY);
+    fail_unless(fd >= 0, "Failed to open %s: %s", target_file,
+      strerror(errno));
+
+    mark_point();
+    memset(&serial_stats, 0, sizeof(serial_stats));
+    res = rsync_sender_send_file(p, sess, fd, target_file, tab,
+      &serial_stats);
+    fail_unless(res == 0, "Failed to send file: %s", strerror(errno));
+
+    serial = palloc(p, tests_writtenlen);
+    memcpy(serial, tests_written, tests_writtenlen);
+    seriallen = tests_writtenlen;
+
+    /* The compressor state must start afresh for the second pass. */
+    sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5, algos[i],
+      0x1357);
+    tests_writtenlen = 0;
+
+    res = rsync_sender_set_parallel(0, 4);
+    if (res < 0 &&
+        errno == ENOSYS) {
+      (void) close(fd);
+      return;
+    }
+
+    fail_unless(res == 0, "Failed to set parallel search: %s",
+      strerror(errno));
+
+    mark_point();
+    memset(&stats, 0, sizeof(stats));
+    res = rsync_sender_send_file(p, sess, fd, target_file, tab, &stats);
+    fail_unless(res == 0, "Failed to send file in parallel: %s",
+      strerror(errno));
+    (void) close(fd);
+
+    (void) rsync_sender_set_parallel(RSYNC_SENDER_DEFAULT_PARALLEL_MIN_SIZE,
+      1);
+
+    fail_unless(stats.matched_blocks == serial_stats.matched_blocks,
+      "Expected %lu matched blocks, got %lu",
+      (unsigned long) serial_stats.matched_blocks,
+      (unsigned long) stats.matched_blocks);
+    fail_unless(tests_writtenlen == seriallen, "Expected %lu bytes, got %lu",
+      (unsigned long) seriallen, (unsigned long) tests_writtenlen);
+    fail_unless(memcmp(tests_written, serial, seriallen) == 0,
+      "Parallel token stream differs from serial");
+
+    check_delta(sess, tab);
+  }
+}
+END_TEST
+
+START_TEST (sender_send_sparse_test) {
+  register unsigned int i;
+  int fd, res;
+
+  /* A sparse target: some data, a long hole, some more data, and a hole to
+   * the end.  The tokens sent must be the same as for the same data written
+   * out in full.
+   */
+  targetlen = TEST_SPARSE_SIZE;
+  target = pcalloc(p, targetlen);
+  memcpy(target, basis, 100000);
+  memcpy(target + (2 * 1024 * 1024) + 123, basis + 150000, 50000);
+
+  tests_writtensz = TEST_SPARSE_SIZE * 2;
+  tests_written = palloc(p, tests_writtensz);
+
+  for (i = 0; i < 2; i++) {
+    struct rsync_session *sess;
+    struct rsync_sumtable *tab;
+    unsigned char *dense;
+    uint32_t denselen;
+
+    if (i == 1) {
+      /* Now with zeroes in the basis, to be matched in the holes. */
+      memset(basis + 200000, 0, 20000);
+      tests_write_file(basis_file, basis, TEST_BASIS_SIZE);
+    }
+
+    tests_write_file(target_file, target, targetlen);
+
+    sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+      RSYNC_COMPRESS_ALGO_NONE, 0x1357);
+    tab = get_basis_sums(sess);
+
+    fd = open(target_file, O_RDONLY);
+    fail_unless(fd >= 0, "Failed to open %s: %s", target_file,
+      strerror(errno));
+
+    mark_point();
+    res = rsync_sender_send_file(p, sess, fd, target_file, tab, NULL);
+    fail_unless(res == 0, "Failed to send file: %s", strerror(errno));
+    (void) close(fd);
+
+    dense = palloc(p, tests_writtenlen);
+    memcpy(dense, tests_written, tests_writtenlen);
+    denselen = tests_writtenlen;
+
+    /* Rewrite the target with holes. */
+    fd = open(target_file, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    fail_unless(fd >= 0, "Failed to open %s: %s", target_file,
+      strerror(errno));
+    fail_unless(pwrite(fd, target, 100000, 0) == 100000,
+      "Failed to write %s: %s", target_file, strerror(errno));
+    fail_unless(pwrite(fd, target + (2 * 1024 * 1024) + 123, 50000,
+      (2 * 1024 * 1024) + 123) == 50000, "Failed to write %s: %s",
+      target_file, strerror(errno));
+    fail_unless(ftruncate(fd, targetlen) == 0, "Failed to truncate %s: %s",
+      target_file, strerror(errno));
+    (void) close(fd);
+
+    fd = open(target_file, O_RDONLY);
+    fail_unless(fd >= 0, "Failed to open %s: %s", target_file,
+      strerror(errno));
+
+    sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+      RSYNC_COMPRESS_ALGO_NONE, 0x1357);
+    tests_writtenlen = 0;
+
+    mark_point();
+    res = rsync_sender_send_file(p, sess, fd, target_file, tab, NULL);
+    fail_unless(res == 0, "Failed to send sparse file: %s", strerror(errno));
+
+    fail_unless(tests_writtenlen == denselen, "Expected %lu bytes, got %lu",
+      (unsigned long) denselen, (unsigned long) tests_writtenlen);
+    fail_unless(memcmp(tests_written, dense, denselen) == 0,
+      "Sparse file token stream differs from dense file");
+    check_delta(sess, tab);
+
+    /* And likewise when searching in parallel. */
+    if (rsync_sender_set_parallel(0, 4) == 0) {
+      sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+        RSYNC_COMPRESS_ALGO_NONE, 0x1357);
+      tests_writtenlen = 0;
+
+      mark_point();
+      res = rsync_sender_send_file(p, sess, fd, target_file, tab, NULL);
+      fail_unless(res == 0, "Failed to send sparse file in parallel: %s",
+        strerror(errno));
+      (void) rsync_sender_set_parallel(RSYNC_SENDER_DEFAULT_PARALLEL_MIN_SIZE,
+        1);
+
+      fail_unless(tests_writtenlen == denselen &&
+        memcmp(tests_written, dense, denselen) == 0,
+        "Parallel sparse file token stream differs from dense file");
+    }
+
+    (void) close(fd);
+  }
+}
+END_TEST
+
+Suite *tests_get_sender_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("sender");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, sender_send_file_test);
+  tcase_add_test(testcase, sender_send_delta_test);
+  tcase_add_test(testcase, sender_send_whole_file_test);
+  tcase_add_test(testcase, sender_send_small_file_test);
+  tcase_add_test(testcase, sender_send_append_test);
+  tcase_add_test(testcase, sender_prefetch_file_test);
+  tcase_add_test(testcase, sender_send_parallel_test);
+  tcase_add_test(testcase, sender_send_fallback_test);
+  tcase_add_test(testcase, sender_send_policy_test);
+  tcase_add_test(testcase, sender_send_sparse_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
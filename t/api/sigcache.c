@@ -0,0 +1,235 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Signature cache API tests. */
+
+#include "tests.h"
+#include "sigcache.h"
+#include "generator.h"
+#include "checksum.h"
+#include "options.h"
+#include "compress.h"
+
+static pool *p = NULL;
+
+static const char *cache_dir = "/tmp/mod_rsync-sigcache.d";
+static const char *test_file = "/tmp/mod_rsync-sigcache.dat";
+
+#define TEST_FILE_SIZE		(1024 * 1024)
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  (void) tests_rmpath(p, cache_dir);
+  (void) mkdir(cache_dir, 0755);
+
+  tests_writtensz = 64 * 1024;
+  tests_written = palloc(p, tests_writtensz);
+  tests_writtenlen = 0;
+  rsync_write_data = tests_capture_write_data;
+}
+
+static void tear_down(void) {
+  rsync_write_data = tests_write_data;
+  (void) rsync_sigcache_set_dir(NULL, NULL);
+  (void) unlink(test_file);
+
+  if (p) {
+    (void) tests_rmpath(p, cache_dir);
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+static int write_test_file(unsigned char fill, struct stat *st) {
+  unsigned char *data;
+  int fd;
+
+  data = palloc(p, TEST_FILE_SIZE);
+  memset(data, fill, TEST_FILE_SIZE);
+  data[0] = 'a';
+
+  fd = open(test_file, O_CREAT|O_TRUNC|O_RDWR, 0644);
+  fail_unless(fd >= 0, "Failed to open '%s': %s", test_file, strerror(errno));
+  fail_unless(write(fd, data, TEST_FILE_SIZE) == TEST_FILE_SIZE,
+    "Failed to write '%s': %s", test_file, strerror(errno));
+
+  if (st != NULL) {
+    struct timespec ts[2];
+
+    /* Restore the original modification time, so that the rewritten file
+     * looks unchanged.
+     */
+    ts[0] = ts[1] = st->st_mtim;
+    fail_unless(futimens(fd, ts) == 0, "Failed to set times: %s",
+      strerror(errno));
+  }
+
+  return fd;
+}
+
+START_TEST (sigcache_open_test) {
+  struct rsync_session *sess;
+  struct rsync_sigcache *cache;
+  struct rsync_sum_head head;
+  struct stat st;
+  int res;
+
+  mark_point();
+  res = rsync_sigcache_set_dir(p, "relative/path");
+  fail_unless(res < 0, "Failed to handle relative path");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+    RSYNC_COMPRESS_ALGO_NONE, 1);
+  memset(&st, 0, sizeof(st));
+  memset(&head, 0, sizeof(head));
+
+  mark_point();
+  cache = rsync_sigcache_open(p, sess, &st, &head);
+  fail_unless(cache == NULL, "Failed to handle disabled cache");
+  fail_unless(errno == ENOSYS, "Expected ENOSYS (%d), got %s (%d)", ENOSYS,
+    strerror(errno), errno);
+
+  res = rsync_sigcache_set_dir(p, cache_dir);
+  fail_unless(res == 0, "Failed to set cache dir: %s", strerror(errno));
+
+  mark_point();
+  cache = rsync_sigcache_open(p, sess, &st, &head);
+  fail_unless(cache != NULL, "Failed to open cache entry: %s",
+    strerror(errno));
+  fail_unless(rsync_sigcache_get_flags(cache) == 0, "Expected empty entry");
+
+  /* Nothing was recorded, so nothing is stored. */
+  res = rsync_sigcache_close(cache, -1);
+  fail_unless(res == 0, "Failed to close cache entry: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (sigcache_generator_test) {
+  struct rsync_session *sess;
+  struct stat st, entry_st;
+  unsigned char *expected;
+  uint32_t count, expectedlen;
+  const char *entry_path;
+  char name[128];
+  int fd, res;
+
+  res = rsync_sigcache_set_dir(p, cache_dir);
+  fail_unless(res == 0, "Failed to set cache dir: %s", strerror(errno));
+
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+    RSYNC_COMPRESS_ALGO_NONE, 0x1234);
+  fd = write_test_file('x', NULL);
+  fail_unless(fstat(fd, &st) == 0, "Failed to stat: %s", strerror(errno));
+
+  /* A miss: the sums are computed, and the rolling checksums stored. */
+  mark_point();
+  res = rsync_generator_send_sums(p, sess, fd, 0);
+  fail_unless(res == 0, "Failed to send sums: %s", strerror(errno));
+  (void) close(fd);
+
+  expected = palloc(p, tests_writtenlen);
+  memcpy(expected, tests_written, tests_writtenlen);
+  expectedlen = tests_writtenlen;
+
+  memset(name, '\0', sizeof(name));
+  pr_snprintf(name, sizeof(name)-1, "%llx-%llx-md5.sig",
+    (unsigned long long) st.st_dev, (unsigned long long) st.st_ino);
+  entry_path = pdircat(p, cache_dir, name, NULL);
+  fail_unless(stat(entry_path, &entry_st) == 0, "Failed to stat '%s': %s",
+    entry_path, strerror(errno));
+
+  /* The sum head starts with the block count. */
+  count = expected[0] | (expected[1] << 8) | (expected[2] << 16) |
+    (expected[3] << 24);
+  fail_unless(entry_st.st_size > (off_t) (count * 4) &&
+    entry_st.st_size < (off_t) (count * (4 + 16)),
+    "Expected rolling checksums only, got %lu bytes for %lu blocks",
+    (unsigned long) entry_st.st_size, (unsigned long) count);
+
+  /* Change the contents, but not the identity, of the file: a hit reuses the
+   * rolling checksums, but the strong checksums still come from the (changed)
+   * file.
+   */
+  fd = write_test_file('y', &st);
+
+  mark_point();
+  tests_writtenlen = 0;
+  res = rsync_generator_send_sums(p, sess, fd, 0);
+  fail_unless(res == 0, "Failed to send sums: %s", strerror(errno));
+  fail_unless(tests_writtenlen == expectedlen, "Expected %lu bytes, got %lu",
+    (unsigned long) expectedlen, (unsigned long) tests_writtenlen);
+  fail_unless(memcmp(tests_written, expected, 16 + 4) == 0,
+    "Expected cached rolling checksum");
+  fail_unless(memcmp(tests_written + 20, expected + 20, 2) != 0,
+    "Expected recomputed strong checksum");
+
+  /* A different seed changes nothing, and the entry is not rewritten. */
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_MD5,
+    RSYNC_COMPRESS_ALGO_NONE, 0x5678);
+
+  mark_point();
+  tests_writtenlen = 0;
+  res = rsync_generator_send_sums(p, sess, fd, 0);
+  fail_unless(res == 0, "Failed to send sums: %s", strerror(errno));
+  fail_unless(memcmp(tests_written, expected, 16 + 4) == 0,
+    "Expected cached rolling checksum");
+
+  memset(&st, 0, sizeof(st));
+  fail_unless(stat(entry_path, &st) == 0, "Failed to stat '%s': %s",
+    entry_path, strerror(errno));
+  fail_unless(st.st_ino == entry_st.st_ino &&
+    st.st_mtime == entry_st.st_mtime, "Expected entry to be kept");
+
+  /* Full-length sums for a redo bypass the cache. */
+  mark_point();
+  tests_writtenlen = 0;
+  res = rsync_generator_send_sums(p, sess, fd, RSYNC_GENERATOR_FL_FULL_SUMS);
+  fail_unless(res == 0, "Failed to send sums: %s", strerror(errno));
+  fail_unless(memcmp(tests_written + 16, expected + 16, 4) != 0,
+    "Expected recomputed rolling checksum");
+
+  (void) close(fd);
+}
+END_TEST
+
+Suite *tests_get_sigcache_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("sigcache");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, sigcache_open_test);
+  tcase_add_test(testcase, sigcache_generator_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
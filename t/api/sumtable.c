@@ -0,0 +1,374 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Block sum table API tests. */
+
+#include "tests.h"
+#include "sumtable.h"
+#include "msg.h"
+#include "checksum.h"
+#include "compress.h"
+
+static pool *p = NULL;
+
+/* Blocks 3 and 7 are identical, block 5 shares only their rolling checksum,
+ * and the short last block shares block 0's sums.
+ */
+#define TEST_BLOCK_COUNT	10
+#define TEST_BLOCK_SIZE		700
+#define TEST_REMAINDER		123
+#define TEST_S2LEN		3
+
+static uint32_t test_weak[TEST_BLOCK_COUNT] = {
+  0x11111111, 0x22222222, 0x33333333, 0x44444444, 0x55555555,
+  0x44444444, 0x66666666, 0x44444444, 0x77777777, 0x11111111
+};
+
+static unsigned char test_strong[TEST_BLOCK_COUNT][TEST_S2LEN] = {
+  { 0, 0, 1 }, { 0, 0, 2 }, { 0, 0, 3 }, { 0, 0, 4 }, { 0, 0, 5 },
+  { 0, 0, 6 }, { 0, 0, 7 }, { 0, 0, 4 }, { 0, 0, 9 }, { 0, 0, 1 }
+};
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+}
+
+static void tear_down(void) {
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+static uint32_t encode_sums(unsigned char *buf, uint32_t bufsz,
+    int32_t count, int32_t block_len, int32_t s2len, int32_t remainder) {
+  register unsigned int i;
+  unsigned char *ptr;
+  uint32_t buflen;
+
+  ptr = buf;
+  buflen = bufsz;
+
+  rsync_msg_write_int(&ptr, &buflen, count);
+  rsync_msg_write_int(&ptr, &buflen, block_len);
+  rsync_msg_write_int(&ptr, &buflen, s2len);
+  rsync_msg_write_int(&ptr, &buflen, remainder);
+
+  for (i = 0; i < (unsigned int) count && i < TEST_BLOCK_COUNT; i++) {
+    rsync_msg_write_int(&ptr, &buflen, (int32_t) test_weak[i]);
+    rsync_msg_write_data(&ptr, &buflen, test_strong[i], TEST_S2LEN);
+  }
+
+  return bufsz - buflen;
+}
+
+START_TEST (sumtable_read_head_test) {
+  struct rsync_session *sess;
+  struct rsync_sum_head head;
+  unsigned char buf[64], *ptr;
+  uint32_t buflen;
+  int res;
+
+  mark_point();
+  res = rsync_sumtable_read_head(NULL, NULL, NULL, NULL, NULL);
+  fail_unless(res < 0, "Failed to handle null arguments");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_NONE, 0);
+
+  mark_point();
+  (void) encode_sums(buf, sizeof(buf), 0, TEST_BLOCK_SIZE, TEST_S2LEN, 0);
+  ptr = buf;
+  buflen = 15;
+  res = rsync_sumtable_read_head(p, sess, &ptr, &buflen, &head);
+  fail_unless(res < 0, "Failed to handle short header");
+  fail_unless(errno == EAGAIN, "Expected EAGAIN (%d), got %s (%d)", EAGAIN,
+    strerror(errno), errno);
+  fail_unless(ptr == buf, "Consumed data from short header");
+
+  mark_point();
+  buflen = 16;
+  res = rsync_sumtable_read_head(p, sess, &ptr, &buflen, &head);
+  fail_unless(res == 0, "Failed to read header: %s", strerror(errno));
+  fail_unless(buflen == 0, "Expected 0 bytes left, got %lu",
+    (unsigned long) buflen);
+  fail_unless(head.count == 0, "Expected count 0, got %ld", (long) head.count);
+  fail_unless(head.block_len == TEST_BLOCK_SIZE,
+    "Expected block length %d, got %ld", TEST_BLOCK_SIZE,
+    (long) head.block_len);
+
+  /* Block lengths over 128K are only allowed for older protocols. */
+  mark_point();
+  (void) encode_sums(buf, sizeof(buf), 1, 1 << 20, TEST_S2LEN, 0);
+  ptr = buf;
+  buflen = 16;
+  res = rsync_sumtable_read_head(p, sess, &ptr, &buflen, &head);
+  fail_unless(res < 0, "Failed to reject oversized block length");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  sess->protocol_version = 29;
+  ptr = buf;
+  buflen = 16;
+  res = rsync_sumtable_read_head(p, sess, &ptr, &buflen, &head);
+  fail_unless(res == 0, "Failed to read header: %s", strerror(errno));
+
+  mark_point();
+  (void) encode_sums(buf, sizeof(buf), 1, TEST_BLOCK_SIZE, 17, 0);
+  ptr = buf;
+  buflen = 16;
+  res = rsync_sumtable_read_head(p, sess, &ptr, &buflen, &head);
+  fail_unless(res < 0, "Failed to reject oversized s2length");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  (void) encode_sums(buf, sizeof(buf), 1, TEST_BLOCK_SIZE, TEST_S2LEN,
+    TEST_BLOCK_SIZE + 1);
+  ptr = buf;
+  buflen = 16;
+  res = rsync_sumtable_read_head(p, sess, &ptr, &buflen, &head);
+  fail_unless(res < 0, "Failed to reject oversized remainder");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+}
+END_TEST
+
+START_TEST (sumtable_decode_test) {
+  register unsigned int i;
+  struct rsync_session *sess;
+  struct rsync_sumtable *tab;
+  struct rsync_sum_head head;
+  unsigned char buf[512], *ptr;
+  uint32_t buflen, len;
+  int res;
+
+  mark_point();
+  tab = rsync_sumtable_create(NULL, NULL);
+  fail_unless(tab == NULL, "Failed to handle null arguments");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_NONE, 0);
+  len = encode_sums(buf, sizeof(buf), TEST_BLOCK_COUNT, TEST_BLOCK_SIZE,
+    TEST_S2LEN, TEST_REMAINDER);
+
+  ptr = buf;
+  buflen = len;
+  res = rsync_sumtable_read_head(p, sess, &ptr, &buflen, &head);
+  fail_unless(res == 0, "Failed to read header: %s", strerror(errno));
+
+  tab = rsync_sumtable_create(p, &head);
+  fail_unless(tab != NULL, "Failed to create table: %s", strerror(errno));
+
+  /* Feed the sums in uneven pieces, splitting sums across calls. */
+  mark_point();
+  for (i = 0; buflen > 0; i++) {
+    uint32_t piecelen, remaining;
+
+    piecelen = (i % 3) + 2;
+    if (piecelen > buflen) {
+      piecelen = buflen;
+    }
+
+    remaining = piecelen;
+    res = rsync_sumtable_decode(tab, &ptr, &remaining);
+    fail_unless(remaining == 0, "Expected all %lu bytes consumed, got %lu",
+      (unsigned long) piecelen, (unsigned long) remaining);
+    buflen -= piecelen;
+
+    if (buflen > 0) {
+      fail_unless(res < 0, "Finished decoding with %lu bytes left",
+        (unsigned long) buflen);
+      fail_unless(errno == EAGAIN, "Expected EAGAIN (%d), got %s (%d)",
+        EAGAIN, strerror(errno), errno);
+    }
+  }
+
+  fail_unless(res == 0, "Failed to decode sums: %s", strerror(errno));
+  fail_unless(rsync_sumtable_get_head(tab)->count == TEST_BLOCK_COUNT,
+    "Unexpected block count");
+
+  mark_point();
+  for (i = 0; i < TEST_BLOCK_COUNT; i++) {
+    fail_unless(rsync_sumtable_has(tab, test_weak[i]) == TRUE,
+      "Block %u: rolling checksum 0x%08x not found", i, test_weak[i]);
+  }
+
+  fail_unless(rsync_sumtable_has(tab, 0x12345678) == FALSE,
+    "Found unexpected rolling checksum");
+  rsync_sumtable_prefetch(tab, 0x12345678);
+
+  fail_unless(rsync_sumtable_get_block_len(tab, 0) == TEST_BLOCK_SIZE,
+    "Unexpected block length for block 0");
+  fail_unless(rsync_sumtable_get_block_len(tab, TEST_BLOCK_COUNT - 1) ==
+    TEST_REMAINDER, "Unexpected block length for last block");
+}
+END_TEST
+
+START_TEST (sumtable_match_test) {
+  struct rsync_session *sess;
+  struct rsync_sumtable *tab;
+  struct rsync_sum_head head;
+  unsigned char buf[512], *ptr;
+  uint32_t buflen;
+  int32_t idx;
+  int res;
+
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_NONE, 0);
+  buflen = encode_sums(buf, sizeof(buf), TEST_BLOCK_COUNT, TEST_BLOCK_SIZE,
+    TEST_S2LEN, TEST_REMAINDER);
+
+  ptr = buf;
+  res = rsync_sumtable_read_head(p, sess, &ptr, &buflen, &head);
+  fail_unless(res == 0, "Failed to read header: %s", strerror(errno));
+
+  tab = rsync_sumtable_create(p, &head);
+  res = rsync_sumtable_decode(tab, &ptr, &buflen);
+  fail_unless(res == 0, "Failed to decode sums: %s", strerror(errno));
+
+  /* Blocks 3 and 7 match; the lowest is preferred, unless 7 is wanted. */
+  mark_point();
+  idx = rsync_sumtable_match(tab, 0x44444444, test_strong[3],
+    TEST_BLOCK_SIZE, -1);
+  fail_unless(idx == 3, "Expected block 3, got %ld", (long) idx);
+
+  idx = rsync_sumtable_match(tab, 0x44444444, test_strong[3],
+    TEST_BLOCK_SIZE, 7);
+  fail_unless(idx == 7, "Expected block 7, got %ld", (long) idx);
+
+  idx = rsync_sumtable_match(tab, 0x44444444, test_strong[5],
+    TEST_BLOCK_SIZE, 7);
+  fail_unless(idx == 5, "Expected block 5, got %ld", (long) idx);
+
+  /* Matching rolling checksum, but not strong checksum. */
+  idx = rsync_sumtable_match(tab, 0x44444444, test_strong[8],
+    TEST_BLOCK_SIZE, -1);
+  fail_unless(idx == -1, "Expected no match, got %ld", (long) idx);
+
+  /* The short last block only matches data of its own length. */
+  mark_point();
+  idx = rsync_sumtable_match(tab, 0x11111111, test_strong[0],
+    TEST_BLOCK_SIZE, TEST_BLOCK_COUNT - 1);
+  fail_unless(idx == 0, "Expected block 0, got %ld", (long) idx);
+
+  idx = rsync_sumtable_match(tab, 0x11111111, test_strong[0],
+    TEST_REMAINDER, -1);
+  fail_unless(idx == TEST_BLOCK_COUNT - 1, "Expected block %d, got %ld",
+    TEST_BLOCK_COUNT - 1, (long) idx);
+
+  idx = rsync_sumtable_match(tab, 0x12345678, test_strong[0],
+    TEST_BLOCK_SIZE, -1);
+  fail_unless(idx == -1, "Expected no match, got %ld", (long) idx);
+
+  /* Blocks before the minimum index are ignored. */
+  mark_point();
+  idx = rsync_sumtable_match_from(tab, 0x44444444, test_strong[3],
+    TEST_BLOCK_SIZE, -1, 4);
+  fail_unless(idx == 7, "Expected block 7, got %ld", (long) idx);
+
+  idx = rsync_sumtable_match_from(tab, 0x44444444, test_strong[3],
+    TEST_BLOCK_SIZE, 3, 8);
+  fail_unless(idx == -1, "Expected no match, got %ld", (long) idx);
+}
+END_TEST
+
+START_TEST (sumtable_large_test) {
+  register unsigned int i;
+  struct rsync_sumtable *tab;
+  struct rsync_sum_head head;
+  unsigned char *buf, *ptr;
+  uint32_t buflen, seed = 11;
+  int res;
+
+  /* Enough blocks that the probe sequences wrap around the table. */
+  head.count = 100000;
+  head.block_len = TEST_BLOCK_SIZE;
+  head.s2len = 2;
+  head.remainder = 0;
+
+  buflen = head.count * (4 + head.s2len);
+  ptr = buf = palloc(p, buflen);
+
+  for (i = 0; i < (unsigned int) head.count; i++) {
+    unsigned char strong[2];
+
+    strong[0] = i & 0xff;
+    strong[1] = (i >> 8) & 0xff;
+
+    seed = (seed * 1103515245) + 12345;
+    rsync_msg_write_int(&ptr, &buflen, (int32_t) seed);
+    rsync_msg_write_data(&ptr, &buflen, strong, 2);
+  }
+
+  tab = rsync_sumtable_create(p, &head);
+
+  mark_point();
+  ptr = buf;
+  buflen = head.count * (4 + head.s2len);
+  res = rsync_sumtable_decode(tab, &ptr, &buflen);
+  fail_unless(res == 0, "Failed to decode sums: %s", strerror(errno));
+
+  mark_point();
+  seed = 11;
+  for (i = 0; i < (unsigned int) head.count; i++) {
+    unsigned char strong[2];
+    int32_t idx;
+
+    strong[0] = i & 0xff;
+    strong[1] = (i >> 8) & 0xff;
+
+    seed = (seed * 1103515245) + 12345;
+    idx = rsync_sumtable_match(tab, seed, strong, TEST_BLOCK_SIZE,
+      (int32_t) i);
+    fail_unless(idx == (int32_t) i, "Expected block %u, got %ld", i,
+      (long) idx);
+  }
+}
+END_TEST
+
+Suite *tests_get_sumtable_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("sumtable");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, sumtable_read_head_test);
+  tcase_add_test(testcase, sumtable_decode_test);
+  tcase_add_test(testcase, sumtable_match_test);
+  tcase_add_test(testcase, sumtable_large_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
@@ -23,6 +23,8 @@
  */
 
 #include "tests.h"
+#include "options.h"
+#include "compress.h"
 
 struct testsuite_info {
   const char *name;
@@ -33,12 +35,81 @@ static struct testsuite_info suites[] = {
   { "session",		tests_get_session_suite },
   { "msg",		tests_get_msg_suite },
   { "checksum",		tests_get_checksum_suite },
+  { "rolling",		tests_get_rolling_suite },
+  { "multibuf",		tests_get_multibuf_suite },
+  { "generator",	tests_get_generator_suite },
+  { "sigcache",		tests_get_sigcache_suite },
+  { "sumtable",		tests_get_sumtable_suite },
+  { "sender",		tests_get_sender_suite },
+  { "receiver",	tests_get_receiver_suite },
+  { "ndx",		tests_get_ndx_suite },
+  { "pipeline",	tests_get_pipeline_suite },
+  { "workers",		tests_get_workers_suite },
+  { "helpers",		tests_get_helpers_suite },
+  { "fileio",		tests_get_fileio_suite },
+  { "destfile",	tests_get_destfile_suite },
+  { "blocksize",	tests_get_blocksize_suite },
+  { "policy",		tests_get_policy_suite },
+  { "fuzzy",		tests_get_fuzzy_suite },
+  { "compress",		tests_get_compress_suite },
+  { "negotiate",	tests_get_negotiate_suite },
+  { "token",		tests_get_token_suite },
   { "names",		tests_get_names_suite },
   { "entry",		tests_get_entry_suite },
 
   { NULL, NULL }
 };
 
+unsigned char *tests_written = NULL;
+uint32_t tests_writtenlen = 0, tests_writtensz = 0;
+
+int tests_capture_write_data(pool *p, uint32_t channel_id, unsigned char *buf,
+    uint32_t buflen) {
+  if (tests_writtenlen + buflen > tests_writtensz) {
+    return -1;
+  }
+
+  memcpy(tests_written + tests_writtenlen, buf, buflen);
+  tests_writtenlen += buflen;
+  return 0;
+}
+
+void tests_write_file(const char *path, const unsigned char *data,
+    uint32_t datalen) {
+  int fd;
+
+  fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  fail_unless(fd >= 0, "Failed to open %s: %s", path, strerror(errno));
+  fail_unless(write(fd, data, datalen) == (ssize_t) datalen,
+    "Failed to write %s: %s", path, strerror(errno));
+  (void) close(fd);
+}
+
+struct rsync_session *tests_create_session(pool *p, int protocol_version,
+    int checksum_algo, int compress_algo, int32_t seed) {
+  struct rsync_session *sess;
+  struct rsync_options *opts;
+
+  opts = pcalloc(p, sizeof(struct rsync_options));
+  opts->checksum_seed = seed;
+
+  sess = pcalloc(p, sizeof(struct rsync_session));
+  sess->pool = p;
+  sess->options = opts;
+  sess->protocol_version = protocol_version;
+  sess->checksum_algo = checksum_algo;
+  sess->compress_algo = compress_algo;
+
+  if (compress_algo != RSYNC_COMPRESS_ALGO_NONE) {
+    sess->compressor = rsync_compress_create(p, compress_algo,
+      rsync_compress_get_level(compress_algo, Z_DEFAULT_COMPRESSION));
+    fail_unless(sess->compressor != NULL, "Failed to create %s compressor: %s",
+      rsync_compress_get_name(compress_algo), strerror(errno));
+  }
+
+  return sess;
+}
+
 static Suite *tests_get_suite(const char *suite) { 
   register unsigned int i;
 
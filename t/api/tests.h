@@ -28,6 +28,7 @@
 #define MOD_RSYNC_TESTS_H
 
 #include "mod_rsync.h"
+#include "session.h"
 
 #ifdef HAVE_CHECK_H
 # include <check.h>
@@ -40,9 +41,48 @@ int tests_write_data(pool *p, uint32_t channel_id, unsigned char *buf,
   uint32_t buflen);
 int tests_stubs_set_next_cmd(cmd_rec *cmd);
 
+/* Shared fixtures: with tests_capture_write_data() as rsync_write_data, the
+ * data written is appended to tests_written, of tests_writtensz bytes, which
+ * the suite allocates; writing more than that fails.
+ */
+extern unsigned char *tests_written;
+extern uint32_t tests_writtenlen, tests_writtensz;
+
+int tests_capture_write_data(pool *p, uint32_t channel_id, unsigned char *buf,
+  uint32_t buflen);
+
+/* Writes the file, failing the test if that fails. */
+void tests_write_file(const char *path, const unsigned char *data,
+  uint32_t datalen);
+
+/* Returns a session, with zeroed options but for the checksum seed, and a
+ * compressor unless compress_algo is RSYNC_COMPRESS_ALGO_NONE.
+ */
+struct rsync_session *tests_create_session(pool *p, int protocol_version,
+  int checksum_algo, int compress_algo, int32_t seed);
+
 Suite *tests_get_session_suite(void);
 Suite *tests_get_msg_suite(void);
 Suite *tests_get_checksum_suite(void);
+Suite *tests_get_rolling_suite(void);
+Suite *tests_get_multibuf_suite(void);
+Suite *tests_get_generator_suite(void);
+Suite *tests_get_sigcache_suite(void);
+Suite *tests_get_sumtable_suite(void);
+Suite *tests_get_sender_suite(void);
+Suite *tests_get_receiver_suite(void);
+Suite *tests_get_ndx_suite(void);
+Suite *tests_get_pipeline_suite(void);
+Suite *tests_get_workers_suite(void);
+Suite *tests_get_helpers_suite(void);
+Suite *tests_get_fileio_suite(void);
+Suite *tests_get_destfile_suite(void);
+Suite *tests_get_blocksize_suite(void);
+Suite *tests_get_policy_suite(void);
+Suite *tests_get_fuzzy_suite(void);
+Suite *tests_get_compress_suite(void);
+Suite *tests_get_negotiate_suite(void);
+Suite *tests_get_token_suite(void);
 Suite *tests_get_names_suite(void);
 Suite *tests_get_entry_suite(void);
 
@@ -0,0 +1,538 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Token API tests. */
+
+#include "tests.h"
+#include "token.h"
+#include "compress.h"
+#include "policy.h"
+#include "checksum.h"
+
+static pool *p = NULL;
+
+static const char *policy_file = "/tmp/mod_rsync-token.policy";
+
+#define TEST_BLOCK_SIZE		700
+#define TEST_NBLOCKS		10
+#define TEST_LITERAL_SIZE	(80 * 1024)
+
+static unsigned char blocks[TEST_NBLOCKS][TEST_BLOCK_SIZE];
+static unsigned char literal[TEST_LITERAL_SIZE];
+
+static void set_up(void) {
+  register unsigned int i, j;
+  uint32_t seed = 17;
+
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  for (i = 0; i < TEST_NBLOCKS; i++) {
+    for (j = 0; j < TEST_BLOCK_SIZE; j++) {
+      blocks[i][j] = (unsigned char) ('a' + ((i + j) % 26));
+    }
+  }
+
+  /* Mostly incompressible literal data. */
+  for (i = 0; i < TEST_LITERAL_SIZE; i++) {
+    seed = (seed * 1103515245) + 12345;
+    literal[i] = (unsigned char) (seed >> 16);
+  }
+}
+
+static void tear_down(void) {
+  rsync_policy_clear();
+
+  if (p) {
+    (void) rsync_policy_close(p);
+    (void) unlink(policy_file);
+
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+/* A "file" is described by a list of tokens: block indices, or -1 for
+ * the given amount of literal data, terminated by -3.
+ */
+struct test_token {
+  int32_t token;
+  uint32_t datalen;
+};
+
+static struct test_token test_file[] = {
+  { -1, 100 },
+  { 0, 0 },
+  { 1, 0 },
+  { 2, 0 },
+  { -1, TEST_LITERAL_SIZE },
+  { 7, 0 },
+  { 3, 0 },
+  { 3, 0 },
+  { RSYNC_TOKEN_DATA_ONLY, 5000 },
+  { -1, 42 },
+  { 9, 0 },
+  { -3, 0 }
+};
+
+/* Encodes the test file, returning the expected reconstructed contents. */
+static void send_file(struct rsync_session *sess, unsigned char *buf,
+    uint32_t *buflen, unsigned char *expected, uint32_t *expectedlen) {
+  register unsigned int i;
+  unsigned char *ptr;
+  uint32_t len, bound, datalen = 0;
+  const unsigned char *data = NULL;
+  int res;
+
+  ptr = buf + *buflen;
+  len = 1024 * 1024;
+  *expectedlen = 0;
+
+  for (i = 0; test_file[i].token != -3; i++) {
+    struct test_token *tok;
+    int32_t token;
+    const unsigned char *block = NULL;
+
+    tok = &(test_file[i]);
+
+    if (tok->token == -1) {
+      data = literal;
+      datalen = tok->datalen;
+      memcpy(expected + *expectedlen, data, datalen);
+      *expectedlen += datalen;
+      continue;
+    }
+
+    token = tok->token;
+    if (token == RSYNC_TOKEN_DATA_ONLY) {
+      data = literal;
+      datalen = tok->datalen;
+      memcpy(expected + *expectedlen, data, datalen);
+      *expectedlen += datalen;
+
+    } else {
+      block = blocks[token];
+      memcpy(expected + *expectedlen, block, TEST_BLOCK_SIZE);
+      *expectedlen += TEST_BLOCK_SIZE;
+    }
+
+    bound = rsync_token_send_bound(sess, datalen);
+    fail_unless(bound <= len, "Buffer too small for %lu bytes",
+      (unsigned long) bound);
+
+    res = rsync_token_send(p, sess, &ptr, &len, token, data, datalen, block,
+      block != NULL ? TEST_BLOCK_SIZE : 0);
+    fail_unless(res == 0, "Failed to send token %d: %s", token,
+      strerror(errno));
+
+    data = NULL;
+    datalen = 0;
+  }
+
+  res = rsync_token_send(p, sess, &ptr, &len, RSYNC_TOKEN_END, data, datalen,
+    NULL, 0);
+  fail_unless(res == 0, "Failed to send END token: %s", strerror(errno));
+
+  *buflen += (1024 * 1024) - len;
+}
+
+/* Decodes a file, feeding the input in pieces of the given size. */
+static void recv_file(struct rsync_session *sess, unsigned char **buf,
+    uint32_t *buflen, uint32_t piecelen, unsigned char *expected,
+    uint32_t expectedlen) {
+  unsigned char *output;
+  uint32_t outputlen = 0, availlen = 0;
+
+  output = palloc(p, expectedlen);
+
+  while (TRUE) {
+    int32_t token = 0;
+    unsigned char *data = NULL;
+    uint32_t datalen = 0, n;
+    int res;
+
+    res = rsync_token_recv(p, sess, buf, &availlen, &token, &data, &datalen);
+    if (res < 0) {
+      fail_unless(errno == EAGAIN, "Failed to receive token: %s",
+        strerror(errno));
+      fail_unless(*buflen > 0, "Ran out of input");
+
+      n = piecelen < *buflen ? piecelen : *buflen;
+      availlen += n;
+      (*buflen) -= n;
+      continue;
+    }
+
+    if (res == RSYNC_TOKEN_RECV_END) {
+      break;
+    }
+
+    if (res == RSYNC_TOKEN_RECV_DATA) {
+      fail_unless(outputlen + datalen <= expectedlen,
+        "Received too much data");
+      memcpy(output + outputlen, data, datalen);
+      outputlen += datalen;
+      continue;
+    }
+
+    fail_unless(res == RSYNC_TOKEN_RECV_BLOCK, "Unexpected result %d", res);
+    fail_unless(token >= 0 && token < TEST_NBLOCKS, "Unexpected token %d",
+      token);
+    fail_unless(outputlen + TEST_BLOCK_SIZE <= expectedlen,
+      "Received too much data");
+
+    memcpy(output + outputlen, blocks[token], TEST_BLOCK_SIZE);
+    outputlen += TEST_BLOCK_SIZE;
+
+    res = rsync_token_see(sess, blocks[token], TEST_BLOCK_SIZE);
+    fail_unless(res == 0, "Failed to see block %d: %s", token,
+      strerror(errno));
+  }
+
+  /* Any unconsumed input belongs to the next file. */
+  (*buflen) += availlen;
+
+  fail_unless(outputlen == expectedlen, "Expected %lu bytes, got %lu",
+    (unsigned long) expectedlen, (unsigned long) outputlen);
+  fail_unless(memcmp(output, expected, expectedlen) == 0,
+    "Received data does not match sent data");
+}
+
+static void roundtrip(int algo, uint32_t piecelen) {
+  struct rsync_session *sender, *receiver;
+  unsigned char *buf, *ptr, *expected;
+  uint32_t buflen = 0, len, expectedlen = 0;
+
+  sender = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_NONE, algo, 0);
+  receiver = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_NONE, algo, 0);
+
+  buf = palloc(p, 2 * 1024 * 1024);
+  expected = palloc(p, 1024 * 1024);
+
+  /* Two consecutive files, on the same streams. */
+  mark_point();
+  send_file(sender, buf, &buflen, expected, &expectedlen);
+  send_file(sender, buf, &buflen, expected, &expectedlen);
+
+  ptr = buf;
+  len = buflen;
+
+  mark_point();
+  recv_file(receiver, &ptr, &len, piecelen, expected, expectedlen);
+  recv_file(receiver, &ptr, &len, piecelen, expected, expectedlen);
+  fail_unless(len == 0, "Expected all input to be consumed, %lu bytes left",
+    (unsigned long) len);
+}
+
+START_TEST (token_send_test) {
+  int res;
+  struct rsync_session *sess;
+  unsigned char buf[64], *ptr;
+  uint32_t len;
+
+  mark_point();
+  res = rsync_token_send(p, NULL, NULL, NULL, 0, NULL, 0, NULL, 0);
+  fail_unless(res < 0, "Failed to handle null session");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_NONE, 0);
+  ptr = buf;
+  len = sizeof(buf);
+
+  mark_point();
+  res = rsync_token_send(p, sess, &ptr, &len, -3, NULL, 0, NULL, 0);
+  fail_unless(res < 0, "Failed to handle invalid token");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* Uncompressed, block 2 is sent as -3, and END as 0. */
+  mark_point();
+  res = rsync_token_send(p, sess, &ptr, &len, 2, NULL, 0, NULL, 0);
+  fail_unless(res == 0, "Failed to send token: %s", strerror(errno));
+  res = rsync_token_send(p, sess, &ptr, &len, RSYNC_TOKEN_END,
+    (const unsigned char *) "foo", 3, NULL, 0);
+  fail_unless(res == 0, "Failed to send token: %s", strerror(errno));
+
+  fail_unless(sizeof(buf) - len == 15, "Expected 15 bytes, got %lu",
+    (unsigned long) (sizeof(buf) - len));
+  fail_unless(memcmp(buf,
+    "\xfd\xff\xff\xff\x03\x00\x00\x00" "foo" "\x00\x00\x00\x00", 15) == 0,
+    "Unexpected encoding of uncompressed tokens");
+
+  mark_point();
+  fail_unless(rsync_token_get_error(NULL) == NULL,
+    "Failed to handle null session");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+  fail_unless(strcmp(rsync_token_get_error(sess), "unknown error") == 0,
+    "Expected no error");
+}
+END_TEST
+
+START_TEST (token_roundtrip_test) {
+  register unsigned int i;
+  int algos[] = {
+    RSYNC_COMPRESS_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_ZLIB,
+    RSYNC_COMPRESS_ALGO_ZLIBX,
+    RSYNC_COMPRESS_ALGO_LZ4,
+    RSYNC_COMPRESS_ALGO_ZSTD,
+    -1
+  };
+
+  for (i = 0; algos[i] != -1; i++) {
+    if (algos[i] != RSYNC_COMPRESS_ALGO_NONE &&
+        rsync_compress_supported(algos[i]) == FALSE) {
+      continue;
+    }
+
+    mark_point();
+    roundtrip(algos[i], 1024 * 1024);
+
+    /* Split input, to exercise partial tokens. */
+    mark_point();
+    roundtrip(algos[i], 7);
+  }
+}
+END_TEST
+
+START_TEST (token_zlib_dictionary_test) {
+  struct rsync_session *sess;
+  unsigned char buf[8192], *ptr;
+  uint32_t len, primed_len, plain_len;
+  int res;
+
+  /* Literal data repeating a matched block should compress to almost nothing
+   * with "zlib", since the block is in the compressor's history.
+   */
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_ZLIB, 0);
+  ptr = buf;
+  len = sizeof(buf);
+
+  mark_point();
+  res = rsync_token_send(p, sess, &ptr, &len, 5, NULL, 0, blocks[5],
+    TEST_BLOCK_SIZE);
+  fail_unless(res == 0, "Failed to send token: %s", strerror(errno));
+  res = rsync_token_send(p, sess, &ptr, &len, RSYNC_TOKEN_END, blocks[5],
+    TEST_BLOCK_SIZE, NULL, 0);
+  fail_unless(res == 0, "Failed to send token: %s", strerror(errno));
+  primed_len = sizeof(buf) - len;
+
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_ZLIBX, 0);
+  ptr = buf;
+  len = sizeof(buf);
+
+  mark_point();
+  res = rsync_token_send(p, sess, &ptr, &len, 5, NULL, 0, blocks[5],
+    TEST_BLOCK_SIZE);
+  fail_unless(res == 0, "Failed to send token: %s", strerror(errno));
+  res = rsync_token_send(p, sess, &ptr, &len, RSYNC_TOKEN_END, blocks[5],
+    TEST_BLOCK_SIZE, NULL, 0);
+  fail_unless(res == 0, "Failed to send token: %s", strerror(errno));
+  plain_len = sizeof(buf) - len;
+
+  fail_unless(primed_len < plain_len,
+    "Expected primed stream (%lu bytes) to be smaller than unprimed (%lu)",
+    (unsigned long) primed_len, (unsigned long) plain_len);
+}
+END_TEST
+
+START_TEST (token_start_file_test) {
+  register unsigned int i;
+  int res;
+  const char *path = NULL;
+  struct rsync_policy_stats stats;
+  struct rsync_session *sess;
+  struct rsync_compress *comp;
+
+  mark_point();
+  res = rsync_token_start_file(p, NULL, NULL, NULL, 0);
+  fail_unless(res < 0, "Failed to handle null session");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  (void) unsetenv("SFTP_SERVER_COMPRESSION_ALGO");
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_ZLIB, 0);
+  comp = sess->compressor;
+
+  mark_point();
+  res = rsync_token_start_file(p, sess, "photo.jpg", NULL, 0);
+  fail_unless(res == 0, "Failed to start file: %s", strerror(errno));
+  fail_unless(comp->skip == TRUE, "Expected 'photo.jpg' to be skipped");
+
+  mark_point();
+  res = rsync_token_start_file(p, sess, "blocks.txt", blocks[0],
+    TEST_BLOCK_SIZE);
+  fail_unless(res == 0, "Failed to start file: %s", strerror(errno));
+  fail_unless(comp->skip == FALSE, "Expected 'blocks.txt' to be compressed");
+  fail_unless(rsync_token_is_compressing(sess) == TRUE,
+    "Expected 'blocks.txt' to be compressing");
+
+  /* Nor are files which did not compress before, given a policy store.  A
+   * file may be probed in this session, ignoring its history; but only one of
+   * these two paths (whose keys differ modulo the probe interval).
+   */
+  res = rsync_policy_open(policy_file);
+  fail_unless(res == 0, "Failed to open '%s': %s", policy_file,
+    strerror(errno));
+
+  memset(&stats, 0, sizeof(stats));
+  stats.raw_bytes = 100000;
+  stats.compressed_bytes = 99000;
+
+  for (i = 0; i < 2; i++) {
+    path = i == 0 ? "blocks.txt" : "blocks2.txt";
+    (void) rsync_policy_record(path, &stats);
+
+    if (rsync_policy_get_flags(path) & RSYNC_POLICY_FL_NO_COMPRESS) {
+      break;
+    }
+  }
+
+  mark_point();
+  res = rsync_token_start_file(p, sess, path, blocks[0], TEST_BLOCK_SIZE);
+  fail_unless(res == 0, "Failed to start file: %s", strerror(errno));
+  fail_unless(comp->skip == TRUE,
+    "Expected '%s' to be skipped, per its history", path);
+  fail_unless(rsync_token_is_compressing(sess) == FALSE,
+    "Expected '%s' not to be compressing", path);
+
+  (void) rsync_policy_close(p);
+  rsync_policy_clear();
+
+  mark_point();
+  res = rsync_token_start_file(p, sess, "random.dat", literal, 4096);
+  fail_unless(res == 0, "Failed to start file: %s", strerror(errno));
+  fail_unless(comp->skip == TRUE, "Expected 'random.dat' to be skipped");
+
+  /* When the SSH transport compresses, every file is skipped. */
+  (void) setenv("SFTP_SERVER_COMPRESSION_ALGO", "zlib@openssh.com", 1);
+  sess = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_ZLIB, 0);
+  comp = sess->compressor;
+
+  mark_point();
+  res = rsync_token_start_file(p, sess, "blocks.txt", blocks[0],
+    TEST_BLOCK_SIZE);
+  fail_unless(res == 0, "Failed to start file: %s", strerror(errno));
+  fail_unless(comp->skip == TRUE,
+    "Expected 'blocks.txt' to be skipped with compressing transport");
+
+  (void) unsetenv("SFTP_SERVER_COMPRESSION_ALGO");
+}
+END_TEST
+
+START_TEST (token_zstd_skip_test) {
+  register unsigned int i;
+  struct rsync_session *sender, *receiver;
+  unsigned char *buf, *ptr, *text;
+  uint32_t buflen, len, sent[3], textlen = 64 * 1024;
+  const char *paths[] = { "a.txt", "b.jpg", "c.txt" };
+  int res;
+
+  if (rsync_compress_supported(RSYNC_COMPRESS_ALGO_ZSTD) == FALSE) {
+    return;
+  }
+
+  /* The zstd stream continues across files, but a skipped file, even of
+   * compressible data, must not be compressed at the session's level; nor
+   * the files after it at the skipped level.
+   */
+  (void) unsetenv("SFTP_SERVER_COMPRESSION_ALGO");
+  sender = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_ZSTD, 0);
+  receiver = tests_create_session(p, 31, RSYNC_CHECKSUM_ALGO_NONE,
+    RSYNC_COMPRESS_ALGO_ZSTD, 0);
+
+  text = palloc(p, textlen);
+  for (i = 0; i < textlen; i++) {
+    text[i] = blocks[(i / TEST_BLOCK_SIZE) % TEST_NBLOCKS][i % TEST_BLOCK_SIZE];
+  }
+
+  buflen = 3 * rsync_token_send_bound(sender, textlen);
+  buf = ptr = palloc(p, buflen);
+  len = buflen;
+
+  for (i = 0; i < 3; i++) {
+    uint32_t startlen;
+
+    startlen = len;
+
+    mark_point();
+    res = rsync_token_start_file(p, sender, paths[i], text, TEST_BLOCK_SIZE);
+    fail_unless(res == 0, "Failed to start '%s': %s", paths[i],
+      strerror(errno));
+
+    res = rsync_token_send(p, sender, &ptr, &len, RSYNC_TOKEN_END, text,
+      textlen, NULL, 0);
+    fail_unless(res == 0, "Failed to send '%s': %s", paths[i],
+      strerror(errno));
+
+    sent[i] = startlen - len;
+  }
+
+  fail_unless(sent[0] < textlen / 10, "Expected '%s' to be compressed, "
+    "sent %lu bytes", paths[0], (unsigned long) sent[0]);
+  fail_unless(sent[1] > textlen - (textlen / 10), "Expected '%s' to be sent "
+    "nearly raw, sent %lu bytes", paths[1], (unsigned long) sent[1]);
+  fail_unless(sent[2] < textlen / 10, "Expected '%s' to be compressed, "
+    "sent %lu bytes", paths[2], (unsigned long) sent[2]);
+
+  ptr = buf;
+  len = buflen - len;
+
+  for (i = 0; i < 3; i++) {
+    mark_point();
+    recv_file(receiver, &ptr, &len, 1024, text, textlen);
+  }
+
+  fail_unless(len == 0, "Expected all input to be consumed, %lu bytes left",
+    (unsigned long) len);
+}
+END_TEST
+
+Suite *tests_get_token_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("token");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, token_send_test);
+  tcase_add_test(testcase, token_roundtrip_test);
+  tcase_add_test(testcase, token_zlib_dictionary_test);
+  tcase_add_test(testcase, token_start_file_test);
+  tcase_add_test(testcase, token_zstd_skip_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
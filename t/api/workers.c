@@ -0,0 +1,339 @@
+/*
+ * ProFTPD - mod_rsync testsuite
+ * Copyright (c) 2016 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+/* Worker pool API tests. */
+
+#include "tests.h"
+#include "workers.h"
+#include "checksum.h"
+
+static pool *p = NULL;
+
+struct test_job {
+  struct rsync_workers_job job;
+  unsigned int id;
+  unsigned int *seq;
+  volatile int *hold;
+  int fail;
+};
+
+static unsigned int lane_seq[2], lane_order[2][200];
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  memset(lane_seq, 0, sizeof(lane_seq));
+}
+
+static void tear_down(void) {
+  (void) rsync_workers_set_count(0);
+
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+static int test_job_run(struct rsync_workers_job *job) {
+  struct test_job *tj;
+
+  tj = (struct test_job *) job;
+
+  while (tj->hold != NULL &&
+         __atomic_load_n(tj->hold, __ATOMIC_ACQUIRE)) {
+  }
+
+  if (tj->seq != NULL) {
+    unsigned int lane;
+
+    lane = tj->id % 2;
+    lane_order[lane][lane_seq[lane]++] = tj->id;
+  }
+
+  if (tj->fail) {
+    errno = EPERM;
+    return -1;
+  }
+
+  return (int) tj->id;
+}
+
+START_TEST (workers_set_count_test) {
+  int res;
+
+  mark_point();
+  res = rsync_workers_set_count(RSYNC_WORKERS_MAX_COUNT + 1);
+  fail_unless(res < 0, "Failed to handle too many workers");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = rsync_workers_set_count(0);
+  fail_unless(res == 0, "Failed to set count: %s", strerror(errno));
+  fail_unless(rsync_workers_get_count() == 0, "Expected count 0, got %u",
+    rsync_workers_get_count());
+
+#ifdef HAVE_PTHREAD
+  mark_point();
+  res = rsync_workers_set_count(3);
+  fail_unless(res == 0, "Failed to set count: %s", strerror(errno));
+  fail_unless(rsync_workers_get_count() == 3, "Expected count 3, got %u",
+    rsync_workers_get_count());
+#endif /* HAVE_PTHREAD */
+}
+END_TEST
+
+START_TEST (workers_create_test) {
+  struct rsync_workers *workers;
+
+  mark_point();
+  workers = rsync_workers_create(NULL, 0);
+  fail_unless(workers == NULL, "Failed to handle null arguments");
+
+  mark_point();
+  workers = rsync_workers_create(p, 0);
+  fail_unless(workers == NULL, "Failed to handle zero workers");
+
+#ifdef HAVE_PTHREAD
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  workers = rsync_workers_create(p, 2);
+  fail_unless(workers != NULL, "Failed to create workers: %s",
+    strerror(errno));
+  fail_unless(rsync_workers_get_lanes(workers) == 2,
+    "Expected 2 lanes, got %u", rsync_workers_get_lanes(workers));
+
+  mark_point();
+  fail_unless(rsync_workers_destroy(workers) == 0,
+    "Failed to destroy workers: %s", strerror(errno));
+
+  /* Destroying the pool again, e.g. from its pool's cleanup, is harmless. */
+  mark_point();
+  fail_unless(rsync_workers_destroy(workers) == 0,
+    "Failed to destroy workers: %s", strerror(errno));
+#else
+  fail_unless(errno == ENOSYS, "Expected ENOSYS (%d), got %s (%d)", ENOSYS,
+    strerror(errno), errno);
+#endif /* HAVE_PTHREAD */
+}
+END_TEST
+
+#ifdef HAVE_PTHREAD
+START_TEST (workers_submit_test) {
+  register unsigned int i;
+  struct rsync_workers *workers;
+  struct test_job jobs[200], held[RSYNC_WORKERS_RING_SIZE + 2];
+  volatile int hold = TRUE;
+  unsigned int nheld = 0;
+  int res;
+
+  workers = rsync_workers_create(p, 2);
+  fail_unless(workers != NULL, "Failed to create workers: %s",
+    strerror(errno));
+
+  mark_point();
+  res = rsync_workers_submit(workers, 0, NULL);
+  fail_unless(res < 0, "Failed to handle null job");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* Each lane does its jobs in order. */
+  memset(jobs, 0, sizeof(jobs));
+  for (i = 0; i < 200; i++) {
+    jobs[i].job.run = test_job_run;
+    jobs[i].id = i;
+    jobs[i].seq = lane_seq;
+    jobs[i].fail = (i == 77);
+
+    /* Keep the rings from filling up. */
+    if (i >= 100) {
+      res = rsync_workers_wait(workers, &(jobs[i - 100].job));
+      fail_unless(res == (int) (i - 100) || i - 100 == 77,
+        "Job %u: unexpected result %d", i - 100, res);
+    }
+
+    mark_point();
+    res = rsync_workers_submit(workers, i, &(jobs[i].job));
+    fail_unless(res == 0, "Failed to submit job %u: %s", i, strerror(errno));
+  }
+
+  mark_point();
+  res = rsync_workers_submit(workers, 0, &(jobs[199].job));
+  fail_unless(res < 0, "Failed to handle job already queued");
+  fail_unless(errno == EBUSY, "Expected EBUSY (%d), got %s (%d)", EBUSY,
+    strerror(errno), errno);
+
+  for (i = 100; i < 200; i++) {
+    res = rsync_workers_wait(workers, &(jobs[i].job));
+    fail_unless(res == (int) i, "Job %u: unexpected result %d", i, res);
+  }
+
+  mark_point();
+  res = rsync_workers_wait(workers, &(jobs[77].job));
+  fail_unless(res < 0, "Expected job 77 to fail");
+  fail_unless(errno == EPERM, "Expected EPERM (%d), got %s (%d)", EPERM,
+    strerror(errno), errno);
+
+  for (i = 0; i < 2; i++) {
+    register unsigned int j;
+
+    fail_unless(lane_seq[i] == 100, "Lane %u: expected 100 jobs, got %u", i,
+      lane_seq[i]);
+    for (j = 0; j < 100; j++) {
+      fail_unless(lane_order[i][j] == (j * 2) + i,
+        "Lane %u: job %u done out of order", i, lane_order[i][j]);
+    }
+  }
+
+  /* With its worker held up, a lane's ring fills up. */
+  memset(held, 0, sizeof(held));
+  for (i = 0; i < RSYNC_WORKERS_RING_SIZE + 2; i++) {
+    held[i].job.run = test_job_run;
+    held[i].id = i;
+    held[i].hold = &hold;
+
+    res = rsync_workers_submit(workers, 0, &(held[i].job));
+    if (res < 0) {
+      fail_unless(errno == EAGAIN, "Expected EAGAIN (%d), got %s (%d)",
+        EAGAIN, strerror(errno), errno);
+      break;
+    }
+
+    nheld++;
+  }
+
+  fail_unless(nheld >= RSYNC_WORKERS_RING_SIZE &&
+    nheld <= RSYNC_WORKERS_RING_SIZE + 1, "Expected full ring, queued %u",
+    nheld);
+
+  __atomic_store_n(&hold, FALSE, __ATOMIC_RELEASE);
+
+  for (i = 0; i < nheld; i++) {
+    res = rsync_workers_wait(workers, &(held[i].job));
+    fail_unless(res == (int) i, "Job %u: unexpected result %d", i, res);
+  }
+
+  mark_point();
+  fail_unless(rsync_workers_destroy(workers) == 0,
+    "Failed to destroy workers: %s", strerror(errno));
+
+  mark_point();
+  res = rsync_workers_submit(workers, 0, &(jobs[0].job));
+  fail_unless(res < 0, "Failed to handle stopped workers");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+}
+END_TEST
+
+START_TEST (workers_checksum_test) {
+  register unsigned int i;
+  struct rsync_workers *workers;
+  struct rsync_workers_checksum *wck;
+  struct rsync_checksum *ck, *expected;
+  unsigned char *data, digest[RSYNC_CHECKSUM_MAX_DIGEST_LEN],
+    expected_digest[RSYNC_CHECKSUM_MAX_DIGEST_LEN];
+  size_t datalen, digest_len, offset = 0;
+  uint32_t seed = 17;
+  int res;
+
+  workers = rsync_workers_create(p, 1);
+  fail_unless(workers != NULL, "Failed to create workers: %s",
+    strerror(errno));
+
+  ck = rsync_checksum_create(p, RSYNC_CHECKSUM_ALGO_MD5, 0);
+  expected = rsync_checksum_create(p, RSYNC_CHECKSUM_ALGO_MD5, 0);
+
+  mark_point();
+  wck = rsync_workers_checksum_create(NULL, NULL, NULL);
+  fail_unless(wck == NULL, "Failed to handle null arguments");
+  fail_unless(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  wck = rsync_workers_checksum_create(p, workers, ck);
+  fail_unless(wck != NULL, "Failed to create checksum: %s", strerror(errno));
+
+  /* Enough data to cycle through the buffers several times. */
+  datalen = (RSYNC_WORKERS_CHECKSUM_BUFFER_SIZE *
+    RSYNC_WORKERS_CHECKSUM_BUFFER_COUNT * 3) + 12345;
+  data = palloc(p, datalen);
+  for (i = 0; i < datalen; i++) {
+    seed = (seed * 1103515245) + 12345;
+    data[i] = (unsigned char) (seed >> 16);
+  }
+
+  while (offset < datalen) {
+    size_t len;
+
+    len = (offset % 100003) + 1;
+    if (len > datalen - offset) {
+      len = datalen - offset;
+    }
+
+    res = rsync_workers_checksum_update(wck, data + offset, len);
+    fail_unless(res == 0, "Failed to update checksum: %s", strerror(errno));
+    offset += len;
+  }
+
+  mark_point();
+  res = rsync_workers_checksum_flush(wck);
+  fail_unless(res == 0, "Failed to flush checksum: %s", strerror(errno));
+
+  digest_len = rsync_checksum_finish(ck, digest);
+
+  rsync_checksum_update(expected, data, datalen);
+  rsync_checksum_finish(expected, expected_digest);
+
+  fail_unless(memcmp(digest, expected_digest, digest_len) == 0,
+    "Checksum does not match");
+
+  (void) rsync_workers_destroy(workers);
+}
+END_TEST
+#endif /* HAVE_PTHREAD */
+
+Suite *tests_get_workers_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("workers");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, workers_set_count_test);
+  tcase_add_test(testcase, workers_create_test);
+#ifdef HAVE_PTHREAD
+  tcase_add_test(testcase, workers_submit_test);
+  tcase_add_test(testcase, workers_checksum_test);
+#endif /* HAVE_PTHREAD */
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
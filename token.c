@@ -0,0 +1,880 @@
+/*
+ * ProFTPD - mod_rsync tokens
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_rsync.h"
+#include "token.h"
+#include "compress.h"
+#include "msg.h"
+#include "policy.h"
+
+static const char *trace_channel = "rsync.token";
+
+/* Flag bytes in the compressed token stream; see rsync-${version}/token.c. */
+#define TOKEN_FL_END			0x00
+#define TOKEN_FL_LONG			0x20
+#define TOKEN_FL_RUN_LONG		0x21
+#define TOKEN_FL_DEFLATED_DATA		0x40
+#define TOKEN_FL_REL			0x80
+#define TOKEN_FL_RUN_REL		0xc0
+
+/* The length of compressed data must fit into 14 bits. */
+#define TOKEN_MAX_DATA_COUNT		16383
+
+/* rsync feeds matched data to the compressor in pieces of at most this
+ * size.
+ */
+#define TOKEN_MAX_SEE_LEN		0xffff
+
+/* Decompressed data is returned in pieces of at most this size. */
+#define TOKEN_DBUF_SIZE			\
+  ((RSYNC_TOKEN_CHUNK_SIZE * 1001 / 1000) + 16)
+
+/* Receiver states */
+#define TOKEN_RECV_INIT			0
+#define TOKEN_RECV_IDLE			1
+#define TOKEN_RECV_RUNNING		2
+#define TOKEN_RECV_INFLATING		3
+#define TOKEN_RECV_INFLATED		4
+
+struct token_state {
+  /* Sender state */
+  int transport_compressed;
+  int32_t last_token;
+  int32_t run_start;
+  int32_t last_run_end;
+  int flush_pending;
+  int obuf_active;
+  unsigned char obuf[TOKEN_MAX_DATA_COUNT + 2];
+
+  /* Receiver state */
+  int recv_state;
+  int32_t rx_token;
+  int32_t rx_run;
+  uint32_t residue;
+  unsigned char *cbuf;
+  unsigned char *dbuf;
+
+  /* Partial tokens, retained until the rest of the token arrives. */
+  unsigned char pending[TOKEN_MAX_DATA_COUNT + 2];
+  uint32_t pendinglen;
+};
+
+static struct token_state *get_token_state(struct rsync_session *sess) {
+  struct token_state *st;
+
+  st = sess->tokens;
+  if (st == NULL) {
+    st = pcalloc(sess->pool, sizeof(struct token_state));
+    st->transport_compressed = -1;
+    st->last_token = -1;
+    st->recv_state = TOKEN_RECV_INIT;
+    sess->tokens = st;
+  }
+
+  return st;
+}
+
+static struct rsync_compress *get_compressor(struct rsync_session *sess) {
+  if (sess->compress_algo == RSYNC_COMPRESS_ALGO_NONE) {
+    return NULL;
+  }
+
+  return sess->compressor;
+}
+
+uint32_t rsync_token_send_bound(struct rsync_session *sess, uint32_t datalen) {
+  if (get_compressor(sess) == NULL) {
+    /* A length for every chunk of data, and the token itself. */
+    return datalen + (((datalen / RSYNC_TOKEN_CHUNK_SIZE) + 1) * 4) + 4;
+  }
+
+  /* Worst-case expansion of incompressible data, plus two bytes of header
+   * for each piece of compressed data, plus any compressed data left over
+   * from the previous call, plus the run/token bytes.
+   */
+  return datalen + (datalen / 8) + TOKEN_MAX_DATA_COUNT + 64;
+}
+
+int rsync_token_start_file(pool *p, struct rsync_session *sess,
+    const char *path, const unsigned char *data, uint32_t datalen) {
+  struct rsync_compress *comp;
+  struct token_state *st;
+  int skip = FALSE;
+
+  if (p == NULL ||
+      sess == NULL ||
+      path == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  comp = get_compressor(sess);
+  if (comp == NULL) {
+    return 0;
+  }
+
+  st = get_token_state(sess);
+
+  if (st->transport_compressed == -1) {
+    st->transport_compressed = rsync_compress_transport_compressed(p);
+    if (st->transport_compressed == TRUE) {
+      pr_trace_msg(trace_channel, 9,
+        "SSH transport is compressing, skipping compression of file data");
+    }
+  }
+
+  if (st->transport_compressed == TRUE) {
+    skip = TRUE;
+
+  } else if (rsync_compress_skip_path(path) == TRUE) {
+    skip = TRUE;
+
+  } else if (rsync_policy_get_flags(path) & RSYNC_POLICY_FL_NO_COMPRESS) {
+    pr_trace_msg(trace_channel, 17,
+      "data of '%s' has not compressed before, skipping compression", path);
+    skip = TRUE;
+
+  } else if (data != NULL &&
+             rsync_compress_probe(data, datalen) == FALSE) {
+    pr_trace_msg(trace_channel, 17,
+      "data of '%s' appears to be compressed already, skipping compression",
+      path);
+    skip = TRUE;
+  }
+
+  return rsync_compress_set_skip(comp, skip);
+}
+
+int rsync_token_is_compressing(struct rsync_session *sess) {
+  struct rsync_compress *comp;
+
+  if (sess == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  comp = get_compressor(sess);
+  if (comp == NULL ||
+      comp->skip == TRUE) {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+const char *rsync_token_get_error(struct rsync_session *sess) {
+  struct rsync_compress *comp;
+
+  if (sess == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  comp = get_compressor(sess);
+  if (comp == NULL ||
+      comp->deflate_error == NULL) {
+    return "unknown error";
+  }
+
+  return comp->deflate_error;
+}
+
+static int simple_send(struct rsync_session *sess, unsigned char **buf,
+    uint32_t *buflen, int32_t token, const unsigned char *data,
+    uint32_t datalen) {
+  uint32_t len = 0;
+
+  while (len < datalen) {
+    uint32_t n;
+
+    n = datalen - len;
+    if (n > RSYNC_TOKEN_CHUNK_SIZE) {
+      n = RSYNC_TOKEN_CHUNK_SIZE;
+    }
+
+    rsync_msg_write_int(buf, buflen, (int32_t) n);
+    rsync_msg_write_data(buf, buflen, data + len, n);
+    len += n;
+  }
+
+  if (token != RSYNC_TOKEN_DATA_ONLY) {
+    /* Note that the END token is thus written as zero. */
+    rsync_msg_write_int(buf, buflen, -(token + 1));
+  }
+
+  return 0;
+}
+
+/* Writes out the previous run of matched tokens, if any. */
+static void write_run(struct token_state *st, unsigned char **buf,
+    uint32_t *buflen, int32_t token, uint32_t datalen) {
+
+  if (st->last_token == -1) {
+    /* The first token of a file. */
+    st->last_run_end = 0;
+    st->run_start = token;
+    st->flush_pending = FALSE;
+
+  } else if (st->last_token == RSYNC_TOKEN_DATA_ONLY) {
+    st->run_start = token;
+
+  } else if (datalen > 0 ||
+             token != st->last_token + 1 ||
+             token >= st->run_start + 65536) {
+    int32_t r, n;
+
+    r = st->run_start - st->last_run_end;
+    n = st->last_token - st->run_start;
+
+    if (r >= 0 && r <= 63) {
+      rsync_msg_write_byte(buf, buflen,
+        (char) ((n == 0 ? TOKEN_FL_REL : TOKEN_FL_RUN_REL) + r));
+
+    } else {
+      rsync_msg_write_byte(buf, buflen,
+        (char) (n == 0 ? TOKEN_FL_LONG : TOKEN_FL_RUN_LONG));
+      rsync_msg_write_int(buf, buflen, st->run_start);
+    }
+
+    if (n != 0) {
+      rsync_msg_write_byte(buf, buflen, (char) (n & 0xff));
+      rsync_msg_write_byte(buf, buflen, (char) ((n >> 8) & 0xff));
+    }
+
+    st->last_run_end = st->last_token;
+    st->run_start = token;
+  }
+
+  st->last_token = token;
+}
+
+static void write_deflated(struct token_state *st, unsigned char **buf,
+    uint32_t *buflen, uint32_t n) {
+  st->obuf[0] = (unsigned char) (TOKEN_FL_DEFLATED_DATA + (n >> 8));
+  st->obuf[1] = (unsigned char) (n & 0xff);
+  rsync_msg_write_data(buf, buflen, st->obuf, n + 2);
+}
+
+/* Notes: see rsync-${version}/token.c#send_deflated_token(). */
+static int zlib_send(struct rsync_session *sess, struct rsync_compress *comp,
+    struct token_state *st, unsigned char **buf, uint32_t *buflen,
+    int32_t token, const unsigned char *data, uint32_t datalen,
+    const unsigned char *block, uint32_t blocklen) {
+
+  if (st->last_token == -1) {
+    /* Restart the stream for each file, as the receiver will. */
+    rsync_compress_reset(comp);
+  }
+
+  write_run(st, buf, buflen, token, datalen);
+
+  if (datalen > 0 ||
+      st->flush_pending) {
+    int flags = RSYNC_COMPRESS_FL_CONTINUE;
+    uint32_t remaining = datalen;
+
+    comp->next_in = data;
+    comp->avail_in = 0;
+    comp->avail_out = 0;
+
+    do {
+      if (comp->avail_in == 0 &&
+          remaining > 0) {
+        uint32_t n;
+
+        n = remaining;
+        if (n > RSYNC_TOKEN_CHUNK_SIZE) {
+          n = RSYNC_TOKEN_CHUNK_SIZE;
+        }
+
+        comp->avail_in = n;
+        remaining -= n;
+      }
+
+      if (comp->avail_out == 0) {
+        comp->next_out = st->obuf + 2;
+        comp->avail_out = TOKEN_MAX_DATA_COUNT;
+
+        if (flags != RSYNC_COMPRESS_FL_CONTINUE) {
+          /* We held back the last 4 bytes of the previous (full) buffer,
+           * in case they were the flush trailer; move them to the front.
+           */
+          memmove(comp->next_out, st->obuf + TOKEN_MAX_DATA_COUNT - 2, 4);
+          comp->next_out += 4;
+          comp->avail_out -= 4;
+        }
+      }
+
+      if (remaining == 0 &&
+          token != RSYNC_TOKEN_DATA_ONLY) {
+        flags = RSYNC_COMPRESS_FL_FLUSH;
+      }
+
+      if (rsync_compress_deflate(comp, flags) < 0) {
+        return -1;
+      }
+
+      if (remaining == 0 ||
+          comp->avail_out == 0) {
+        int32_t n;
+
+        n = TOKEN_MAX_DATA_COUNT - comp->avail_out;
+        if (flags != RSYNC_COMPRESS_FL_CONTINUE) {
+          /* Trim the 00 00 ff ff trailer of the flush; the receiver knows
+           * to expect it.
+           */
+          n -= 4;
+        }
+
+        if (n > 0) {
+          write_deflated(st, buf, buflen, (uint32_t) n);
+        }
+      }
+    } while (remaining > 0 ||
+             comp->avail_out == 0);
+
+    st->flush_pending = (token == RSYNC_TOKEN_DATA_ONLY);
+  }
+
+  if (token == RSYNC_TOKEN_END) {
+    rsync_msg_write_byte(buf, buflen, TOKEN_FL_END);
+
+  } else if (token != RSYNC_TOKEN_DATA_ONLY &&
+             comp->algo == RSYNC_COMPRESS_ALGO_ZLIB &&
+             block != NULL) {
+    const unsigned char *ptr = block;
+
+    /* Add the matched block to the compressor's history, without sending
+     * it.  Older protocol versions repeatedly add the first piece of the
+     * block, rather than advancing; the receiver does the same.
+     */
+    while (blocklen > 0) {
+      uint32_t n;
+
+      n = blocklen > TOKEN_MAX_SEE_LEN ? TOKEN_MAX_SEE_LEN : blocklen;
+      if (rsync_compress_prime_deflate(comp, ptr, n) < 0) {
+        return -1;
+      }
+
+      blocklen -= n;
+      if (sess->protocol_version >= 31) {
+        ptr += n;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* Notes: see rsync-${version}/token.c#send_zstd_token().  Unlike zlib, the
+ * zstd stream continues across files, and partially filled output buffers
+ * are held until full or flushed.
+ */
+static int zstd_send(struct rsync_session *sess, struct rsync_compress *comp,
+    struct token_state *st, unsigned char **buf, uint32_t *buflen,
+    int32_t token, const unsigned char *data, uint32_t datalen) {
+
+  if (st->last_token == -1) {
+    /* The stream continues, but the level may change for this file. */
+    rsync_compress_reset(comp);
+  }
+
+  write_run(st, buf, buflen, token, datalen);
+
+  if (datalen > 0 ||
+      st->flush_pending) {
+    int flags = RSYNC_COMPRESS_FL_CONTINUE, res;
+
+    comp->next_in = data;
+    comp->avail_in = datalen;
+
+    do {
+      if (st->obuf_active == FALSE) {
+        comp->next_out = st->obuf + 2;
+        comp->avail_out = TOKEN_MAX_DATA_COUNT;
+        st->obuf_active = TRUE;
+      }
+
+      if (token != RSYNC_TOKEN_DATA_ONLY) {
+        flags = RSYNC_COMPRESS_FL_FLUSH;
+      }
+
+      res = rsync_compress_deflate(comp, flags);
+      if (res < 0) {
+        return -1;
+      }
+
+      /* Only send full buffers, unless flushing. */
+      if (comp->avail_out == 0 ||
+          flags == RSYNC_COMPRESS_FL_FLUSH) {
+        write_deflated(st, buf, buflen,
+          (uint32_t) (TOKEN_MAX_DATA_COUNT - comp->avail_out));
+        st->obuf_active = FALSE;
+      }
+    } while (comp->avail_in > 0 ||
+             res == 1);
+
+    st->flush_pending = (token == RSYNC_TOKEN_DATA_ONLY);
+  }
+
+  if (token == RSYNC_TOKEN_END) {
+    rsync_msg_write_byte(buf, buflen, TOKEN_FL_END);
+  }
+
+  return 0;
+}
+
+/* Notes: see rsync-${version}/token.c#send_compressed_token().  Each lz4
+ * block is compressed independently.
+ */
+static int lz4_send(struct rsync_session *sess, struct rsync_compress *comp,
+    struct token_state *st, unsigned char **buf, uint32_t *buflen,
+    int32_t token, const unsigned char *data, uint32_t datalen) {
+
+  write_run(st, buf, buflen, token, datalen);
+
+  comp->next_in = data;
+  comp->avail_in = datalen;
+
+  while (comp->avail_in > 0) {
+    comp->next_out = st->obuf + 2;
+    comp->avail_out = TOKEN_MAX_DATA_COUNT;
+
+    if (rsync_compress_deflate(comp, RSYNC_COMPRESS_FL_FLUSH) < 0) {
+      return -1;
+    }
+
+    write_deflated(st, buf, buflen,
+      (uint32_t) (TOKEN_MAX_DATA_COUNT - comp->avail_out));
+  }
+
+  if (token == RSYNC_TOKEN_END) {
+    rsync_msg_write_byte(buf, buflen, TOKEN_FL_END);
+  }
+
+  return 0;
+}
+
+int rsync_token_send(pool *p, struct rsync_session *sess, unsigned char **buf,
+    uint32_t *buflen, int32_t token, const unsigned char *data,
+    uint32_t datalen, const unsigned char *block, uint32_t blocklen) {
+  struct rsync_compress *comp;
+  struct token_state *st;
+
+  if (sess == NULL ||
+      buf == NULL ||
+      buflen == NULL ||
+      (data == NULL && datalen > 0) ||
+      token < RSYNC_TOKEN_DATA_ONLY) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  comp = get_compressor(sess);
+  if (comp == NULL) {
+    return simple_send(sess, buf, buflen, token, data, datalen);
+  }
+
+  st = get_token_state(sess);
+
+  switch (comp->algo) {
+    case RSYNC_COMPRESS_ALGO_ZLIB:
+    case RSYNC_COMPRESS_ALGO_ZLIBX:
+      return zlib_send(sess, comp, st, buf, buflen, token, data, datalen,
+        block, blocklen);
+
+    case RSYNC_COMPRESS_ALGO_ZSTD:
+      return zstd_send(sess, comp, st, buf, buflen, token, data, datalen);
+
+    case RSYNC_COMPRESS_ALGO_LZ4:
+      return lz4_send(sess, comp, st, buf, buflen, token, data, datalen);
+
+    default:
+      break;
+  }
+
+  errno = ENOSYS;
+  return -1;
+}
+
+int rsync_token_send_direct(struct rsync_session *sess, unsigned char **buf,
+    uint32_t *buflen, uint32_t datalen) {
+
+  if (sess == NULL ||
+      buf == NULL ||
+      buflen == NULL ||
+      datalen == 0 ||
+      datalen > RSYNC_TOKEN_CHUNK_SIZE) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (get_compressor(sess) != NULL) {
+    errno = ENOTSUP;
+    return -1;
+  }
+
+  rsync_msg_write_int(buf, buflen, (int32_t) datalen);
+  return 0;
+}
+
+/* Makes the next len bytes of input available, contiguously, at *ptr, without
+ * consuming them.  If there are not yet enough bytes, whatever input remains
+ * is retained, and EAGAIN is returned.
+ */
+static int token_peek(struct token_state *st, unsigned char **buf,
+    uint32_t *buflen, uint32_t len, unsigned char **ptr) {
+
+  if (st->pendinglen == 0 &&
+      *buflen >= len) {
+    *ptr = *buf;
+    return 0;
+  }
+
+  if (st->pendinglen < len) {
+    uint32_t n;
+
+    n = len - st->pendinglen;
+    if (n > *buflen) {
+      n = *buflen;
+    }
+
+    memcpy(st->pending + st->pendinglen, *buf, n);
+    st->pendinglen += n;
+    (*buf) += n;
+    (*buflen) -= n;
+  }
+
+  if (st->pendinglen < len) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  *ptr = st->pending;
+  return 0;
+}
+
+static void token_consume(struct token_state *st, unsigned char **buf,
+    uint32_t *buflen, uint32_t len) {
+
+  if (st->pendinglen > 0) {
+    st->pendinglen -= len;
+    if (st->pendinglen > 0) {
+      memmove(st->pending, st->pending + len, st->pendinglen);
+    }
+
+    return;
+  }
+
+  (*buf) += len;
+  (*buflen) -= len;
+}
+
+static uint32_t token_get_int(const unsigned char *ptr) {
+  return ((uint32_t) ptr[0]) |
+         ((uint32_t) ptr[1] << 8) |
+         ((uint32_t) ptr[2] << 16) |
+         ((uint32_t) ptr[3] << 24);
+}
+
+/* Notes: see rsync-${version}/token.c#simple_recv_token().  Literal data is
+ * returned directly from the caller's buffer.
+ */
+static int simple_recv(struct token_state *st, unsigned char **buf,
+    uint32_t *buflen, int32_t *token, unsigned char **data,
+    uint32_t *datalen) {
+
+  if (st->residue == 0) {
+    unsigned char *ptr;
+    int32_t i;
+
+    if (token_peek(st, buf, buflen, 4, &ptr) < 0) {
+      return -1;
+    }
+
+    i = (int32_t) token_get_int(ptr);
+    token_consume(st, buf, buflen, 4);
+
+    if (i == 0) {
+      return RSYNC_TOKEN_RECV_END;
+    }
+
+    if (i < 0) {
+      *token = -i - 1;
+      return RSYNC_TOKEN_RECV_BLOCK;
+    }
+
+    st->residue = (uint32_t) i;
+  }
+
+  if (*buflen == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  *data = *buf;
+  *datalen = st->residue < *buflen ? st->residue : *buflen;
+
+  st->residue -= *datalen;
+  (*buf) += *datalen;
+  (*buflen) -= *datalen;
+
+  return RSYNC_TOKEN_RECV_DATA;
+}
+
+/* Notes: see rsync-${version}/token.c#recv_deflated_token(), and its zstd
+ * and lz4 siblings.
+ */
+static int compressed_recv(struct rsync_session *sess,
+    struct rsync_compress *comp, struct token_state *st, unsigned char **buf,
+    uint32_t *buflen, int32_t *token, unsigned char **data,
+    uint32_t *datalen) {
+  int is_zlib;
+
+  is_zlib = (comp->algo == RSYNC_COMPRESS_ALGO_ZLIB ||
+             comp->algo == RSYNC_COMPRESS_ALGO_ZLIBX);
+
+  if (st->dbuf == NULL) {
+    st->cbuf = palloc(sess->pool, TOKEN_MAX_DATA_COUNT);
+    st->dbuf = palloc(sess->pool, TOKEN_DBUF_SIZE);
+  }
+
+  while (TRUE) {
+    unsigned char *ptr;
+    uint32_t n, len;
+    int flag, run;
+
+    pr_signals_handle();
+
+    switch (st->recv_state) {
+      case TOKEN_RECV_INIT:
+        rsync_compress_reset(comp);
+        st->recv_state = TOKEN_RECV_IDLE;
+        st->rx_token = 0;
+        break;
+
+      case TOKEN_RECV_IDLE:
+      case TOKEN_RECV_INFLATED:
+        if (token_peek(st, buf, buflen, 1, &ptr) < 0) {
+          return -1;
+        }
+
+        flag = ptr[0];
+
+        if ((flag & 0xc0) == TOKEN_FL_DEFLATED_DATA) {
+          if (token_peek(st, buf, buflen, 2, &ptr) < 0) {
+            return -1;
+          }
+
+          n = ((flag & 0x3f) << 8) + ptr[1];
+          if (token_peek(st, buf, buflen, n + 2, &ptr) < 0) {
+            return -1;
+          }
+
+          memcpy(st->cbuf, ptr + 2, n);
+          token_consume(st, buf, buflen, n + 2);
+
+          comp->next_in = st->cbuf;
+          comp->avail_in = n;
+          st->recv_state = TOKEN_RECV_INFLATING;
+          break;
+        }
+
+        if (st->recv_state == TOKEN_RECV_INFLATED &&
+            is_zlib) {
+          /* Return any data still buffered in the decompressor, before
+           * handling this (unconsumed) flag.
+           */
+          comp->avail_in = 0;
+          comp->next_out = st->dbuf;
+          comp->avail_out = TOKEN_DBUF_SIZE;
+
+          if (rsync_compress_inflate(comp) < 0) {
+            return -1;
+          }
+
+          n = TOKEN_DBUF_SIZE - comp->avail_out;
+          if (n > 0) {
+            *data = st->dbuf;
+            *datalen = n;
+            return RSYNC_TOKEN_RECV_DATA;
+          }
+
+          if (rsync_compress_inflate_sync(comp) < 0) {
+            (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+              "compressed file data did not end at sync point");
+            errno = EIO;
+            return -1;
+          }
+        }
+
+        st->recv_state = TOKEN_RECV_IDLE;
+
+        if (flag == TOKEN_FL_END) {
+          token_consume(st, buf, buflen, 1);
+          st->recv_state = TOKEN_RECV_INIT;
+          return RSYNC_TOKEN_RECV_END;
+        }
+
+        if (flag & TOKEN_FL_REL) {
+          run = (flag >> 6) & 0x01;
+          len = 1;
+
+        } else {
+          run = flag & 0x01;
+          len = 5;
+        }
+
+        if (run) {
+          len += 2;
+        }
+
+        if (token_peek(st, buf, buflen, len, &ptr) < 0) {
+          return -1;
+        }
+
+        if (flag & TOKEN_FL_REL) {
+          st->rx_token += flag & 0x3f;
+
+        } else {
+          st->rx_token = (int32_t) token_get_int(ptr + 1);
+        }
+
+        if (run) {
+          st->rx_run = ptr[len - 2] + (ptr[len - 1] << 8);
+          st->recv_state = TOKEN_RECV_RUNNING;
+        }
+
+        token_consume(st, buf, buflen, len);
+
+        *token = st->rx_token;
+        return RSYNC_TOKEN_RECV_BLOCK;
+
+      case TOKEN_RECV_INFLATING:
+        comp->next_out = st->dbuf;
+        comp->avail_out = TOKEN_DBUF_SIZE;
+
+        if (rsync_compress_inflate(comp) < 0) {
+          (void) pr_log_writefile(rsync_logfd, MOD_RSYNC_VERSION,
+            "error decompressing file data: %s", strerror(errno));
+          return -1;
+        }
+
+        n = TOKEN_DBUF_SIZE - comp->avail_out;
+
+        if (comp->avail_in == 0) {
+          if (comp->algo == RSYNC_COMPRESS_ALGO_ZSTD) {
+            if (n < TOKEN_DBUF_SIZE) {
+              st->recv_state = TOKEN_RECV_IDLE;
+            }
+
+          } else {
+            st->recv_state = TOKEN_RECV_INFLATED;
+          }
+        }
+
+        if (n > 0) {
+          *data = st->dbuf;
+          *datalen = n;
+          return RSYNC_TOKEN_RECV_DATA;
+        }
+        break;
+
+      case TOKEN_RECV_RUNNING:
+        st->rx_token++;
+        if (--st->rx_run == 0) {
+          st->recv_state = TOKEN_RECV_IDLE;
+        }
+
+        *token = st->rx_token;
+        return RSYNC_TOKEN_RECV_BLOCK;
+
+      default:
+        pr_trace_msg(trace_channel, 3, "unknown token receive state %d",
+          st->recv_state);
+        errno = EINVAL;
+        return -1;
+    }
+  }
+}
+
+int rsync_token_recv(pool *p, struct rsync_session *sess, unsigned char **buf,
+    uint32_t *buflen, int32_t *token, unsigned char **data,
+    uint32_t *datalen) {
+  struct rsync_compress *comp;
+  struct token_state *st;
+
+  if (sess == NULL ||
+      buf == NULL ||
+      buflen == NULL ||
+      token == NULL ||
+      data == NULL ||
+      datalen == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  st = get_token_state(sess);
+
+  comp = get_compressor(sess);
+  if (comp == NULL) {
+    return simple_recv(st, buf, buflen, token, data, datalen);
+  }
+
+  return compressed_recv(sess, comp, st, buf, buflen, token, data, datalen);
+}
+
+/* Notes: see rsync-${version}/token.c#see_deflate_token(). */
+int rsync_token_see(struct rsync_session *sess, const unsigned char *block,
+    uint32_t blocklen) {
+  struct rsync_compress *comp;
+
+  if (sess == NULL ||
+      block == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  comp = get_compressor(sess);
+  if (comp == NULL ||
+      comp->algo != RSYNC_COMPRESS_ALGO_ZLIB) {
+    return 0;
+  }
+
+  while (blocklen > 0) {
+    uint32_t n;
+
+    n = blocklen > TOKEN_MAX_SEE_LEN ? TOKEN_MAX_SEE_LEN : blocklen;
+    if (rsync_compress_prime_inflate(comp, block, n) < 0) {
+      return -1;
+    }
+
+    blocklen -= n;
+    if (sess->protocol_version >= 31) {
+      block += n;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * ProFTPD - mod_rsync tokens
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_RSYNC_TOKEN_H
+#define MOD_RSYNC_TOKEN_H
+
+#include "mod_rsync.h"
+#include "session.h"
+
+/* File deltas are sent as a stream of "tokens": runs of literal data, and
+ * references to blocks of the receiver's basis file.  Without compression,
+ * these are simple length-prefixed chunks; with compression, they use the
+ * flag-byte format of rsync-${version}/token.c.
+ */
+
+/* Special token values for rsync_token_send(). */
+#define RSYNC_TOKEN_END			-1
+#define RSYNC_TOKEN_DATA_ONLY		-2
+
+/* Return values for rsync_token_recv(). */
+#define RSYNC_TOKEN_RECV_END		0
+#define RSYNC_TOKEN_RECV_DATA		1
+#define RSYNC_TOKEN_RECV_BLOCK		2
+
+/* Literal data is sent in chunks of at most this size. */
+#define RSYNC_TOKEN_CHUNK_SIZE		(32 * 1024)
+
+/* Returns the amount of buffer space that rsync_token_send() may need, at
+ * most, for the given amount of literal data.
+ */
+uint32_t rsync_token_send_bound(struct rsync_session *sess, uint32_t datalen);
+
+/* Called before sending the tokens of each file, with the file's path and
+ * its first block of data, if available.  Decides whether the file's data is
+ * worth compressing: it is not if the path matches the skip-compress suffix
+ * list, if the file has not compressed before (see policy.h), if the data
+ * appears to be compressed already, or if the SSH transport is itself
+ * compressing.
+ */
+int rsync_token_start_file(pool *p, struct rsync_session *sess,
+  const char *path, const unsigned char *data, uint32_t datalen);
+
+/* Returns TRUE if the current file's literal data is being compressed,
+ * i.e. compression is in use, and rsync_token_start_file() did not skip it.
+ */
+int rsync_token_is_compressing(struct rsync_session *sess);
+
+/* Returns why compressing file data last failed, for logging. */
+const char *rsync_token_get_error(struct rsync_session *sess);
+
+/* Writes the given literal data, if any, followed by the given token:
+ * a block index, RSYNC_TOKEN_END at the end of the file, or
+ * RSYNC_TOKEN_DATA_ONLY to send only the data.
+ *
+ * For block tokens, the matched block's data should also be provided; it is
+ * not sent, but, when compressing with zlib, is added to the compressor's
+ * history.  This may be called from a worker thread (see workers.h), so
+ * errors are not logged here; see rsync_token_get_error().
+ */
+int rsync_token_send(pool *p, struct rsync_session *sess, unsigned char **buf,
+  uint32_t *buflen, int32_t token, const unsigned char *data,
+  uint32_t datalen, const unsigned char *block, uint32_t blocklen);
+
+/* Without compression, literal data is sent as-is, after a length prefix.
+ * This writes the prefix for a chunk of at most RSYNC_TOKEN_CHUNK_SIZE bytes,
+ * so that the caller can then send the data itself directly, e.g. from a
+ * mapped file, rather than copying it into the buffer.  Returns -1, with
+ * errno set to ENOTSUP, if the data must go through rsync_token_send().
+ */
+int rsync_token_send_direct(struct rsync_session *sess, unsigned char **buf,
+  uint32_t *buflen, uint32_t datalen);
+
+/* Reads the next token from the given buffer.  Returns RSYNC_TOKEN_RECV_DATA,
+ * with the literal data in data/datalen; RSYNC_TOKEN_RECV_BLOCK, with the
+ * block index in token; or RSYNC_TOKEN_RECV_END at the end of the file.
+ *
+ * Returns -1, with errno set to EAGAIN, if more data is needed; any partial
+ * token is retained until the next call.
+ */
+int rsync_token_recv(pool *p, struct rsync_session *sess, unsigned char **buf,
+  uint32_t *buflen, int32_t *token, unsigned char **data, uint32_t *datalen);
+
+/* When receiving with zlib compression, the data of each matched block must
+ * be added to the decompressor's history, once the block has been read from
+ * the basis file.
+ */
+int rsync_token_see(struct rsync_session *sess, const unsigned char *block,
+  uint32_t blocklen);
+
+#endif /* MOD_RSYNC_TOKEN_H */
@@ -130,10 +130,32 @@ int rsync_version_handle_data(pool *p, struct rsync_session *sess,
       compat_flags |= RSYNC_VERSION_COMPAT_FL_INCR_RECURSE;
     }
 
+    /* Only advertise the capabilities which the client has told us, via its
+     * "-e.xxx" client info, that it supports.
+     */
+    if (opts->client_info != NULL) {
+      if (strchr(opts->client_info, 'C') != NULL) {
+        compat_flags |= RSYNC_VERSION_COMPAT_FL_CHKSUM_SEED_FIX;
+      }
+
+      /* Protocol 31 clients which support varint file list flags also
+       * support the negotiation of checksum (and compression) algorithms.
+       */
+      if (sess->protocol_version >= 31 &&
+          strchr(opts->client_info, 'v') != NULL) {
+        compat_flags |= RSYNC_VERSION_COMPAT_FL_VARINT_FLIST_FLAGS;
+      }
+    }
+
     bufsz = buflen = 256;
     ptr = buf = palloc(sess->pool, bufsz);
 
-    rsync_msg_write_int(&buf, &buflen, compat_flags);
+    /* Older rsync versions read the flags as a single byte; since none of the
+     * flags we send to such clients exceeds 0x7f, the varint encoding is
+     * identical for them.
+     */
+    rsync_msg_write_varint(&buf, &buflen, compat_flags);
+    sess->compat_flags = compat_flags;
 
     pr_trace_msg(trace_channel, 9, "sending compatibility flags %lu",
       (unsigned long) compat_flags);
@@ -29,7 +29,7 @@
 #include "session.h"
 
 /* The rsync protocol version we want to use. */
-#define RSYNC_PROTOCOL_VERSION          30
+#define RSYNC_PROTOCOL_VERSION          31
 
 /* Define a narrow range of acceptable supported rsync protocol versions until
  * support for older versions is added.
@@ -37,8 +37,18 @@
 #define RSYNC_PROTOCOL_VERSION_MIN      28
 #define RSYNC_PROTOCOL_VERSION_MAX      31
 
-/* Protocol version compatibility flags */
+/* Protocol version compatibility flags; these values are copied from
+ * rsync.h.
+ */
 #define RSYNC_VERSION_COMPAT_FL_INCR_RECURSE		0x0001
+#define RSYNC_VERSION_COMPAT_FL_SYMLINK_TIMES		0x0002
+#define RSYNC_VERSION_COMPAT_FL_SYMLINK_ICONV		0x0004
+#define RSYNC_VERSION_COMPAT_FL_SAFE_FLIST		0x0008
+#define RSYNC_VERSION_COMPAT_FL_AVOID_XATTR_OPTIM	0x0010
+#define RSYNC_VERSION_COMPAT_FL_CHKSUM_SEED_FIX		0x0020
+#define RSYNC_VERSION_COMPAT_FL_INPLACE_PARTIAL_DIR	0x0040
+#define RSYNC_VERSION_COMPAT_FL_VARINT_FLIST_FLAGS	0x0080
+#define RSYNC_VERSION_COMPAT_FL_ID0_NAMES		0x0100
 
 int rsync_version_handle_data(pool *p, struct rsync_session *sess,
   unsigned char **data, uint32_t *datalen);
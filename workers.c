@@ -0,0 +1,528 @@
+/*
+ * ProFTPD - mod_rsync workers
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+#include "mod_rsync.h"
+#include "workers.h"
+#include "multibuf.h"
+#include "rolling.h"
+
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+# include <signal.h>
+#endif /* HAVE_PTHREAD */
+
+static unsigned int workers_count = 0;
+
+static const char *trace_channel = "rsync.workers";
+
+#ifdef HAVE_PTHREAD
+/* The ring's indices only ever increase (wrapping around); the producer owns
+ * the tail, and the consumer the head.  They are kept on separate cache
+ * lines, so that the two threads do not contend for them.
+ */
+struct workers_ring {
+  unsigned int head;
+  unsigned char pad1[64 - sizeof(unsigned int)];
+  unsigned int tail;
+  unsigned char pad2[64 - sizeof(unsigned int)];
+  struct rsync_workers_job *jobs[RSYNC_WORKERS_RING_SIZE];
+};
+
+struct workers_lane {
+  struct rsync_workers *workers;
+  struct workers_ring ring;
+  pthread_t thread;
+
+  /* Protected by the mutex; the worker sleeps while its ring is empty. */
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int sleeping;
+  int stop;
+};
+#endif /* HAVE_PTHREAD */
+
+struct rsync_workers {
+  pool *pool;
+  unsigned int nlanes;
+
+#ifdef HAVE_PTHREAD
+  struct workers_lane *lanes;
+
+  /* Protected by the mutex; the main thread sleeps while waiting for a job
+   * to finish.
+   */
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int waiting;
+#endif /* HAVE_PTHREAD */
+
+  int stopped;
+};
+
+#ifdef HAVE_PTHREAD
+static int ring_push(struct workers_ring *ring, struct rsync_workers_job *job) {
+  unsigned int head, tail;
+
+  tail = __atomic_load_n(&(ring->tail), __ATOMIC_RELAXED);
+  head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+  if (tail - head == RSYNC_WORKERS_RING_SIZE) {
+    return -1;
+  }
+
+  ring->jobs[tail & (RSYNC_WORKERS_RING_SIZE - 1)] = job;
+
+  /* Sequentially consistent, so that either the worker sees the job, or we
+   * see that it is sleeping (and wake it).
+   */
+  __atomic_store_n(&(ring->tail), tail + 1, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+static struct rsync_workers_job *ring_pop(struct workers_ring *ring) {
+  struct rsync_workers_job *job;
+  unsigned int head, tail;
+
+  head = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+  tail = __atomic_load_n(&(ring->tail), __ATOMIC_SEQ_CST);
+  if (head == tail) {
+    return NULL;
+  }
+
+  job = ring->jobs[head & (RSYNC_WORKERS_RING_SIZE - 1)];
+  __atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+  return job;
+}
+
+static void *worker_thread(void *data) {
+  struct workers_lane *lane;
+  struct rsync_workers *workers;
+
+  lane = data;
+  workers = lane->workers;
+
+  while (TRUE) {
+    struct rsync_workers_job *job;
+
+    job = ring_pop(&(lane->ring));
+    if (job == NULL) {
+      pthread_mutex_lock(&(lane->mutex));
+      __atomic_store_n(&(lane->sleeping), TRUE, __ATOMIC_SEQ_CST);
+
+      while ((job = ring_pop(&(lane->ring))) == NULL &&
+             lane->stop == FALSE) {
+        pthread_cond_wait(&(lane->cond), &(lane->mutex));
+      }
+
+      __atomic_store_n(&(lane->sleeping), FALSE, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&(lane->mutex));
+
+      if (job == NULL) {
+        /* Stopped, with nothing left to do. */
+        break;
+      }
+    }
+
+    errno = 0;
+    job->res = (job->run)(job);
+    job->xerrno = job->res < 0 ? errno : 0;
+    __atomic_store_n(&(job->done), TRUE, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&(workers->waiting), __ATOMIC_SEQ_CST)) {
+      pthread_mutex_lock(&(workers->mutex));
+      pthread_cond_broadcast(&(workers->cond));
+      pthread_mutex_unlock(&(workers->mutex));
+    }
+  }
+
+  return NULL;
+}
+
+static void stop_workers(struct rsync_workers *workers) {
+  register unsigned int i;
+
+  if (workers->stopped) {
+    return;
+  }
+
+  for (i = 0; i < workers->nlanes; i++) {
+    struct workers_lane *lane;
+
+    lane = &(workers->lanes[i]);
+
+    pthread_mutex_lock(&(lane->mutex));
+    lane->stop = TRUE;
+    pthread_cond_signal(&(lane->cond));
+    pthread_mutex_unlock(&(lane->mutex));
+
+    pthread_join(lane->thread, NULL);
+    pthread_cond_destroy(&(lane->cond));
+    pthread_mutex_destroy(&(lane->mutex));
+  }
+
+  pthread_cond_destroy(&(workers->cond));
+  pthread_mutex_destroy(&(workers->mutex));
+  workers->stopped = TRUE;
+}
+
+static void workers_cleanup_cb(void *data) {
+  stop_workers(data);
+}
+#endif /* HAVE_PTHREAD */
+
+int rsync_workers_set_count(unsigned int count) {
+  if (count > RSYNC_WORKERS_MAX_COUNT) {
+    errno = EINVAL;
+    return -1;
+  }
+
+#ifndef HAVE_PTHREAD
+  if (count > 0) {
+    errno = ENOSYS;
+    return -1;
+  }
+#endif /* !HAVE_PTHREAD */
+
+  workers_count = count;
+  return 0;
+}
+
+unsigned int rsync_workers_get_count(void) {
+  return workers_count;
+}
+
+struct rsync_workers *rsync_workers_create(pool *p, unsigned int count) {
+#ifdef HAVE_PTHREAD
+  struct rsync_workers *workers;
+  sigset_t all_sigs, saved_sigs;
+  unsigned int i;
+  int xerrno = 0;
+
+  if (p == NULL ||
+      count == 0 ||
+      count > RSYNC_WORKERS_MAX_COUNT) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  workers = pcalloc(p, sizeof(struct rsync_workers));
+  workers->pool = p;
+  workers->lanes = pcalloc(p, count * sizeof(struct workers_lane));
+  pthread_mutex_init(&(workers->mutex), NULL);
+  pthread_cond_init(&(workers->cond), NULL);
+
+  /* Make sure the checksum kernels are chosen before the workers use them. */
+  (void) rsync_multibuf_get_kernel();
+  (void) rsync_rolling_get_kernel();
+
+  /* Signals are for the main thread to handle, not the workers. */
+  sigfillset(&all_sigs);
+  pthread_sigmask(SIG_BLOCK, &all_sigs, &saved_sigs);
+
+  for (i = 0; i < count; i++) {
+    struct workers_lane *lane;
+
+    lane = &(workers->lanes[i]);
+    lane->workers = workers;
+    pthread_mutex_init(&(lane->mutex), NULL);
+    pthread_cond_init(&(lane->cond), NULL);
+
+    xerrno = pthread_create(&(lane->thread), NULL, worker_thread, lane);
+    if (xerrno != 0) {
+      pthread_cond_destroy(&(lane->cond));
+      pthread_mutex_destroy(&(lane->mutex));
+      break;
+    }
+
+    workers->nlanes++;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &saved_sigs, NULL);
+
+  if (workers->nlanes == 0) {
+    pthread_cond_destroy(&(workers->cond));
+    pthread_mutex_destroy(&(workers->mutex));
+
+    pr_trace_msg(trace_channel, 3, "error starting worker thread: %s",
+      strerror(xerrno));
+    errno = xerrno;
+    return NULL;
+  }
+
+  if (workers->nlanes < count) {
+    pr_trace_msg(trace_channel, 3,
+      "error starting worker thread: %s; using %u of %u workers",
+      strerror(xerrno), workers->nlanes, count);
+  }
+
+  register_cleanup(p, workers, workers_cleanup_cb, workers_cleanup_cb);
+
+  pr_trace_msg(trace_channel, 9, "started %u worker threads",
+    workers->nlanes);
+  return workers;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif /* HAVE_PTHREAD */
+}
+
+unsigned int rsync_workers_get_lanes(struct rsync_workers *workers) {
+  if (workers == NULL) {
+    return 0;
+  }
+
+  return workers->nlanes;
+}
+
+int rsync_workers_submit(struct rsync_workers *workers, unsigned int lane,
+    struct rsync_workers_job *job) {
+#ifdef HAVE_PTHREAD
+  struct workers_lane *l;
+
+  if (workers == NULL ||
+      job == NULL ||
+      job->run == NULL ||
+      workers->stopped) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (job->busy) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  l = &(workers->lanes[lane % workers->nlanes]);
+
+  job->res = job->xerrno = 0;
+  job->done = FALSE;
+
+  if (ring_push(&(l->ring), job) < 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  job->busy = TRUE;
+
+  if (__atomic_load_n(&(l->sleeping), __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&(l->mutex));
+    pthread_cond_signal(&(l->cond));
+    pthread_mutex_unlock(&(l->mutex));
+  }
+
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* HAVE_PTHREAD */
+}
+
+int rsync_workers_wait(struct rsync_workers *workers,
+    struct rsync_workers_job *job) {
+
+  if (workers == NULL ||
+      job == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+#ifdef HAVE_PTHREAD
+  if (job->busy) {
+    if (!__atomic_load_n(&(job->done), __ATOMIC_ACQUIRE)) {
+      pthread_mutex_lock(&(workers->mutex));
+      __atomic_store_n(&(workers->waiting), TRUE, __ATOMIC_SEQ_CST);
+
+      while (!__atomic_load_n(&(job->done), __ATOMIC_SEQ_CST)) {
+        pthread_cond_wait(&(workers->cond), &(workers->mutex));
+      }
+
+      __atomic_store_n(&(workers->waiting), FALSE, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&(workers->mutex));
+    }
+
+    job->busy = FALSE;
+  }
+#endif /* HAVE_PTHREAD */
+
+  if (job->res < 0) {
+    errno = job->xerrno;
+  }
+
+  return job->res;
+}
+
+int rsync_workers_destroy(struct rsync_workers *workers) {
+  if (workers == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+#ifdef HAVE_PTHREAD
+  stop_workers(workers);
+#endif /* HAVE_PTHREAD */
+
+  return 0;
+}
+
+/* File checksums */
+
+struct checksum_job {
+  struct rsync_workers_job job;
+  struct rsync_checksum *ck;
+  unsigned char *data;
+  size_t datalen;
+};
+
+struct rsync_workers_checksum {
+  struct rsync_workers *workers;
+  struct rsync_checksum *ck;
+  struct checksum_job jobs[RSYNC_WORKERS_CHECKSUM_BUFFER_COUNT];
+
+  /* The buffer being filled. */
+  unsigned int next;
+};
+
+static int checksum_job_run(struct rsync_workers_job *job) {
+  struct checksum_job *cj;
+
+  cj = (struct checksum_job *) job;
+  return rsync_checksum_update(cj->ck, cj->data, cj->datalen);
+}
+
+struct rsync_workers_checksum *rsync_workers_checksum_create(pool *p,
+    struct rsync_workers *workers, struct rsync_checksum *ck) {
+  register unsigned int i;
+  struct rsync_workers_checksum *wck;
+
+  if (p == NULL ||
+      workers == NULL ||
+      ck == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  wck = pcalloc(p, sizeof(struct rsync_workers_checksum));
+  wck->workers = workers;
+  wck->ck = ck;
+
+  for (i = 0; i < RSYNC_WORKERS_CHECKSUM_BUFFER_COUNT; i++) {
+    wck->jobs[i].job.run = checksum_job_run;
+    wck->jobs[i].ck = ck;
+    wck->jobs[i].data = palloc(p, RSYNC_WORKERS_CHECKSUM_BUFFER_SIZE);
+  }
+
+  return wck;
+}
+
+static int submit_checksum(struct rsync_workers_checksum *wck) {
+  struct checksum_job *cj;
+
+  cj = &(wck->jobs[wck->next]);
+  if (rsync_workers_submit(wck->workers, RSYNC_WORKERS_CHECKSUM_LANE,
+      &(cj->job)) < 0) {
+    return -1;
+  }
+
+  wck->next = (wck->next + 1) % RSYNC_WORKERS_CHECKSUM_BUFFER_COUNT;
+  return 0;
+}
+
+int rsync_workers_checksum_update(struct rsync_workers_checksum *wck,
+    const unsigned char *data, size_t datalen) {
+
+  if (wck == NULL ||
+      (data == NULL && datalen > 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  while (datalen > 0) {
+    struct checksum_job *cj;
+    size_t len;
+
+    cj = &(wck->jobs[wck->next]);
+
+    /* Wait for the worker to finish with the buffer, before refilling it. */
+    if (cj->job.busy) {
+      if (rsync_workers_wait(wck->workers, &(cj->job)) < 0) {
+        return -1;
+      }
+
+      cj->datalen = 0;
+    }
+
+    len = RSYNC_WORKERS_CHECKSUM_BUFFER_SIZE - cj->datalen;
+    if (len > datalen) {
+      len = datalen;
+    }
+
+    memcpy(cj->data + cj->datalen, data, len);
+    cj->datalen += len;
+    data += len;
+    datalen -= len;
+
+    if (cj->datalen == RSYNC_WORKERS_CHECKSUM_BUFFER_SIZE &&
+        submit_checksum(wck) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int rsync_workers_checksum_flush(struct rsync_workers_checksum *wck) {
+  register unsigned int i;
+  int res = 0, xerrno = 0;
+
+  if (wck == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (wck->jobs[wck->next].datalen > 0 &&
+      wck->jobs[wck->next].job.busy == FALSE &&
+      submit_checksum(wck) < 0) {
+    return -1;
+  }
+
+  /* The lane sums the buffers in order; wait for all of them. */
+  for (i = 0; i < RSYNC_WORKERS_CHECKSUM_BUFFER_COUNT; i++) {
+    struct checksum_job *cj;
+
+    cj = &(wck->jobs[i]);
+    if (cj->job.busy &&
+        rsync_workers_wait(wck->workers, &(cj->job)) < 0) {
+      xerrno = errno;
+      res = -1;
+    }
+
+    cj->datalen = 0;
+  }
+
+  if (res < 0) {
+    errno = xerrno;
+  }
+
+  return res;
+}
@@ -0,0 +1,116 @@
+/*
+ * ProFTPD - mod_rsync workers
+ * Copyright (c) 2016 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+
+#ifndef MOD_RSYNC_WORKERS_H
+#define MOD_RSYNC_WORKERS_H
+
+#include "mod_rsync.h"
+#include "checksum.h"
+
+/* ProFTPD serves each session in a single process, so, left to itself, all
+ * of a transfer's hashing and compression would share one core with the SSH
+ * encryption.  A session may instead have a pool of worker threads, to which
+ * that work (block sums, file checksums, compression) is handed off; the
+ * main thread then only parses, dispatches and writes.
+ *
+ * Each worker has a "lane": a lock-free, single-producer, single-consumer
+ * ring of jobs from the main thread.  A lane's jobs are done in the order
+ * submitted, so work which must be done in sequence (e.g. a file checksum,
+ * or a compression stream) is kept to one lane.  A mutex is only taken to
+ * sleep when there is nothing to do, or to wait for a job to finish.
+ *
+ * Jobs run outside of proftpd proper: they must not allocate from pools,
+ * log, or handle signals.
+ */
+
+#define RSYNC_WORKERS_MAX_COUNT			64
+
+/* Jobs which may be queued on each lane (a power of two). */
+#define RSYNC_WORKERS_RING_SIZE			64
+
+/* The lanes used for file checksums, and for compression; these are the same
+ * lane if there is only one worker.  Block sums use all of the lanes.
+ */
+#define RSYNC_WORKERS_CHECKSUM_LANE		0
+#define RSYNC_WORKERS_COMPRESS_LANE		1
+
+/* File checksums are computed from copies of the data, in buffers of this
+ * size, so that the caller need not keep the data around.
+ */
+#define RSYNC_WORKERS_CHECKSUM_BUFFER_SIZE	(256 * 1024)
+#define RSYNC_WORKERS_CHECKSUM_BUFFER_COUNT	4
+
+struct rsync_workers;
+
+struct rsync_workers_job {
+  int (*run)(struct rsync_workers_job *job);
+
+  /* Once done: the return value of run(), and errno, if it failed. */
+  int res;
+  int xerrno;
+
+  /* Private: whether the job is queued, and whether it is done. */
+  int busy;
+  int done;
+};
+
+/* Sets the number of workers for each new session; 0, the default, disables
+ * the pool.  Returns ENOSYS if threads are wanted but not supported.
+ */
+int rsync_workers_set_count(unsigned int count);
+unsigned int rsync_workers_get_count(void);
+
+struct rsync_workers *rsync_workers_create(pool *p, unsigned int count);
+unsigned int rsync_workers_get_lanes(struct rsync_workers *workers);
+
+/* Queues the job on the given lane (modulo the number of lanes).  Returns -1,
+ * with errno set to EAGAIN, if the lane's ring is full, or to EBUSY if the
+ * job is already queued.
+ */
+int rsync_workers_submit(struct rsync_workers *workers, unsigned int lane,
+  struct rsync_workers_job *job);
+
+/* Waits for the given job, if queued, to finish; returns the job's result,
+ * with errno set to the job's errno, if it failed.
+ */
+int rsync_workers_wait(struct rsync_workers *workers,
+  struct rsync_workers_job *job);
+
+/* Waits for all queued jobs to finish, and stops the workers. */
+int rsync_workers_destroy(struct rsync_workers *workers);
+
+/* Updates a file checksum on the checksum lane.  The data is copied, and
+ * summed by the worker while the caller carries on; rsync_workers_checksum_
+ * flush() must be called before the checksum is finished.
+ */
+struct rsync_workers_checksum;
+
+struct rsync_workers_checksum *rsync_workers_checksum_create(pool *p,
+  struct rsync_workers *workers, struct rsync_checksum *ck);
+int rsync_workers_checksum_update(struct rsync_workers_checksum *wck,
+  const unsigned char *data, size_t datalen);
+int rsync_workers_checksum_flush(struct rsync_workers_checksum *wck);
+
+#endif /* MOD_RSYNC_WORKERS_H */